@@ -0,0 +1,126 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * accession_mappings.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_ACCESSION_MAPPINGS_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_ACCESSION_MAPPINGS_H_
+
+#include "gene_trees_service_library.h"
+#include "typedefs.h"
+#include "jansson.h"
+
+
+/**
+ * An edge of the trie, from a node to its child for the next byte of
+ * a name. The edges are stored in an open addressing hash table keyed
+ * by their parent and byte.
+ */
+typedef struct AccessionMappingEdge
+{
+	/** The parent node. */
+	uint32 ame_parent;
+
+	/**
+	 * The child node. Since the root is never a child, this is 0 for
+	 * an empty slot.
+	 */
+	uint32 ame_child;
+
+	/** The byte of the name that this edge is for. */
+	unsigned char ame_byte;
+} AccessionMappingEdge;
+
+
+/**
+ * The name prefixes that are replaced when working out accessions,
+ * e.g. "Paragon x Watkins 1190" to "ParW", compiled into a trie so
+ * that the longest matching prefix of a name is found in a single
+ * pass over it, however many mappings there are.
+ */
+typedef struct AccessionMappings
+{
+	/** The edges of the trie. */
+	AccessionMappingEdge *am_edges_p;
+
+	/** The number of slots in am_edges_p, which is a power of 2. */
+	uint32 am_num_edge_slots;
+
+	/**
+	 * For each node, the index into am_values_ss of the mapping whose
+	 * prefix ends there or AM_NO_MAPPING if there isn't one.
+	 */
+	uint32 *am_node_mappings_p;
+
+	/** The number of nodes in the trie, including the root. */
+	uint32 am_num_nodes;
+
+	/** The replacement for each prefix. */
+	char **am_values_ss;
+
+	/** The number of mappings. */
+	uint32 am_num_mappings;
+} AccessionMappings;
+
+
+/** The value for a trie node that isn't the end of a prefix. */
+#define AM_NO_MAPPING (0xFFFFFFFF)
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Compile a set of name mappings.
+ *
+ * @param mappings_p A JSON object whose keys are the prefixes and whose
+ * values are the strings to replace them with.
+ * @return The AccessionMappings, which should be freed with FreeAccessionMappings (),
+ * or <code>NULL</code> if any of the values are not strings or upon error.
+ */
+GENE_TREES_SERVICE_LOCAL AccessionMappings *AllocateAccessionMappings (const json_t *mappings_p);
+
+
+/**
+ * Free some AccessionMappings.
+ *
+ * @param mappings_p The AccessionMappings.
+ */
+GENE_TREES_SERVICE_LOCAL void FreeAccessionMappings (AccessionMappings *mappings_p);
+
+
+/**
+ * Find the mapping with the longest prefix of a name.
+ *
+ * @param mappings_p The AccessionMappings.
+ * @param name_s The name.
+ * @param prefix_length_p If a mapping is found, the length of its prefix
+ * will be stored here.
+ * @return The replacement for the prefix or <code>NULL</code> if none of
+ * the prefixes match the name.
+ */
+GENE_TREES_SERVICE_LOCAL const char *GetAccessionMapping (const AccessionMappings *mappings_p, const char *name_s, size_t *prefix_length_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_ACCESSION_MAPPINGS_H_ */
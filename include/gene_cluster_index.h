@@ -0,0 +1,243 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_cluster_index.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_CLUSTER_INDEX_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_CLUSTER_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gene_trees_service_library.h"
+
+
+/*
+ * A gene cluster index file is laid out as
+ *
+ *   GeneClusterIndexHeader
+ *   GeneClusterIndexEntry [gcih_num_entries], sorted by Gene ID
+ *   uint32_t [gcih_num_entries], the indexes of the entries sorted by Cluster ID and then Gene ID
+ *   char [gcih_strings_size], the Gene IDs, which are not nul-terminated
+ *
+ * All values are stored in the byte order of the machine that built the
+ * file, which is checked using gcih_byte_order when the file is opened.
+ * The checksum covers everything after the header. Only libc types are
+ * used here so that the tools that build these files don't need the
+ * rest of Grassroots.
+ */
+
+/** The magic bytes at the start of every gene cluster index file. */
+#define GCI_MAGIC_S "GTGCIDX"
+
+/** The current version of the file format. */
+#define GCI_VERSION (1)
+
+/** The value used to check the byte order. */
+#define GCI_BYTE_ORDER (0x01020304)
+
+
+/**
+ * The header of a gene cluster index file.
+ */
+typedef struct GeneClusterIndexHeader
+{
+	/** GCI_MAGIC_S including its terminating nul. */
+	char gcih_magic [8];
+
+	/** The version of the file format. */
+	uint32_t gcih_version;
+
+	/** GCI_BYTE_ORDER as written by the machine that built the file. */
+	uint32_t gcih_byte_order;
+
+	/** The number of genes in the index. */
+	uint64_t gcih_num_entries;
+
+	/** The number of bytes used to store the Gene IDs. */
+	uint64_t gcih_strings_size;
+
+	/** The FNV-1a checksum of everything after this header. */
+	uint64_t gcih_checksum;
+} GeneClusterIndexHeader;
+
+
+/**
+ * The entry for a single gene.
+ */
+typedef struct GeneClusterIndexEntry
+{
+	/** The offset of the Gene ID within the strings section. */
+	uint64_t gcie_gene_offset;
+
+	/** The length of the Gene ID. */
+	uint32_t gcie_gene_length;
+
+	/** The Cluster ID for the gene. */
+	uint32_t gcie_cluster_id;
+} GeneClusterIndexEntry;
+
+
+/**
+ * A read-only, memory-mapped gene cluster index file.
+ */
+typedef struct GeneClusterIndex
+{
+	/**
+	 * @private
+	 *
+	 * The start of the mapped file.
+	 */
+	void *gci_data_p;
+
+	/**
+	 * @private
+	 *
+	 * The size of the mapped file.
+	 */
+	size_t gci_size;
+
+	/**
+	 * @private
+	 *
+	 * The number of genes in the index.
+	 */
+	size_t gci_num_entries;
+
+	/**
+	 * @private
+	 *
+	 * The gene entries, sorted by Gene ID.
+	 */
+	const GeneClusterIndexEntry *gci_entries_p;
+
+	/**
+	 * @private
+	 *
+	 * The indexes of the entries, sorted by Cluster ID.
+	 */
+	const uint32_t *gci_cluster_order_p;
+
+	/**
+	 * @private
+	 *
+	 * The Gene IDs.
+	 */
+	const char *gci_strings_s;
+
+	/**
+	 * @private
+	 *
+	 * The number of bytes in gci_strings_s.
+	 */
+	size_t gci_strings_size;
+} GeneClusterIndex;
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Open and map a gene cluster index file. The file's header and sizes
+ * are always checked before it is used. Each lookup checks the entries
+ * that it reads, so a corrupt file can give wrong answers but can't
+ * cause reads outside of the mapping.
+ *
+ * @param filename_s The path to the file.
+ * @param verify_flag If this is <code>true</code>, the whole file will also
+ * be read to check its checksum and every entry. This touches every page of
+ * the file, so is best left to the tools that build the files.
+ * @return The GeneClusterIndex or <code>NULL</code> upon error.
+ * @memberof GeneClusterIndex
+ */
+GENE_TREES_SERVICE_LOCAL GeneClusterIndex *OpenGeneClusterIndex (const char *filename_s, const bool verify_flag);
+
+
+/**
+ * Unmap and free a GeneClusterIndex.
+ *
+ * @param index_p The GeneClusterIndex to close.
+ * @memberof GeneClusterIndex
+ */
+GENE_TREES_SERVICE_LOCAL void CloseGeneClusterIndex (GeneClusterIndex *index_p);
+
+
+/**
+ * Get the Cluster ID for a gene.
+ *
+ * @param index_p The GeneClusterIndex to search.
+ * @param gene_s The Gene ID to find.
+ * @param cluster_p Where the Cluster ID will be stored if the gene is found.
+ * @return <code>true</code> if the gene is in a cluster, <code>false</code> otherwise.
+ * @memberof GeneClusterIndex
+ */
+GENE_TREES_SERVICE_LOCAL bool GetGeneClusterFromIndex (const GeneClusterIndex *index_p, const char *gene_s, uint32_t *cluster_p);
+
+
+/**
+ * Get the number of genes in a cluster.
+ *
+ * @param index_p The GeneClusterIndex to search.
+ * @param cluster_id The Cluster ID.
+ * @param first_p If this is not <code>NULL</code>, it will be set to the position
+ * of the cluster's first gene for use with GetGeneClusterIndexGeneByCluster().
+ * @return The number of genes in the cluster.
+ * @memberof GeneClusterIndex
+ */
+GENE_TREES_SERVICE_LOCAL size_t GetGeneClusterIndexClusterSize (const GeneClusterIndex *index_p, const uint32_t cluster_id, size_t *first_p);
+
+
+/**
+ * Get a gene's entry by its position when the genes are sorted by
+ * Cluster ID and then Gene ID.
+ *
+ * @param index_p The GeneClusterIndex to use.
+ * @param position The position of the gene.
+ * @param gene_length_p Where the length of the Gene ID will be stored.
+ * @return The Gene ID, which is not nul-terminated, or <code>NULL</code>
+ * if the position is out of range.
+ * @memberof GeneClusterIndex
+ */
+GENE_TREES_SERVICE_LOCAL const char *GetGeneClusterIndexGeneByCluster (const GeneClusterIndex *index_p, const size_t position, size_t *gene_length_p);
+
+
+/**
+ * Update an FNV-1a checksum with some more data.
+ *
+ * @param data_p The data to add.
+ * @param length The length of the data.
+ * @param checksum The checksum so far. For the first call, use
+ * GCI_CHECKSUM_SEED.
+ * @return The updated checksum.
+ */
+GENE_TREES_SERVICE_LOCAL uint64_t UpdateGeneClusterIndexChecksum (const void *data_p, const size_t length, uint64_t checksum);
+
+
+/** The value to start a checksum from. */
+#define GCI_CHECKSUM_SEED (14695981039346656037ULL)
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_CLUSTER_INDEX_H_ */
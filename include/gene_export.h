@@ -0,0 +1,173 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_export.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_EXPORT_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_EXPORT_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#include "gene_trees_service_library.h"
+#include "typedefs.h"
+#include "bson.h"
+
+
+/**
+ * The formats that genes can be exported in.
+ */
+typedef enum GeneExportFormat
+{
+	/** One relaxed extended JSON document per line */
+	GEF_NDJSON,
+
+	/** The gene sequences with the Gene and Cluster IDs as their headers */
+	GEF_FASTA,
+
+	/** The number of formats */
+	GEF_NUM_FORMATS
+} GeneExportFormat;
+
+
+/**
+ * An export of genes that is written to a file as the documents
+ * come back from the database, so that no more than one document
+ * is ever held in memory.
+ */
+typedef struct GeneExport
+{
+	/** The format that the genes are written in. */
+	GeneExportFormat ge_format;
+
+	/** The full path to the file being written. */
+	char *ge_filename_s;
+
+	/** The file being written. */
+	FILE *ge_out_f;
+
+	/** The number of genes that have been written. */
+	uint64 ge_num_genes;
+
+	/**
+	 * The number of genes that were skipped, e.g. as they have no
+	 * sequence to write as FASTA.
+	 */
+	uint64 ge_num_skipped;
+
+	/**
+	 * This is set to <code>true</code> if writing a gene failed, in
+	 * which case the file is incomplete.
+	 */
+	bool ge_failed_flag;
+} GeneExport;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the GeneExportFormat for its name.
+ *
+ * @param format_s The name of the format, either "ndjson" or "fasta".
+ * @param format_p Where the format will be stored.
+ * @return <code>true</code> if the format is known, <code>false</code> otherwise.
+ */
+GENE_TREES_SERVICE_LOCAL bool GetGeneExportFormat (const char *format_s, GeneExportFormat *format_p);
+
+
+/**
+ * Get the name of a GeneExportFormat.
+ *
+ * @param format The GeneExportFormat.
+ * @return The name of the format.
+ */
+GENE_TREES_SERVICE_LOCAL const char *GetGeneExportFormatAsString (const GeneExportFormat format);
+
+
+/**
+ * Get the fields that a GeneExportFormat needs from each document.
+ *
+ * @param format The GeneExportFormat.
+ * @return The comma-separated fields or <code>NULL</code> if the format
+ * writes whichever fields were asked for.
+ */
+GENE_TREES_SERVICE_LOCAL const char *GetGeneExportFields (const GeneExportFormat format);
+
+
+/**
+ * Start an export by creating a new, uniquely-named file for it.
+ *
+ * @param directory_s The directory to create the file in.
+ * @param format The GeneExportFormat to write the genes in.
+ * @return The new GeneExport, which should be freed with FreeGeneExport (),
+ * or <code>NULL</code> upon error.
+ */
+GENE_TREES_SERVICE_LOCAL GeneExport *AllocateGeneExport (const char *directory_s, const GeneExportFormat format);
+
+
+/**
+ * Write a gene's document to an export.
+ *
+ * @param export_p The GeneExport.
+ * @param document_p The gene's document. Any packed sequences in it are unpacked.
+ * @return <code>true</code> if the gene was written or skipped, <code>false</code>
+ * if writing it failed.
+ */
+GENE_TREES_SERVICE_LOCAL bool WriteGeneExportDocument (GeneExport *export_p, const bson_t *document_p);
+
+
+/**
+ * Finish writing an export and close its file.
+ *
+ * @param export_p The GeneExport.
+ * @return <code>true</code> if the whole export was written successfully,
+ * <code>false</code> otherwise.
+ */
+GENE_TREES_SERVICE_LOCAL bool CloseGeneExport (GeneExport *export_p);
+
+
+/**
+ * Free a GeneExport, closing its file if it is still open.
+ *
+ * @param export_p The GeneExport.
+ * @param remove_file_flag If this is <code>true</code>, the export's file
+ * is deleted too, e.g. as it is incomplete.
+ */
+GENE_TREES_SERVICE_LOCAL void FreeGeneExport (GeneExport *export_p, const bool remove_file_flag);
+
+
+/**
+ * Remove the export files in a directory that were last written to
+ * longer ago than a given age. Any other files in the directory are
+ * left alone.
+ *
+ * @param directory_s The directory that the exports are written to.
+ * @param max_age The number of seconds to keep each export for.
+ * @return The number of exports that were removed.
+ */
+GENE_TREES_SERVICE_LOCAL uint32 RemoveOldGeneExports (const char *directory_s, const time_t max_age);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_EXPORT_H_ */
@@ -0,0 +1,63 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_homologs.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_HOMOLOGS_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_HOMOLOGS_H_
+
+#include "gene_trees_service_library.h"
+#include "gene_tree.h"
+#include "jansson.h"
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the homologs of a gene from its gene tree. Each of the other leaves
+ * is an ortholog if the gene and the leaf's most recent common ancestor
+ * is a speciation and a paralog if it is a duplication.
+ *
+ * An ancestor is a duplication or a speciation if it has an NHX D tag,
+ * e.g. [&&NHX:D=Y]. Otherwise it is a duplication if any species are on
+ * more than one of its branches. The species of a leaf are taken from its
+ * NHX S tag or, failing that, from the start of its name. If neither
+ * of these are available, the leaf's relationship is just "homolog".
+ *
+ * @param tree_p The GeneTree.
+ * @param leaf The index of the gene's leaf.
+ * @param species_prefix_length The number of characters at the start of a
+ * leaf's name that identify its species, e.g. 5 for "TraesCS1A02G000100".
+ * If this is 0, only the NHX S tags are used for species.
+ * @return A JSON array of { "gene_id": <leaf name>, "relationship":
+ * "ortholog" | "paralog" | "homolog", "species": <species> } objects,
+ * with the nearest homologs first, or <code>NULL</code> upon error.
+ */
+GENE_TREES_SERVICE_LOCAL json_t *GetGeneTreeHomologs (const GeneTree *tree_p, const uint32 leaf, const uint32 species_prefix_length);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_HOMOLOGS_H_ */
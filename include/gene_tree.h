@@ -0,0 +1,200 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_tree.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREE_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREE_H_
+
+#include "gene_trees_service_library.h"
+#include "typedefs.h"
+
+
+/** The index used for a node that doesn't exist. */
+#define GT_NO_NODE ((uint32) 0xFFFFFFFF)
+
+
+/**
+ * A node in a parsed gene tree.
+ */
+typedef struct GeneTreeNode
+{
+	/** The index of the parent node or GT_NO_NODE for the root. */
+	uint32 gtn_parent;
+
+	/** The index of the first child node or GT_NO_NODE for a leaf. */
+	uint32 gtn_first_child;
+
+	/** The index of the next child of this node's parent or GT_NO_NODE. */
+	uint32 gtn_next_sibling;
+
+	/** The number of leaves at or below this node. */
+	uint32 gtn_num_leaves;
+
+	/**
+	 * The offset of the node's label in the Newick string. This is
+	 * everything after the node's children, i.e. its name, branch
+	 * length and any comments such as NHX tags.
+	 */
+	uint32 gtn_label_start;
+
+	/** The length of the node's label. */
+	uint32 gtn_label_length;
+
+	/** The offset of the node's name, without any quotes, in the Newick string. */
+	uint32 gtn_name_start;
+
+	/** The length of the node's name. */
+	uint32 gtn_name_length;
+} GeneTreeNode;
+
+
+/**
+ * A slot in the hash table used to find leaves by name. The key is
+ * the first gtle_name_length bytes of the leaf's name.
+ */
+typedef struct GeneTreeLeafSlot
+{
+	/** The index of the leaf or GT_NO_NODE if the slot is empty. */
+	uint32 gtls_node;
+
+	/** The length of the key. */
+	uint32 gtls_name_length;
+} GeneTreeLeafSlot;
+
+
+/**
+ * A gene tree parsed from a Newick string. The nodes are stored
+ * in a single array with each node after its parent, and the root
+ * is the first node.
+ */
+typedef struct GeneTree
+{
+	/** The Newick string that the tree was parsed from. */
+	char *gt_newick_s;
+
+	/** The length of gt_newick_s. */
+	size_t gt_newick_length;
+
+	/** The nodes. */
+	GeneTreeNode *gt_nodes_p;
+
+	/** The number of nodes. */
+	uint32 gt_num_nodes;
+
+	/**
+	 * The hash table of leaf names. Each leaf has a slot for its whole
+	 * name and one for each prefix of it that ends before a '.', '_'
+	 * or '|', unless an earlier leaf already has that key.
+	 */
+	GeneTreeLeafSlot *gt_leaf_slots_p;
+
+	/** The number of slots in gt_leaf_slots_p, which is a power of 2. */
+	uint32 gt_num_leaf_slots;
+
+	/**
+	 * The number of references to this tree. A GeneTreeCache uses this
+	 * so that a tree that is evicted whilst it is in use isn't freed until
+	 * it is released.
+	 */
+	uint32 gt_num_references;
+} GeneTree;
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Parse a Newick tree.
+ *
+ * @param newick_s The tree to parse.
+ * @return The parsed GeneTree, which has its own copy of newick_s,
+ * or <code>NULL</code> if the tree could not be parsed.
+ * @memberof GeneTree
+ */
+GENE_TREES_SERVICE_LOCAL GeneTree *ParseGeneTree (const char *newick_s);
+
+
+/**
+ * Free a GeneTree.
+ *
+ * @param tree_p The GeneTree to free.
+ * @memberof GeneTree
+ */
+GENE_TREES_SERVICE_LOCAL void FreeGeneTree (GeneTree *tree_p);
+
+
+/**
+ * Find the leaf for a gene. This is a hash table lookup so it doesn't
+ * depend on the size of the tree.
+ *
+ * @param tree_p The GeneTree to search.
+ * @param gene_s The Gene ID. This matches a leaf with exactly this
+ * name or one that starts with it followed by a '.', '_' or '|', as leaf
+ * names often have a transcript or species suffix.
+ * @return The index of the leaf or GT_NO_NODE if it could not be found.
+ * @memberof GeneTree
+ */
+GENE_TREES_SERVICE_LOCAL uint32 FindGeneTreeLeaf (const GeneTree *tree_p, const char *gene_s);
+
+
+/**
+ * Get the smallest subtree around a node that has at least a given
+ * number of leaves, i.e. the nearest leaves to it.
+ *
+ * @param tree_p The GeneTree.
+ * @param node The index of the node, which is usually a leaf.
+ * @param min_leaves The minimum number of leaves. If the whole tree has fewer
+ * leaves than this, then the whole tree is returned.
+ * @return The root of the subtree.
+ * @memberof GeneTree
+ */
+GENE_TREES_SERVICE_LOCAL uint32 GetGeneTreeSubtree (const GeneTree *tree_p, uint32 node, const uint32 min_leaves);
+
+
+/**
+ * Write a subtree in Newick format. The labels, branch lengths and
+ * comments of the nodes are kept as they were in the original tree.
+ *
+ * @param tree_p The GeneTree.
+ * @param root The index of the subtree's root.
+ * @return The Newick string, which should be freed with FreeMemory (),
+ * or <code>NULL</code> upon error.
+ * @memberof GeneTree
+ */
+GENE_TREES_SERVICE_LOCAL char *GetGeneTreeSubtreeAsNewick (const GeneTree *tree_p, const uint32 root);
+
+
+/**
+ * Get the number of bytes of memory that a GeneTree uses.
+ *
+ * @param tree_p The GeneTree.
+ * @return The number of bytes.
+ * @memberof GeneTree
+ */
+GENE_TREES_SERVICE_LOCAL size_t GetGeneTreeSize (const GeneTree *tree_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREE_H_ */
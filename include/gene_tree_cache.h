@@ -0,0 +1,188 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_tree_cache.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREE_CACHE_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREE_CACHE_H_
+
+#include <pthread.h>
+
+#include "gene_trees_service_library.h"
+#include "gene_tree.h"
+
+
+/* forward declaration */
+struct GeneTreeCacheEntry;
+
+
+/**
+ * A bounded, least-recently-used cache of parsed gene trees keyed
+ * by their Cluster IDs, so that the trees for busy clusters are only
+ * parsed once rather than for every hit in them. It is safe to use
+ * from multiple threads.
+ */
+typedef struct GeneTreeCache
+{
+	/**
+	 * @private
+	 *
+	 * The hash buckets used to find entries by their Cluster IDs.
+	 */
+	struct GeneTreeCacheEntry **gtc_buckets_pp;
+
+	/**
+	 * @private
+	 *
+	 * The number of hash buckets.
+	 */
+	size_t gtc_num_buckets;
+
+	/**
+	 * @private
+	 *
+	 * The most recently used entry.
+	 */
+	struct GeneTreeCacheEntry *gtc_head_p;
+
+	/**
+	 * @private
+	 *
+	 * The least recently used entry, which is
+	 * the next one to be evicted.
+	 */
+	struct GeneTreeCacheEntry *gtc_tail_p;
+
+	/**
+	 * @private
+	 *
+	 * The current number of trees.
+	 */
+	size_t gtc_num_entries;
+
+	/**
+	 * @private
+	 *
+	 * The maximum number of trees.
+	 */
+	size_t gtc_max_entries;
+
+	/**
+	 * @private
+	 *
+	 * The current number of bytes used by the trees.
+	 */
+	size_t gtc_num_bytes;
+
+	/**
+	 * @private
+	 *
+	 * The maximum number of bytes to use for the trees.
+	 * If this is 0, there is no limit.
+	 */
+	size_t gtc_max_bytes;
+
+	/**
+	 * @private
+	 *
+	 * The lock used to access the cache and the
+	 * reference counts of its trees.
+	 */
+	pthread_mutex_t gtc_lock;
+
+} GeneTreeCache;
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate a GeneTreeCache.
+ *
+ * @param max_trees The maximum number of parsed trees to keep.
+ * @param max_bytes The maximum number of bytes of memory to use for the
+ * parsed trees. If this is 0, only max_trees is used to limit the cache.
+ * @return The newly-allocated GeneTreeCache or <code>NULL</code> upon error.
+ * @memberof GeneTreeCache
+ */
+GENE_TREES_SERVICE_LOCAL GeneTreeCache *AllocateGeneTreeCache (const size_t max_trees, const size_t max_bytes);
+
+
+/**
+ * Free a GeneTreeCache and all of its trees.
+ *
+ * @param cache_p The GeneTreeCache to free.
+ * @memberof GeneTreeCache
+ */
+GENE_TREES_SERVICE_LOCAL void FreeGeneTreeCache (GeneTreeCache *cache_p);
+
+
+/**
+ * Get the parsed gene tree for a cluster.
+ *
+ * @param cache_p The GeneTreeCache to use. If this is <code>NULL</code>,
+ * then the tree is parsed without being cached.
+ * @param cluster_p The Cluster ID for the tree. If this is <code>NULL</code>,
+ * then the tree is parsed without being cached.
+ * @param newick_s The cluster's gene tree. If this differs from the cached
+ * tree for the cluster, then it is parsed again and replaces it.
+ * @return The GeneTree, which must be released with ReleaseCachedGeneTree ()
+ * once it is no longer needed, or <code>NULL</code> if it could not be parsed.
+ * @memberof GeneTreeCache
+ */
+GENE_TREES_SERVICE_LOCAL GeneTree *GetCachedGeneTree (GeneTreeCache *cache_p, const uint32 *cluster_p, const char *newick_s);
+
+
+/**
+ * Release a GeneTree from GetCachedGeneTree (). It is freed if it has
+ * been evicted from the cache, or was never in it.
+ *
+ * @param cache_p The GeneTreeCache that the tree came from.
+ * @param tree_p The GeneTree to release.
+ * @memberof GeneTreeCache
+ */
+GENE_TREES_SERVICE_LOCAL void ReleaseCachedGeneTree (GeneTreeCache *cache_p, GeneTree *tree_p);
+
+
+/**
+ * Get the subtree around a gene from a cluster's gene tree.
+ *
+ * @param cache_p The GeneTreeCache to use. If this is <code>NULL</code>,
+ * then the tree is parsed just for this call.
+ * @param cluster_p The Cluster ID for the tree. If this is <code>NULL</code>,
+ * then the tree is parsed just for this call.
+ * @param newick_s The cluster's gene tree. If this differs from the cached
+ * tree for the cluster, then it is parsed again.
+ * @param gene_s The Gene ID to get the subtree around.
+ * @param min_leaves The minimum number of leaves for the subtree.
+ * @return The subtree in Newick format, which should be freed with FreeMemory (),
+ * or <code>NULL</code> if the tree could not be parsed or the gene is not in it.
+ * @memberof GeneTreeCache
+ */
+GENE_TREES_SERVICE_LOCAL char *GetCachedGeneSubtree (GeneTreeCache *cache_p, const uint32 *cluster_p, const char *newick_s, const char *gene_s, const uint32 min_leaves);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREE_CACHE_H_ */
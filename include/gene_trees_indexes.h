@@ -0,0 +1,75 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_trees_indexes.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREES_INDEXES_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREES_INDEXES_H_
+
+#include "gene_trees_service_library.h"
+#include "mongodb_tool.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Make sure that the indexes that the searches rely upon exist
+ * for a collection. These are an index on the gene ids and a compound
+ * index on the cluster and gene ids, which also serves queries that
+ * only use the cluster id.
+ *
+ * Any indexes that already exist are left untouched, so this is cheap
+ * to call once they have been built. Any that are missing are built
+ * in the background so that the collection stays available while
+ * this is running.
+ *
+ * @param tool_p The MongoTool to use.
+ * @param database_s The name of the database.
+ * @param collection_s The name of the collection to index.
+ * @return <code>true</code> if the indexes exist, <code>false</code> otherwise.
+ */
+GENE_TREES_SERVICE_LOCAL bool EnsureGeneTreesIndexes (MongoTool *tool_p, const char *database_s, const char *collection_s);
+
+
+/**
+ * Check, with listIndexes, that a collection has the indexes that the
+ * searches rely upon and build any that are missing with
+ * EnsureGeneTreesIndexes (). Each collection is only checked once per
+ * process, however many services are configured to use it.
+ *
+ * @param tool_p The MongoTool to use.
+ * @param database_s The name of the database.
+ * @param collection_s The name of the collection to check.
+ * @param require_flag If this is <code>true</code>, the check fails unless
+ * the indexes exist or can be built. Otherwise, the collection is marked
+ * as checked before any missing indexes are built, so that other services
+ * don't wait for the build, and if it fails a warning is logged.
+ * @return <code>false</code> if require_flag is <code>true</code> and the
+ * indexes could not be built, <code>true</code> otherwise.
+ */
+GENE_TREES_SERVICE_LOCAL bool CheckGeneTreesIndexes (MongoTool *tool_p, const char *database_s, const char *collection_s, const bool require_flag);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_GENE_TREES_INDEXES_H_ */
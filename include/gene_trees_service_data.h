@@ -28,11 +28,18 @@
 #ifndef GENE_TREES_SERVICE_DATA_H
 #define GENE_TREES_SERVICE_DATA_H
 
+#include <pthread.h>
+
 #include "gene_trees_service_library.h"
 #include "jansson.h"
 
 #include "service.h"
 #include "mongodb_tool.h"
+#include "search_cache.h"
+#include "mongo_tool_pool.h"
+#include "search_timings.h"
+#include "gene_cluster_index.h"
+#include "gene_tree_cache.h"
 
 
 
@@ -51,16 +58,29 @@ typedef struct /*GENE_TREES_SERVICE_LOCAL*/ GeneTreesServiceData
 	 * @private
 	 *
 	 * The MongoTool to connect to the database where our data is stored.
+	 * This is only used while configuring the service, searches get
+	 * their MongoTools from gtsd_pool_p.
 	 */
 	MongoTool *gtsd_mongo_p;
 
 
+	/**
+	 * @private
+	 *
+	 * The pool of MongoTools that concurrent searches check
+	 * out for their own use. This is shared with every other
+	 * instance in the process that uses the same collection
+	 * and pool settings.
+	 */
+	MongoToolPool *gtsd_pool_p;
+
+
 	/**
 	 * @private
 	 *
 	 * The name of the database to use.
 	 */
-	const char *gtsd_database_s;
+	char *gtsd_database_s;
 
 
 	/**
@@ -68,7 +88,110 @@ typedef struct /*GENE_TREES_SERVICE_LOCAL*/ GeneTreesServiceData
 	 *
 	 * The collection name to use.
 	 */
-	const char *gtsd_collection_s;
+	char *gtsd_collection_s;
+
+
+	/**
+	 * @private
+	 *
+	 * The cache of recent search results. This is
+	 * <code>NULL</code> if caching is disabled.
+	 */
+	SearchCache *gtsd_cache_p;
+
+
+	/**
+	 * @private
+	 *
+	 * The histograms of how long each phase of the searches took.
+	 */
+	SearchTimings *gtsd_timings_p;
+
+
+	/**
+	 * @private
+	 *
+	 * The local index of which cluster each gene is in. This is
+	 * <code>NULL</code> if "gene_index_file" isn't set. It is
+	 * shared with every other instance in the process that uses
+	 * the same file.
+	 */
+	GeneClusterIndex *gtsd_gene_index_p;
+
+
+	/**
+	 * @private
+	 *
+	 * The most recently used parsed gene trees, keyed by their
+	 * Cluster IDs. This is <code>NULL</code> if "tree_cache_size" is 0.
+	 * It is shared with every other instance in the process that uses
+	 * the same collection and cache settings.
+	 */
+	GeneTreeCache *gtsd_tree_cache_p;
+
+
+	/**
+	 * @private
+	 *
+	 * The maximum number of hits in each page of the
+	 * results for a search by gene prefix.
+	 */
+	uint32 gtsd_prefix_search_limit;
+
+
+	/**
+	 * @private
+	 *
+	 * If the gene trees don't have NHX species tags, the number of
+	 * characters at the start of each gene ID that give its species.
+	 * If this is 0, the species are only taken from the NHX tags.
+	 */
+	uint32 gtsd_species_prefix_length;
+
+
+	/**
+	 * @private
+	 *
+	 * The directory that exports are written to. If this is
+	 * <code>NULL</code>, exports are disabled.
+	 */
+	char *gtsd_export_directory_s;
+
+
+	/**
+	 * @private
+	 *
+	 * The number of seconds that exports are kept for before
+	 * they are removed. If this is 0, they are never removed.
+	 */
+	time_t gtsd_export_max_age;
+
+
+	/**
+	 * @private
+	 *
+	 * The GrassrootsServer that this service is running on.
+	 */
+	GrassrootsServer *gtsd_grassroots_p;
+
+
+	/**
+	 * @private
+	 *
+	 * The number of references to this data. The service holds one
+	 * and each search that is running on a worker thread holds another,
+	 * so the data is only freed once the service has been closed and
+	 * all of its searches have finished.
+	 */
+	size_t gtsd_num_references;
+
+
+	/**
+	 * @private
+	 *
+	 * The lock used to access gtsd_num_references.
+	 */
+	pthread_mutex_t gtsd_references_lock;
 
 
 } GeneTreesServiceData;
@@ -98,14 +221,48 @@ extern "C"
 {
 #endif
 
+/**
+ * Allocate a GeneTreesServiceData with a single reference, which
+ * belongs to the service that it is for.
+ *
+ * @return The new GeneTreesServiceData or <code>NULL</code> upon error.
+ */
 GENE_TREES_SERVICE_LOCAL GeneTreesServiceData *AllocateGeneTreesServiceData (void);
 
 
-GENE_TREES_SERVICE_LOCAL void FreeGeneTreesServiceData (GeneTreesServiceData *data_p);
+/**
+ * Add a reference to a GeneTreesServiceData, e.g. for a search that
+ * is going to run on a worker thread.
+ *
+ * @param data_p The GeneTreesServiceData.
+ * @return <code>true</code> if the reference was added, <code>false</code> otherwise.
+ */
+GENE_TREES_SERVICE_LOCAL bool RetainGeneTreesServiceData (GeneTreesServiceData *data_p);
+
+
+/**
+ * Release a reference to a GeneTreesServiceData, freeing it
+ * if this was the last one. This never waits for any searches
+ * that are still using it.
+ *
+ * @param data_p The GeneTreesServiceData.
+ */
+GENE_TREES_SERVICE_LOCAL void ReleaseGeneTreesServiceData (GeneTreesServiceData *data_p);
 
 
 GENE_TREES_SERVICE_LOCAL bool ConfigureGeneTreesService (GeneTreesServiceData *data_p, GrassrootsServer *grassroots_p);
 
+
+/**
+ * Allocate a new MongoTool that is connected to the configured
+ * database and collection.
+ *
+ * @param data_p The configuration data for the service.
+ * @return The new MongoTool or <code>NULL</code> upon error.
+ */
+GENE_TREES_SERVICE_LOCAL MongoTool *AllocateGeneTreesMongoTool (GeneTreesServiceData *data_p);
+
+
 #ifdef __cplusplus
 }
 #endif
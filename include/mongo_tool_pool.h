@@ -0,0 +1,215 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * mongo_tool_pool.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_MONGO_TOOL_POOL_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_MONGO_TOOL_POOL_H_
+
+#include <time.h>
+#include <pthread.h>
+
+#include "gene_trees_service_library.h"
+#include "mongodb_tool.h"
+#include "jansson.h"
+
+
+/**
+ * A bounded pool of MongoTools that can be shared between
+ * concurrent searches. Each MongoTool is only ever used by one
+ * thread at a time, between calls to CheckOutMongoTool() and
+ * CheckInMongoTool(). Tools are created on demand, up to the pool's
+ * size, and are then kept for reuse.
+ */
+typedef struct MongoToolPool
+{
+	/**
+	 * @private
+	 *
+	 * The MongoTools that are not currently checked out.
+	 */
+	MongoTool **mtp_free_tools_pp;
+
+	/**
+	 * @private
+	 *
+	 * The number of entries in mtp_free_tools_pp.
+	 */
+	size_t mtp_num_free_tools;
+
+	/**
+	 * @private
+	 *
+	 * The number of MongoTools that have been created, whether
+	 * they are checked out or not.
+	 */
+	size_t mtp_num_tools;
+
+	/**
+	 * @private
+	 *
+	 * The maximum number of MongoTools that this pool will create.
+	 */
+	size_t mtp_max_tools;
+
+	/**
+	 * @private
+	 *
+	 * The number of seconds to wait for a MongoTool to be checked
+	 * back in when they are all in use. If this is 0, then
+	 * CheckOutMongoTool() waits for as long as it takes.
+	 */
+	time_t mtp_wait_timeout;
+
+	/**
+	 * @private
+	 *
+	 * The function used to create new MongoTools.
+	 */
+	MongoTool *(*mtp_allocate_tool_fn) (void *data_p);
+
+	/**
+	 * @private
+	 *
+	 * The data passed to mtp_allocate_tool_fn.
+	 */
+	void *mtp_allocate_tool_data_p;
+
+	/**
+	 * @private
+	 *
+	 * The total number of times that a MongoTool has been checked out.
+	 */
+	uint64 mtp_num_checkouts;
+
+	/**
+	 * @private
+	 *
+	 * The number of check outs that had to wait for a MongoTool
+	 * to be checked back in.
+	 */
+	uint64 mtp_num_waits;
+
+	/**
+	 * @private
+	 *
+	 * The number of check outs that gave up waiting.
+	 */
+	uint64 mtp_num_timeouts;
+
+	/**
+	 * @private
+	 *
+	 * The total time, in microseconds, spent waiting for
+	 * MongoTools to be checked back in.
+	 */
+	uint64 mtp_total_wait_us;
+
+	/**
+	 * @private
+	 *
+	 * The largest number of MongoTools that have been checked
+	 * out at the same time.
+	 */
+	size_t mtp_max_in_use;
+
+	/**
+	 * @private
+	 *
+	 * The lock used to access the pool.
+	 */
+	pthread_mutex_t mtp_lock;
+
+	/**
+	 * @private
+	 *
+	 * The condition that is signalled when a MongoTool is checked in.
+	 */
+	pthread_cond_t mtp_tool_available;
+
+} MongoToolPool;
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate a MongoToolPool.
+ *
+ * @param max_tools The maximum number of MongoTools that the pool will create.
+ * @param wait_timeout The number of seconds that CheckOutMongoTool() will wait
+ * for a MongoTool when they are all in use. If this is 0, it will wait indefinitely.
+ * @param allocate_tool_fn The function used to create each MongoTool.
+ * @param allocate_tool_data_p The data to pass to allocate_tool_fn.
+ * @return The new MongoToolPool or <code>NULL</code> upon error.
+ * @memberof MongoToolPool
+ */
+GENE_TREES_SERVICE_LOCAL MongoToolPool *AllocateMongoToolPool (const size_t max_tools, const time_t wait_timeout, MongoTool *(*allocate_tool_fn) (void *data_p), void *allocate_tool_data_p);
+
+
+/**
+ * Free a MongoToolPool along with all of its MongoTools. None of
+ * the MongoTools may still be checked out when this is called.
+ *
+ * @param pool_p The MongoToolPool to free.
+ * @memberof MongoToolPool
+ */
+GENE_TREES_SERVICE_LOCAL void FreeMongoToolPool (MongoToolPool *pool_p);
+
+
+/**
+ * Get a MongoTool for the sole use of the calling thread. If all of the
+ * MongoTools are in use and the pool is at its maximum size, this
+ * blocks until one is checked back in or the pool's timeout expires.
+ *
+ * @param pool_p The MongoToolPool to use.
+ * @return The MongoTool which must be returned with CheckInMongoTool()
+ * or <code>NULL</code> upon error.
+ * @memberof MongoToolPool
+ */
+GENE_TREES_SERVICE_LOCAL MongoTool *CheckOutMongoTool (MongoToolPool *pool_p);
+
+
+/**
+ * Return a MongoTool to the pool that it was checked out from.
+ *
+ * @param pool_p The MongoToolPool that the MongoTool came from.
+ * @param tool_p The MongoTool to return.
+ * @memberof MongoToolPool
+ */
+GENE_TREES_SERVICE_LOCAL void CheckInMongoTool (MongoToolPool *pool_p, MongoTool *tool_p);
+
+
+/**
+ * Get the usage statistics for a MongoToolPool.
+ *
+ * @param pool_p The MongoToolPool to get the statistics for.
+ * @return A JSON object of the statistics or <code>NULL</code> upon error.
+ * @memberof MongoToolPool
+ */
+GENE_TREES_SERVICE_LOCAL json_t *GetMongoToolPoolStatistics (MongoToolPool *pool_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_MONGO_TOOL_POOL_H_ */
@@ -0,0 +1,113 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * packed_sequence.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_PACKED_SEQUENCE_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_PACKED_SEQUENCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gene_trees_service_library.h"
+#include "bson.h"
+
+
+/*
+ * A packed sequence is stored as a BSON binary value of subtype
+ * PS_BSON_SUBTYPE laid out as
+ *
+ *   char [4], PS_MAGIC_S followed by PS_VERSION
+ *   uint32_t, the length of the sequence
+ *   uint32_t, the number of runs of other characters
+ *   the runs, each of which is a uint32_t start, a uint32_t length and the character
+ *   the bases, 2 bits each with A, C, G and T as 0 to 3, 4 to a byte starting with the low bits
+ *
+ * The integers are little-endian. Everything that isn't one of the four
+ * upper case bases, such as the Ns in sequences or the gaps in
+ * alignments, is stored in the runs.
+ */
+
+/** The magic bytes at the start of a packed sequence. */
+#define PS_MAGIC_S "GTS"
+
+/** The current version of the packed sequence format. */
+#define PS_VERSION (1)
+
+/** The BSON binary subtype used for packed sequences. */
+#define PS_BSON_SUBTYPE (BSON_SUBTYPE_USER)
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Pack a nucleotide sequence or alignment.
+ *
+ * @param sequence_s The sequence to pack.
+ * @param length The length of the sequence.
+ * @param packed_size_p Where the size of the packed sequence will be stored.
+ * @return The packed sequence, which should be freed with FreeMemory (),
+ * or <code>NULL</code> if it would not be smaller than the sequence itself,
+ * as it would be for a protein sequence, or upon error.
+ */
+GENE_TREES_SERVICE_LOCAL uint8_t *PackSequence (const char *sequence_s, const size_t length, size_t *packed_size_p);
+
+
+/**
+ * Unpack a sequence that was packed by PackSequence ().
+ *
+ * @param packed_p The packed sequence.
+ * @param packed_size The size of the packed sequence.
+ * @param length_p If this is not <code>NULL</code>, the length of the sequence will be stored here.
+ * @return The nul-terminated sequence, which should be freed with FreeMemory (),
+ * or <code>NULL</code> if the packed sequence is invalid or upon error.
+ */
+GENE_TREES_SERVICE_LOCAL char *UnpackSequence (const uint8_t *packed_p, const size_t packed_size, size_t *length_p);
+
+
+/**
+ * Check whether some binary data is a packed sequence.
+ *
+ * @param subtype The BSON binary subtype of the data.
+ * @param data_p The data.
+ * @param size The size of the data.
+ * @return <code>true</code> if it is a packed sequence, <code>false</code> otherwise.
+ */
+GENE_TREES_SERVICE_LOCAL bool IsPackedSequence (const bson_subtype_t subtype, const uint8_t *data_p, const size_t size);
+
+
+/**
+ * Get a copy of a document with any packed sequences in its top-level
+ * fields replaced by the sequences themselves.
+ *
+ * @param doc_p The document.
+ * @return The new document, which should be freed with bson_destroy (), or
+ * <code>NULL</code> if the document doesn't have any packed sequences or upon error.
+ */
+GENE_TREES_SERVICE_LOCAL bson_t *GetUnpackedDocument (const bson_t *doc_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_PACKED_SEQUENCE_H_ */
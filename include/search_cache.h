@@ -0,0 +1,179 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_cache.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_SEARCH_CACHE_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_SEARCH_CACHE_H_
+
+#include <time.h>
+#include <pthread.h>
+
+#include "gene_trees_service_library.h"
+#include "jansson.h"
+
+
+/* forward declaration */
+struct SearchCacheEntry;
+
+
+/**
+ * A bounded, least-recently-used cache of serialised search
+ * results. It is safe to use from multiple threads.
+ */
+typedef struct SearchCache
+{
+	/**
+	 * @private
+	 *
+	 * The hash buckets used to find entries by their keys.
+	 */
+	struct SearchCacheEntry **sc_buckets_pp;
+
+	/**
+	 * @private
+	 *
+	 * The number of hash buckets.
+	 */
+	size_t sc_num_buckets;
+
+	/**
+	 * @private
+	 *
+	 * The most recently used entry.
+	 */
+	struct SearchCacheEntry *sc_head_p;
+
+	/**
+	 * @private
+	 *
+	 * The least recently used entry, which is
+	 * the next one to be evicted.
+	 */
+	struct SearchCacheEntry *sc_tail_p;
+
+	/**
+	 * @private
+	 *
+	 * The current number of entries.
+	 */
+	size_t sc_num_entries;
+
+	/**
+	 * @private
+	 *
+	 * The maximum number of entries.
+	 */
+	size_t sc_max_entries;
+
+	/**
+	 * @private
+	 *
+	 * The current number of bytes used by the keys and
+	 * serialised results.
+	 */
+	size_t sc_num_bytes;
+
+	/**
+	 * @private
+	 *
+	 * The maximum number of bytes to use for the keys and
+	 * serialised results. If this is 0, there is no limit.
+	 */
+	size_t sc_max_bytes;
+
+	/**
+	 * @private
+	 *
+	 * The number of seconds that an entry is valid for.
+	 * If this is 0, entries do not expire.
+	 */
+	time_t sc_ttl;
+
+	/**
+	 * @private
+	 *
+	 * The lock used to access the cache.
+	 */
+	pthread_mutex_t sc_lock;
+
+} SearchCache;
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate a SearchCache.
+ *
+ * @param max_entries The maximum number of result sets to store.
+ * @param max_bytes The maximum number of bytes to use for storing the
+ * result sets. If this is 0, only max_entries is used to limit the cache.
+ * @param ttl The number of seconds that a result set is valid for. If this
+ * is 0, then the result sets never expire.
+ * @return The newly-allocated SearchCache or <code>NULL</code> upon error.
+ * @memberof SearchCache
+ */
+GENE_TREES_SERVICE_LOCAL SearchCache *AllocateSearchCache (const size_t max_entries, const size_t max_bytes, const time_t ttl);
+
+
+/**
+ * Free a SearchCache and all of its entries.
+ *
+ * @param cache_p The SearchCache to free.
+ * @memberof SearchCache
+ */
+GENE_TREES_SERVICE_LOCAL void FreeSearchCache (SearchCache *cache_p);
+
+
+/**
+ * Get a copy of the results stored for a given query.
+ *
+ * @param cache_p The SearchCache to search.
+ * @param key_s The key for the query.
+ * @return A newly-allocated JSON array of the results which the caller
+ * must json_decref() or <code>NULL</code> if there are no valid results
+ * for this key.
+ * @memberof SearchCache
+ */
+GENE_TREES_SERVICE_LOCAL json_t *GetCachedSearchResults (SearchCache *cache_p, const char *key_s);
+
+
+/**
+ * Store the results for a given query.
+ *
+ * @param cache_p The SearchCache to add the results to.
+ * @param key_s The key for the query.
+ * @param results_p The JSON array of results. This is serialised so the
+ * caller retains ownership of it.
+ * @return <code>true</code> if the results were stored successfully,
+ * <code>false</code> otherwise, e.g. if the results were too large to cache.
+ * @memberof SearchCache
+ */
+GENE_TREES_SERVICE_LOCAL bool AddSearchResultsToCache (SearchCache *cache_p, const char *key_s, const json_t *results_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_SEARCH_CACHE_H_ */
@@ -38,6 +38,9 @@ extern "C"
 GENE_TREES_SERVICE_LOCAL Service *GetGeneTreesSearchService (GrassrootsServer *grassroots_p);
 
 
+GENE_TREES_SERVICE_LOCAL Service *GetGeneTreesAsyncSearchService (GrassrootsServer *grassroots_p);
+
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,235 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_timings.h
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_SEARCH_TIMINGS_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_SEARCH_TIMINGS_H_
+
+#include <time.h>
+#include <pthread.h>
+
+#include "gene_trees_service_library.h"
+#include "jansson.h"
+
+
+/**
+ * The phases of a search that are timed.
+ */
+typedef enum SearchPhase
+{
+	/** Waiting for a MongoTool from the pool. */
+	SP_CONNECTION,
+
+	/** Running the query and reading the documents from the cursor. */
+	SP_QUERY,
+
+	/** Converting the documents from BSON to JSON. */
+	SP_CONVERT,
+
+	/** Wrapping the hits as resources and adding them to the ServiceJob. */
+	SP_WRAP,
+
+	/** The whole search, including any cache lookups. */
+	SP_TOTAL,
+
+	/** The number of phases. */
+	SP_NUM_PHASES
+} SearchPhase;
+
+
+/**
+ * The number of buckets, apart from the overflow one, in
+ * each phase's histogram.
+ */
+#define ST_NUM_BUCKETS (14)
+
+
+/**
+ * The time spent in each phase of a single search.
+ */
+typedef struct SearchTimer
+{
+	/** The number of nanoseconds spent in each phase. */
+	uint64 st_phase_ns [SP_NUM_PHASES];
+} SearchTimer;
+
+
+struct MetricsFile;
+
+
+/**
+ * Histograms of the time spent in each phase, aggregated over all
+ * of the searches that a service has run. It is safe to use from
+ * multiple threads.
+ *
+ * Those that are written to a metrics file are shared by every
+ * instance of the same service and kept for the life of the process,
+ * so that their counts only ever go up as Prometheus expects. Each
+ * service's histograms are written to the file with its name as the
+ * "service" label, so several services can share a file.
+ */
+typedef struct SearchTimings
+{
+	/**
+	 * @private
+	 *
+	 * The number of searches in each bucket for each phase. The
+	 * last bucket holds the searches that took longer than the
+	 * largest bound.
+	 */
+	uint64 sts_buckets [SP_NUM_PHASES][ST_NUM_BUCKETS + 1];
+
+	/**
+	 * @private
+	 *
+	 * The total number of nanoseconds spent in each phase.
+	 */
+	uint64 sts_sums_ns [SP_NUM_PHASES];
+
+	/**
+	 * @private
+	 *
+	 * The number of searches that have been added.
+	 */
+	uint64 sts_count;
+
+	/**
+	 * @private
+	 *
+	 * The value of the "service" label in the metrics file, this is
+	 * <code>NULL</code> if sts_metrics_file_p is.
+	 */
+	char *sts_label_s;
+
+	/**
+	 * @private
+	 *
+	 * The file that the histograms are written to so that they can be
+	 * scraped, this can be <code>NULL</code>.
+	 */
+	struct MetricsFile *sts_metrics_file_p;
+
+	/**
+	 * @private
+	 *
+	 * The next SearchTimings written to the same metrics file.
+	 */
+	struct SearchTimings *sts_next_p;
+
+	/**
+	 * @private
+	 *
+	 * The lock used to access the histograms.
+	 */
+	pthread_mutex_t sts_lock;
+} SearchTimings;
+
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the current time for timing a phase.
+ *
+ * @return The value of the monotonic clock in nanoseconds.
+ */
+GENE_TREES_SERVICE_LOCAL uint64 GetSearchTime (void);
+
+
+/**
+ * Reset all of a SearchTimer's phases to 0.
+ *
+ * @param timer_p The SearchTimer to reset.
+ * @memberof SearchTimer
+ */
+GENE_TREES_SERVICE_LOCAL void InitSearchTimer (SearchTimer *timer_p);
+
+
+/**
+ * Add the time since a given start to a phase.
+ *
+ * @param timer_p The SearchTimer to update. If this is <code>NULL</code>,
+ * this does nothing.
+ * @param phase The phase to add the time to.
+ * @param start_ns The start time, from GetSearchTime().
+ * @return The current time, so that the next phase can start from it.
+ * @memberof SearchTimer
+ */
+GENE_TREES_SERVICE_LOCAL uint64 AddSearchPhaseTime (SearchTimer *timer_p, const SearchPhase phase, const uint64 start_ns);
+
+
+/**
+ * Get the times for each phase of a search, in milliseconds.
+ *
+ * @param timer_p The SearchTimer to convert.
+ * @return A JSON object of the times or <code>NULL</code> upon error.
+ * @memberof SearchTimer
+ */
+GENE_TREES_SERVICE_LOCAL json_t *GetSearchTimerAsJSON (const SearchTimer *timer_p);
+
+
+/**
+ * Get a SearchTimings for a service.
+ *
+ * @param label_s The name of the service, used as the "service" label in
+ * the metrics file.
+ * @param metrics_file_s The file to write the histograms to, in the Prometheus
+ * text format, so that they can be scraped. This can be <code>NULL</code>.
+ * If an earlier instance of the same service used the same file, its
+ * SearchTimings is returned so that the counts carry on from it.
+ * @param write_interval The minimum number of seconds between writes of metrics_file_s.
+ * If the services sharing a file ask for different intervals, the shortest is used.
+ * @return The SearchTimings or <code>NULL</code> upon error.
+ * @memberof SearchTimings
+ */
+GENE_TREES_SERVICE_LOCAL SearchTimings *AllocateSearchTimings (const char *label_s, const char *metrics_file_s, const time_t write_interval);
+
+
+/**
+ * Release a SearchTimings. Ones that aren't written to a metrics file are
+ * freed. The others are kept for the next instance of the service and
+ * the file isn't written, so it keeps the figures from the last periodic write.
+ *
+ * @param timings_p The SearchTimings to release.
+ * @memberof SearchTimings
+ */
+GENE_TREES_SERVICE_LOCAL void FreeSearchTimings (SearchTimings *timings_p);
+
+
+/**
+ * Add the times for a search to the histograms. If it is time to,
+ * the metrics file is rewritten too with the histograms of every
+ * service that shares it. This never waits for another thread that
+ * is writing the file.
+ *
+ * @param timings_p The SearchTimings to update.
+ * @param timer_p The times for the search.
+ * @memberof SearchTimings
+ */
+GENE_TREES_SERVICE_LOCAL void AddSearchTimerToTimings (SearchTimings *timings_p, const SearchTimer *timer_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_SEARCH_TIMINGS_H_ */
@@ -0,0 +1,72 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * shared_resources.h
+ *
+ * Grassroots creates and frees instances of the services as it needs
+ * them, so anything that is expensive to build, such as caches, pools
+ * and mapped files, is kept here and shared between every instance in
+ * the process that is configured to use it.
+ */
+
+#ifndef SERVICES_GENE_TREES_SERVICE_INCLUDE_SHARED_RESOURCES_H_
+#define SERVICES_GENE_TREES_SERVICE_INCLUDE_SHARED_RESOURCES_H_
+
+#include "gene_trees_service_library.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the resource for a key, creating it if no one else in this process
+ * is using it. Each successful call must be matched with a call to
+ * ReleaseSharedResource() and the resource is freed when the last of
+ * its references is released.
+ *
+ * The resource is created whilst the registry is locked, so two services
+ * that start at the same time won't both create it.
+ *
+ * @param key_s The key for the resource. This should include everything
+ * that the resource was configured with, so that services configured
+ * differently don't share it.
+ * @param allocate_fn The function used to create the resource if it doesn't
+ * already exist.
+ * @param free_fn The function used to free the resource when its last
+ * reference is released.
+ * @param allocate_data_p The data to pass to allocate_fn.
+ * @return The resource or <code>NULL</code> upon error.
+ */
+GENE_TREES_SERVICE_LOCAL void *AcquireSharedResource (const char *key_s, void *(*allocate_fn) (void *allocate_data_p), void (*free_fn) (void *resource_p), void *allocate_data_p);
+
+
+/**
+ * Release a reference to a resource from AcquireSharedResource() and
+ * free it if this was the last one.
+ *
+ * @param resource_p The resource to release.
+ */
+GENE_TREES_SERVICE_LOCAL void ReleaseSharedResource (void *resource_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERVICES_GENE_TREES_SERVICE_INCLUDE_SHARED_RESOURCES_H_ */
@@ -0,0 +1,287 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * accession_mappings.c
+ */
+
+#include <string.h>
+
+#include "accession_mappings.h"
+
+#include "memory_allocations.h"
+#include "string_utils.h"
+#include "streams.h"
+
+
+static void AddAccessionMapping (AccessionMappings *mappings_p, const char *prefix_s, const uint32 mapping);
+
+static uint32 GetAccessionMappingChild (const AccessionMappings *mappings_p, const uint32 parent, const unsigned char byte);
+
+static uint32 GetAccessionMappingEdgeSlot (const AccessionMappings *mappings_p, const uint32 parent, const unsigned char byte);
+
+static uint32 GetAccessionMappingEdgeHash (const uint32 parent, const unsigned char byte);
+
+
+AccessionMappings *AllocateAccessionMappings (const json_t *mappings_p)
+{
+	AccessionMappings *accession_mappings_p = (AccessionMappings *) AllocMemory (sizeof (AccessionMappings));
+
+	if (accession_mappings_p)
+		{
+			const size_t num_mappings = json_object_size (mappings_p);
+			size_t max_nodes = 1;
+			size_t num_slots = 8;
+			const char *key_s;
+			json_t *value_p;
+
+			accession_mappings_p -> am_edges_p = NULL;
+			accession_mappings_p -> am_num_edge_slots = 0;
+			accession_mappings_p -> am_node_mappings_p = NULL;
+			accession_mappings_p -> am_num_nodes = 1;
+			accession_mappings_p -> am_values_ss = NULL;
+			accession_mappings_p -> am_num_mappings = 0;
+
+			/* Each byte of each prefix adds at most one node */
+			json_object_foreach ((json_t *) mappings_p, key_s, value_p)
+				{
+					max_nodes += strlen (key_s);
+				}
+
+			/* Keep the edge table no more than half full */
+			while (num_slots < (max_nodes << 1))
+				{
+					num_slots <<= 1;
+				}
+
+			if (num_slots <= AM_NO_MAPPING)
+				{
+					accession_mappings_p -> am_num_edge_slots = (uint32) num_slots;
+					accession_mappings_p -> am_edges_p = (AccessionMappingEdge *) AllocMemoryArray (num_slots, sizeof (AccessionMappingEdge));
+					accession_mappings_p -> am_node_mappings_p = (uint32 *) AllocMemoryArray (max_nodes, sizeof (uint32));
+					accession_mappings_p -> am_values_ss = (num_mappings > 0) ? (char **) AllocMemoryArray (num_mappings, sizeof (char *)) : NULL;
+
+					if ((accession_mappings_p -> am_edges_p) && (accession_mappings_p -> am_node_mappings_p) && ((num_mappings == 0) || (accession_mappings_p -> am_values_ss)))
+						{
+							bool success_flag = true;
+							size_t i;
+
+							memset (accession_mappings_p -> am_edges_p, 0, num_slots * sizeof (AccessionMappingEdge));
+
+							for (i = 0; i < max_nodes; ++ i)
+								{
+									accession_mappings_p -> am_node_mappings_p [i] = AM_NO_MAPPING;
+								}
+
+							json_object_foreach ((json_t *) mappings_p, key_s, value_p)
+								{
+									if (json_is_string (value_p))
+										{
+											char *copied_value_s = EasyCopyToNewString (json_string_value (value_p));
+
+											if (copied_value_s)
+												{
+													const uint32 mapping = accession_mappings_p -> am_num_mappings;
+
+													accession_mappings_p -> am_values_ss [mapping] = copied_value_s;
+													++ (accession_mappings_p -> am_num_mappings);
+
+													AddAccessionMapping (accession_mappings_p, key_s, mapping);
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy \"%s\"", json_string_value (value_p));
+													success_flag = false;
+												}
+										}
+									else
+										{
+											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, mappings_p, "Value for \"%s\" is not a string", key_s);
+											success_flag = false;
+										}
+
+									if (!success_flag)
+										{
+											break;
+										}
+								}
+
+							if (success_flag)
+								{
+									return accession_mappings_p;
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate trie for " SIZET_FMT " name mappings", num_mappings);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Too many name mappings, " SIZET_FMT, num_mappings);
+				}
+
+			FreeAccessionMappings (accession_mappings_p);
+		}		/* if (accession_mappings_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate name mappings");
+		}
+
+	return NULL;
+}
+
+
+void FreeAccessionMappings (AccessionMappings *mappings_p)
+{
+	if (mappings_p -> am_values_ss)
+		{
+			uint32 i;
+
+			for (i = 0; i < mappings_p -> am_num_mappings; ++ i)
+				{
+					FreeCopiedString (mappings_p -> am_values_ss [i]);
+				}
+
+			FreeMemory (mappings_p -> am_values_ss);
+		}
+
+	if (mappings_p -> am_node_mappings_p)
+		{
+			FreeMemory (mappings_p -> am_node_mappings_p);
+		}
+
+	if (mappings_p -> am_edges_p)
+		{
+			FreeMemory (mappings_p -> am_edges_p);
+		}
+
+	FreeMemory (mappings_p);
+}
+
+
+const char *GetAccessionMapping (const AccessionMappings *mappings_p, const char *name_s, size_t *prefix_length_p)
+{
+	const char *value_s = NULL;
+	uint32 node = 0;
+	size_t i = 0;
+
+	/* An empty prefix matches everything */
+	if (mappings_p -> am_node_mappings_p [0] != AM_NO_MAPPING)
+		{
+			value_s = mappings_p -> am_values_ss [mappings_p -> am_node_mappings_p [0]];
+			*prefix_length_p = 0;
+		}
+
+	while (name_s [i] != '\0')
+		{
+			node = GetAccessionMappingChild (mappings_p, node, (unsigned char) name_s [i]);
+
+			if (node == 0)
+				{
+					break;
+				}
+
+			++ i;
+
+			if (mappings_p -> am_node_mappings_p [node] != AM_NO_MAPPING)
+				{
+					value_s = mappings_p -> am_values_ss [mappings_p -> am_node_mappings_p [node]];
+					*prefix_length_p = i;
+				}
+		}
+
+	return value_s;
+}
+
+
+static void AddAccessionMapping (AccessionMappings *mappings_p, const char *prefix_s, const uint32 mapping)
+{
+	uint32 node = 0;
+	const char *c_p;
+
+	for (c_p = prefix_s; *c_p != '\0'; ++ c_p)
+		{
+			const unsigned char byte = (unsigned char) *c_p;
+			const uint32 slot = GetAccessionMappingEdgeSlot (mappings_p, node, byte);
+			AccessionMappingEdge *edge_p = (mappings_p -> am_edges_p) + slot;
+
+			if (edge_p -> ame_child == 0)
+				{
+					edge_p -> ame_parent = node;
+					edge_p -> ame_byte = byte;
+					edge_p -> ame_child = mappings_p -> am_num_nodes;
+
+					++ (mappings_p -> am_num_nodes);
+				}
+
+			node = edge_p -> ame_child;
+		}
+
+	/* JSON object keys are unique, so no two mappings can end at the same node */
+	mappings_p -> am_node_mappings_p [node] = mapping;
+}
+
+
+static uint32 GetAccessionMappingChild (const AccessionMappings *mappings_p, const uint32 parent, const unsigned char byte)
+{
+	return mappings_p -> am_edges_p [GetAccessionMappingEdgeSlot (mappings_p, parent, byte)].ame_child;
+}
+
+
+/*
+ * Get the slot for an edge, which is either the edge itself or the
+ * empty slot that it would go in.
+ */
+static uint32 GetAccessionMappingEdgeSlot (const AccessionMappings *mappings_p, const uint32 parent, const unsigned char byte)
+{
+	const uint32 mask = (mappings_p -> am_num_edge_slots) - 1;
+	uint32 i = GetAccessionMappingEdgeHash (parent, byte) & mask;
+
+	while (mappings_p -> am_edges_p [i].ame_child != 0)
+		{
+			const AccessionMappingEdge *edge_p = (mappings_p -> am_edges_p) + i;
+
+			if ((edge_p -> ame_parent == parent) && (edge_p -> ame_byte == byte))
+				{
+					break;
+				}
+
+			i = (i + 1) & mask;
+		}
+
+	return i;
+}
+
+
+/*
+ * FNV-1a over the parent node followed by the byte
+ */
+static uint32 GetAccessionMappingEdgeHash (const uint32 parent, const unsigned char byte)
+{
+	uint32 hash = 2166136261U;
+	uint32 i;
+
+	for (i = 0; i < 32; i += 8)
+		{
+			hash ^= (parent >> i) & 0xFF;
+			hash *= 16777619U;
+		}
+
+	hash ^= byte;
+	hash *= 16777619U;
+
+	return hash;
+}
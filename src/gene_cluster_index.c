@@ -0,0 +1,366 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_cluster_index.c
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gene_cluster_index.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+static bool CheckGeneClusterIndex (const GeneClusterIndexHeader *header_p, const size_t file_size, const char *filename_s);
+
+static bool VerifyGeneClusterIndex (const GeneClusterIndex *index_p, const uint64_t checksum, const char *filename_s);
+
+static const char *GetEntryGeneId (const GeneClusterIndex *index_p, const GeneClusterIndexEntry *entry_p);
+
+static int CompareGeneIds (const char *gene_s, const size_t gene_length, const char *entry_gene_s, const size_t entry_length);
+
+
+GeneClusterIndex *OpenGeneClusterIndex (const char *filename_s, const bool verify_flag)
+{
+	int fd = open (filename_s, O_RDONLY);
+
+	if (fd != -1)
+		{
+			struct stat st;
+
+			if ((fstat (fd, &st) == 0) && (st.st_size >= (off_t) sizeof (GeneClusterIndexHeader)))
+				{
+					const size_t file_size = (size_t) st.st_size;
+					void *data_p = mmap (NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+
+					if (data_p != MAP_FAILED)
+						{
+							const GeneClusterIndexHeader *header_p = (const GeneClusterIndexHeader *) data_p;
+
+							if (CheckGeneClusterIndex (header_p, file_size, filename_s))
+								{
+									GeneClusterIndex *index_p = (GeneClusterIndex *) AllocMemory (sizeof (GeneClusterIndex));
+
+									if (index_p)
+										{
+											const char *start_p = ((const char *) data_p) + sizeof (GeneClusterIndexHeader);
+
+											index_p -> gci_data_p = data_p;
+											index_p -> gci_size = file_size;
+											index_p -> gci_num_entries = (size_t) (header_p -> gcih_num_entries);
+											index_p -> gci_strings_size = (size_t) (header_p -> gcih_strings_size);
+											index_p -> gci_entries_p = (const GeneClusterIndexEntry *) start_p;
+											index_p -> gci_cluster_order_p = (const uint32_t *) (start_p + (index_p -> gci_num_entries) * sizeof (GeneClusterIndexEntry));
+											index_p -> gci_strings_s = ((const char *) (index_p -> gci_cluster_order_p)) + (index_p -> gci_num_entries) * sizeof (uint32_t);
+
+											if ((!verify_flag) || VerifyGeneClusterIndex (index_p, header_p -> gcih_checksum, filename_s))
+												{
+													/* The lookups are binary searches, so don't read ahead */
+													madvise (data_p, file_size, MADV_RANDOM);
+
+													close (fd);
+
+													PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Opened gene cluster index \"%s\" with " SIZET_FMT " genes", filename_s, index_p -> gci_num_entries);
+
+													return index_p;
+												}
+
+											FreeMemory (index_p);
+										}
+								}
+
+							munmap (data_p, file_size);
+						}		/* if (data_p != MAP_FAILED) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to map gene cluster index \"%s\"", filename_s);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene cluster index \"%s\" is too small", filename_s);
+				}
+
+			close (fd);
+		}		/* if (fd != -1) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to open gene cluster index \"%s\"", filename_s);
+		}
+
+	return NULL;
+}
+
+
+void CloseGeneClusterIndex (GeneClusterIndex *index_p)
+{
+	munmap (index_p -> gci_data_p, index_p -> gci_size);
+	FreeMemory (index_p);
+}
+
+
+bool GetGeneClusterFromIndex (const GeneClusterIndex *index_p, const char *gene_s, uint32_t *cluster_p)
+{
+	const size_t gene_length = strlen (gene_s);
+	size_t lower = 0;
+	size_t upper = index_p -> gci_num_entries;
+
+	while (lower < upper)
+		{
+			const size_t mid = lower + ((upper - lower) >> 1);
+			const GeneClusterIndexEntry *entry_p = (index_p -> gci_entries_p) + mid;
+			const char *entry_gene_s = GetEntryGeneId (index_p, entry_p);
+			int res;
+
+			if (!entry_gene_s)
+				{
+					return false;
+				}
+
+			res = CompareGeneIds (gene_s, gene_length, entry_gene_s, entry_p -> gcie_gene_length);
+
+			if (res == 0)
+				{
+					*cluster_p = entry_p -> gcie_cluster_id;
+					return true;
+				}
+			else if (res < 0)
+				{
+					upper = mid;
+				}
+			else
+				{
+					lower = mid + 1;
+				}
+		}
+
+	return false;
+}
+
+
+size_t GetGeneClusterIndexClusterSize (const GeneClusterIndex *index_p, const uint32_t cluster_id, size_t *first_p)
+{
+	const uint32_t *order_p = index_p -> gci_cluster_order_p;
+	const GeneClusterIndexEntry *entries_p = index_p -> gci_entries_p;
+	const size_t num_entries = index_p -> gci_num_entries;
+	size_t lower = 0;
+	size_t upper = num_entries;
+	size_t first;
+
+	/* Find the first gene with a Cluster ID that is not less than cluster_id */
+	while (lower < upper)
+		{
+			const size_t mid = lower + ((upper - lower) >> 1);
+
+			if (order_p [mid] >= num_entries)
+				{
+					return 0;
+				}
+
+			if (entries_p [order_p [mid]].gcie_cluster_id < cluster_id)
+				{
+					lower = mid + 1;
+				}
+			else
+				{
+					upper = mid;
+				}
+		}
+
+	first = lower;
+	upper = num_entries;
+
+	/* and then the first one that is greater than it */
+	while (lower < upper)
+		{
+			const size_t mid = lower + ((upper - lower) >> 1);
+
+			if (order_p [mid] >= num_entries)
+				{
+					return 0;
+				}
+
+			if (entries_p [order_p [mid]].gcie_cluster_id <= cluster_id)
+				{
+					lower = mid + 1;
+				}
+			else
+				{
+					upper = mid;
+				}
+		}
+
+	if (first_p)
+		{
+			*first_p = first;
+		}
+
+	return lower - first;
+}
+
+
+const char *GetGeneClusterIndexGeneByCluster (const GeneClusterIndex *index_p, const size_t position, size_t *gene_length_p)
+{
+	if ((position < index_p -> gci_num_entries) && (index_p -> gci_cluster_order_p [position] < index_p -> gci_num_entries))
+		{
+			const GeneClusterIndexEntry *entry_p = (index_p -> gci_entries_p) + (index_p -> gci_cluster_order_p [position]);
+			const char *gene_s = GetEntryGeneId (index_p, entry_p);
+
+			if (gene_s)
+				{
+					*gene_length_p = entry_p -> gcie_gene_length;
+				}
+
+			return gene_s;
+		}
+
+	return NULL;
+}
+
+
+uint64_t UpdateGeneClusterIndexChecksum (const void *data_p, const size_t length, uint64_t checksum)
+{
+	const unsigned char *byte_p = (const unsigned char *) data_p;
+	const unsigned char *end_p = byte_p + length;
+
+	while (byte_p < end_p)
+		{
+			checksum ^= *byte_p;
+			checksum *= 1099511628211ULL;
+			++ byte_p;
+		}
+
+	return checksum;
+}
+
+
+/*
+ * Check the header and that the sections fit the file. This doesn't
+ * touch the body, so opening a large index stays cheap. The lookups
+ * check each entry that they use, so a corrupt body can't cause reads
+ * outside of the mapping.
+ */
+static bool CheckGeneClusterIndex (const GeneClusterIndexHeader *header_p, const size_t file_size, const char *filename_s)
+{
+	if (memcmp (header_p -> gcih_magic, GCI_MAGIC_S, sizeof (header_p -> gcih_magic)) != 0)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "\"%s\" is not a gene cluster index", filename_s);
+		}
+	else if (header_p -> gcih_version != GCI_VERSION)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene cluster index \"%s\" is version " UINT32_FMT ", only version %d is supported", filename_s, header_p -> gcih_version, GCI_VERSION);
+		}
+	else if (header_p -> gcih_byte_order != GCI_BYTE_ORDER)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene cluster index \"%s\" was built on a machine with a different byte order", filename_s);
+		}
+	else
+		{
+			const uint64_t num_entries = header_p -> gcih_num_entries;
+			const uint64_t body_size = file_size - sizeof (GeneClusterIndexHeader);
+
+			/* Check the sizes without overflowing */
+			if ((num_entries > UINT32_MAX) ||
+					(num_entries * (sizeof (GeneClusterIndexEntry) + sizeof (uint32_t)) > body_size) ||
+					(header_p -> gcih_strings_size != body_size - num_entries * (sizeof (GeneClusterIndexEntry) + sizeof (uint32_t))))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene cluster index \"%s\" has the wrong size", filename_s);
+				}
+			else
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * Read the whole body to check its checksum and every entry. This is
+ * only done when asked for, e.g. by the builder once it has written a
+ * file, since it touches every page of the mapping.
+ */
+static bool VerifyGeneClusterIndex (const GeneClusterIndex *index_p, const uint64_t checksum, const char *filename_s)
+{
+	const char *body_p = (const char *) (index_p -> gci_entries_p);
+
+	if (UpdateGeneClusterIndexChecksum (body_p, (index_p -> gci_size) - sizeof (GeneClusterIndexHeader), GCI_CHECKSUM_SEED) == checksum)
+		{
+			size_t i;
+
+			for (i = 0; i < index_p -> gci_num_entries; ++ i)
+				{
+					if ((!GetEntryGeneId (index_p, (index_p -> gci_entries_p) + i)) || (index_p -> gci_cluster_order_p [i] >= index_p -> gci_num_entries))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene cluster index \"%s\" has an invalid entry at " SIZET_FMT, filename_s, i);
+							return false;
+						}
+				}
+
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene cluster index \"%s\" failed its checksum", filename_s);
+		}
+
+	return false;
+}
+
+
+/*
+ * Get an entry's Gene ID, or NULL if it lies outside of the strings section.
+ */
+static const char *GetEntryGeneId (const GeneClusterIndex *index_p, const GeneClusterIndexEntry *entry_p)
+{
+	if ((entry_p -> gcie_gene_offset <= index_p -> gci_strings_size) && (entry_p -> gcie_gene_length <= (index_p -> gci_strings_size) - (entry_p -> gcie_gene_offset)))
+		{
+			return (index_p -> gci_strings_s) + (entry_p -> gcie_gene_offset);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Compare Gene IDs by their bytes and then their lengths, which is
+ * the order that the index is sorted in.
+ */
+static int CompareGeneIds (const char *gene_s, const size_t gene_length, const char *entry_gene_s, const size_t entry_length)
+{
+	const size_t length = (gene_length < entry_length) ? gene_length : entry_length;
+	int res = memcmp (gene_s, entry_gene_s, length);
+
+	if (res == 0)
+		{
+			if (gene_length < entry_length)
+				{
+					res = -1;
+				}
+			else if (gene_length > entry_length)
+				{
+					res = 1;
+				}
+		}
+
+	return res;
+}
@@ -0,0 +1,451 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_export.c
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "gene_export.h"
+#include "gene_trees_service.h"
+#include "packed_sequence.h"
+
+#include "memory_allocations.h"
+#include "string_utils.h"
+#include "streams.h"
+
+
+/* The size of the buffer that the genes are written through */
+#define GE_BUFFER_SIZE (1 << 20)
+
+/* The number of bases on each line of FASTA */
+#define GE_FASTA_LINE_LENGTH (60)
+
+
+static const char * const S_FORMATS_SS [GEF_NUM_FORMATS] =
+{
+	"ndjson",
+	"fasta"
+};
+
+
+static bool WriteNDJSONGene (GeneExport *export_p, const bson_t *document_p);
+
+static bool WriteFASTAGene (GeneExport *export_p, const bson_t *document_p);
+
+static bool WriteFASTASequence (FILE *out_f, const char *sequence_s, const size_t length);
+
+static bool IsGeneExportFilename (const char *name_s);
+
+
+bool GetGeneExportFormat (const char *format_s, GeneExportFormat *format_p)
+{
+	GeneExportFormat i;
+
+	for (i = 0; i < GEF_NUM_FORMATS; ++ i)
+		{
+			if (Stricmp (format_s, S_FORMATS_SS [i]) == 0)
+				{
+					*format_p = i;
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+const char *GetGeneExportFormatAsString (const GeneExportFormat format)
+{
+	return (format < GEF_NUM_FORMATS) ? S_FORMATS_SS [format] : NULL;
+}
+
+
+const char *GetGeneExportFields (const GeneExportFormat format)
+{
+	return (format == GEF_FASTA) ? "gene_id,cluster_id,gene_sequence" : NULL;
+}
+
+
+GeneExport *AllocateGeneExport (const char *directory_s, const GeneExportFormat format)
+{
+	const char *extension_s = S_FORMATS_SS [format];
+
+	/* <directory>/genes_XXXXXX.<extension> */
+	const size_t filename_size = strlen (directory_s) + strlen (extension_s) + 15;
+	char *filename_s = (char *) AllocMemory (filename_size);
+
+	if (filename_s)
+		{
+			int fd;
+
+			snprintf (filename_s, filename_size, "%s/genes_XXXXXX.%s", directory_s, extension_s);
+
+			fd = mkstemps (filename_s, (int) strlen (extension_s) + 1);
+
+			if (fd != -1)
+				{
+					FILE *out_f = NULL;
+
+					/* mkstemps () only lets the owner read the file */
+					fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+					out_f = fdopen (fd, "w");
+
+					if (out_f)
+						{
+							GeneExport *export_p = (GeneExport *) AllocMemory (sizeof (GeneExport));
+
+							if (export_p)
+								{
+									setvbuf (out_f, NULL, _IOFBF, GE_BUFFER_SIZE);
+
+									export_p -> ge_format = format;
+									export_p -> ge_filename_s = filename_s;
+									export_p -> ge_out_f = out_f;
+									export_p -> ge_num_genes = 0;
+									export_p -> ge_num_skipped = 0;
+									export_p -> ge_failed_flag = false;
+
+									return export_p;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate export for \"%s\"", filename_s);
+								}
+
+							fclose (out_f);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to open \"%s\": %s", filename_s, strerror (errno));
+							close (fd);
+						}
+
+					unlink (filename_s);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create export file in \"%s\": %s", directory_s, strerror (errno));
+				}
+
+			FreeMemory (filename_s);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate export filename for \"%s\"", directory_s);
+		}
+
+	return NULL;
+}
+
+
+bool WriteGeneExportDocument (GeneExport *export_p, const bson_t *document_p)
+{
+	bool success_flag = false;
+
+	switch (export_p -> ge_format)
+		{
+			case GEF_NDJSON:
+				success_flag = WriteNDJSONGene (export_p, document_p);
+				break;
+
+			case GEF_FASTA:
+				success_flag = WriteFASTAGene (export_p, document_p);
+				break;
+
+			default:
+				break;
+		}
+
+	if (!success_flag)
+		{
+			export_p -> ge_failed_flag = true;
+		}
+
+	return success_flag;
+}
+
+
+bool CloseGeneExport (GeneExport *export_p)
+{
+	if (export_p -> ge_out_f)
+		{
+			if (fclose (export_p -> ge_out_f) != 0)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to write \"%s\": %s", export_p -> ge_filename_s, strerror (errno));
+					export_p -> ge_failed_flag = true;
+				}
+
+			export_p -> ge_out_f = NULL;
+		}
+
+	return ! (export_p -> ge_failed_flag);
+}
+
+
+void FreeGeneExport (GeneExport *export_p, const bool remove_file_flag)
+{
+	if (export_p -> ge_out_f)
+		{
+			fclose (export_p -> ge_out_f);
+		}
+
+	if (remove_file_flag)
+		{
+			unlink (export_p -> ge_filename_s);
+		}
+
+	FreeMemory (export_p -> ge_filename_s);
+	FreeMemory (export_p);
+}
+
+
+uint32 RemoveOldGeneExports (const char *directory_s, const time_t max_age)
+{
+	uint32 num_removed = 0;
+	DIR *dir_p = opendir (directory_s);
+
+	if (dir_p)
+		{
+			const time_t cutoff = time (NULL) - max_age;
+			struct dirent *entry_p;
+
+			while ((entry_p = readdir (dir_p)) != NULL)
+				{
+					if (IsGeneExportFilename (entry_p -> d_name))
+						{
+							char *filename_s = ConcatenateVarargsStrings (directory_s, "/", entry_p -> d_name, NULL);
+
+							if (filename_s)
+								{
+									struct stat st;
+
+									if ((stat (filename_s, &st) == 0) && (S_ISREG (st.st_mode)) && (st.st_mtime < cutoff))
+										{
+											/* Another export may have just removed it */
+											if (unlink (filename_s) == 0)
+												{
+													++ num_removed;
+												}
+											else if (errno != ENOENT)
+												{
+													PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to remove old export \"%s\": %s", filename_s, strerror (errno));
+												}
+										}
+
+									FreeCopiedString (filename_s);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make path for \"%s\" in \"%s\"", entry_p -> d_name, directory_s);
+								}
+						}
+				}
+
+			closedir (dir_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to open export directory \"%s\": %s", directory_s, strerror (errno));
+		}
+
+	return num_removed;
+}
+
+
+/*
+ * Only the files that AllocateGeneExport () makes, genes_XXXXXX.<extension>,
+ * are ever removed, so anything else in the directory is left alone.
+ */
+static bool IsGeneExportFilename (const char *name_s)
+{
+	const size_t length = strlen (name_s);
+	GeneExportFormat i;
+
+	if ((length > 13) && (strncmp (name_s, "genes_", 6) == 0) && (name_s [12] == '.'))
+		{
+			for (i = 0; i < GEF_NUM_FORMATS; ++ i)
+				{
+					if (strcmp (name_s + 13, S_FORMATS_SS [i]) == 0)
+						{
+							return true;
+						}
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * Write the document as a single line of relaxed extended JSON. This
+ * goes straight from the BSON to the text without building a json_t,
+ * and it is the same form that mongoexport writes and mongoimport reads.
+ */
+static bool WriteNDJSONGene (GeneExport *export_p, const bson_t *document_p)
+{
+	bool success_flag = false;
+	bson_t *unpacked_doc_p = GetUnpackedDocument (document_p);
+	size_t length = 0;
+	char *json_s = bson_as_relaxed_extended_json (unpacked_doc_p ? unpacked_doc_p : document_p, &length);
+
+	if (json_s)
+		{
+			if ((fwrite (json_s, 1, length, export_p -> ge_out_f) == length) && (fputc ('\n', export_p -> ge_out_f) != EOF))
+				{
+					++ (export_p -> ge_num_genes);
+					success_flag = true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to write to \"%s\": %s", export_p -> ge_filename_s, strerror (errno));
+				}
+
+			bson_free (json_s);
+		}
+	else
+		{
+			PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to convert gene to JSON");
+		}
+
+	if (unpacked_doc_p)
+		{
+			bson_destroy (unpacked_doc_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Write the gene as
+ *
+ *   ><gene_id> cluster_id=<cluster_id>
+ *   <gene_sequence in lines of GE_FASTA_LINE_LENGTH>
+ *
+ * Genes without a sequence are skipped.
+ */
+static bool WriteFASTAGene (GeneExport *export_p, const bson_t *document_p)
+{
+	const char *gene_s = NULL;
+	const char *sequence_s = NULL;
+	char *unpacked_s = NULL;
+	size_t length = 0;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, GTS_GENE_ID_S) && BSON_ITER_HOLDS_UTF8 (&iter))
+		{
+			gene_s = bson_iter_utf8 (&iter, NULL);
+		}
+
+	if (bson_iter_init_find (&iter, document_p, GTS_GENE_SEQUENCE_S))
+		{
+			if (BSON_ITER_HOLDS_UTF8 (&iter))
+				{
+					uint32_t utf8_length = 0;
+
+					sequence_s = bson_iter_utf8 (&iter, &utf8_length);
+					length = utf8_length;
+				}
+			else if (BSON_ITER_HOLDS_BINARY (&iter))
+				{
+					bson_subtype_t subtype;
+					uint32_t size = 0;
+					const uint8_t *data_p = NULL;
+
+					bson_iter_binary (&iter, &subtype, &size, &data_p);
+
+					if (IsPackedSequence (subtype, data_p, size))
+						{
+							if ((unpacked_s = UnpackSequence (data_p, size, &length)) != NULL)
+								{
+									sequence_s = unpacked_s;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unpack sequence for \"%s\"", gene_s ? gene_s : "NULL");
+									return false;
+								}
+						}
+				}
+		}
+
+	if (gene_s && sequence_s)
+		{
+			bool success_flag = false;
+			int res;
+
+			if (bson_iter_init_find (&iter, document_p, GTS_CLUSTER_ID_S) && BSON_ITER_HOLDS_NUMBER (&iter))
+				{
+					res = fprintf (export_p -> ge_out_f, ">%s %s=" UINT32_FMT "\n", gene_s, GTS_CLUSTER_ID_S, (uint32) bson_iter_as_int64 (&iter));
+				}
+			else
+				{
+					res = fprintf (export_p -> ge_out_f, ">%s\n", gene_s);
+				}
+
+			if ((res > 0) && WriteFASTASequence (export_p -> ge_out_f, sequence_s, length))
+				{
+					++ (export_p -> ge_num_genes);
+					success_flag = true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to write \"%s\" to \"%s\": %s", gene_s, export_p -> ge_filename_s, strerror (errno));
+				}
+
+			if (unpacked_s)
+				{
+					FreeMemory (unpacked_s);
+				}
+
+			return success_flag;
+		}
+
+	if (unpacked_s)
+		{
+			FreeMemory (unpacked_s);
+		}
+
+	++ (export_p -> ge_num_skipped);
+
+	return true;
+}
+
+
+static bool WriteFASTASequence (FILE *out_f, const char *sequence_s, const size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i += GE_FASTA_LINE_LENGTH)
+		{
+			const size_t line_length = (length - i < GE_FASTA_LINE_LENGTH) ? length - i : GE_FASTA_LINE_LENGTH;
+
+			if ((fwrite (sequence_s + i, 1, line_length, out_f) != line_length) || (fputc ('\n', out_f) == EOF))
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
@@ -0,0 +1,467 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_homologs.c
+ */
+
+#include <string.h>
+
+#include "gene_homologs.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+typedef enum GeneTreeEvent
+{
+	GE_UNKNOWN,
+	GE_SPECIATION,
+	GE_DUPLICATION
+} GeneTreeEvent;
+
+
+/*
+ * A species that has been seen whilst walking up the tree. gs_step is 0
+ * for those below the current ancestor on the gene's side, otherwise
+ * it is the ancestor that it was seen at and gs_branch is which of that
+ * ancestor's other children it was under.
+ */
+typedef struct GeneSpecies
+{
+	const char *gs_species_s;
+	size_t gs_length;
+	uint32 gs_step;
+	uint32 gs_branch;
+} GeneSpecies;
+
+
+/* An open addressing hash table of species */
+typedef struct GeneSpeciesSet
+{
+	GeneSpecies *gss_species_p;
+	size_t gss_num_slots;
+	size_t gss_num_species;
+} GeneSpeciesSet;
+
+
+static GeneTreeEvent GetSpeciesOverlapEvent (const GeneTree *tree_p, const uint32 node, const uint32 gene_child, const uint32 step, GeneSpeciesSet *set_p, const uint32 species_prefix_length);
+
+static bool AddHomologs (json_t *homologs_p, const GeneTree *tree_p, const uint32 node, const uint32 gene_child, const GeneTreeEvent event, GeneSpeciesSet *set_p, const uint32 species_prefix_length);
+
+static GeneTreeEvent GetNHXEvent (const GeneTree *tree_p, const uint32 node);
+
+static bool GetLeafSpecies (const GeneTree *tree_p, const uint32 leaf, const uint32 species_prefix_length, const char **species_ss, size_t *length_p);
+
+static bool GetNHXTag (const GeneTree *tree_p, const uint32 node, const char *tag_s, const char **value_ss, size_t *length_p);
+
+static uint32 GetFirstLeaf (const GeneTree *tree_p, uint32 node);
+
+static uint32 GetNextLeaf (const GeneTree *tree_p, const uint32 root, uint32 leaf);
+
+static GeneSpecies *GetGeneSpecies (GeneSpeciesSet *set_p, const char *species_s, const size_t length, bool *added_flag_p);
+
+
+json_t *GetGeneTreeHomologs (const GeneTree *tree_p, const uint32 leaf, const uint32 species_prefix_length)
+{
+	json_t *homologs_p = json_array ();
+
+	if (homologs_p)
+		{
+			GeneSpeciesSet set;
+
+			/* There can't be more species than leaves */
+			set.gss_num_slots = 8;
+			set.gss_num_species = 0;
+
+			while (set.gss_num_slots < ((size_t) (tree_p -> gt_nodes_p [0].gtn_num_leaves) << 1))
+				{
+					set.gss_num_slots <<= 1;
+				}
+
+			set.gss_species_p = (GeneSpecies *) AllocMemoryArray (set.gss_num_slots, sizeof (GeneSpecies));
+
+			if (set.gss_species_p)
+				{
+					const char *species_s = NULL;
+					size_t species_length = 0;
+					uint32 gene_child = leaf;
+					uint32 node = tree_p -> gt_nodes_p [leaf].gtn_parent;
+					uint32 step = 0;
+					bool success_flag = true;
+
+					memset (set.gss_species_p, 0, set.gss_num_slots * sizeof (GeneSpecies));
+
+					if (GetLeafSpecies (tree_p, leaf, species_prefix_length, &species_s, &species_length))
+						{
+							bool added_flag;
+
+							GetGeneSpecies (&set, species_s, species_length, &added_flag);
+						}
+
+					/*
+					 * Each of the leaves under the other children of an ancestor
+					 * has that ancestor as its common ancestor with the gene, so
+					 * walking up to the root visits every leaf once.
+					 */
+					while (success_flag && (node != GT_NO_NODE))
+						{
+							GeneTreeEvent event = GetNHXEvent (tree_p, node);
+
+							++ step;
+
+							if (event == GE_UNKNOWN)
+								{
+									event = GetSpeciesOverlapEvent (tree_p, node, gene_child, step, &set, species_prefix_length);
+								}
+
+							success_flag = AddHomologs (homologs_p, tree_p, node, gene_child, event, &set, species_prefix_length);
+
+							gene_child = node;
+							node = tree_p -> gt_nodes_p [node].gtn_parent;
+						}
+
+					FreeMemory (set.gss_species_p);
+
+					if (success_flag)
+						{
+							return homologs_p;
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " species slots", set.gss_num_slots);
+				}
+
+			json_decref (homologs_p);
+		}		/* if (homologs_p) */
+
+	return NULL;
+}
+
+
+/*
+ * An ancestor is a duplication if a species is under more than one of
+ * its children, whether that is the gene's side or any of the others.
+ */
+static GeneTreeEvent GetSpeciesOverlapEvent (const GeneTree *tree_p, const uint32 node, const uint32 gene_child, const uint32 step, GeneSpeciesSet *set_p, const uint32 species_prefix_length)
+{
+	uint32 child = tree_p -> gt_nodes_p [node].gtn_first_child;
+	uint32 branch = 0;
+	bool found_flag = false;
+
+	while (child != GT_NO_NODE)
+		{
+			if (child != gene_child)
+				{
+					uint32 leaf = GetFirstLeaf (tree_p, child);
+
+					++ branch;
+
+					while (leaf != GT_NO_NODE)
+						{
+							const char *species_s = NULL;
+							size_t species_length = 0;
+
+							if (GetLeafSpecies (tree_p, leaf, species_prefix_length, &species_s, &species_length))
+								{
+									bool added_flag = false;
+									GeneSpecies *species_p = GetGeneSpecies (set_p, species_s, species_length, &added_flag);
+
+									found_flag = true;
+
+									if (added_flag)
+										{
+											species_p -> gs_step = step;
+											species_p -> gs_branch = branch;
+										}
+									else if ((species_p -> gs_step != step) || (species_p -> gs_branch != branch))
+										{
+											return GE_DUPLICATION;
+										}
+								}
+
+							leaf = GetNextLeaf (tree_p, child, leaf);
+						}
+				}
+
+			child = tree_p -> gt_nodes_p [child].gtn_next_sibling;
+		}
+
+	return found_flag ? GE_SPECIATION : GE_UNKNOWN;
+}
+
+
+/*
+ * Add the leaves under all of the other children of an ancestor and
+ * then move their species to the gene's side, ready for the next one up.
+ */
+static bool AddHomologs (json_t *homologs_p, const GeneTree *tree_p, const uint32 node, const uint32 gene_child, const GeneTreeEvent event, GeneSpeciesSet *set_p, const uint32 species_prefix_length)
+{
+	const char *relationship_s = (event == GE_SPECIATION) ? "ortholog" : ((event == GE_DUPLICATION) ? "paralog" : "homolog");
+	uint32 child = tree_p -> gt_nodes_p [node].gtn_first_child;
+
+	while (child != GT_NO_NODE)
+		{
+			if (child != gene_child)
+				{
+					uint32 leaf = GetFirstLeaf (tree_p, child);
+
+					while (leaf != GT_NO_NODE)
+						{
+							const GeneTreeNode *leaf_p = (tree_p -> gt_nodes_p) + leaf;
+							const char *species_s = NULL;
+							size_t species_length = 0;
+							const bool species_flag = GetLeafSpecies (tree_p, leaf, species_prefix_length, &species_s, &species_length);
+
+							if (species_flag)
+								{
+									bool added_flag;
+									GeneSpecies *species_p = GetGeneSpecies (set_p, species_s, species_length, &added_flag);
+
+									species_p -> gs_step = 0;
+								}
+
+							/* Leaves without names can't be returned */
+							if (leaf_p -> gtn_name_length > 0)
+								{
+									json_t *homolog_p = json_object ();
+
+									if (homolog_p)
+										{
+											bool success_flag = false;
+
+											if (json_object_set_new (homolog_p, "gene_id", json_stringn ((tree_p -> gt_newick_s) + (leaf_p -> gtn_name_start), leaf_p -> gtn_name_length)) == 0)
+												{
+													if (json_object_set_new (homolog_p, "relationship", json_string (relationship_s)) == 0)
+														{
+															if ((!species_flag) || (json_object_set_new (homolog_p, "species", json_stringn (species_s, species_length)) == 0))
+																{
+																	if (json_array_append_new (homologs_p, homolog_p) == 0)
+																		{
+																			success_flag = true;
+																		}
+																	else
+																		{
+																			homolog_p = NULL;
+																		}
+																}
+														}
+												}
+
+											if (!success_flag)
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add homolog for leaf " UINT32_FMT, leaf);
+
+													if (homolog_p)
+														{
+															json_decref (homolog_p);
+														}
+
+													return false;
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate homolog for leaf " UINT32_FMT, leaf);
+											return false;
+										}
+								}		/* if (leaf_p -> gtn_name_length > 0) */
+
+							leaf = GetNextLeaf (tree_p, child, leaf);
+						}
+				}
+
+			child = tree_p -> gt_nodes_p [child].gtn_next_sibling;
+		}
+
+	return true;
+}
+
+
+/*
+ * Get the event from an NHX D tag, e.g. [&&NHX:D=Y]
+ */
+static GeneTreeEvent GetNHXEvent (const GeneTree *tree_p, const uint32 node)
+{
+	const char *value_s = NULL;
+	size_t length = 0;
+
+	if (GetNHXTag (tree_p, node, "D", &value_s, &length) && (length > 0))
+		{
+			switch (*value_s)
+				{
+					case 'Y':
+					case 'y':
+					case 'T':
+					case 't':
+						return GE_DUPLICATION;
+
+					case 'N':
+					case 'n':
+					case 'F':
+					case 'f':
+						return GE_SPECIATION;
+
+					default:
+						break;
+				}
+		}
+
+	return GE_UNKNOWN;
+}
+
+
+static bool GetLeafSpecies (const GeneTree *tree_p, const uint32 leaf, const uint32 species_prefix_length, const char **species_ss, size_t *length_p)
+{
+	if (GetNHXTag (tree_p, leaf, "S", species_ss, length_p) && (*length_p > 0))
+		{
+			return true;
+		}
+	else if ((species_prefix_length > 0) && (tree_p -> gt_nodes_p [leaf].gtn_name_length >= species_prefix_length))
+		{
+			*species_ss = (tree_p -> gt_newick_s) + (tree_p -> gt_nodes_p [leaf].gtn_name_start);
+			*length_p = species_prefix_length;
+
+			return true;
+		}
+
+	return false;
+}
+
+
+/*
+ * Find the value of a tag in a node's NHX comment. The tags are
+ * separated by colons, e.g. [&&NHX:S=wheat:D=N:B=100]
+ */
+static bool GetNHXTag (const GeneTree *tree_p, const uint32 node, const char *tag_s, const char **value_ss, size_t *length_p)
+{
+	const char *label_s = (tree_p -> gt_newick_s) + (tree_p -> gt_nodes_p [node].gtn_label_start);
+	const char *end_s = label_s + (tree_p -> gt_nodes_p [node].gtn_label_length);
+	const size_t tag_length = strlen (tag_s);
+
+	while (label_s < end_s)
+		{
+			if ((*label_s == '[') && (end_s - label_s > 6) && (strncmp (label_s, "[&&NHX", 6) == 0))
+				{
+					label_s += 6;
+
+					while ((label_s < end_s) && (*label_s == ':'))
+						{
+							const char *key_s = ++ label_s;
+
+							while ((label_s < end_s) && (*label_s != '=') && (*label_s != ':') && (*label_s != ']'))
+								{
+									++ label_s;
+								}
+
+							if ((label_s < end_s) && (*label_s == '='))
+								{
+									const bool match_flag = ((size_t) (label_s - key_s) == tag_length) && (strncmp (key_s, tag_s, tag_length) == 0);
+									const char *value_s = ++ label_s;
+
+									while ((label_s < end_s) && (*label_s != ':') && (*label_s != ']'))
+										{
+											++ label_s;
+										}
+
+									if (match_flag)
+										{
+											*value_ss = value_s;
+											*length_p = label_s - value_s;
+
+											return true;
+										}
+								}
+						}
+
+					return false;
+				}
+
+			++ label_s;
+		}
+
+	return false;
+}
+
+
+static uint32 GetFirstLeaf (const GeneTree *tree_p, uint32 node)
+{
+	while (tree_p -> gt_nodes_p [node].gtn_first_child != GT_NO_NODE)
+		{
+			node = tree_p -> gt_nodes_p [node].gtn_first_child;
+		}
+
+	return node;
+}
+
+
+/*
+ * Get the leaf after the given one in the subtree below root
+ * or GT_NO_NODE if it was the last one.
+ */
+static uint32 GetNextLeaf (const GeneTree *tree_p, const uint32 root, uint32 leaf)
+{
+	while ((leaf != root) && (tree_p -> gt_nodes_p [leaf].gtn_next_sibling == GT_NO_NODE))
+		{
+			leaf = tree_p -> gt_nodes_p [leaf].gtn_parent;
+		}
+
+	return (leaf != root) ? GetFirstLeaf (tree_p, tree_p -> gt_nodes_p [leaf].gtn_next_sibling) : GT_NO_NODE;
+}
+
+
+/*
+ * Find a species, adding it to the gene's side if it isn't there yet
+ */
+static GeneSpecies *GetGeneSpecies (GeneSpeciesSet *set_p, const char *species_s, const size_t length, bool *added_flag_p)
+{
+	const size_t mask = (set_p -> gss_num_slots) - 1;
+	uint32 hash = 2166136261U;
+	GeneSpecies *species_p = NULL;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < length; ++ i)
+		{
+			hash ^= (unsigned char) species_s [i];
+			hash *= 16777619U;
+		}
+
+	i = hash & mask;
+	species_p = (set_p -> gss_species_p) + i;
+
+	while (species_p -> gs_species_s)
+		{
+			if ((species_p -> gs_length == length) && (strncmp (species_p -> gs_species_s, species_s, length) == 0))
+				{
+					*added_flag_p = false;
+					return species_p;
+				}
+
+			i = (i + 1) & mask;
+			species_p = (set_p -> gss_species_p) + i;
+		}
+
+	species_p -> gs_species_s = species_s;
+	species_p -> gs_length = length;
+	species_p -> gs_step = 0;
+	species_p -> gs_branch = 0;
+
+	++ (set_p -> gss_num_species);
+	*added_flag_p = true;
+
+	return species_p;
+}
@@ -0,0 +1,648 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_tree.c
+ */
+
+#include <string.h>
+
+#include "gene_tree.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+static bool AddGeneTreeNode (GeneTree *tree_p, uint32 **last_children_pp, size_t *max_nodes_p, const uint32 parent, uint32 *node_p);
+
+static size_t ParseGeneTreeLabel (const char *newick_s, size_t i, GeneTreeNode *node_p);
+
+static size_t SkipWhitespace (const char *newick_s, size_t i);
+
+static bool AddGeneTreeLeafSlots (GeneTree *tree_p);
+
+static void AddGeneTreeLeafSlot (GeneTree *tree_p, const uint32 node, const uint32 name_length);
+
+static uint32 GetGeneTreeLeafHash (const char *name_s, const size_t length);
+
+/* The characters that can separate a Gene ID from the rest of a leaf's name */
+static const char * const S_LEAF_SEPARATORS_S = "._|";
+
+
+/*
+ * The tree is parsed without recursion, as the trees for large
+ * families can be deep enough to overflow the stack.
+ */
+GeneTree *ParseGeneTree (const char *newick_s)
+{
+	const size_t length = strlen (newick_s);
+	GeneTree *tree_p = NULL;
+
+	if (length >= GT_NO_NODE)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene tree of " SIZET_FMT " bytes is too large", length);
+			return NULL;
+		}
+
+	tree_p = (GeneTree *) AllocMemory (sizeof (GeneTree));
+
+	if (tree_p)
+		{
+			size_t max_nodes = 64;
+
+			tree_p -> gt_newick_s = EasyCopyToNewString (newick_s);
+			tree_p -> gt_newick_length = length;
+			tree_p -> gt_nodes_p = (GeneTreeNode *) AllocMemoryArray (max_nodes, sizeof (GeneTreeNode));
+			tree_p -> gt_num_nodes = 0;
+			tree_p -> gt_leaf_slots_p = NULL;
+			tree_p -> gt_num_leaf_slots = 0;
+			tree_p -> gt_num_references = 1;
+
+			if ((tree_p -> gt_newick_s) && (tree_p -> gt_nodes_p))
+				{
+					/* The last child added to each node, so that the children stay in order */
+					uint32 *last_children_p = (uint32 *) AllocMemoryArray (max_nodes, sizeof (uint32));
+
+					if (last_children_p)
+						{
+							const char *s = tree_p -> gt_newick_s;
+							uint32 current = GT_NO_NODE;
+							uint32 node;
+							size_t i = 0;
+							bool expect_node_flag = true;
+							bool success_flag = true;
+							bool done_flag = false;
+
+							while (success_flag && !done_flag)
+								{
+									i = SkipWhitespace (s, i);
+
+									switch (s [i])
+										{
+											case '(':
+												if (expect_node_flag && ((current != GT_NO_NODE) || (tree_p -> gt_num_nodes == 0)))
+													{
+														if ((success_flag = AddGeneTreeNode (tree_p, &last_children_p, &max_nodes, current, &node)) == true)
+															{
+																current = node;
+																++ i;
+															}
+													}
+												else
+													{
+														success_flag = false;
+													}
+												break;
+
+											case ',':
+											case ')':
+												if (current != GT_NO_NODE)
+													{
+														/* A missing leaf, such as in "(,A)", has no label */
+														if (expect_node_flag)
+															{
+																if ((success_flag = AddGeneTreeNode (tree_p, &last_children_p, &max_nodes, current, &node)) == true)
+																	{
+																		ParseGeneTreeLabel (s, i, (tree_p -> gt_nodes_p) + node);
+																	}
+															}
+
+														if (success_flag)
+															{
+																if (s [i] == ',')
+																	{
+																		expect_node_flag = true;
+																		++ i;
+																	}
+																else
+																	{
+																		i = ParseGeneTreeLabel (s, i + 1, (tree_p -> gt_nodes_p) + current);
+																		current = tree_p -> gt_nodes_p [current].gtn_parent;
+																		expect_node_flag = false;
+																	}
+															}
+													}
+												else
+													{
+														success_flag = false;
+													}
+												break;
+
+											case '[':
+												/* A comment before the tree */
+												if (tree_p -> gt_num_nodes == 0)
+													{
+														const char *end_s = strchr (s + i, ']');
+
+														if (end_s)
+															{
+																i = end_s - s + 1;
+															}
+														else
+															{
+																success_flag = false;
+															}
+													}
+												else
+													{
+														success_flag = false;
+													}
+												break;
+
+											case ';':
+											case '\0':
+												/* Allow the final ; to be missing */
+												if ((current == GT_NO_NODE) && (tree_p -> gt_num_nodes > 0))
+													{
+														done_flag = true;
+													}
+												else
+													{
+														success_flag = false;
+													}
+												break;
+
+											default:
+												if (expect_node_flag && ((current != GT_NO_NODE) || (tree_p -> gt_num_nodes == 0)))
+													{
+														if ((success_flag = AddGeneTreeNode (tree_p, &last_children_p, &max_nodes, current, &node)) == true)
+															{
+																i = ParseGeneTreeLabel (s, i, (tree_p -> gt_nodes_p) + node);
+																expect_node_flag = false;
+															}
+													}
+												else
+													{
+														success_flag = false;
+													}
+												break;
+										}		/* switch (s [i]) */
+
+								}		/* while (success_flag && !done_flag) */
+
+							FreeMemory (last_children_p);
+
+							if (success_flag)
+								{
+									GeneTreeNode *nodes_p = tree_p -> gt_nodes_p;
+
+									/* Every node is after its parent, so the leaves can be counted in a single pass */
+									for (node = tree_p -> gt_num_nodes - 1; node > 0; -- node)
+										{
+											nodes_p [nodes_p [node].gtn_parent].gtn_num_leaves += nodes_p [node].gtn_num_leaves;
+										}
+
+									if (AddGeneTreeLeafSlots (tree_p))
+										{
+											return tree_p;
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to parse gene tree at position " SIZET_FMT, i);
+								}
+
+						}		/* if (last_children_p) */
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate gene tree");
+				}
+
+			FreeGeneTree (tree_p);
+		}		/* if (tree_p) */
+
+	return NULL;
+}
+
+
+void FreeGeneTree (GeneTree *tree_p)
+{
+	if (tree_p -> gt_newick_s)
+		{
+			FreeCopiedString (tree_p -> gt_newick_s);
+		}
+
+	if (tree_p -> gt_nodes_p)
+		{
+			FreeMemory (tree_p -> gt_nodes_p);
+		}
+
+	if (tree_p -> gt_leaf_slots_p)
+		{
+			FreeMemory (tree_p -> gt_leaf_slots_p);
+		}
+
+	FreeMemory (tree_p);
+}
+
+
+uint32 FindGeneTreeLeaf (const GeneTree *tree_p, const char *gene_s)
+{
+	const size_t gene_length = strlen (gene_s);
+	const uint32 mask = (tree_p -> gt_num_leaf_slots) - 1;
+	uint32 i = GetGeneTreeLeafHash (gene_s, gene_length) & mask;
+	const GeneTreeLeafSlot *slot_p = (tree_p -> gt_leaf_slots_p) + i;
+
+	while (slot_p -> gtls_node != GT_NO_NODE)
+		{
+			if (slot_p -> gtls_name_length == gene_length)
+				{
+					const char *name_s = (tree_p -> gt_newick_s) + (tree_p -> gt_nodes_p [slot_p -> gtls_node].gtn_name_start);
+
+					if (memcmp (name_s, gene_s, gene_length) == 0)
+						{
+							return slot_p -> gtls_node;
+						}
+				}
+
+			i = (i + 1) & mask;
+			slot_p = (tree_p -> gt_leaf_slots_p) + i;
+		}
+
+	return GT_NO_NODE;
+}
+
+
+uint32 GetGeneTreeSubtree (const GeneTree *tree_p, uint32 node, const uint32 min_leaves)
+{
+	const GeneTreeNode *nodes_p = tree_p -> gt_nodes_p;
+
+	while ((nodes_p [node].gtn_num_leaves < min_leaves) && (nodes_p [node].gtn_parent != GT_NO_NODE))
+		{
+			node = nodes_p [node].gtn_parent;
+		}
+
+	return node;
+}
+
+
+char *GetGeneTreeSubtreeAsNewick (const GeneTree *tree_p, const uint32 root)
+{
+	/* A subtree can't be any longer than the tree that it came from */
+	char *newick_s = (char *) AllocMemory ((tree_p -> gt_newick_length) + 2);
+
+	if (newick_s)
+		{
+			const GeneTreeNode *nodes_p = tree_p -> gt_nodes_p;
+			char *dest_s = newick_s;
+			uint32 node = root;
+			bool up_flag = false;
+
+			for (;;)
+				{
+					const GeneTreeNode *node_p = nodes_p + node;
+
+					if ((!up_flag) && (node_p -> gtn_first_child != GT_NO_NODE))
+						{
+							*dest_s ++ = '(';
+							node = node_p -> gtn_first_child;
+						}
+					else
+						{
+							if (up_flag)
+								{
+									*dest_s ++ = ')';
+								}
+
+							memcpy (dest_s, (tree_p -> gt_newick_s) + (node_p -> gtn_label_start), node_p -> gtn_label_length);
+							dest_s += node_p -> gtn_label_length;
+
+							if (node == root)
+								{
+									break;
+								}
+							else if (node_p -> gtn_next_sibling != GT_NO_NODE)
+								{
+									*dest_s ++ = ',';
+									node = node_p -> gtn_next_sibling;
+									up_flag = false;
+								}
+							else
+								{
+									node = node_p -> gtn_parent;
+									up_flag = true;
+								}
+						}
+				}
+
+			*dest_s ++ = ';';
+			*dest_s = '\0';
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for subtree", tree_p -> gt_newick_length + 2);
+		}
+
+	return newick_s;
+}
+
+
+size_t GetGeneTreeSize (const GeneTree *tree_p)
+{
+	return sizeof (GeneTree) + (tree_p -> gt_newick_length) + 1 + (tree_p -> gt_num_nodes) * sizeof (GeneTreeNode) + (tree_p -> gt_num_leaf_slots) * sizeof (GeneTreeLeafSlot);
+}
+
+
+static bool AddGeneTreeNode (GeneTree *tree_p, uint32 **last_children_pp, size_t *max_nodes_p, const uint32 parent, uint32 *node_p)
+{
+	GeneTreeNode *new_node_p;
+	uint32 node;
+
+	if (tree_p -> gt_num_nodes == *max_nodes_p)
+		{
+			const size_t max_nodes = (*max_nodes_p) << 1;
+			GeneTreeNode *nodes_p = (GeneTreeNode *) ReallocMemory (tree_p -> gt_nodes_p, max_nodes * sizeof (GeneTreeNode), (*max_nodes_p) * sizeof (GeneTreeNode));
+
+			if (!nodes_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " gene tree nodes", max_nodes);
+					return false;
+				}
+
+			tree_p -> gt_nodes_p = nodes_p;
+
+			if (! (*last_children_pp = (uint32 *) ReallocMemory (*last_children_pp, max_nodes * sizeof (uint32), (*max_nodes_p) * sizeof (uint32))))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " gene tree nodes", max_nodes);
+					return false;
+				}
+
+			*max_nodes_p = max_nodes;
+		}
+
+	node = tree_p -> gt_num_nodes;
+	new_node_p = (tree_p -> gt_nodes_p) + node;
+
+	new_node_p -> gtn_parent = parent;
+	new_node_p -> gtn_first_child = GT_NO_NODE;
+	new_node_p -> gtn_next_sibling = GT_NO_NODE;
+	new_node_p -> gtn_num_leaves = 0;
+	new_node_p -> gtn_label_start = 0;
+	new_node_p -> gtn_label_length = 0;
+	new_node_p -> gtn_name_start = 0;
+	new_node_p -> gtn_name_length = 0;
+
+	(*last_children_pp) [node] = GT_NO_NODE;
+
+	if (parent != GT_NO_NODE)
+		{
+			const uint32 last_child = (*last_children_pp) [parent];
+
+			if (last_child != GT_NO_NODE)
+				{
+					tree_p -> gt_nodes_p [last_child].gtn_next_sibling = node;
+				}
+			else
+				{
+					tree_p -> gt_nodes_p [parent].gtn_first_child = node;
+				}
+
+			(*last_children_pp) [parent] = node;
+		}
+
+	++ (tree_p -> gt_num_nodes);
+	*node_p = node;
+
+	return true;
+}
+
+
+/*
+ * Parse a node's name, branch length and comments, which can be in
+ * any order after the name, starting from position i. This also
+ * marks the node as a leaf if it doesn't have any children.
+ */
+static size_t ParseGeneTreeLabel (const char *newick_s, size_t i, GeneTreeNode *node_p)
+{
+	size_t end;
+
+	i = SkipWhitespace (newick_s, i);
+	node_p -> gtn_label_start = (uint32) i;
+
+	if (newick_s [i] == '\'')
+		{
+			/* A quoted name, where '' is a quote */
+			node_p -> gtn_name_start = (uint32) (++ i);
+
+			while ((newick_s [i] != '\0') && ! ((newick_s [i] == '\'') && (newick_s [i + 1] != '\'')))
+				{
+					i += (newick_s [i] == '\'') ? 2 : 1;
+				}
+
+			node_p -> gtn_name_length = (uint32) (i - node_p -> gtn_name_start);
+
+			if (newick_s [i] == '\'')
+				{
+					++ i;
+				}
+		}
+	else
+		{
+			node_p -> gtn_name_start = (uint32) i;
+			i += strcspn (newick_s + i, ":,();[");
+
+			end = i;
+			while ((end > node_p -> gtn_name_start) && ((newick_s [end - 1] == ' ') || (newick_s [end - 1] == '\t') || (newick_s [end - 1] == '\r') || (newick_s [end - 1] == '\n')))
+				{
+					-- end;
+				}
+
+			node_p -> gtn_name_length = (uint32) (end - node_p -> gtn_name_start);
+		}
+
+	end = i;
+
+	for (;;)
+		{
+			i = SkipWhitespace (newick_s, i);
+
+			if (newick_s [i] == '[')
+				{
+					const char *comment_end_s = strchr (newick_s + i, ']');
+
+					i = comment_end_s ? (size_t) (comment_end_s - newick_s + 1) : i + strlen (newick_s + i);
+				}
+			else if (newick_s [i] == ':')
+				{
+					++ i;
+					i += strcspn (newick_s + i, ",();[");
+				}
+			else
+				{
+					break;
+				}
+
+			end = i;
+		}
+
+	/* Trim any whitespace before a branch length's terminator */
+	while ((end > node_p -> gtn_label_start) && ((newick_s [end - 1] == ' ') || (newick_s [end - 1] == '\t') || (newick_s [end - 1] == '\r') || (newick_s [end - 1] == '\n')))
+		{
+			-- end;
+		}
+
+	node_p -> gtn_label_length = (uint32) (end - node_p -> gtn_label_start);
+
+	if (node_p -> gtn_first_child == GT_NO_NODE)
+		{
+			node_p -> gtn_num_leaves = 1;
+		}
+
+	return i;
+}
+
+
+static size_t SkipWhitespace (const char *newick_s, size_t i)
+{
+	return i + strspn (newick_s + i, " \t\r\n");
+}
+
+
+/*
+ * Build the hash table of leaf names. The whole names go in first so that
+ * a leaf named after a gene is found ahead of one that only starts with it.
+ */
+static bool AddGeneTreeLeafSlots (GeneTree *tree_p)
+{
+	const GeneTreeNode *node_p = tree_p -> gt_nodes_p;
+	size_t num_keys = 0;
+	size_t num_slots = 8;
+	uint32 i;
+
+	for (i = 0; i < tree_p -> gt_num_nodes; ++ i, ++ node_p)
+		{
+			if (node_p -> gtn_first_child == GT_NO_NODE)
+				{
+					const char *name_s = (tree_p -> gt_newick_s) + (node_p -> gtn_name_start);
+					uint32 j;
+
+					++ num_keys;
+
+					for (j = 1; j < node_p -> gtn_name_length; ++ j)
+						{
+							if (strchr (S_LEAF_SEPARATORS_S, name_s [j]))
+								{
+									++ num_keys;
+								}
+						}
+				}
+		}
+
+	/* Keep the table at most half full so that the probes stay short */
+	while (num_slots < (num_keys << 1))
+		{
+			num_slots <<= 1;
+		}
+
+	if (num_slots > GT_NO_NODE)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Gene tree has too many leaf names, " SIZET_FMT, num_keys);
+			return false;
+		}
+
+	tree_p -> gt_leaf_slots_p = (GeneTreeLeafSlot *) AllocMemoryArray (num_slots, sizeof (GeneTreeLeafSlot));
+
+	if (! (tree_p -> gt_leaf_slots_p))
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " gene tree leaf slots", num_slots);
+			return false;
+		}
+
+	tree_p -> gt_num_leaf_slots = (uint32) num_slots;
+
+	for (i = 0; i < num_slots; ++ i)
+		{
+			tree_p -> gt_leaf_slots_p [i].gtls_node = GT_NO_NODE;
+			tree_p -> gt_leaf_slots_p [i].gtls_name_length = 0;
+		}
+
+	for (i = 0, node_p = tree_p -> gt_nodes_p; i < tree_p -> gt_num_nodes; ++ i, ++ node_p)
+		{
+			if (node_p -> gtn_first_child == GT_NO_NODE)
+				{
+					AddGeneTreeLeafSlot (tree_p, i, node_p -> gtn_name_length);
+				}
+		}
+
+	for (i = 0, node_p = tree_p -> gt_nodes_p; i < tree_p -> gt_num_nodes; ++ i, ++ node_p)
+		{
+			if (node_p -> gtn_first_child == GT_NO_NODE)
+				{
+					const char *name_s = (tree_p -> gt_newick_s) + (node_p -> gtn_name_start);
+					uint32 j;
+
+					for (j = 1; j < node_p -> gtn_name_length; ++ j)
+						{
+							if (strchr (S_LEAF_SEPARATORS_S, name_s [j]))
+								{
+									AddGeneTreeLeafSlot (tree_p, i, j);
+								}
+						}
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * Add a key unless it is already in the table
+ */
+static void AddGeneTreeLeafSlot (GeneTree *tree_p, const uint32 node, const uint32 name_length)
+{
+	const char *name_s = (tree_p -> gt_newick_s) + (tree_p -> gt_nodes_p [node].gtn_name_start);
+	const uint32 mask = (tree_p -> gt_num_leaf_slots) - 1;
+	uint32 i = GetGeneTreeLeafHash (name_s, name_length) & mask;
+	GeneTreeLeafSlot *slot_p = (tree_p -> gt_leaf_slots_p) + i;
+
+	while (slot_p -> gtls_node != GT_NO_NODE)
+		{
+			if (slot_p -> gtls_name_length == name_length)
+				{
+					const char *slot_name_s = (tree_p -> gt_newick_s) + (tree_p -> gt_nodes_p [slot_p -> gtls_node].gtn_name_start);
+
+					if (memcmp (slot_name_s, name_s, name_length) == 0)
+						{
+							return;
+						}
+				}
+
+			i = (i + 1) & mask;
+			slot_p = (tree_p -> gt_leaf_slots_p) + i;
+		}
+
+	slot_p -> gtls_node = node;
+	slot_p -> gtls_name_length = name_length;
+}
+
+
+/*
+ * FNV-1a
+ */
+static uint32 GetGeneTreeLeafHash (const char *name_s, const size_t length)
+{
+	uint32 hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < length; ++ i)
+		{
+			hash ^= (unsigned char) name_s [i];
+			hash *= 16777619U;
+		}
+
+	return hash;
+}
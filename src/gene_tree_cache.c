@@ -0,0 +1,416 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_tree_cache.c
+ */
+
+#include <string.h>
+
+#include "gene_tree_cache.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+/*
+ * As with the SearchCache, an entry is in the singly-linked chain for
+ * its hash bucket and the doubly-linked list ordered by use.
+ */
+typedef struct GeneTreeCacheEntry
+{
+	uint32 gtce_cluster_id;
+
+	/* The cache holds one of the tree's references */
+	GeneTree *gtce_tree_p;
+
+	size_t gtce_num_bytes;
+
+	struct GeneTreeCacheEntry *gtce_next_in_bucket_p;
+
+	struct GeneTreeCacheEntry *gtce_prev_p;
+
+	struct GeneTreeCacheEntry *gtce_next_p;
+} GeneTreeCacheEntry;
+
+
+static GeneTreeCacheEntry *FindGeneTreeCacheEntry (const GeneTreeCache *cache_p, const uint32 cluster_id);
+
+static void AddGeneTreeCacheEntry (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p);
+
+static void MoveGeneTreeCacheEntryToHead (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p);
+
+static void UnlinkGeneTreeCacheEntry (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p);
+
+static void RemoveGeneTreeCacheEntry (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p);
+
+static void ReleaseGeneTreeReference (GeneTree *tree_p);
+
+static char *GetGeneSubtree (const GeneTree *tree_p, const char *gene_s, const uint32 min_leaves);
+
+
+GeneTreeCache *AllocateGeneTreeCache (const size_t max_trees, const size_t max_bytes)
+{
+	GeneTreeCache *cache_p = (GeneTreeCache *) AllocMemory (sizeof (GeneTreeCache));
+
+	if (cache_p)
+		{
+			const size_t num_buckets = max_trees > 0 ? max_trees : 1;
+			GeneTreeCacheEntry **buckets_pp = (GeneTreeCacheEntry **) AllocMemoryArray (num_buckets, sizeof (GeneTreeCacheEntry *));
+
+			if (buckets_pp)
+				{
+					if (pthread_mutex_init (& (cache_p -> gtc_lock), NULL) == 0)
+						{
+							memset (buckets_pp, 0, num_buckets * sizeof (GeneTreeCacheEntry *));
+
+							cache_p -> gtc_buckets_pp = buckets_pp;
+							cache_p -> gtc_num_buckets = num_buckets;
+							cache_p -> gtc_head_p = NULL;
+							cache_p -> gtc_tail_p = NULL;
+							cache_p -> gtc_num_entries = 0;
+							cache_p -> gtc_max_entries = max_trees;
+							cache_p -> gtc_num_bytes = 0;
+							cache_p -> gtc_max_bytes = max_bytes;
+
+							return cache_p;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise gene tree cache lock");
+						}
+
+					FreeMemory (buckets_pp);
+				}		/* if (buckets_pp) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " gene tree cache buckets", num_buckets);
+				}
+
+			FreeMemory (cache_p);
+		}		/* if (cache_p) */
+
+	return NULL;
+}
+
+
+void FreeGeneTreeCache (GeneTreeCache *cache_p)
+{
+	GeneTreeCacheEntry *entry_p = cache_p -> gtc_head_p;
+
+	while (entry_p)
+		{
+			GeneTreeCacheEntry *next_p = entry_p -> gtce_next_p;
+
+			ReleaseGeneTreeReference (entry_p -> gtce_tree_p);
+			FreeMemory (entry_p);
+
+			entry_p = next_p;
+		}
+
+	pthread_mutex_destroy (& (cache_p -> gtc_lock));
+
+	FreeMemory (cache_p -> gtc_buckets_pp);
+	FreeMemory (cache_p);
+}
+
+
+GeneTree *GetCachedGeneTree (GeneTreeCache *cache_p, const uint32 *cluster_p, const char *newick_s)
+{
+	GeneTree *tree_p = NULL;
+	const bool cache_flag = (cache_p != NULL) && (cluster_p != NULL);
+
+	if (cache_flag)
+		{
+			if (pthread_mutex_lock (& (cache_p -> gtc_lock)) == 0)
+				{
+					GeneTreeCacheEntry *entry_p = FindGeneTreeCacheEntry (cache_p, *cluster_p);
+
+					if (entry_p)
+						{
+							if (strcmp (entry_p -> gtce_tree_p -> gt_newick_s, newick_s) == 0)
+								{
+									MoveGeneTreeCacheEntryToHead (cache_p, entry_p);
+
+									tree_p = entry_p -> gtce_tree_p;
+									++ (tree_p -> gt_num_references);
+								}
+							else
+								{
+									/* The cluster's tree has changed */
+									RemoveGeneTreeCacheEntry (cache_p, entry_p);
+								}
+						}
+
+					pthread_mutex_unlock (& (cache_p -> gtc_lock));
+
+					if (tree_p)
+						{
+							return tree_p;
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock gene tree cache to get cluster " UINT32_FMT, *cluster_p);
+				}
+		}		/* if (cache_flag) */
+
+	/* Parse the tree without holding the lock */
+	tree_p = ParseGeneTree (newick_s);
+
+	if (tree_p)
+		{
+			if (cache_flag)
+				{
+					const size_t num_bytes = GetGeneTreeSize (tree_p) + sizeof (GeneTreeCacheEntry);
+
+					/*
+					 * Don't let a single huge tree flush everything else out
+					 */
+					if ((cache_p -> gtc_max_bytes == 0) || (num_bytes <= cache_p -> gtc_max_bytes))
+						{
+							GeneTreeCacheEntry *entry_p = (GeneTreeCacheEntry *) AllocMemory (sizeof (GeneTreeCacheEntry));
+
+							if (entry_p)
+								{
+									entry_p -> gtce_cluster_id = *cluster_p;
+									entry_p -> gtce_tree_p = tree_p;
+									entry_p -> gtce_num_bytes = num_bytes;
+									entry_p -> gtce_next_in_bucket_p = NULL;
+									entry_p -> gtce_prev_p = NULL;
+									entry_p -> gtce_next_p = NULL;
+
+									if (pthread_mutex_lock (& (cache_p -> gtc_lock)) == 0)
+										{
+											++ (tree_p -> gt_num_references);
+											AddGeneTreeCacheEntry (cache_p, entry_p);
+
+											pthread_mutex_unlock (& (cache_p -> gtc_lock));
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock gene tree cache to add cluster " UINT32_FMT, *cluster_p);
+											FreeMemory (entry_p);
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate gene tree cache entry for cluster " UINT32_FMT, *cluster_p);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Gene tree for cluster " UINT32_FMT " is too large to cache, " SIZET_FMT " bytes", *cluster_p, num_bytes);
+						}
+				}		/* if (cache_flag) */
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to parse gene tree for cluster " UINT32_FMT, cluster_p ? *cluster_p : 0);
+		}
+
+	return tree_p;
+}
+
+
+void ReleaseCachedGeneTree (GeneTreeCache *cache_p, GeneTree *tree_p)
+{
+	if (cache_p)
+		{
+			if (pthread_mutex_lock (& (cache_p -> gtc_lock)) == 0)
+				{
+					ReleaseGeneTreeReference (tree_p);
+					pthread_mutex_unlock (& (cache_p -> gtc_lock));
+				}
+			else
+				{
+					/* Leak the tree rather than risk freeing it whilst it is in use */
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock gene tree cache to release tree");
+				}
+		}
+	else
+		{
+			ReleaseGeneTreeReference (tree_p);
+		}
+}
+
+
+char *GetCachedGeneSubtree (GeneTreeCache *cache_p, const uint32 *cluster_p, const char *newick_s, const char *gene_s, const uint32 min_leaves)
+{
+	char *subtree_s = NULL;
+	GeneTree *tree_p = GetCachedGeneTree (cache_p, cluster_p, newick_s);
+
+	if (tree_p)
+		{
+			subtree_s = GetGeneSubtree (tree_p, gene_s, min_leaves);
+			ReleaseCachedGeneTree (cache_p, tree_p);
+		}
+
+	return subtree_s;
+}
+
+
+static GeneTreeCacheEntry *FindGeneTreeCacheEntry (const GeneTreeCache *cache_p, const uint32 cluster_id)
+{
+	GeneTreeCacheEntry *entry_p = * ((cache_p -> gtc_buckets_pp) + (cluster_id % (cache_p -> gtc_num_buckets)));
+
+	while (entry_p)
+		{
+			if (entry_p -> gtce_cluster_id == cluster_id)
+				{
+					return entry_p;
+				}
+
+			entry_p = entry_p -> gtce_next_in_bucket_p;
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Add an entry at the head of the cache, replacing any entry for the same
+ * cluster that another thread added whilst this one was parsing its tree.
+ */
+static void AddGeneTreeCacheEntry (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p)
+{
+	GeneTreeCacheEntry *old_entry_p = FindGeneTreeCacheEntry (cache_p, entry_p -> gtce_cluster_id);
+	GeneTreeCacheEntry **bucket_pp = (cache_p -> gtc_buckets_pp) + ((entry_p -> gtce_cluster_id) % (cache_p -> gtc_num_buckets));
+
+	if (old_entry_p)
+		{
+			RemoveGeneTreeCacheEntry (cache_p, old_entry_p);
+		}
+
+	/*
+	 * Evict the least recently used trees until there is room. Any that
+	 * are still in use are freed when they are released.
+	 */
+	while ((cache_p -> gtc_tail_p) &&
+		((cache_p -> gtc_num_entries >= cache_p -> gtc_max_entries) ||
+		((cache_p -> gtc_max_bytes > 0) && (cache_p -> gtc_num_bytes + entry_p -> gtce_num_bytes > cache_p -> gtc_max_bytes))))
+		{
+			RemoveGeneTreeCacheEntry (cache_p, cache_p -> gtc_tail_p);
+		}
+
+	entry_p -> gtce_next_in_bucket_p = *bucket_pp;
+	*bucket_pp = entry_p;
+
+	entry_p -> gtce_next_p = cache_p -> gtc_head_p;
+
+	if (cache_p -> gtc_head_p)
+		{
+			cache_p -> gtc_head_p -> gtce_prev_p = entry_p;
+		}
+	else
+		{
+			cache_p -> gtc_tail_p = entry_p;
+		}
+
+	cache_p -> gtc_head_p = entry_p;
+
+	++ (cache_p -> gtc_num_entries);
+	cache_p -> gtc_num_bytes += entry_p -> gtce_num_bytes;
+}
+
+
+static void MoveGeneTreeCacheEntryToHead (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p)
+{
+	if (cache_p -> gtc_head_p != entry_p)
+		{
+			UnlinkGeneTreeCacheEntry (cache_p, entry_p);
+
+			entry_p -> gtce_next_p = cache_p -> gtc_head_p;
+			cache_p -> gtc_head_p -> gtce_prev_p = entry_p;
+			cache_p -> gtc_head_p = entry_p;
+
+			if (!cache_p -> gtc_tail_p)
+				{
+					cache_p -> gtc_tail_p = entry_p;
+				}
+		}
+}
+
+
+static void UnlinkGeneTreeCacheEntry (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p)
+{
+	if (entry_p -> gtce_prev_p)
+		{
+			entry_p -> gtce_prev_p -> gtce_next_p = entry_p -> gtce_next_p;
+		}
+	else
+		{
+			cache_p -> gtc_head_p = entry_p -> gtce_next_p;
+		}
+
+	if (entry_p -> gtce_next_p)
+		{
+			entry_p -> gtce_next_p -> gtce_prev_p = entry_p -> gtce_prev_p;
+		}
+	else
+		{
+			cache_p -> gtc_tail_p = entry_p -> gtce_prev_p;
+		}
+
+	entry_p -> gtce_prev_p = NULL;
+	entry_p -> gtce_next_p = NULL;
+}
+
+
+static void RemoveGeneTreeCacheEntry (GeneTreeCache *cache_p, GeneTreeCacheEntry *entry_p)
+{
+	GeneTreeCacheEntry **bucket_pp = (cache_p -> gtc_buckets_pp) + ((entry_p -> gtce_cluster_id) % (cache_p -> gtc_num_buckets));
+
+	while (*bucket_pp != entry_p)
+		{
+			bucket_pp = & ((*bucket_pp) -> gtce_next_in_bucket_p);
+		}
+
+	*bucket_pp = entry_p -> gtce_next_in_bucket_p;
+
+	UnlinkGeneTreeCacheEntry (cache_p, entry_p);
+
+	-- (cache_p -> gtc_num_entries);
+	cache_p -> gtc_num_bytes -= entry_p -> gtce_num_bytes;
+
+	ReleaseGeneTreeReference (entry_p -> gtce_tree_p);
+	FreeMemory (entry_p);
+}
+
+
+/*
+ * This must be called with the cache's lock held if the tree
+ * came from a cache
+ */
+static void ReleaseGeneTreeReference (GeneTree *tree_p)
+{
+	if (-- (tree_p -> gt_num_references) == 0)
+		{
+			FreeGeneTree (tree_p);
+		}
+}
+
+
+static char *GetGeneSubtree (const GeneTree *tree_p, const char *gene_s, const uint32 min_leaves)
+{
+	const uint32 leaf = FindGeneTreeLeaf (tree_p, gene_s);
+
+	if (leaf != GT_NO_NODE)
+		{
+			return GetGeneTreeSubtreeAsNewick (tree_p, GetGeneTreeSubtree (tree_p, leaf, min_leaves));
+		}
+
+	return NULL;
+}
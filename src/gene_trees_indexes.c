@@ -0,0 +1,347 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_trees_indexes.c
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "gene_trees_indexes.h"
+#include "gene_trees_service.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+static const char * const S_GENE_ID_INDEX_S = "gene_id_1";
+
+static const char * const S_CLUSTER_GENE_ID_INDEX_S = "cluster_id_1_gene_id_1";
+
+
+/*
+ * A collection whose indexes have already been checked by
+ * this process, keyed by "<database>.<collection>"
+ */
+typedef struct CheckedCollection
+{
+	char *cc_name_s;
+
+	struct CheckedCollection *cc_next_p;
+} CheckedCollection;
+
+
+/*
+ * Every instance of each service configures itself, so these
+ * make sure that each collection is only checked once per process.
+ * The entries live for as long as the process does.
+ */
+static pthread_mutex_t s_checked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CheckedCollection *s_checked_collections_p = NULL;
+
+
+static bool FindGeneTreesIndexes (MongoTool *tool_p, const char *database_s, const char *collection_s, bool *gene_index_flag_p, bool *cluster_index_flag_p);
+
+static bool IsIndexOn (const bson_t *index_p, const char *first_key_s, const char *second_key_s);
+
+static bool IsCollectionChecked (const char *name_s);
+
+static void SetCollectionChecked (char *name_s);
+
+
+bool CheckGeneTreesIndexes (MongoTool *tool_p, const char *database_s, const char *collection_s, const bool require_flag)
+{
+	bool success_flag = false;
+	bool build_flag = false;
+	char *name_s = ConcatenateVarargsStrings (database_s, ".", collection_s, NULL);
+
+	if (name_s)
+		{
+			/*
+			 * Hold the lock for the whole check so that two services
+			 * starting at once don't both check the same collection
+			 */
+			pthread_mutex_lock (&s_checked_lock);
+
+			if (IsCollectionChecked (name_s))
+				{
+					success_flag = true;
+				}
+			else
+				{
+					bool gene_index_flag = false;
+					bool cluster_index_flag = false;
+
+					if (FindGeneTreesIndexes (tool_p, database_s, collection_s, &gene_index_flag, &cluster_index_flag))
+						{
+							if (gene_index_flag && cluster_index_flag)
+								{
+									success_flag = true;
+								}
+							else if (require_flag)
+								{
+									success_flag = EnsureGeneTreesIndexes (tool_p, database_s, collection_s);
+								}
+							else
+								{
+									if (!gene_index_flag)
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "db \"%s\" collection \"%s\" has no index on \"%s\", building it in the background", database_s, collection_s, GTS_GENE_ID_S);
+										}
+
+									if (!cluster_index_flag)
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "db \"%s\" collection \"%s\" has no index on \"%s\" and \"%s\", building it in the background", database_s, collection_s, GTS_CLUSTER_ID_S, GTS_GENE_ID_S);
+										}
+
+									/*
+									 * The service still works without the indexes, just more slowly,
+									 * so the other services can carry on starting while they are built
+									 */
+									build_flag = true;
+									success_flag = true;
+								}
+						}
+					else if (!require_flag)
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to check indexes for db \"%s\" collection \"%s\"", database_s, collection_s);
+							success_flag = true;
+						}
+
+					/* A required check that failed is tried again by the next service to start */
+					if (success_flag)
+						{
+							SetCollectionChecked (name_s);
+							name_s = NULL;
+						}
+				}
+
+			pthread_mutex_unlock (&s_checked_lock);
+
+			if (name_s)
+				{
+					FreeCopiedString (name_s);
+				}
+
+			if (build_flag)
+				{
+					if (EnsureGeneTreesIndexes (tool_p, database_s, collection_s))
+						{
+							PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Built the indexes for db \"%s\" collection \"%s\"", database_s, collection_s);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to build the indexes for db \"%s\" collection \"%s\", searches will use collection scans", database_s, collection_s);
+						}
+				}
+		}		/* if (name_s) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make name for db \"%s\" collection \"%s\"", database_s, collection_s);
+		}
+
+	return success_flag;
+}
+
+
+bool EnsureGeneTreesIndexes (MongoTool *tool_p, const char *database_s, const char *collection_s)
+{
+	bool success_flag = false;
+
+	/*
+	 * createIndexes is a no-op for any index that already exists with the
+	 * same specification, so we can send both every time. The gene id index
+	 * is unique to match the one that the "GT Generate Indexes" parameter
+	 * used to build.
+	 */
+	bson_t *command_p = BCON_NEW ("createIndexes", BCON_UTF8 (collection_s),
+		"indexes", "[",
+			"{",
+				"key", "{", GTS_GENE_ID_S, BCON_INT32 (1), "}",
+				"name", BCON_UTF8 (S_GENE_ID_INDEX_S),
+				"unique", BCON_BOOL (true),
+				"background", BCON_BOOL (true),
+			"}",
+			"{",
+				"key", "{", GTS_CLUSTER_ID_S, BCON_INT32 (1), GTS_GENE_ID_S, BCON_INT32 (1), "}",
+				"name", BCON_UTF8 (S_CLUSTER_GENE_ID_INDEX_S),
+				"background", BCON_BOOL (true),
+			"}",
+		"]");
+
+	if (command_p)
+		{
+			mongoc_database_t *database_p = mongoc_client_get_database (tool_p -> mt_client_p, database_s);
+
+			if (database_p)
+				{
+					bson_t reply;
+					bson_error_t error;
+
+					if (mongoc_database_write_command_with_opts (database_p, command_p, NULL, &reply, &error))
+						{
+							success_flag = true;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create indexes for db \"%s\" collection \"%s\": %s", database_s, collection_s, error.message);
+						}
+
+					bson_destroy (&reply);
+					mongoc_database_destroy (database_p);
+				}		/* if (database_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get database \"%s\"", database_s);
+				}
+
+			bson_destroy (command_p);
+		}		/* if (command_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create index command for db \"%s\" collection \"%s\"", database_s, collection_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Use listIndexes to see whether the indexes exist. They are matched on
+ * their keys rather than their names, so that any that were built by hand
+ * under other names still count.
+ */
+static bool FindGeneTreesIndexes (MongoTool *tool_p, const char *database_s, const char *collection_s, bool *gene_index_flag_p, bool *cluster_index_flag_p)
+{
+	bool success_flag = false;
+	mongoc_collection_t *collection_p = mongoc_client_get_collection (tool_p -> mt_client_p, database_s, collection_s);
+
+	if (collection_p)
+		{
+			mongoc_cursor_t *cursor_p = mongoc_collection_find_indexes_with_opts (collection_p, NULL);
+
+			if (cursor_p)
+				{
+					const bson_t *index_p = NULL;
+					bson_error_t error;
+
+					while (mongoc_cursor_next (cursor_p, &index_p))
+						{
+							if (IsIndexOn (index_p, GTS_GENE_ID_S, NULL))
+								{
+									*gene_index_flag_p = true;
+								}
+							else if (IsIndexOn (index_p, GTS_CLUSTER_ID_S, GTS_GENE_ID_S))
+								{
+									*cluster_index_flag_p = true;
+								}
+						}
+
+					if (!mongoc_cursor_error (cursor_p, &error))
+						{
+							success_flag = true;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to list indexes for db \"%s\" collection \"%s\": %s", database_s, collection_s, error.message);
+						}
+
+					mongoc_cursor_destroy (cursor_p);
+				}		/* if (cursor_p) */
+
+			mongoc_collection_destroy (collection_p);
+		}		/* if (collection_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get collection \"%s\" in db \"%s\"", collection_s, database_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Check whether an index from listIndexes is an ascending index on
+ * exactly the given keys, in order.
+ */
+static bool IsIndexOn (const bson_t *index_p, const char *first_key_s, const char *second_key_s)
+{
+	bson_iter_t iter;
+	bson_iter_t key_iter;
+
+	if (bson_iter_init_find (&iter, index_p, "key") && BSON_ITER_HOLDS_DOCUMENT (&iter) && bson_iter_recurse (&iter, &key_iter))
+		{
+			const char *keys_ss [2];
+			size_t i;
+
+			keys_ss [0] = first_key_s;
+			keys_ss [1] = second_key_s;
+
+			for (i = 0; i < 2; ++ i)
+				{
+					if (keys_ss [i])
+						{
+							if (! (bson_iter_next (&key_iter) && (strcmp (bson_iter_key (&key_iter), keys_ss [i]) == 0) && BSON_ITER_HOLDS_NUMBER (&key_iter) && (bson_iter_as_int64 (&key_iter) == 1)))
+								{
+									return false;
+								}
+						}
+				}
+
+			/* There mustn't be any more keys */
+			return !bson_iter_next (&key_iter);
+		}
+
+	return false;
+}
+
+
+static bool IsCollectionChecked (const char *name_s)
+{
+	const CheckedCollection *checked_p;
+
+	for (checked_p = s_checked_collections_p; checked_p; checked_p = checked_p -> cc_next_p)
+		{
+			if (strcmp (checked_p -> cc_name_s, name_s) == 0)
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * If this fails, the only cost is that the collection is checked again
+ */
+static void SetCollectionChecked (char *name_s)
+{
+	CheckedCollection *checked_p = (CheckedCollection *) AllocMemory (sizeof (CheckedCollection));
+
+	if (checked_p)
+		{
+			checked_p -> cc_name_s = name_s;
+			checked_p -> cc_next_p = s_checked_collections_p;
+			s_checked_collections_p = checked_p;
+		}
+	else
+		{
+			FreeCopiedString (name_s);
+		}
+}
@@ -61,13 +61,21 @@ ServicesArray *GetServices (User *user_p, GrassrootsServer *grassroots_p)
 
 	if (search_service_p)
 		{
-			ServicesArray *services_p = AllocateServicesArray (1);
+			Service *async_search_service_p = GetGeneTreesAsyncSearchService (grassroots_p);
 
-			if (services_p)
+			if (async_search_service_p)
 				{
-					* (services_p -> sa_services_pp) = search_service_p;
+					ServicesArray *services_p = AllocateServicesArray (2);
 
-					return services_p;
+					if (services_p)
+						{
+							* (services_p -> sa_services_pp) = search_service_p;
+							* ((services_p -> sa_services_pp) + 1) = async_search_service_p;
+
+							return services_p;
+						}
+
+					FreeService (async_search_service_p);
 				}
 
 			FreeService (search_service_p);
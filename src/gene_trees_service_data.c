@@ -20,11 +20,124 @@
  *      Author: billy
  */
 
+#include <stdio.h>
+
 #define ALLOCATE_GENE_TREES_SERVICE_TAGS (1)
 #include "gene_trees_service_data.h"
+#include "gene_trees_indexes.h"
+#include "shared_resources.h"
 
 #include "streams.h"
 #include "string_utils.h"
+#include "json_util.h"
+
+
+/*
+ * The settings used to create a shared SearchCache
+ */
+typedef struct SearchCacheSettings
+{
+	size_t scs_max_entries;
+
+	size_t scs_max_bytes;
+
+	time_t scs_ttl;
+} SearchCacheSettings;
+
+
+/*
+ * The data that a shared MongoToolPool uses to create its MongoTools.
+ * The pool can outlive the service that created it, so this has its
+ * own copies of the database and collection names.
+ */
+typedef struct PooledToolData
+{
+	char *ptd_database_s;
+
+	char *ptd_collection_s;
+
+	MongoClientManager *ptd_mongo_manager_p;
+} PooledToolData;
+
+
+/*
+ * The settings used to create a shared MongoToolPool
+ */
+typedef struct MongoToolPoolSettings
+{
+	const GeneTreesServiceData *mtps_data_p;
+
+	size_t mtps_max_tools;
+
+	time_t mtps_wait_timeout;
+} MongoToolPoolSettings;
+
+
+/*
+ * The settings used to open a shared GeneClusterIndex
+ */
+typedef struct GeneClusterIndexSettings
+{
+	const char *gcis_filename_s;
+
+	bool gcis_verify_flag;
+} GeneClusterIndexSettings;
+
+
+/*
+ * The settings used to create a shared GeneTreeCache
+ */
+typedef struct GeneTreeCacheSettings
+{
+	size_t gtcs_max_trees;
+
+	size_t gtcs_max_bytes;
+} GeneTreeCacheSettings;
+
+
+static void FreeGeneTreesServiceData (GeneTreesServiceData *data_p);
+
+static bool CopyConfigString (const json_t *service_config_p, const char *key_s, char **value_ss);
+
+static bool ConfigureSearchCache (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static void *AllocateSharedSearchCache (void *data_p);
+
+static void FreeSharedSearchCache (void *cache_p);
+
+static char *GetSharedResourceKey (const char *type_s, const GeneTreesServiceData *data_p, const char *settings_s);
+
+static bool ConfigureIndexes (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static bool ConfigureMongoToolPool (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static bool ConfigureSearchTimings (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static bool ConfigureGeneClusterIndex (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static void *OpenSharedGeneClusterIndex (void *data_p);
+
+static void CloseSharedGeneClusterIndex (void *index_p);
+
+static bool ConfigureGeneTreeCache (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static void *AllocateSharedGeneTreeCache (void *data_p);
+
+static void FreeSharedGeneTreeCache (void *cache_p);
+
+static void ConfigurePrefixSearches (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static void ConfigureHomologs (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static void ConfigureExports (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static void *AllocateSharedMongoToolPool (void *data_p);
+
+static void FreeSharedMongoToolPool (void *pool_p);
+
+static MongoTool *AllocatePooledMongoTool (void *data_p);
+
+static void FreePooledToolData (PooledToolData *tool_data_p);
 
 
 GeneTreesServiceData *AllocateGeneTreesServiceData  (void)
@@ -33,25 +146,71 @@ GeneTreesServiceData *AllocateGeneTreesServiceData  (void)
 
 	if (data_p)
 		{
-			data_p -> gtsd_mongo_p = NULL;
-			data_p -> gtsd_database_s = NULL;
-			data_p -> gtsd_collection_s = NULL;
+			if (pthread_mutex_init (& (data_p -> gtsd_references_lock), NULL) == 0)
+				{
+					data_p -> gtsd_mongo_p = NULL;
+					data_p -> gtsd_pool_p = NULL;
+					data_p -> gtsd_database_s = NULL;
+					data_p -> gtsd_collection_s = NULL;
+					data_p -> gtsd_cache_p = NULL;
+					data_p -> gtsd_timings_p = NULL;
+					data_p -> gtsd_gene_index_p = NULL;
+					data_p -> gtsd_tree_cache_p = NULL;
+					data_p -> gtsd_prefix_search_limit = 0;
+					data_p -> gtsd_species_prefix_length = 0;
+					data_p -> gtsd_export_directory_s = NULL;
+					data_p -> gtsd_export_max_age = 0;
+					data_p -> gtsd_grassroots_p = NULL;
+					data_p -> gtsd_num_references = 1;
 
-			return data_p;
+					return data_p;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise references lock");
+			FreeMemory (data_p);
 		}
 
 	return NULL;
 }
 
 
-void FreeGeneTreesServiceData (GeneTreesServiceData *data_p)
+bool RetainGeneTreesServiceData (GeneTreesServiceData *data_p)
 {
-	if (data_p -> gtsd_mongo_p)
+	bool success_flag = false;
+
+	if (pthread_mutex_lock (& (data_p -> gtsd_references_lock)) == 0)
 		{
-			FreeMongoTool (data_p -> gtsd_mongo_p);
+			++ (data_p -> gtsd_num_references);
+			success_flag = true;
+
+			pthread_mutex_unlock (& (data_p -> gtsd_references_lock));
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock references");
 		}
 
-	FreeMemory (data_p);
+	return success_flag;
+}
+
+
+void ReleaseGeneTreesServiceData (GeneTreesServiceData *data_p)
+{
+	if (pthread_mutex_lock (& (data_p -> gtsd_references_lock)) == 0)
+		{
+			const size_t num_references = -- (data_p -> gtsd_num_references);
+
+			pthread_mutex_unlock (& (data_p -> gtsd_references_lock));
+
+			if (num_references == 0)
+				{
+					FreeGeneTreesServiceData (data_p);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock references");
+		}
 }
 
 
@@ -60,34 +219,611 @@ bool ConfigureGeneTreesService (GeneTreesServiceData *data_p, GrassrootsServer *
 	bool success_flag = false;
 	const json_t *service_config_p = data_p -> gtsd_base_data.sd_config_p;
 
-	data_p -> gtsd_database_s = GetJSONString (service_config_p, "database");
+	data_p -> gtsd_grassroots_p = grassroots_p;
 
-	if (data_p -> gtsd_database_s)
+	ConfigurePrefixSearches (data_p, service_config_p);
+	ConfigureHomologs (data_p, service_config_p);
+	ConfigureExports (data_p, service_config_p);
+
+	/*
+	 * Searches on worker threads can outlive the service and
+	 * its configuration, so they need copies of these
+	 */
+	if (CopyConfigString (service_config_p, "database", & (data_p -> gtsd_database_s)) &&
+			CopyConfigString (service_config_p, "collection", & (data_p -> gtsd_collection_s)) &&
+			CopyConfigString (service_config_p, "export_directory", & (data_p -> gtsd_export_directory_s)) &&
+			(data_p -> gtsd_database_s))
 		{
-			if ((data_p -> gtsd_collection_s = GetJSONString (service_config_p, "collection")) != NULL)
+			if (data_p -> gtsd_collection_s)
 				{
-					if ((data_p -> gtsd_mongo_p = AllocateMongoTool (NULL, grassroots_p -> gs_mongo_manager_p)) != NULL)
+					if ((data_p -> gtsd_mongo_p = AllocateGeneTreesMongoTool (data_p)) != NULL)
 						{
-							if (SetMongoToolDatabaseAndCollection (data_p -> gtsd_mongo_p, data_p -> gtsd_database_s, data_p -> gtsd_collection_s))
+							if (ConfigureMongoToolPool (data_p, service_config_p))
 								{
-									success_flag = true;
-								}
-							else
-								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set database to \"%s\"", data_p -> gtsd_database_s);
+									if (ConfigureIndexes (data_p, service_config_p))
+										{
+											if (ConfigureSearchCache (data_p, service_config_p))
+												{
+													if (ConfigureSearchTimings (data_p, service_config_p))
+														{
+															if (ConfigureGeneClusterIndex (data_p, service_config_p))
+																{
+																	success_flag = ConfigureGeneTreeCache (data_p, service_config_p);
+																}
+														}
+												}
+										}
 								}
+						}		/* if ((data_p -> gtsd_mongo_p = AllocateGeneTreesMongoTool (data_p)) != NULL) */
+
+				}		/* if (data_p -> gtsd_collection_s) */
 
-						}		/* if ((data_p -> gtsd_mongo_p = AllocateMongoTool (NULL, grassroots_p -> gs_mongo_manager_p)) != NULL) */
-					else
+		}		/* if (CopyConfigString (...) && ... && (data_p -> gtsd_database_s)) */
+
+	return success_flag;
+}
+
+
+MongoTool *AllocateGeneTreesMongoTool (GeneTreesServiceData *data_p)
+{
+	MongoTool *tool_p = AllocateMongoTool (NULL, data_p -> gtsd_grassroots_p -> gs_mongo_manager_p);
+
+	if (tool_p)
+		{
+			if (SetMongoToolDatabaseAndCollection (tool_p, data_p -> gtsd_database_s, data_p -> gtsd_collection_s))
+				{
+					return tool_p;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set database to \"%s\"", data_p -> gtsd_database_s);
+				}
+
+			FreeMongoTool (tool_p);
+		}		/* if (tool_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate MongoTool");
+		}
+
+	return NULL;
+}
+
+
+static void FreeGeneTreesServiceData (GeneTreesServiceData *data_p)
+{
+	if (data_p -> gtsd_pool_p)
+		{
+			ReleaseSharedResource (data_p -> gtsd_pool_p);
+		}
+
+	if (data_p -> gtsd_mongo_p)
+		{
+			FreeMongoTool (data_p -> gtsd_mongo_p);
+		}
+
+	if (data_p -> gtsd_cache_p)
+		{
+			ReleaseSharedResource (data_p -> gtsd_cache_p);
+		}
+
+	if (data_p -> gtsd_timings_p)
+		{
+			FreeSearchTimings (data_p -> gtsd_timings_p);
+		}
+
+	if (data_p -> gtsd_gene_index_p)
+		{
+			ReleaseSharedResource (data_p -> gtsd_gene_index_p);
+		}
+
+	if (data_p -> gtsd_tree_cache_p)
+		{
+			ReleaseSharedResource (data_p -> gtsd_tree_cache_p);
+		}
+
+	if (data_p -> gtsd_database_s)
+		{
+			FreeCopiedString (data_p -> gtsd_database_s);
+		}
+
+	if (data_p -> gtsd_collection_s)
+		{
+			FreeCopiedString (data_p -> gtsd_collection_s);
+		}
+
+	if (data_p -> gtsd_export_directory_s)
+		{
+			FreeCopiedString (data_p -> gtsd_export_directory_s);
+		}
+
+	pthread_mutex_destroy (& (data_p -> gtsd_references_lock));
+
+	FreeMemory (data_p);
+}
+
+
+/*
+ * Copy a string from the configuration if it is there. This only
+ * fails if the copy can't be made.
+ */
+static bool CopyConfigString (const json_t *service_config_p, const char *key_s, char **value_ss)
+{
+	const char *value_s = GetJSONString (service_config_p, key_s);
+
+	if (value_s)
+		{
+			if ((*value_ss = EasyCopyToNewString (value_s)) == NULL)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy \"%s\": \"%s\"", key_s, value_s);
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * The cache is only used if "cache_size" is set to the
+ * maximum number of result sets to keep. It is shared by every
+ * instance of the services in this process that use the same
+ * collection and cache settings, so the results stay cached
+ * after the instance that ran the search has been freed.
+ */
+static bool ConfigureSearchCache (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	bool success_flag = true;
+	int max_entries = 0;
+
+	if (GetJSONInteger (service_config_p, "cache_size", &max_entries) && (max_entries > 0))
+		{
+			SearchCacheSettings settings;
+			char settings_s [64];
+			char *key_s;
+			int max_megabytes = 0;
+			int ttl = 0;
+
+			GetJSONInteger (service_config_p, "cache_max_megabytes", &max_megabytes);
+			GetJSONInteger (service_config_p, "cache_ttl", &ttl);
+
+			if (max_megabytes < 0)
+				{
+					max_megabytes = 0;
+				}
+
+			if (ttl < 0)
+				{
+					ttl = 0;
+				}
+
+			settings.scs_max_entries = (size_t) max_entries;
+			settings.scs_max_bytes = ((size_t) max_megabytes) << 20;
+			settings.scs_ttl = (time_t) ttl;
+
+			snprintf (settings_s, sizeof (settings_s), "%d:%d:%d", max_entries, max_megabytes, ttl);
+
+			if ((key_s = GetSharedResourceKey ("search_cache", data_p, settings_s)) != NULL)
+				{
+					data_p -> gtsd_cache_p = (SearchCache *) AcquireSharedResource (key_s, AllocateSharedSearchCache, FreeSharedSearchCache, &settings);
+					FreeCopiedString (key_s);
+				}
+
+			if (!data_p -> gtsd_cache_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate search cache with %d entries", max_entries);
+					success_flag = false;
+				}
+		}
+
+	return success_flag;
+}
+
+
+static void *AllocateSharedSearchCache (void *data_p)
+{
+	const SearchCacheSettings *settings_p = (const SearchCacheSettings *) data_p;
+
+	return AllocateSearchCache (settings_p -> scs_max_entries, settings_p -> scs_max_bytes, settings_p -> scs_ttl);
+}
+
+
+static void FreeSharedSearchCache (void *cache_p)
+{
+	FreeSearchCache ((SearchCache *) cache_p);
+}
+
+
+/*
+ * The key for a shared resource is its type, the database and
+ * collection that it is for and any settings that it was created with.
+ */
+static char *GetSharedResourceKey (const char *type_s, const GeneTreesServiceData *data_p, const char *settings_s)
+{
+	char *key_s = ConcatenateVarargsStrings (type_s, ":", data_p -> gtsd_database_s, ".", data_p -> gtsd_collection_s, ":", settings_s, NULL);
+
+	if (!key_s)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make %s key for db \"%s\" collection \"%s\"", type_s, data_p -> gtsd_database_s, data_p -> gtsd_collection_s);
+		}
+
+	return key_s;
+}
+
+
+/*
+ * Without the indexes, every search is a collection scan. Each collection
+ * is only checked once per process and any missing indexes are built in
+ * the background. If "require_indexes" is set, then the service refuses
+ * to start unless they exist or can be built.
+ */
+static bool ConfigureIndexes (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	bool require_flag = false;
+
+	GetJSONBoolean (service_config_p, "require_indexes", &require_flag);
+
+	if (CheckGeneTreesIndexes (data_p -> gtsd_mongo_p, data_p -> gtsd_database_s, data_p -> gtsd_collection_s, require_flag))
+		{
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Indexes are required for db \"%s\" collection \"%s\" but could not be created", data_p -> gtsd_database_s, data_p -> gtsd_collection_s);
+
+	return false;
+}
+
+
+/*
+ * Each concurrent search needs a MongoTool of its own, so "mongo_pool_size"
+ * sets how many searches can query the database at once. Any others wait
+ * for up to "mongo_pool_timeout" seconds for one to be checked back in.
+ * The pool is shared by every instance of the services in this process
+ * that use the same collection and pool settings, so the limit applies
+ * to all of them together.
+ */
+static bool ConfigureMongoToolPool (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	MongoToolPoolSettings settings;
+	char settings_s [64];
+	char *key_s;
+	int pool_size = 8;
+	int timeout = 0;
+
+	GetJSONInteger (service_config_p, "mongo_pool_size", &pool_size);
+	GetJSONInteger (service_config_p, "mongo_pool_timeout", &timeout);
+
+	if (pool_size <= 0)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid mongo_pool_size %d, using 1", pool_size);
+			pool_size = 1;
+		}
+
+	if (timeout < 0)
+		{
+			timeout = 0;
+		}
+
+	settings.mtps_data_p = data_p;
+	settings.mtps_max_tools = (size_t) pool_size;
+	settings.mtps_wait_timeout = (time_t) timeout;
+
+	snprintf (settings_s, sizeof (settings_s), "%d:%d", pool_size, timeout);
+
+	if ((key_s = GetSharedResourceKey ("mongo_pool", data_p, settings_s)) != NULL)
+		{
+			data_p -> gtsd_pool_p = (MongoToolPool *) AcquireSharedResource (key_s, AllocateSharedMongoToolPool, FreeSharedMongoToolPool, &settings);
+			FreeCopiedString (key_s);
+		}
+
+	if (! (data_p -> gtsd_pool_p))
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate pool of %d MongoTools", pool_size);
+		}
+
+	return (data_p -> gtsd_pool_p != NULL);
+}
+
+
+static void *AllocateSharedMongoToolPool (void *data_p)
+{
+	const MongoToolPoolSettings *settings_p = (const MongoToolPoolSettings *) data_p;
+	PooledToolData *tool_data_p = (PooledToolData *) AllocMemory (sizeof (PooledToolData));
+
+	if (tool_data_p)
+		{
+			tool_data_p -> ptd_database_s = EasyCopyToNewString (settings_p -> mtps_data_p -> gtsd_database_s);
+			tool_data_p -> ptd_collection_s = EasyCopyToNewString (settings_p -> mtps_data_p -> gtsd_collection_s);
+			tool_data_p -> ptd_mongo_manager_p = settings_p -> mtps_data_p -> gtsd_grassroots_p -> gs_mongo_manager_p;
+
+			if ((tool_data_p -> ptd_database_s) && (tool_data_p -> ptd_collection_s))
+				{
+					MongoToolPool *pool_p = AllocateMongoToolPool (settings_p -> mtps_max_tools, settings_p -> mtps_wait_timeout, AllocatePooledMongoTool, tool_data_p);
+
+					if (pool_p)
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate MongoTool");
+							return pool_p;
 						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy db \"%s\" collection \"%s\" for MongoToolPool", settings_p -> mtps_data_p -> gtsd_database_s, settings_p -> mtps_data_p -> gtsd_collection_s);
+				}
+
+			FreePooledToolData (tool_data_p);
+		}		/* if (tool_data_p) */
 
-				}		/* if ((data_p -> gtsd_accessions_collection_s = GetJSONString (service_config_p, "accessions_collection")) != NULL) */
+	return NULL;
+}
 
-		}		/* if (data_p -> psd_database_s) */
 
-	return success_flag;
+/*
+ * The pool is only freed once every instance that used it has been
+ * closed, so this is where its usage statistics cover all of them.
+ */
+static void FreeSharedMongoToolPool (void *pool_p)
+{
+	MongoToolPool *mongo_pool_p = (MongoToolPool *) pool_p;
+	PooledToolData *tool_data_p = (PooledToolData *) (mongo_pool_p -> mtp_allocate_tool_data_p);
+	json_t *stats_p = GetMongoToolPoolStatistics (mongo_pool_p);
+
+	if (stats_p)
+		{
+			PrintJSONToLog (STM_LEVEL_INFO, __FILE__, __LINE__, stats_p, "MongoToolPool statistics for db \"%s\" collection \"%s\": ", tool_data_p -> ptd_database_s, tool_data_p -> ptd_collection_s);
+			json_decref (stats_p);
+		}
+
+	FreeMongoToolPool (mongo_pool_p);
+	FreePooledToolData (tool_data_p);
+}
+
+
+static MongoTool *AllocatePooledMongoTool (void *data_p)
+{
+	PooledToolData *tool_data_p = (PooledToolData *) data_p;
+	MongoTool *tool_p = AllocateMongoTool (NULL, tool_data_p -> ptd_mongo_manager_p);
+
+	if (tool_p)
+		{
+			if (SetMongoToolDatabaseAndCollection (tool_p, tool_data_p -> ptd_database_s, tool_data_p -> ptd_collection_s))
+				{
+					return tool_p;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set database to \"%s\"", tool_data_p -> ptd_database_s);
+				}
+
+			FreeMongoTool (tool_p);
+		}		/* if (tool_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate MongoTool");
+		}
+
+	return NULL;
+}
+
+
+static void FreePooledToolData (PooledToolData *tool_data_p)
+{
+	if (tool_data_p -> ptd_database_s)
+		{
+			FreeCopiedString (tool_data_p -> ptd_database_s);
+		}
+
+	if (tool_data_p -> ptd_collection_s)
+		{
+			FreeCopiedString (tool_data_p -> ptd_collection_s);
+		}
+
+	FreeMemory (tool_data_p);
+}
+
+
+/*
+ * The histograms are always kept. If "metrics_file" is set, they are
+ * also written to it at most every "metrics_interval" seconds, so that
+ * they can be scraped. The services can share a file as each one's
+ * histograms are labelled with its name.
+ */
+static bool ConfigureSearchTimings (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	const char *metrics_file_s = GetJSONString (service_config_p, "metrics_file");
+	const char *service_name_s = GetServiceName (data_p -> gtsd_base_data.sd_service_p);
+	int interval = 60;
+
+	GetJSONInteger (service_config_p, "metrics_interval", &interval);
+
+	if (interval < 0)
+		{
+			interval = 0;
+		}
+
+	data_p -> gtsd_timings_p = AllocateSearchTimings (service_name_s, metrics_file_s, (time_t) interval);
+
+	if (! (data_p -> gtsd_timings_p))
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate search timings");
+		}
+
+	return (data_p -> gtsd_timings_p != NULL);
+}
+
+
+/*
+ * If "gene_index_file" is set, it is a prebuilt gene cluster index
+ * that is mapped into memory so that summaries of which clusters genes are
+ * in can be answered without going to the database. The builder verifies
+ * the files that it writes, so the whole file is only read again here if
+ * "gene_index_verify" is true. Each file is only mapped once per process,
+ * however many instances use it, so it is only verified by the first one
+ * to open it.
+ */
+static bool ConfigureGeneClusterIndex (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	const char *index_file_s = GetJSONString (service_config_p, "gene_index_file");
+
+	if (index_file_s)
+		{
+			GeneClusterIndexSettings settings;
+			char *key_s = ConcatenateStrings ("gene_index:", index_file_s);
+
+			settings.gcis_filename_s = index_file_s;
+			settings.gcis_verify_flag = false;
+
+			GetJSONBoolean (service_config_p, "gene_index_verify", & (settings.gcis_verify_flag));
+
+			if (key_s)
+				{
+					data_p -> gtsd_gene_index_p = (GeneClusterIndex *) AcquireSharedResource (key_s, OpenSharedGeneClusterIndex, CloseSharedGeneClusterIndex, &settings);
+					FreeCopiedString (key_s);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make gene_index key for \"%s\"", index_file_s);
+				}
+
+			return (data_p -> gtsd_gene_index_p != NULL);
+		}
+
+	return true;
+}
+
+
+static void *OpenSharedGeneClusterIndex (void *data_p)
+{
+	const GeneClusterIndexSettings *settings_p = (const GeneClusterIndexSettings *) data_p;
+
+	return OpenGeneClusterIndex (settings_p -> gcis_filename_s, settings_p -> gcis_verify_flag);
+}
+
+
+static void CloseSharedGeneClusterIndex (void *index_p)
+{
+	CloseGeneClusterIndex ((GeneClusterIndex *) index_p);
 }
 
 
+/*
+ * "tree_cache_size" is the number of parsed gene trees to keep and
+ * "tree_cache_max_megabytes" caps the memory that they use. If the
+ * size is 0, each tree is parsed every time that it is needed. The
+ * cache is shared by every instance of the services in this process
+ * that use the same collection and cache settings.
+ */
+static bool ConfigureGeneTreeCache (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	int num_trees = 1024;
+
+	GetJSONInteger (service_config_p, "tree_cache_size", &num_trees);
+
+	if (num_trees > 0)
+		{
+			GeneTreeCacheSettings settings;
+			char settings_s [64];
+			char *key_s;
+			int max_megabytes = 256;
+
+			GetJSONInteger (service_config_p, "tree_cache_max_megabytes", &max_megabytes);
+
+			if (max_megabytes < 0)
+				{
+					max_megabytes = 0;
+				}
+
+			settings.gtcs_max_trees = (size_t) num_trees;
+			settings.gtcs_max_bytes = ((size_t) max_megabytes) << 20;
+
+			snprintf (settings_s, sizeof (settings_s), "%d:%d", num_trees, max_megabytes);
+
+			if ((key_s = GetSharedResourceKey ("tree_cache", data_p, settings_s)) != NULL)
+				{
+					data_p -> gtsd_tree_cache_p = (GeneTreeCache *) AcquireSharedResource (key_s, AllocateSharedGeneTreeCache, FreeSharedGeneTreeCache, &settings);
+					FreeCopiedString (key_s);
+				}
+
+			if (! (data_p -> gtsd_tree_cache_p))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate gene tree cache with %d trees", num_trees);
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static void *AllocateSharedGeneTreeCache (void *data_p)
+{
+	const GeneTreeCacheSettings *settings_p = (const GeneTreeCacheSettings *) data_p;
+
+	return AllocateGeneTreeCache (settings_p -> gtcs_max_trees, settings_p -> gtcs_max_bytes);
+}
+
+
+static void FreeSharedGeneTreeCache (void *cache_p)
+{
+	FreeGeneTreeCache ((GeneTreeCache *) cache_p);
+}
+
+
+/*
+ * "prefix_search_limit" caps each page of the hits for a gene prefix,
+ * as a short prefix can match most of the collection.
+ */
+static void ConfigurePrefixSearches (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	int limit = 100;
+
+	GetJSONInteger (service_config_p, "prefix_search_limit", &limit);
+
+	if (limit <= 0)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid prefix_search_limit %d, using 100", limit);
+			limit = 100;
+		}
+
+	data_p -> gtsd_prefix_search_limit = (uint32) limit;
+}
+
+
+/*
+ * "species_prefix_length" is the number of characters at the start of
+ * a gene ID that give its species when a gene tree has no NHX S tags.
+ */
+static void ConfigureHomologs (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	int length = 0;
+
+	GetJSONInteger (service_config_p, "species_prefix_length", &length);
+
+	if (length < 0)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid species_prefix_length %d, using 0", length);
+			length = 0;
+		}
+
+	data_p -> gtsd_species_prefix_length = (uint32) length;
+}
+
+
+/*
+ * Nothing else removes the exports, so "export_max_age" is the number
+ * of seconds to keep each one for. The old ones are removed each time
+ * that a new export is started. If it is 0, they are kept forever.
+ */
+static void ConfigureExports (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	int max_age = 86400;
+
+	GetJSONInteger (service_config_p, "export_max_age", &max_age);
+
+	if (max_age < 0)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid export_max_age %d, using 0", max_age);
+			max_age = 0;
+		}
+
+	data_p -> gtsd_export_max_age = (time_t) max_age;
+}
@@ -0,0 +1,269 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * mongo_tool_pool.c
+ */
+
+#include <errno.h>
+
+#include "mongo_tool_pool.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+static uint64 GetElapsedMicroseconds (const struct timespec *start_p);
+
+
+MongoToolPool *AllocateMongoToolPool (const size_t max_tools, const time_t wait_timeout, MongoTool *(*allocate_tool_fn) (void *data_p), void *allocate_tool_data_p)
+{
+	if (max_tools > 0)
+		{
+			MongoTool **tools_pp = (MongoTool **) AllocMemoryArray (max_tools, sizeof (MongoTool *));
+
+			if (tools_pp)
+				{
+					MongoToolPool *pool_p = (MongoToolPool *) AllocMemory (sizeof (MongoToolPool));
+
+					if (pool_p)
+						{
+							if (pthread_mutex_init (& (pool_p -> mtp_lock), NULL) == 0)
+								{
+									if (pthread_cond_init (& (pool_p -> mtp_tool_available), NULL) == 0)
+										{
+											pool_p -> mtp_free_tools_pp = tools_pp;
+											pool_p -> mtp_num_free_tools = 0;
+											pool_p -> mtp_num_tools = 0;
+											pool_p -> mtp_max_tools = max_tools;
+											pool_p -> mtp_wait_timeout = wait_timeout;
+											pool_p -> mtp_allocate_tool_fn = allocate_tool_fn;
+											pool_p -> mtp_allocate_tool_data_p = allocate_tool_data_p;
+											pool_p -> mtp_num_checkouts = 0;
+											pool_p -> mtp_num_waits = 0;
+											pool_p -> mtp_num_timeouts = 0;
+											pool_p -> mtp_total_wait_us = 0;
+											pool_p -> mtp_max_in_use = 0;
+
+											return pool_p;
+										}
+
+									pthread_mutex_destroy (& (pool_p -> mtp_lock));
+								}
+
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise MongoToolPool lock");
+							FreeMemory (pool_p);
+						}		/* if (pool_p) */
+
+					FreeMemory (tools_pp);
+				}		/* if (tools_pp) */
+
+		}		/* if (max_tools > 0) */
+
+	return NULL;
+}
+
+
+void FreeMongoToolPool (MongoToolPool *pool_p)
+{
+	size_t i;
+
+	if (pool_p -> mtp_num_free_tools != pool_p -> mtp_num_tools)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Freeing MongoToolPool with " SIZET_FMT " MongoTools still checked out", pool_p -> mtp_num_tools - pool_p -> mtp_num_free_tools);
+		}
+
+	for (i = 0; i < pool_p -> mtp_num_free_tools; ++ i)
+		{
+			FreeMongoTool (* ((pool_p -> mtp_free_tools_pp) + i));
+		}
+
+	pthread_cond_destroy (& (pool_p -> mtp_tool_available));
+	pthread_mutex_destroy (& (pool_p -> mtp_lock));
+
+	FreeMemory (pool_p -> mtp_free_tools_pp);
+	FreeMemory (pool_p);
+}
+
+
+MongoTool *CheckOutMongoTool (MongoToolPool *pool_p)
+{
+	MongoTool *tool_p = NULL;
+
+	if (pthread_mutex_lock (& (pool_p -> mtp_lock)) == 0)
+		{
+			bool create_flag = false;
+			bool waited_flag = false;
+			int res = 0;
+			struct timespec deadline;
+			struct timespec wait_start;
+
+			while ((pool_p -> mtp_num_free_tools == 0) && (pool_p -> mtp_num_tools == pool_p -> mtp_max_tools) && (res == 0))
+				{
+					if (!waited_flag)
+						{
+							waited_flag = true;
+							++ (pool_p -> mtp_num_waits);
+
+							clock_gettime (CLOCK_MONOTONIC, &wait_start);
+
+							if (pool_p -> mtp_wait_timeout > 0)
+								{
+									clock_gettime (CLOCK_REALTIME, &deadline);
+									deadline.tv_sec += pool_p -> mtp_wait_timeout;
+								}
+						}
+
+					if (pool_p -> mtp_wait_timeout > 0)
+						{
+							res = pthread_cond_timedwait (& (pool_p -> mtp_tool_available), & (pool_p -> mtp_lock), &deadline);
+						}
+					else
+						{
+							res = pthread_cond_wait (& (pool_p -> mtp_tool_available), & (pool_p -> mtp_lock));
+						}
+				}
+
+			if (waited_flag)
+				{
+					pool_p -> mtp_total_wait_us += GetElapsedMicroseconds (&wait_start);
+				}
+
+			if (pool_p -> mtp_num_free_tools > 0)
+				{
+					-- (pool_p -> mtp_num_free_tools);
+					tool_p = * ((pool_p -> mtp_free_tools_pp) + (pool_p -> mtp_num_free_tools));
+				}
+			else if (pool_p -> mtp_num_tools < pool_p -> mtp_max_tools)
+				{
+					/*
+					 * Reserve the slot now and create the tool once we've released
+					 * the lock, so that other threads aren't held up by the connection.
+					 */
+					++ (pool_p -> mtp_num_tools);
+					create_flag = true;
+				}
+			else if (res == ETIMEDOUT)
+				{
+					++ (pool_p -> mtp_num_timeouts);
+				}
+
+			if (tool_p || create_flag)
+				{
+					const size_t num_in_use = (pool_p -> mtp_num_tools) - (pool_p -> mtp_num_free_tools);
+
+					++ (pool_p -> mtp_num_checkouts);
+
+					if (num_in_use > pool_p -> mtp_max_in_use)
+						{
+							pool_p -> mtp_max_in_use = num_in_use;
+						}
+				}
+
+			pthread_mutex_unlock (& (pool_p -> mtp_lock));
+
+			if (create_flag)
+				{
+					tool_p = pool_p -> mtp_allocate_tool_fn (pool_p -> mtp_allocate_tool_data_p);
+
+					if (!tool_p)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create MongoTool for pool");
+
+							/* Give the slot back */
+							if (pthread_mutex_lock (& (pool_p -> mtp_lock)) == 0)
+								{
+									-- (pool_p -> mtp_num_tools);
+									pthread_cond_signal (& (pool_p -> mtp_tool_available));
+									pthread_mutex_unlock (& (pool_p -> mtp_lock));
+								}
+						}
+				}
+			else if (!tool_p)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Timed out waiting for a MongoTool after " SIZET_FMT " seconds", (size_t) (pool_p -> mtp_wait_timeout));
+				}
+
+		}		/* if (pthread_mutex_lock (& (pool_p -> mtp_lock)) == 0) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock MongoToolPool");
+		}
+
+	return tool_p;
+}
+
+
+void CheckInMongoTool (MongoToolPool *pool_p, MongoTool *tool_p)
+{
+	if (pthread_mutex_lock (& (pool_p -> mtp_lock)) == 0)
+		{
+			* ((pool_p -> mtp_free_tools_pp) + (pool_p -> mtp_num_free_tools)) = tool_p;
+			++ (pool_p -> mtp_num_free_tools);
+
+			pthread_cond_signal (& (pool_p -> mtp_tool_available));
+			pthread_mutex_unlock (& (pool_p -> mtp_lock));
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock MongoToolPool, freeing MongoTool instead");
+			FreeMongoTool (tool_p);
+		}
+}
+
+
+json_t *GetMongoToolPoolStatistics (MongoToolPool *pool_p)
+{
+	json_t *stats_p = NULL;
+
+	if (pthread_mutex_lock (& (pool_p -> mtp_lock)) == 0)
+		{
+			stats_p = json_pack ("{s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I}",
+				"size", (json_int_t) (pool_p -> mtp_max_tools),
+				"connections", (json_int_t) (pool_p -> mtp_num_tools),
+				"in_use", (json_int_t) ((pool_p -> mtp_num_tools) - (pool_p -> mtp_num_free_tools)),
+				"max_in_use", (json_int_t) (pool_p -> mtp_max_in_use),
+				"checkouts", (json_int_t) (pool_p -> mtp_num_checkouts),
+				"waits", (json_int_t) (pool_p -> mtp_num_waits),
+				"timeouts", (json_int_t) (pool_p -> mtp_num_timeouts),
+				"total_wait_us", (json_int_t) (pool_p -> mtp_total_wait_us));
+
+			pthread_mutex_unlock (& (pool_p -> mtp_lock));
+
+			if (!stats_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create MongoToolPool statistics");
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock MongoToolPool");
+		}
+
+	return stats_p;
+}
+
+
+static uint64 GetElapsedMicroseconds (const struct timespec *start_p)
+{
+	struct timespec now;
+	int64 elapsed_us;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	elapsed_us = ((int64) (now.tv_sec - start_p -> tv_sec)) * 1000000 + (now.tv_nsec - start_p -> tv_nsec) / 1000;
+
+	return (elapsed_us > 0) ? (uint64) elapsed_us : 0;
+}
@@ -0,0 +1,312 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * packed_sequence.c
+ */
+
+#include <string.h>
+
+#include "packed_sequence.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+/* The magic bytes and version, the length and the number of runs */
+#define PS_HEADER_SIZE (12)
+
+/* The start, length and character of a run */
+#define PS_RUN_SIZE (9)
+
+
+static int GetBaseCode (const char c);
+
+static void WriteUInt32 (uint8_t *dest_p, const uint32_t value);
+
+static uint32_t ReadUInt32 (const uint8_t *src_p);
+
+
+uint8_t *PackSequence (const char *sequence_s, const size_t length, size_t *packed_size_p)
+{
+	size_t num_runs = 0;
+	size_t packed_size;
+	size_t i;
+
+	if ((length == 0) || (length > UINT32_MAX))
+		{
+			return NULL;
+		}
+
+	/* Count the runs first to see if packing is worthwhile */
+	for (i = 0; i < length; ++ i)
+		{
+			if ((GetBaseCode (sequence_s [i]) < 0) && ((i == 0) || (sequence_s [i] != sequence_s [i - 1])))
+				{
+					++ num_runs;
+				}
+		}
+
+	packed_size = PS_HEADER_SIZE + (num_runs * PS_RUN_SIZE) + ((length + 3) >> 2);
+
+	if (packed_size < length)
+		{
+			uint8_t *packed_p = (uint8_t *) AllocMemory (packed_size);
+
+			if (packed_p)
+				{
+					uint8_t *run_p = packed_p + PS_HEADER_SIZE;
+					uint8_t *bases_p = run_p + (num_runs * PS_RUN_SIZE);
+					uint8_t *current_run_p = NULL;
+
+					memcpy (packed_p, PS_MAGIC_S, 3);
+					packed_p [3] = PS_VERSION;
+					WriteUInt32 (packed_p + 4, (uint32_t) length);
+					WriteUInt32 (packed_p + 8, (uint32_t) num_runs);
+
+					memset (bases_p, 0, (length + 3) >> 2);
+
+					for (i = 0; i < length; ++ i)
+						{
+							const int code = GetBaseCode (sequence_s [i]);
+
+							if (code >= 0)
+								{
+									bases_p [i >> 2] |= (uint8_t) (code << ((i & 3) << 1));
+									current_run_p = NULL;
+								}
+							else if (current_run_p && (sequence_s [i] == sequence_s [i - 1]))
+								{
+									WriteUInt32 (current_run_p + 4, ReadUInt32 (current_run_p + 4) + 1);
+								}
+							else
+								{
+									current_run_p = run_p;
+									WriteUInt32 (current_run_p, (uint32_t) i);
+									WriteUInt32 (current_run_p + 4, 1);
+									current_run_p [8] = (uint8_t) sequence_s [i];
+
+									run_p += PS_RUN_SIZE;
+								}
+						}
+
+					*packed_size_p = packed_size;
+					return packed_p;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes to pack sequence", packed_size);
+				}
+		}
+
+	return NULL;
+}
+
+
+char *UnpackSequence (const uint8_t *packed_p, const size_t packed_size, size_t *length_p)
+{
+	if ((packed_size >= PS_HEADER_SIZE) && (memcmp (packed_p, PS_MAGIC_S, 3) == 0) && (packed_p [3] == PS_VERSION))
+		{
+			const size_t length = ReadUInt32 (packed_p + 4);
+			const size_t num_runs = ReadUInt32 (packed_p + 8);
+
+			if (packed_size == PS_HEADER_SIZE + (num_runs * PS_RUN_SIZE) + ((length + 3) >> 2))
+				{
+					char *sequence_s = (char *) AllocMemory (length + 1);
+
+					if (sequence_s)
+						{
+							static const char BASES [] = { 'A', 'C', 'G', 'T' };
+							const uint8_t *run_p = packed_p + PS_HEADER_SIZE;
+							const uint8_t *bases_p = run_p + (num_runs * PS_RUN_SIZE);
+							size_t i;
+
+							for (i = 0; i < length; ++ i)
+								{
+									sequence_s [i] = BASES [(bases_p [i >> 2] >> ((i & 3) << 1)) & 3];
+								}
+
+							for (i = 0; i < num_runs; ++ i, run_p += PS_RUN_SIZE)
+								{
+									const size_t start = ReadUInt32 (run_p);
+									const size_t run_length = ReadUInt32 (run_p + 4);
+
+									if ((start > length) || (run_length > length - start))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Run " SIZET_FMT " of packed sequence is out of range", i);
+											FreeMemory (sequence_s);
+											return NULL;
+										}
+
+									memset (sequence_s + start, run_p [8], run_length);
+								}
+
+							sequence_s [length] = '\0';
+
+							if (length_p)
+								{
+									*length_p = length;
+								}
+
+							return sequence_s;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes to unpack sequence", length + 1);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Packed sequence has the wrong size");
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Data is not a packed sequence");
+		}
+
+	return NULL;
+}
+
+
+bool IsPackedSequence (const bson_subtype_t subtype, const uint8_t *data_p, const size_t size)
+{
+	return ((subtype == PS_BSON_SUBTYPE) && (size >= PS_HEADER_SIZE) && (memcmp (data_p, PS_MAGIC_S, 3) == 0));
+}
+
+
+bson_t *GetUnpackedDocument (const bson_t *doc_p)
+{
+	bson_iter_t iter;
+	bool packed_flag = false;
+
+	/* Most documents won't have any, so check before copying anything */
+	if (bson_iter_init (&iter, doc_p))
+		{
+			while ((!packed_flag) && bson_iter_next (&iter))
+				{
+					if (BSON_ITER_HOLDS_BINARY (&iter))
+						{
+							bson_subtype_t subtype;
+							uint32_t size;
+							const uint8_t *data_p;
+
+							bson_iter_binary (&iter, &subtype, &size, &data_p);
+							packed_flag = IsPackedSequence (subtype, data_p, size);
+						}
+				}
+		}
+
+	if (packed_flag)
+		{
+			bson_t *unpacked_doc_p = bson_new ();
+
+			if (unpacked_doc_p)
+				{
+					bool success_flag = bson_iter_init (&iter, doc_p);
+
+					while (success_flag && bson_iter_next (&iter))
+						{
+							const char *key_s = bson_iter_key (&iter);
+							const int key_length = (int) bson_iter_key_len (&iter);
+							bool copy_flag = true;
+
+							if (BSON_ITER_HOLDS_BINARY (&iter))
+								{
+									bson_subtype_t subtype;
+									uint32_t size;
+									const uint8_t *data_p;
+
+									bson_iter_binary (&iter, &subtype, &size, &data_p);
+
+									if (IsPackedSequence (subtype, data_p, size))
+										{
+											size_t length;
+											char *sequence_s = UnpackSequence (data_p, size, &length);
+
+											/* If it can't be unpacked, it is left as it is */
+											if (sequence_s)
+												{
+													success_flag = bson_append_utf8 (unpacked_doc_p, key_s, key_length, sequence_s, (int) length);
+													copy_flag = false;
+
+													FreeMemory (sequence_s);
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to unpack \"%s\"", key_s);
+												}
+										}
+								}
+
+							if (copy_flag)
+								{
+									success_flag = bson_append_iter (unpacked_doc_p, key_s, key_length, &iter);
+								}
+						}
+
+					if (success_flag)
+						{
+							return unpacked_doc_p;
+						}
+
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy document while unpacking its sequences");
+					bson_destroy (unpacked_doc_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate unpacked document");
+				}
+		}
+
+	return NULL;
+}
+
+
+static int GetBaseCode (const char c)
+{
+	switch (c)
+		{
+			case 'A':
+				return 0;
+
+			case 'C':
+				return 1;
+
+			case 'G':
+				return 2;
+
+			case 'T':
+				return 3;
+
+			default:
+				return -1;
+		}
+}
+
+
+static void WriteUInt32 (uint8_t *dest_p, const uint32_t value)
+{
+	dest_p [0] = (uint8_t) (value & 0xFF);
+	dest_p [1] = (uint8_t) ((value >> 8) & 0xFF);
+	dest_p [2] = (uint8_t) ((value >> 16) & 0xFF);
+	dest_p [3] = (uint8_t) ((value >> 24) & 0xFF);
+}
+
+
+static uint32_t ReadUInt32 (const uint8_t *src_p)
+{
+	return ((uint32_t) src_p [0]) | (((uint32_t) src_p [1]) << 8) | (((uint32_t) src_p [2]) << 16) | (((uint32_t) src_p [3]) << 24);
+}
@@ -0,0 +1,404 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_cache.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "search_cache.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+/*
+ * An entry is in two lists at once: the singly-linked chain for
+ * its hash bucket and the doubly-linked list ordered by use.
+ */
+typedef struct SearchCacheEntry
+{
+	char *sce_key_s;
+
+	char *sce_results_s;
+
+	size_t sce_num_bytes;
+
+	size_t sce_hash;
+
+	time_t sce_expiry_time;
+
+	struct SearchCacheEntry *sce_next_in_bucket_p;
+
+	struct SearchCacheEntry *sce_prev_p;
+
+	struct SearchCacheEntry *sce_next_p;
+} SearchCacheEntry;
+
+
+static size_t GetSearchCacheKeyHash (const char *key_s);
+
+static SearchCacheEntry *FindSearchCacheEntry (const SearchCache *cache_p, const char *key_s, const size_t hash);
+
+static void MoveSearchCacheEntryToHead (SearchCache *cache_p, SearchCacheEntry *entry_p);
+
+static void UnlinkSearchCacheEntry (SearchCache *cache_p, SearchCacheEntry *entry_p);
+
+static void RemoveSearchCacheEntry (SearchCache *cache_p, SearchCacheEntry *entry_p);
+
+static void FreeSearchCacheEntry (SearchCacheEntry *entry_p);
+
+
+SearchCache *AllocateSearchCache (const size_t max_entries, const size_t max_bytes, const time_t ttl)
+{
+	SearchCache *cache_p = (SearchCache *) AllocMemory (sizeof (SearchCache));
+
+	if (cache_p)
+		{
+			/* Keep the chains short when the cache is full */
+			const size_t num_buckets = max_entries > 0 ? max_entries : 1;
+			SearchCacheEntry **buckets_pp = (SearchCacheEntry **) AllocMemoryArray (num_buckets, sizeof (SearchCacheEntry *));
+
+			if (buckets_pp)
+				{
+					if (pthread_mutex_init (& (cache_p -> sc_lock), NULL) == 0)
+						{
+							memset (buckets_pp, 0, num_buckets * sizeof (SearchCacheEntry *));
+
+							cache_p -> sc_buckets_pp = buckets_pp;
+							cache_p -> sc_num_buckets = num_buckets;
+							cache_p -> sc_head_p = NULL;
+							cache_p -> sc_tail_p = NULL;
+							cache_p -> sc_num_entries = 0;
+							cache_p -> sc_max_entries = max_entries;
+							cache_p -> sc_num_bytes = 0;
+							cache_p -> sc_max_bytes = max_bytes;
+							cache_p -> sc_ttl = ttl;
+
+							return cache_p;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise search cache lock");
+						}
+
+					FreeMemory (buckets_pp);
+				}		/* if (buckets_pp) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " search cache buckets", num_buckets);
+				}
+
+			FreeMemory (cache_p);
+		}		/* if (cache_p) */
+
+	return NULL;
+}
+
+
+void FreeSearchCache (SearchCache *cache_p)
+{
+	SearchCacheEntry *entry_p = cache_p -> sc_head_p;
+
+	while (entry_p)
+		{
+			SearchCacheEntry *next_p = entry_p -> sce_next_p;
+
+			FreeSearchCacheEntry (entry_p);
+			entry_p = next_p;
+		}
+
+	pthread_mutex_destroy (& (cache_p -> sc_lock));
+
+	FreeMemory (cache_p -> sc_buckets_pp);
+	FreeMemory (cache_p);
+}
+
+
+json_t *GetCachedSearchResults (SearchCache *cache_p, const char *key_s)
+{
+	json_t *results_p = NULL;
+	char *results_s = NULL;
+	const size_t hash = GetSearchCacheKeyHash (key_s);
+
+	if (pthread_mutex_lock (& (cache_p -> sc_lock)) == 0)
+		{
+			SearchCacheEntry *entry_p = FindSearchCacheEntry (cache_p, key_s, hash);
+
+			if (entry_p)
+				{
+					if ((cache_p -> sc_ttl == 0) || (time (NULL) < entry_p -> sce_expiry_time))
+						{
+							MoveSearchCacheEntryToHead (cache_p, entry_p);
+
+							/*
+							 * Take a copy so that we can parse it without holding the lock
+							 */
+							results_s = EasyCopyToNewString (entry_p -> sce_results_s);
+						}
+					else
+						{
+							RemoveSearchCacheEntry (cache_p, entry_p);
+						}
+				}
+
+			pthread_mutex_unlock (& (cache_p -> sc_lock));
+		}		/* if (pthread_mutex_lock (& (cache_p -> sc_lock)) == 0) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock search cache to get \"%s\"", key_s);
+		}
+
+	if (results_s)
+		{
+			json_error_t err;
+
+			results_p = json_loads (results_s, 0, &err);
+
+			if (!results_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to parse cached results for \"%s\": %s", key_s, err.text);
+				}
+
+			FreeCopiedString (results_s);
+		}
+
+	return results_p;
+}
+
+
+bool AddSearchResultsToCache (SearchCache *cache_p, const char *key_s, const json_t *results_p)
+{
+	bool success_flag = false;
+	char *results_s = json_dumps (results_p, JSON_COMPACT);
+
+	if (results_s)
+		{
+			const size_t key_length = strlen (key_s);
+			const size_t num_bytes = key_length + strlen (results_s) + 2;
+
+			/*
+			 * Don't let a single huge result set flush everything else out
+			 */
+			if ((cache_p -> sc_max_bytes == 0) || (num_bytes <= cache_p -> sc_max_bytes))
+				{
+					SearchCacheEntry *entry_p = (SearchCacheEntry *) AllocMemory (sizeof (SearchCacheEntry));
+
+					if (entry_p)
+						{
+							entry_p -> sce_key_s = CopyToNewString (key_s, key_length, false);
+
+							if (entry_p -> sce_key_s)
+								{
+									entry_p -> sce_results_s = results_s;
+									entry_p -> sce_num_bytes = num_bytes;
+									entry_p -> sce_hash = GetSearchCacheKeyHash (key_s);
+									entry_p -> sce_expiry_time = time (NULL) + cache_p -> sc_ttl;
+									entry_p -> sce_prev_p = NULL;
+									entry_p -> sce_next_p = NULL;
+									entry_p -> sce_next_in_bucket_p = NULL;
+
+									if (pthread_mutex_lock (& (cache_p -> sc_lock)) == 0)
+										{
+											SearchCacheEntry *old_entry_p = FindSearchCacheEntry (cache_p, key_s, entry_p -> sce_hash);
+											SearchCacheEntry **bucket_pp = (cache_p -> sc_buckets_pp) + ((entry_p -> sce_hash) % (cache_p -> sc_num_buckets));
+
+											if (old_entry_p)
+												{
+													RemoveSearchCacheEntry (cache_p, old_entry_p);
+												}
+
+											/*
+											 * Evict the least recently used entries until there is room
+											 */
+											while ((cache_p -> sc_tail_p) &&
+												((cache_p -> sc_num_entries >= cache_p -> sc_max_entries) ||
+												((cache_p -> sc_max_bytes > 0) && (cache_p -> sc_num_bytes + num_bytes > cache_p -> sc_max_bytes))))
+												{
+													RemoveSearchCacheEntry (cache_p, cache_p -> sc_tail_p);
+												}
+
+											entry_p -> sce_next_in_bucket_p = *bucket_pp;
+											*bucket_pp = entry_p;
+
+											entry_p -> sce_next_p = cache_p -> sc_head_p;
+
+											if (cache_p -> sc_head_p)
+												{
+													cache_p -> sc_head_p -> sce_prev_p = entry_p;
+												}
+											else
+												{
+													cache_p -> sc_tail_p = entry_p;
+												}
+
+											cache_p -> sc_head_p = entry_p;
+
+											++ (cache_p -> sc_num_entries);
+											cache_p -> sc_num_bytes += num_bytes;
+
+											pthread_mutex_unlock (& (cache_p -> sc_lock));
+
+											return true;
+										}		/* if (pthread_mutex_lock (& (cache_p -> sc_lock)) == 0) */
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock search cache to add \"%s\"", key_s);
+										}
+
+									/* the entry owns results_s now */
+									FreeSearchCacheEntry (entry_p);
+									return false;
+								}		/* if (entry_p -> sce_key_s) */
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy search cache key \"%s\"", key_s);
+								}
+
+							FreeMemory (entry_p);
+						}		/* if (entry_p) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate search cache entry for \"%s\"", key_s);
+						}
+
+				}		/* if ((cache_p -> sc_max_bytes == 0) || (num_bytes <= cache_p -> sc_max_bytes)) */
+			else
+				{
+					PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Results for \"%s\" are too large to cache, " SIZET_FMT " bytes", key_s, num_bytes);
+				}
+
+			free (results_s);
+		}		/* if (results_s) */
+	else
+		{
+			PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, results_p, "Failed to serialise results for \"%s\"", key_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * FNV-1a
+ */
+static size_t GetSearchCacheKeyHash (const char *key_s)
+{
+	size_t hash = 2166136261U;
+
+	while (*key_s != '\0')
+		{
+			hash ^= (unsigned char) (*key_s);
+			hash *= 16777619U;
+			++ key_s;
+		}
+
+	return hash;
+}
+
+
+static SearchCacheEntry *FindSearchCacheEntry (const SearchCache *cache_p, const char *key_s, const size_t hash)
+{
+	SearchCacheEntry *entry_p = * ((cache_p -> sc_buckets_pp) + (hash % (cache_p -> sc_num_buckets)));
+
+	while (entry_p)
+		{
+			if ((entry_p -> sce_hash == hash) && (strcmp (entry_p -> sce_key_s, key_s) == 0))
+				{
+					return entry_p;
+				}
+
+			entry_p = entry_p -> sce_next_in_bucket_p;
+		}
+
+	return NULL;
+}
+
+
+static void MoveSearchCacheEntryToHead (SearchCache *cache_p, SearchCacheEntry *entry_p)
+{
+	if (cache_p -> sc_head_p != entry_p)
+		{
+			UnlinkSearchCacheEntry (cache_p, entry_p);
+
+			entry_p -> sce_next_p = cache_p -> sc_head_p;
+			cache_p -> sc_head_p -> sce_prev_p = entry_p;
+			cache_p -> sc_head_p = entry_p;
+
+			if (!cache_p -> sc_tail_p)
+				{
+					cache_p -> sc_tail_p = entry_p;
+				}
+		}
+}
+
+
+static void UnlinkSearchCacheEntry (SearchCache *cache_p, SearchCacheEntry *entry_p)
+{
+	if (entry_p -> sce_prev_p)
+		{
+			entry_p -> sce_prev_p -> sce_next_p = entry_p -> sce_next_p;
+		}
+	else
+		{
+			cache_p -> sc_head_p = entry_p -> sce_next_p;
+		}
+
+	if (entry_p -> sce_next_p)
+		{
+			entry_p -> sce_next_p -> sce_prev_p = entry_p -> sce_prev_p;
+		}
+	else
+		{
+			cache_p -> sc_tail_p = entry_p -> sce_prev_p;
+		}
+
+	entry_p -> sce_prev_p = NULL;
+	entry_p -> sce_next_p = NULL;
+}
+
+
+static void RemoveSearchCacheEntry (SearchCache *cache_p, SearchCacheEntry *entry_p)
+{
+	SearchCacheEntry **bucket_pp = (cache_p -> sc_buckets_pp) + ((entry_p -> sce_hash) % (cache_p -> sc_num_buckets));
+
+	while (*bucket_pp != entry_p)
+		{
+			bucket_pp = & ((*bucket_pp) -> sce_next_in_bucket_p);
+		}
+
+	*bucket_pp = entry_p -> sce_next_in_bucket_p;
+
+	UnlinkSearchCacheEntry (cache_p, entry_p);
+
+	-- (cache_p -> sc_num_entries);
+	cache_p -> sc_num_bytes -= entry_p -> sce_num_bytes;
+
+	FreeSearchCacheEntry (entry_p);
+}
+
+
+static void FreeSearchCacheEntry (SearchCacheEntry *entry_p)
+{
+	FreeCopiedString (entry_p -> sce_key_s);
+
+	/* This was allocated by json_dumps () */
+	free (entry_p -> sce_results_s);
+
+	FreeMemory (entry_p);
+}
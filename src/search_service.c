@@ -20,12 +20,25 @@
  *      Author: billy
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
 #include "search_service.h"
 #include "gene_trees_service.h"
+#include "search_cache.h"
+#include "search_timings.h"
+#include "packed_sequence.h"
+#include "gene_tree_cache.h"
+#include "gene_homologs.h"
+#include "gene_export.h"
 
 
 #include "audit.h"
 #include "streams.h"
+#include "jobs_manager.h"
+#include "grassroots_server.h"
 #include "math_utils.h"
 #include "string_utils.h"
 
@@ -38,16 +51,303 @@
  */
 
 static NamedParameterType S_GENE_ID = { "GT Gene", PT_STRING };
+static NamedParameterType S_GENE_IDS = { "GT Genes", PT_LARGE_STRING };
 static NamedParameterType S_CLUSTER_ID = { "GT Cluster", PT_UNSIGNED_INT };
-static NamedParameterType S_GENERATE_INDEXES = { "GT Generate Indexes", PT_BOOLEAN };
+static NamedParameterType S_FIELDS = { "GT Fields", PT_STRING };
+static NamedParameterType S_LIMIT = { "GT Limit", PT_UNSIGNED_INT };
+static NamedParameterType S_PAGE_TOKEN = { "GT Page Token", PT_STRING };
+static NamedParameterType S_SUMMARY = { "GT Summary", PT_BOOLEAN };
+static NamedParameterType S_TREE_LEAVES = { "GT Tree Leaves", PT_UNSIGNED_INT };
+static NamedParameterType S_HOMOLOGS = { "GT Homologs", PT_BOOLEAN };
+static NamedParameterType S_EXPORT = { "GT Export", PT_STRING };
+static NamedParameterType S_LAST_CLUSTER_ID = { "GT Last Cluster", PT_UNSIGNED_INT };
+
+
+/**
+ * The key in a job's metadata for the token to get the next page of results.
+ */
+static const char * const S_NEXT_PAGE_TOKEN_S = "next_page_token";
+
+
+/**
+ * The fields that are needed to find a gene's homologs.
+ */
+static const char * const S_HOMOLOG_FIELDS_S = "gene_id,cluster_id,genetree";
+
+
+/**
+ * The fields that can be requested using the S_FIELDS parameter.
+ */
+static const char * const *S_PROJECTABLE_FIELDS_SS [] =
+{
+	&GTS_GENE_ID_S,
+	&GTS_CLUSTER_ID_S,
+	&GTS_GENETREE_S,
+	&GTS_GENE_SEQUENCE_S,
+	&GTS_ALIGNMENT_S,
+	NULL
+};
+
+
+/**
+ * The state used whilst iterating over the hits
+ * for a search.
+ */
+typedef struct SearchHits
+{
+	/** The ServiceJob to add the results to. */
+	ServiceJob *sh_job_p;
+
+	/** The Gene ID that was searched for, this can be <code>NULL</code>. */
+	const char *sh_gene_s;
+
+	/** The Cluster ID that was searched for, this can be <code>NULL</code>. */
+	const uint32 *sh_cluster_p;
+
+	/** The prefix used for the titles of the results, this can be <code>NULL</code>. */
+	const char *sh_query_s;
+
+	/**
+	 * If this is <code>true</code> then the hits are sorted by Gene ID
+	 * and are titled by the Gene ID that they matched.
+	 */
+	bool sh_group_by_gene_flag;
+
+	/** The Gene ID of the current group of hits when grouping by gene. */
+	char *sh_current_gene_s;
+
+	/** The size of the buffer that sh_current_gene_s points to. */
+	size_t sh_current_gene_size;
+
+	/**
+	 * The buffer that the title for each hit is written into. This is
+	 * reused for every hit rather than allocating a new title each time.
+	 */
+	char *sh_title_s;
+
+	/** The size of the buffer that sh_title_s points to. */
+	size_t sh_title_size;
+
+	/** The times for each phase of the search, this can be <code>NULL</code>. */
+	SearchTimer *sh_timer_p;
+
+	/** When the current phase of the search started. */
+	uint64 sh_phase_start_ns;
+
+	/** The index of the current hit within its group when grouping by gene. */
+	size_t sh_gene_hit_index;
+
+	/** The number of distinct Gene IDs that have hits when grouping by gene. */
+	size_t sh_num_genes;
+
+	/**
+	 * If the results are going to be cached, this is the JSON array
+	 * that they are collected in, otherwise it is <code>NULL</code>.
+	 */
+	json_t *sh_cached_results_p;
+
+	/** The number of hits returned from the database so far. */
+	size_t sh_num_hits;
+
+	/** The number of hits successfully added to the ServiceJob so far. */
+	size_t sh_num_added;
+
+	/** The maximum number of hits to add to the ServiceJob, 0 means no limit. */
+	size_t sh_limit;
+
+	/**
+	 * If there are more hits than sh_limit, this is the token for
+	 * the next page of hits, otherwise it is <code>NULL</code>.
+	 */
+	char *sh_next_page_token_s;
+
+	/**
+	 * If this is greater than 0, each hit's gene tree is trimmed to
+	 * the smallest subtree around its gene with at least this many leaves.
+	 */
+	uint32 sh_tree_leaves;
+
+	/** The parsed gene trees to trim with, this can be <code>NULL</code>. */
+	GeneTreeCache *sh_tree_cache_p;
+} SearchHits;
+
+
+/**
+ * The search parameters for a job.
+ */
+typedef struct SearchRequest
+{
+	/** The Gene ID to search for, this can be <code>NULL</code>. */
+	const char *sr_gene_s;
+
+	/** The list of Gene IDs to search for, this can be <code>NULL</code>. */
+	const char *sr_genes_s;
+
+	/** The Cluster ID to search for, this can be <code>NULL</code>. */
+	const uint32 *sr_cluster_p;
+
+	/** The fields to return for each hit, this can be <code>NULL</code>. */
+	const char *sr_fields_s;
+
+	/** The maximum number of hits to return, this can be <code>NULL</code>. */
+	const uint32 *sr_limit_p;
+
+	/** The token to start the page of hits from, this can be <code>NULL</code>. */
+	const char *sr_page_token_s;
+
+	/**
+	 * The minimum number of leaves of the subtree around each hit's
+	 * gene to return rather than its whole gene tree, this can be <code>NULL</code>.
+	 */
+	const uint32 *sr_tree_leaves_p;
+
+	/**
+	 * If this is <code>true</code> then only the number of matching genes
+	 * in each cluster is returned rather than the hits themselves.
+	 */
+	bool sr_summary_flag;
+
+	/**
+	 * If this is <code>true</code> then the orthologs and paralogs of the
+	 * Gene ID are returned rather than its hit.
+	 */
+	bool sr_homologs_flag;
+
+	/**
+	 * The format to export the hits to a file in, either "ndjson" or
+	 * "fasta", this can be <code>NULL</code>.
+	 */
+	const char *sr_export_s;
+
+	/**
+	 * The last Cluster ID of a range of clusters to export, starting
+	 * from sr_cluster_p, this can be <code>NULL</code>.
+	 */
+	const uint32 *sr_last_cluster_p;
+} SearchRequest;
+
+
+/**
+ * A search that is being run on a worker thread. It has
+ * its own copies of the search parameters and its own
+ * ServiceJob, with the same id as the one returned to the
+ * client, so that it never touches the job that the server
+ * is sending back.
+ */
+typedef struct AsyncSearch
+{
+	/** The ServiceJobSet holding as_job_p. */
+	ServiceJobSet *as_jobs_p;
+
+	/** The worker thread's ServiceJob for the search. */
+	ServiceJob *as_job_p;
+
+	/**
+	 * The JobsManager that clients poll for the job. Each change
+	 * to as_job_p is stored here through the manager's own locking.
+	 */
+	JobsManager *as_jobs_manager_p;
+
+	/**
+	 * The configuration data for the service that started the search.
+	 * The search holds its own reference to this, which it releases
+	 * when it has finished.
+	 */
+	GeneTreesServiceData *as_data_p;
+
+	/** The search parameters. */
+	SearchRequest as_request;
+
+	/** The storage for the Cluster ID, if there is one, in as_request. */
+	uint32 as_cluster;
+
+	/** The storage for the limit, if there is one, in as_request. */
+	uint32 as_limit;
+
+	/** The storage for the number of tree leaves, if there is one, in as_request. */
+	uint32 as_tree_leaves;
+
+	/** The storage for the last Cluster ID, if there is one, in as_request. */
+	uint32 as_last_cluster;
+} AsyncSearch;
+
+
+/**
+ * A gene that was found in the local gene cluster index.
+ */
+typedef struct IndexedGene
+{
+	/** The Cluster ID for the gene. */
+	uint32 ig_cluster_id;
+
+	/** The Gene ID. */
+	const char *ig_gene_s;
+} IndexedGene;
+
+
+/**
+ * The state used whilst finding the homologs for a gene.
+ */
+typedef struct HomologSearch
+{
+	/** The ServiceJob to add the results to. */
+	ServiceJob *hs_job_p;
+
+	/** The configuration data for the service that is running the search. */
+	GeneTreesServiceData *hs_data_p;
+
+	/**
+	 * If the results are going to be cached, this is the JSON array
+	 * that they are collected in, otherwise it is <code>NULL</code>.
+	 */
+	json_t *hs_cached_results_p;
+
+	/** The times for each phase of the search. */
+	SearchTimer *hs_timer_p;
+
+	/** When the current phase of the search started. */
+	uint64 hs_phase_start_ns;
+
+	/** The number of hits returned from the database. */
+	size_t hs_num_hits;
+
+	/** The number of hits whose homologs were added to the ServiceJob. */
+	size_t hs_num_added;
+} HomologSearch;
+
+
+/**
+ * The state used whilst writing the hits to an export file.
+ */
+typedef struct ExportHits
+{
+	/** The export that the hits are written to. */
+	GeneExport *eh_export_p;
+
+	/** The times for each phase of the export. */
+	SearchTimer *eh_timer_p;
 
+	/** When the current phase of the export started. */
+	uint64 eh_phase_start_ns;
+} ExportHits;
+
+
+static Service *AllocateGeneTreesSearchService (GrassrootsServer *grassroots_p,
+																								const char *(*get_name_fn) (const Service *service_p),
+																								const char *(*get_alias_fn) (const Service *service_p),
+																								ServiceJobSet *(*run_fn) (Service *service_p, ParameterSet *param_set_p, User *user_p, ProvidersStateTable *providers_p),
+																								Synchronicity synchronicity);
 
 static const char *GetGeneTreesSearchServiceName (const Service *service_p);
 
+static const char *GetGeneTreesAsyncSearchServiceName (const Service *service_p);
+
 static const char *GetGeneTreesSearchServiceDescription (const Service *service_p);
 
 static const char *GetGeneTreesSearchServiceAlias (const Service *service_p);
 
+static const char *GetGeneTreesAsyncSearchServiceAlias (const Service *service_p);
+
 static const char *GetGeneTreesSearchServiceInformationUri (const Service *service_p);
 
 static ParameterSet *GetGeneTreesSearchServiceParameters (Service *service_p, DataResource *resource_p, User *user_p);
@@ -58,13 +358,84 @@ static void ReleaseGeneTreesSearchServiceParameters (Service *service_p, Paramet
 
 static ServiceJobSet *RunGeneTreesSearchService (Service *service_p, ParameterSet *param_set_p, User *user_p, ProvidersStateTable *providers_p);
 
+static ServiceJobSet *RunGeneTreesAsyncSearchService (Service *service_p, ParameterSet *param_set_p, User *user_p, ProvidersStateTable *providers_p);
+
 static ParameterSet *IsResourceForGeneTreesSearchService (Service *service_p, DataResource *resource_p, Handler *handler_p);
 
 static bool CloseGeneTreesSearchService (Service *service_p);
 
 static ServiceMetadata *GetGeneTreesSearchServiceMetadata (Service *service_p);
 
-static void DoSearch (ServiceJob *job_p, const char * const gene_s, const uint32 * const cluster_p, GeneTreesServiceData *data_p);
+
+static void GetSearchRequest (ParameterSet *param_set_p, SearchRequest *request_p);
+
+static bool RunSearch (ServiceJob *job_p, const SearchRequest *request_p, GeneTreesServiceData *data_p, const bool async_flag);
+
+static AsyncSearch *AllocateAsyncSearch (Service *service_p, const ServiceJob *job_p, const SearchRequest *request_p, JobsManager *jobs_manager_p, GeneTreesServiceData *data_p);
+
+static void FreeAsyncSearch (AsyncSearch *search_p);
+
+static void *RunAsyncSearch (void *data_p);
+
+static bool UpdateAsyncSearchJob (JobsManager *jobs_manager_p, ServiceJob *job_p);
+
+static void DoSearch (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const char *prefix_s, const uint32 * const cluster_p, const bson_t *opts_p, const uint32 limit, const char *page_token_s, const uint32 tree_leaves, const char *cache_key_s, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p);
+
+static char *GetSearchCacheKey (const char *gene_s, const char *genes_s, const uint32 *cluster_p, const char *fields_s, const bool summary_flag, const uint32 tree_leaves, const bool homologs_flag);
+
+static bool AddCachedResultsToServiceJob (ServiceJob *job_p, const char *cache_key_s, GeneTreesServiceData *data_p);
+
+static bool GetSearchOptions (const char *fields_s, const bool sort_by_gene_flag, const bool subtree_flag, const uint32 limit, bson_t **opts_pp, ServiceJob *job_p);
+
+static bool AddProjection (bson_t *opts_p, const char *fields_s, const bool sort_by_gene_flag, const bool subtree_flag, ServiceJob *job_p);
+
+static bson_t *GetGeneIdsArray (const char *genes_s, const char *gene_s, uint32 *num_genes_p);
+
+static const char *GetHitGeneId (const bson_t *document_p);
+
+static const char *GetProjectableField (const char *field_s, const size_t length);
+
+static bool AddSearchHit (const bson_t *document_p, void *data_p);
+
+static bool ReserveSearchHitsBuffer (char **buffer_ss, size_t *buffer_size_p, const size_t required_size);
+
+static void TrimHitGeneTree (json_t *entry_p, const bson_t *document_p, const SearchHits *hits_p);
+
+static bson_t *GetSearchQuery (const char * const gene_s, const bson_t *genes_p, const char *prefix_s, const uint32 * const cluster_p, const char *page_token_s);
+
+static bool AddGenePrefixQuery (bson_t *query_p, const char *prefix_s, const char *page_token_s);
+
+static char *GetGenePrefix (const char *gene_s, ServiceJob *job_p);
+
+static void DoSummary (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const uint32 * const cluster_p, const char *cache_key_s, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p);
+
+static json_t *GetClusterSummary (const bson_t *document_p, char **title_ss);
+
+static json_t *AllocateClusterSummary (const uint32 *cluster_id_p, const json_int_t num_genes, char **title_ss);
+
+static bool AddClusterSummaryToServiceJob (ServiceJob *job_p, json_t *summary_p, const char *title_s, json_t **cached_results_pp);
+
+static void DoIndexSummary (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const uint32 * const cluster_p, SearchTimer *timer_p, GeneTreesServiceData *data_p);
+
+static void AddIndexedGene (const GeneClusterIndex *index_p, const char *gene_s, const uint32 * const cluster_p, IndexedGene *genes_p, size_t *num_genes_p);
+
+static int CompareIndexedGenes (const void *v0_p, const void *v1_p);
+
+static bool AddIndexedClusterSummary (ServiceJob *job_p, const uint32 cluster_id, const json_int_t num_genes, SearchTimer *timer_p, uint64 *phase_start_ns_p);
+
+static void DoHomologSearch (ServiceJob *job_p, const char * const gene_s, const uint32 * const cluster_p, const bson_t *opts_p, const char *cache_key_s, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p);
+
+static bool AddGeneHomologs (const bson_t *document_p, void *data_p);
+
+static void DoExport (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const char *prefix_s, const uint32 * const cluster_p, const uint32 * const last_cluster_p, const bson_t *opts_p, const GeneExportFormat format, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p);
+
+static bool AddClusterRangeQuery (bson_t *query_p, const uint32 * const first_cluster_p, const uint32 last_cluster);
+
+static bool WriteExportHit (const bson_t *document_p, void *data_p);
+
+static bool AddSearchMetadata (ServiceJob *job_p, const char *key_s, json_t *value_p);
+
+static void AddSearchTimings (ServiceJob *job_p, const SearchTimer *timer_p, GeneTreesServiceData *data_p);
 
 
 /*
@@ -73,6 +444,23 @@ static void DoSearch (ServiceJob *job_p, const char * const gene_s, const uint32
 
 
 Service *GetGeneTreesSearchService (GrassrootsServer *grassroots_p)
+{
+	return AllocateGeneTreesSearchService (grassroots_p, GetGeneTreesSearchServiceName, GetGeneTreesSearchServiceAlias, RunGeneTreesSearchService, SY_SYNCHRONOUS);
+}
+
+
+Service *GetGeneTreesAsyncSearchService (GrassrootsServer *grassroots_p)
+{
+	return AllocateGeneTreesSearchService (grassroots_p, GetGeneTreesAsyncSearchServiceName, GetGeneTreesAsyncSearchServiceAlias, RunGeneTreesAsyncSearchService, SY_ASYNCHRONOUS_DETACHED);
+}
+
+
+
+static Service *AllocateGeneTreesSearchService (GrassrootsServer *grassroots_p,
+																								const char *(*get_name_fn) (const Service *service_p),
+																								const char *(*get_alias_fn) (const Service *service_p),
+																								ServiceJobSet *(*run_fn) (Service *service_p, ParameterSet *param_set_p, User *user_p, ProvidersStateTable *providers_p),
+																								Synchronicity synchronicity)
 {
 	Service *service_p = (Service *) AllocMemory (sizeof (Service));
 
@@ -83,11 +471,11 @@ Service *GetGeneTreesSearchService (GrassrootsServer *grassroots_p)
 			if (data_p)
 				{
 					if (InitialiseService (service_p,
-																 GetGeneTreesSearchServiceName,
+																 get_name_fn,
 																 GetGeneTreesSearchServiceDescription,
-																 GetGeneTreesSearchServiceAlias,
+																 get_alias_fn,
 																 GetGeneTreesSearchServiceInformationUri,
-																 RunGeneTreesSearchService,
+																 run_fn,
 																 IsResourceForGeneTreesSearchService,
 																 GetGeneTreesSearchServiceParameters,
 																 GetGeneTreesSearchServiceParameterTypesForNamedParameters,
@@ -95,7 +483,7 @@ Service *GetGeneTreesSearchService (GrassrootsServer *grassroots_p)
 																 CloseGeneTreesSearchService,
 																 NULL,
 																 false,
-																 SY_SYNCHRONOUS,
+																 synchronicity,
 																 (ServiceData *) data_p,
 																 GetGeneTreesSearchServiceMetadata,
 																 NULL,
@@ -109,7 +497,7 @@ Service *GetGeneTreesSearchService (GrassrootsServer *grassroots_p)
 						}		/* if (InitialiseService (.... */
 					else
 						{
-							FreeGeneTreesServiceData (data_p);
+							ReleaseGeneTreesServiceData (data_p);
 						}
 				}
 
@@ -131,6 +519,12 @@ static const char *GetGeneTreesSearchServiceName (const Service * UNUSED_PARAM (
 }
 
 
+static const char *GetGeneTreesAsyncSearchServiceName (const Service * UNUSED_PARAM (service_p))
+{
+	return "GeneTrees asynchronous search service";
+}
+
+
 static const char *GetGeneTreesSearchServiceDescription (const Service * UNUSED_PARAM (service_p))
 {
 	return "A service to get the parental data for given markers and populations";
@@ -142,6 +536,11 @@ static const char *GetGeneTreesSearchServiceAlias (const Service * UNUSED_PARAM
 	return GT_GROUP_ALIAS_PREFIX_S SERVICE_GROUP_ALIAS_SEPARATOR "search";
 }
 
+static const char *GetGeneTreesAsyncSearchServiceAlias (const Service * UNUSED_PARAM (service_p))
+{
+	return GT_GROUP_ALIAS_PREFIX_S SERVICE_GROUP_ALIAS_SEPARATOR "async_search";
+}
+
 static const char *GetGeneTreesSearchServiceInformationUri (const Service * UNUSED_PARAM (service_p))
 {
 	return NULL;
@@ -158,22 +557,91 @@ static ParameterSet *GetGeneTreesSearchServiceParameters (Service *service_p, Da
 			Parameter *param_p = NULL;
 			ParameterGroup *group_p = NULL;
 
-			if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_GENE_ID.npt_type, S_GENE_ID.npt_name_s, "Gene", "The Gene ID to search for", NULL, PL_ALL)) != NULL)
+			if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_GENE_ID.npt_type, S_GENE_ID.npt_name_s, "Gene", "The Gene ID to search for. End it with a * to find every gene that starts with it, e.g. TraesCS1A02G0*", NULL, PL_ALL)) != NULL)
 				{
-					if ((param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, group_p, S_CLUSTER_ID.npt_name_s, "Cluster", "The Cluster ID to search for", NULL, PL_ALL)) != NULL)
+					if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_GENE_IDS.npt_type, S_GENE_IDS.npt_name_s, "Genes",
+						"A list of Gene IDs to search for in a single query. The IDs can be separated by new lines, commas or spaces and the hits are grouped by Gene ID.", NULL, PL_ADVANCED)) != NULL)
 						{
-							if ((param_p = EasyCreateAndAddBooleanParameterToParameterSet(data_p, param_set_p, group_p, S_GENERATE_INDEXES.npt_name_s, "Indexes", "Ensure indexes for faster searching", NULL, PL_ADVANCED)) != NULL)
+							if ((param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, group_p, S_CLUSTER_ID.npt_name_s, "Cluster", "The Cluster ID to search for", NULL, PL_ALL)) != NULL)
 								{
-									return param_set_p;
+									if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_FIELDS.npt_type, S_FIELDS.npt_name_s, "Fields",
+										"A comma-separated list of the fields to return for each hit, e.g. \"gene_id, cluster_id\". "
+										"If this is left empty, then all of the fields including the sequences, alignments and trees are returned.", NULL, PL_ADVANCED)) != NULL)
+										{
+											if ((param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, group_p, S_LIMIT.npt_name_s, "Limit",
+												"The maximum number of hits to return. If there are more, the job's metadata has a \"next_page_token\" to get the next page with. "
+												"If this is 0, all of the hits are returned.", NULL, PL_ADVANCED)) != NULL)
+												{
+													if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_PAGE_TOKEN.npt_type, S_PAGE_TOKEN.npt_name_s, "Page Token",
+														"The \"next_page_token\" from a previous search with the same parameters, to get the following page of hits.", NULL, PL_ADVANCED)) != NULL)
+														{
+															if ((param_p = EasyCreateAndAddBooleanParameterToParameterSet (data_p, param_set_p, group_p, S_SUMMARY.npt_name_s, "Summary",
+																"Only return the number of matching genes in each cluster rather than the full hits.", NULL, PL_ALL)) != NULL)
+																{
+																	if ((param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, group_p, S_TREE_LEAVES.npt_name_s, "Tree Leaves",
+																		"Rather than the whole gene tree for each hit, return the smallest subtree around the hit's gene that has at least this many leaves. "
+																		"If this is 0, the whole tree is returned.", NULL, PL_ADVANCED)) != NULL)
+																		{
+																			if ((param_p = EasyCreateAndAddBooleanParameterToParameterSet (data_p, param_set_p, group_p, S_HOMOLOGS.npt_name_s, "Homologs",
+																				"Rather than the Gene's hit, return its orthologs and paralogs from its cluster's gene tree.", NULL, PL_ALL)) != NULL)
+																				{
+																					if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_EXPORT.npt_type, S_EXPORT.npt_name_s, "Export",
+																						"Rather than returning the hits, write all of them to a file on the server either as \"ndjson\", one JSON document per line, "
+																						"or as \"fasta\" from their gene sequences. If no genes or clusters are given, the asynchronous search service exports the whole collection.", NULL, PL_ADVANCED)) != NULL)
+																						{
+																							if ((param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, group_p, S_LAST_CLUSTER_ID.npt_name_s, "Last Cluster",
+																								"When exporting, the last Cluster ID of a range of clusters to export, starting from the Cluster.", NULL, PL_ADVANCED)) != NULL)
+																								{
+																									return param_set_p;
+																								}
+																							else
+																								{
+																									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_LAST_CLUSTER_ID.npt_name_s);
+																								}
+																						}
+																					else
+																						{
+																							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_EXPORT.npt_name_s);
+																						}
+																				}
+																			else
+																				{
+																					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_HOMOLOGS.npt_name_s);
+																				}
+																		}
+																	else
+																		{
+																			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_TREE_LEAVES.npt_name_s);
+																		}
+																}
+															else
+																{
+																	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_SUMMARY.npt_name_s);
+																}
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_PAGE_TOKEN.npt_name_s);
+														}
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_LIMIT.npt_name_s);
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_FIELDS.npt_name_s);
+										}
 								}
 							else
 								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_GENERATE_INDEXES.npt_name_s);
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_CLUSTER_ID.npt_name_s);
 								}
 						}
 					else
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_CLUSTER_ID.npt_name_s);
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_GENE_IDS.npt_name_s);
 						}
 				}
 			else
@@ -197,8 +665,16 @@ static bool GetGeneTreesSearchServiceParameterTypesForNamedParameters (const Ser
 	const NamedParameterType params [] =
 		{
 			S_GENE_ID,
+			S_GENE_IDS,
 			S_CLUSTER_ID,
-			S_GENERATE_INDEXES,
+			S_FIELDS,
+			S_LIMIT,
+			S_PAGE_TOKEN,
+			S_SUMMARY,
+			S_TREE_LEAVES,
+			S_HOMOLOGS,
+			S_EXPORT,
+			S_LAST_CLUSTER_ID,
 			NULL
 		};
 
@@ -216,8 +692,14 @@ static void ReleaseGeneTreesSearchServiceParameters (Service * UNUSED_PARAM (ser
 static bool CloseGeneTreesSearchService (Service *service_p)
 {
 	bool success_flag = true;
+	GeneTreesServiceData *data_p = (GeneTreesServiceData *) (service_p -> se_data_p);
 
-	FreeGeneTreesServiceData ((GeneTreesServiceData *) (service_p -> se_data_p));;
+	/*
+	 * Any searches that are still running on worker threads have their
+	 * own references to the data, so this doesn't wait for them and
+	 * the last one to finish frees it.
+	 */
+	ReleaseGeneTreesServiceData (data_p);
 
 	return success_flag;
 }
@@ -239,45 +721,10 @@ static ServiceJobSet *RunGeneTreesSearchService (Service *service_p, ParameterSe
 
 			if (param_set_p)
 				{
-					const char *gene_s = NULL;
-					const uint32 *cluster_p = NULL;
-					const bool *indexes_p = NULL;
-
-					if (GetCurrentBooleanParameterValueFromParameterSet (param_set_p, S_GENERATE_INDEXES.npt_name_s, &indexes_p))
-						{
-							if (indexes_p && (*indexes_p))
-								{
-									if (!AddCollectionSingleIndex (data_p -> gtsd_mongo_p, data_p -> gtsd_database_s, data_p -> gtsd_collection_s, GTS_GENE_ID_S, NULL, true, false))
-										{
-											AddParameterErrorMessageToServiceJob (job_p, S_GENERATE_INDEXES.npt_name_s, S_GENERATE_INDEXES.npt_type, "Failed to add index for genes");
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> gtsd_database_s, data_p -> gtsd_collection_s, GTS_GENE_ID_S);
-										}
-
-									if (!AddCollectionSingleIndex (data_p -> gtsd_mongo_p, data_p -> gtsd_database_s, data_p -> gtsd_collection_s, GTS_CLUSTER_ID_S, NULL, false, false))
-										{
-											AddParameterErrorMessageToServiceJob (job_p, S_GENERATE_INDEXES.npt_name_s, S_GENERATE_INDEXES.npt_type, "Failed to add index for clusters");
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> gtsd_database_s, data_p -> gtsd_collection_s, GTS_GENE_ID_S);
-										}
-								}
-						}
-
-
-					if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_GENE_ID.npt_name_s, &gene_s))
-						{
-							if (IsStringEmpty (gene_s))
-								{
-									gene_s = NULL;
-								}
-						}		/* if (GetParameterValueFromParameterSet (param_set_p, S_MARKER.npt_name_s, &marker_value, true)) */
-
-					GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_CLUSTER_ID.npt_name_s, &cluster_p);
-
-					if (gene_s || cluster_p)
-						{
-							DoSearch (job_p, gene_s, cluster_p, data_p);
-						}
-
+					SearchRequest request;
 
+					GetSearchRequest (param_set_p, &request);
+					RunSearch (job_p, &request, data_p, false);
 				}		/* if (param_set_p) */
 
 
@@ -288,251 +735,2683 @@ static ServiceJobSet *RunGeneTreesSearchService (Service *service_p, ParameterSe
 }
 
 
-static ServiceMetadata *GetGeneTreesSearchServiceMetadata (Service * UNUSED_PARAM (service_p))
+/*
+ * The asynchronous version takes a copy of the search parameters, marks
+ * the job as pending, registers it with the JobsManager and returns straight
+ * away. The search itself is run on a worker thread with its own copy of the
+ * job, which it stores in the JobsManager each time that its status changes,
+ * so clients can poll the job rather than keeping the connection open. The
+ * worker holds its own reference to the service's data, so the service can be
+ * closed, without waiting, while the search is still running.
+ */
+static ServiceJobSet *RunGeneTreesAsyncSearchService (Service *service_p, ParameterSet *param_set_p, User * UNUSED_PARAM (user_p), ProvidersStateTable * UNUSED_PARAM (providers_p))
 {
-	const char *term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "topic_0625";
-	SchemaTerm *category_p = AllocateSchemaTerm (term_url_s, "Genotype and phenotype",
-																							 "The study of genetic constitution of a living entity, such as an individual, and organism, a cell and so on, "
-																							 "typically with respect to a particular observable phenotypic traits, or resources concerning such traits, which "
-																							 "might be an aspect of biochemistry, physiology, morphology, anatomy, development and so on.");
+	GeneTreesServiceData *data_p = (GeneTreesServiceData *) (service_p -> se_data_p);
 
-	if (category_p)
+	service_p -> se_jobs_p = AllocateSimpleServiceJobSet (service_p, NULL, "Gene Trees");
+
+	if (service_p -> se_jobs_p)
 		{
-			SchemaTerm *subcategory_p;
+			ServiceJob *job_p = GetServiceJobFromServiceJobSet (service_p -> se_jobs_p, 0);
 
-			term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "operation_0304";
-			subcategory_p = AllocateSchemaTerm (term_url_s, "Query and retrieval", "Search or query a data resource and retrieve entries and / or annotation.");
+			LogParameterSet (param_set_p, job_p);
 
-			if (subcategory_p)
+			SetServiceJobStatus (job_p, OS_FAILED_TO_START);
+
+			if (param_set_p)
 				{
-					ServiceMetadata *metadata_p = AllocateServiceMetadata (category_p, subcategory_p);
+					SearchRequest request;
+					JobsManager *jobs_manager_p = GetJobsManager (data_p -> gtsd_grassroots_p);
 
-					if (metadata_p)
-						{
-							SchemaTerm *input_p;
+					GetSearchRequest (param_set_p, &request);
 
-							term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "data_0968";
-							input_p = AllocateSchemaTerm (term_url_s, "Keyword",
-																						"Boolean operators (AND, OR and NOT) and wildcard characters may be allowed. Keyword(s) or phrase(s) used (typically) for text-searching purposes.");
+					if (jobs_manager_p)
+						{
+							AsyncSearch *search_p = AllocateAsyncSearch (service_p, job_p, &request, jobs_manager_p, data_p);
 
-							if (input_p)
+							if (search_p)
 								{
-									if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p))
-										{
-											SchemaTerm *output_p;
-
+									SetServiceJobStatus (job_p, OS_PENDING);
 
-											/* Genotype */
-											term_url_s = CONTEXT_PREFIX_EXPERIMENTAL_FACTOR_ONTOLOGY_S "EFO_0000513";
-											output_p = AllocateSchemaTerm (term_url_s, "genotype", "Information, making the distinction between the actual physical material "
-																										 "(e.g. a cell) and the information about the genetic content (genotype).");
-
-											if (output_p)
+									if (UpdateAsyncSearchJob (jobs_manager_p, job_p))
+										{
+											if (RetainGeneTreesServiceData (data_p))
 												{
-													if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p))
+													pthread_t thread;
+													pthread_attr_t attrs;
+													bool started_flag = false;
+
+													if (pthread_attr_init (&attrs) == 0)
 														{
-															return metadata_p;
-														}		/* if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p)) */
-													else
+															if (pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED) == 0)
+																{
+																	if (pthread_create (&thread, &attrs, RunAsyncSearch, search_p) == 0)
+																		{
+																			started_flag = true;
+																		}
+																}
+
+															pthread_attr_destroy (&attrs);
+														}
+
+													if (started_flag)
 														{
-															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add output term %s to service metadata", term_url_s);
-															FreeSchemaTerm (output_p);
+															/* The worker thread logs its copy of the job when it has finished */
+															return service_p -> se_jobs_p;
 														}
 
-												}		/* if (output_p) */
-											else
-												{
-													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate output term %s for service metadata", term_url_s);
-												}
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to start worker thread for asynchronous search");
+													ReleaseGeneTreesServiceData (data_p);
+												}		/* if (RetainGeneTreesServiceData (data_p)) */
 
-										}		/* if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p)) */
+											/* Don't leave a pending job in the JobsManager that will never run */
+											SetServiceJobStatus (job_p, OS_FAILED_TO_START);
+											UpdateAsyncSearchJob (jobs_manager_p, job_p);
+										}		/* if (UpdateAsyncSearchJob (jobs_manager_p, job_p)) */
 									else
 										{
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add input term %s to service metadata", term_url_s);
-											FreeSchemaTerm (input_p);
+											SetServiceJobStatus (job_p, OS_FAILED_TO_START);
 										}
 
-								}		/* if (input_p) */
+									FreeAsyncSearch (search_p);
+								}		/* if (search_p) */
 							else
 								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate input term %s for service metadata", term_url_s);
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate asynchronous search");
 								}
 
-							FreeServiceMetadata (metadata_p);
-						}		/* if (metadata_p) */
+						}		/* if (jobs_manager_p) */
 					else
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate service metadata");
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get JobsManager for asynchronous search");
 						}
 
-				}		/* if (subcategory_p) */
-			else
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate sub-category term %s for service metadata", term_url_s);
-				}
-
-		}		/* if (category_p) */
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate category term %s for service metadata", term_url_s);
-		}
+				}		/* if (param_set_p) */
 
-	return NULL;
-}
 
+			LogServiceJob (job_p);
+		}		/* if (service_p -> se_jobs_p) */
 
-static ParameterSet *IsResourceForGeneTreesSearchService (Service * UNUSED_PARAM (service_p), DataResource * UNUSED_PARAM (resource_p), Handler * UNUSED_PARAM (handler_p))
-{
-	return NULL;
+	return service_p -> se_jobs_p;
 }
 
 
-
-
-static void DoSearch (ServiceJob *job_p, const char * const gene_s, const uint32 * const cluster_p, GeneTreesServiceData *data_p)
+static void GetSearchRequest (ParameterSet *param_set_p, SearchRequest *request_p)
 {
-	OperationStatus status = OS_FAILED_TO_START;
-	bson_t *query_p = bson_new ();
-
-	if (query_p)
+	const bool *summary_p = NULL;
+	const bool *homologs_p = NULL;
+
+	request_p -> sr_gene_s = NULL;
+	request_p -> sr_genes_s = NULL;
+	request_p -> sr_cluster_p = NULL;
+	request_p -> sr_fields_s = NULL;
+	request_p -> sr_limit_p = NULL;
+	request_p -> sr_page_token_s = NULL;
+	request_p -> sr_tree_leaves_p = NULL;
+	request_p -> sr_summary_flag = false;
+	request_p -> sr_homologs_flag = false;
+	request_p -> sr_export_s = NULL;
+	request_p -> sr_last_cluster_p = NULL;
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_GENE_ID.npt_name_s, & (request_p -> sr_gene_s)))
 		{
-			bool success_flag = true;
-			
-			if (gene_s)
+			if (IsStringEmpty (request_p -> sr_gene_s))
 				{
-					if (!BSON_APPEND_UTF8 (query_p, GTS_GENE_ID_S, gene_s))
-						{
-							success_flag = false;
-							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to add \"%s\": \"%s\"", GTS_GENE_ID_S, gene_s);
-						}
+					request_p -> sr_gene_s = NULL;
 				}
+		}		/* if (GetParameterValueFromParameterSet (param_set_p, S_MARKER.npt_name_s, &marker_value, true)) */
 
-			if (cluster_p)
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_GENE_IDS.npt_name_s, & (request_p -> sr_genes_s)))
+		{
+			if (IsStringEmpty (request_p -> sr_genes_s))
+				{
+					request_p -> sr_genes_s = NULL;
+				}
+		}
+
+	GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_CLUSTER_ID.npt_name_s, & (request_p -> sr_cluster_p));
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_FIELDS.npt_name_s, & (request_p -> sr_fields_s)))
+		{
+			if (IsStringEmpty (request_p -> sr_fields_s))
+				{
+					request_p -> sr_fields_s = NULL;
+				}
+		}
+
+	if (GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_LIMIT.npt_name_s, & (request_p -> sr_limit_p)))
+		{
+			if ((request_p -> sr_limit_p) && (* (request_p -> sr_limit_p) == 0))
+				{
+					request_p -> sr_limit_p = NULL;
+				}
+		}
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_PAGE_TOKEN.npt_name_s, & (request_p -> sr_page_token_s)))
+		{
+			if (IsStringEmpty (request_p -> sr_page_token_s))
+				{
+					request_p -> sr_page_token_s = NULL;
+				}
+		}
+
+	if (GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_TREE_LEAVES.npt_name_s, & (request_p -> sr_tree_leaves_p)))
+		{
+			if ((request_p -> sr_tree_leaves_p) && (* (request_p -> sr_tree_leaves_p) == 0))
+				{
+					request_p -> sr_tree_leaves_p = NULL;
+				}
+		}
+
+	if (GetCurrentBooleanParameterValueFromParameterSet (param_set_p, S_SUMMARY.npt_name_s, &summary_p))
+		{
+			if (summary_p)
+				{
+					request_p -> sr_summary_flag = *summary_p;
+				}
+		}
+
+	if (GetCurrentBooleanParameterValueFromParameterSet (param_set_p, S_HOMOLOGS.npt_name_s, &homologs_p))
+		{
+			if (homologs_p)
+				{
+					request_p -> sr_homologs_flag = *homologs_p;
+				}
+		}
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_EXPORT.npt_name_s, & (request_p -> sr_export_s)))
+		{
+			if (IsStringEmpty (request_p -> sr_export_s))
+				{
+					request_p -> sr_export_s = NULL;
+				}
+		}
+
+	GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_LAST_CLUSTER_ID.npt_name_s, & (request_p -> sr_last_cluster_p));
+}
+
+
+/*
+ * Returns true if there was something to search for.
+ */
+static bool RunSearch (ServiceJob *job_p, const SearchRequest *request_p, GeneTreesServiceData *data_p, const bool async_flag)
+{
+	const char *gene_s = request_p -> sr_gene_s;
+	const uint32 *cluster_p = request_p -> sr_cluster_p;
+	bson_t *genes_p = NULL;
+	char *prefix_s = NULL;
+	bool run_flag = true;
+	bool searched_flag = false;
+	bool export_flag = false;
+	GeneExportFormat export_format = GEF_NDJSON;
+	SearchTimer timer;
+	const uint64 start_ns = GetSearchTime ();
+
+	InitSearchTimer (&timer);
+
+	/*
+	 * The homologs come from a single gene's place in its tree
+	 */
+	if (request_p -> sr_homologs_flag)
+		{
+			if (!gene_s)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_HOMOLOGS.npt_name_s, S_HOMOLOGS.npt_type, "A Gene ID is needed to find homologs");
+					run_flag = false;
+				}
+			else if ((*gene_s != '\0') && (gene_s [strlen (gene_s) - 1] == '*'))
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_HOMOLOGS.npt_name_s, S_HOMOLOGS.npt_type, "Homologs can't be found for a gene prefix");
+					run_flag = false;
+				}
+			else if (request_p -> sr_genes_s)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_HOMOLOGS.npt_name_s, S_HOMOLOGS.npt_type, "Homologs can only be found for a single Gene ID");
+					run_flag = false;
+				}
+			else if (request_p -> sr_summary_flag)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_HOMOLOGS.npt_name_s, S_HOMOLOGS.npt_type, "Homologs can't be found for a summary");
+					run_flag = false;
+				}
+		}
+
+	/*
+	 * An export writes every hit to a file rather than to the job
+	 */
+	if (run_flag && (request_p -> sr_export_s))
+		{
+			if (!GetGeneExportFormat (request_p -> sr_export_s, &export_format))
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_EXPORT.npt_name_s, S_EXPORT.npt_type, "The export format must be either \"ndjson\" or \"fasta\"");
+					run_flag = false;
+				}
+			else if (! (data_p -> gtsd_export_directory_s))
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_EXPORT.npt_name_s, S_EXPORT.npt_type, "Exports are not enabled on this server");
+					run_flag = false;
+				}
+			else if ((request_p -> sr_summary_flag) || (request_p -> sr_homologs_flag))
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_EXPORT.npt_name_s, S_EXPORT.npt_type, "Summaries and homologs can't be exported");
+					run_flag = false;
+				}
+			else if ((!async_flag) && (!gene_s) && (! (request_p -> sr_genes_s)) && (!cluster_p) && (! (request_p -> sr_last_cluster_p)))
+				{
+					/* This would tie up the server's connection for as long as the whole collection takes */
+					AddParameterErrorMessageToServiceJob (job_p, S_EXPORT.npt_name_s, S_EXPORT.npt_type, "The whole collection can only be exported with the asynchronous search service");
+					run_flag = false;
+				}
+			else
+				{
+					export_flag = true;
+				}
+		}
+
+	if (run_flag && (request_p -> sr_last_cluster_p))
+		{
+			if (!export_flag)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_LAST_CLUSTER_ID.npt_name_s, S_LAST_CLUSTER_ID.npt_type, "A range of clusters can only be exported");
+					run_flag = false;
+				}
+			else if ((cluster_p) && (*cluster_p > * (request_p -> sr_last_cluster_p)))
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_LAST_CLUSTER_ID.npt_name_s, S_LAST_CLUSTER_ID.npt_type, "The last Cluster ID is before the first one");
+					run_flag = false;
+				}
+		}
+
+	/*
+	 * A Gene ID ending in a * matches every gene that starts with the
+	 * rest of it, such as all of the isoforms of a transcript
+	 */
+	if (run_flag && gene_s && (*gene_s != '\0') && (gene_s [strlen (gene_s) - 1] == '*'))
+		{
+			if (request_p -> sr_genes_s)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_GENE_ID.npt_name_s, S_GENE_ID.npt_type, "A gene prefix can't be searched for along with a list of Gene IDs");
+					run_flag = false;
+				}
+			else if (request_p -> sr_summary_flag)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_GENE_ID.npt_name_s, S_GENE_ID.npt_type, "A gene prefix can't be used for a summary");
+					run_flag = false;
+				}
+			else if ((prefix_s = GetGenePrefix (gene_s, job_p)) != NULL)
+				{
+					gene_s = NULL;
+				}
+			else
+				{
+					run_flag = false;
+				}
+		}
+
+	if (run_flag && (request_p -> sr_genes_s))
+		{
+			uint32 num_genes = 0;
+
+			/*
+			 * Any single Gene ID is searched for along with the list
+			 */
+			genes_p = GetGeneIdsArray (request_p -> sr_genes_s, gene_s, &num_genes);
+
+			if (!genes_p)
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_GENE_IDS.npt_name_s, S_GENE_IDS.npt_type, "Failed to parse the list of Gene IDs");
+					run_flag = false;
+				}
+			else if (num_genes == 0)
+				{
+					bson_destroy (genes_p);
+					genes_p = NULL;
+				}
+		}
+
+	if (run_flag && (gene_s || genes_p || prefix_s || cluster_p || export_flag))
+		{
+			const bool summary_flag = request_p -> sr_summary_flag;
+			const bool homologs_flag = request_p -> sr_homologs_flag;
+
+			/*
+			 * A summary has one entry per cluster so it doesn't use fields or pages
+			 * and the homologs are a single result that only needs the gene's tree.
+			 * A FASTA export only needs the IDs and sequences.
+			 */
+			const char *export_fields_s = export_flag ? GetGeneExportFields (export_format) : NULL;
+			const char *fields_s = summary_flag ? NULL : (homologs_flag ? S_HOMOLOG_FIELDS_S : (export_fields_s ? export_fields_s : request_p -> sr_fields_s));
+			uint32 limit = ((!summary_flag) && (!homologs_flag) && (!export_flag) && (request_p -> sr_limit_p)) ? * (request_p -> sr_limit_p) : 0;
+			const uint32 tree_leaves = ((!summary_flag) && (!homologs_flag) && (!export_flag) && (request_p -> sr_tree_leaves_p)) ? * (request_p -> sr_tree_leaves_p) : 0;
+			const char *page_token_s = ((!summary_flag) && (!homologs_flag) && (!export_flag)) ? request_p -> sr_page_token_s : NULL;
+			/*
+			 * A summary only needs to know which cluster each gene is in, so if
+			 * there is a local index it can be answered without the database.
+			 * This is quicker than a cache lookup, so these aren't cached.
+			 */
+			const bool use_index_flag = summary_flag && (data_p -> gtsd_gene_index_p != NULL);
+			char *cache_key_s = NULL;
+
+			/*
+			 * A short prefix can match most of the collection, so these
+			 * searches are always paged and the pages are capped
+			 */
+			if (prefix_s && (!export_flag) && ((limit == 0) || (limit > data_p -> gtsd_prefix_search_limit)))
+				{
+					limit = data_p -> gtsd_prefix_search_limit;
+				}
+
+			/*
+			 * A page of hits is cheap to get and the cache only stores the hits
+			 * themselves rather than the token for the next page, so only whole
+			 * result sets are cached. A page token without a limit still only
+			 * gets the hits from the token onwards, so these aren't cached either.
+			 */
+			if ((data_p -> gtsd_cache_p) && (limit == 0) && (!page_token_s) && (!use_index_flag) && (!export_flag))
+				{
+					cache_key_s = GetSearchCacheKey (gene_s, genes_p ? request_p -> sr_genes_s : NULL, cluster_p, fields_s, summary_flag, tree_leaves, homologs_flag);
+				}
+
+			if (use_index_flag)
+				{
+					DoIndexSummary (job_p, gene_s, genes_p, cluster_p, &timer, data_p);
+				}
+			else if (! (cache_key_s && AddCachedResultsToServiceJob (job_p, cache_key_s, data_p)))
+				{
+					bson_t *opts_p = NULL;
+
+					/*
+					 * Paging needs the hits in a stable order and the tokens are
+					 * Gene IDs, so sort by them. As these are unique, each page
+					 * can then start from the token using the gene_id index, or
+					 * the compound cluster_id and gene_id one, and costs the
+					 * same however deep into the results it is.
+					 */
+					if (summary_flag || GetSearchOptions (fields_s, (genes_p != NULL) || (limit > 0) || (page_token_s != NULL), tree_leaves > 0, limit, &opts_p, job_p))
+						{
+							/*
+							 * Only hold on to a connection for as long as the
+							 * query itself takes
+							 */
+							const uint64 connection_start_ns = GetSearchTime ();
+							MongoTool *mongo_p = CheckOutMongoTool (data_p -> gtsd_pool_p);
+
+							AddSearchPhaseTime (&timer, SP_CONNECTION, connection_start_ns);
+
+							if (mongo_p)
+								{
+									if (summary_flag)
+										{
+											DoSummary (job_p, gene_s, genes_p, cluster_p, cache_key_s, mongo_p, &timer, data_p);
+										}
+									else if (homologs_flag)
+										{
+											DoHomologSearch (job_p, gene_s, cluster_p, opts_p, cache_key_s, mongo_p, &timer, data_p);
+										}
+									else if (export_flag)
+										{
+											DoExport (job_p, gene_s, genes_p, prefix_s, cluster_p, request_p -> sr_last_cluster_p, opts_p, export_format, mongo_p, &timer, data_p);
+										}
+									else
+										{
+											DoSearch (job_p, gene_s, genes_p, prefix_s, cluster_p, opts_p, limit, page_token_s, tree_leaves, cache_key_s, mongo_p, &timer, data_p);
+										}
+
+									CheckInMongoTool (data_p -> gtsd_pool_p, mongo_p);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get a MongoTool to search with");
+									SetServiceJobStatus (job_p, OS_FAILED);
+								}
+
+							if (opts_p)
+								{
+									bson_destroy (opts_p);
+								}
+						}
+				}
+
+			if (cache_key_s)
+				{
+					FreeCopiedString (cache_key_s);
+				}
+
+			AddSearchPhaseTime (&timer, SP_TOTAL, start_ns);
+			AddSearchTimings (job_p, &timer, data_p);
+
+			searched_flag = true;
+		}
+
+	if (genes_p)
+		{
+			bson_destroy (genes_p);
+		}
+
+	if (prefix_s)
+		{
+			FreeCopiedString (prefix_s);
+		}
+
+	return searched_flag;
+}
+
+
+static AsyncSearch *AllocateAsyncSearch (Service *service_p, const ServiceJob *job_p, const SearchRequest *request_p, JobsManager *jobs_manager_p, GeneTreesServiceData *data_p)
+{
+	AsyncSearch *search_p = (AsyncSearch *) AllocMemory (sizeof (AsyncSearch));
+
+	if (search_p)
+		{
+			bool success_flag = true;
+
+			search_p -> as_jobs_p = AllocateSimpleServiceJobSet (service_p, NULL, "Gene Trees");
+			search_p -> as_job_p = NULL;
+			search_p -> as_jobs_manager_p = jobs_manager_p;
+			search_p -> as_data_p = data_p;
+
+			search_p -> as_request.sr_gene_s = NULL;
+			search_p -> as_request.sr_genes_s = NULL;
+			search_p -> as_request.sr_cluster_p = NULL;
+			search_p -> as_request.sr_fields_s = NULL;
+			search_p -> as_request.sr_limit_p = NULL;
+			search_p -> as_request.sr_page_token_s = NULL;
+			search_p -> as_request.sr_tree_leaves_p = NULL;
+			search_p -> as_request.sr_summary_flag = request_p -> sr_summary_flag;
+			search_p -> as_request.sr_homologs_flag = request_p -> sr_homologs_flag;
+			search_p -> as_request.sr_export_s = NULL;
+			search_p -> as_request.sr_last_cluster_p = NULL;
+
+			/*
+			 * The worker's job takes the id of the one that the client
+			 * gets back, so that polling for it finds the worker's results
+			 */
+			if (search_p -> as_jobs_p)
+				{
+					search_p -> as_job_p = GetServiceJobFromServiceJobSet (search_p -> as_jobs_p, 0);
+					uuid_copy (search_p -> as_job_p -> sj_id, job_p -> sj_id);
+				}
+			else
+				{
+					success_flag = false;
+				}
+
+			/*
+			 * The ParameterSet will have been freed by the time that
+			 * the search runs, so we need our own copies of the values
+			 */
+			if (success_flag && (request_p -> sr_gene_s))
+				{
+					if ((search_p -> as_request.sr_gene_s = EasyCopyToNewString (request_p -> sr_gene_s)) == NULL)
+						{
+							success_flag = false;
+						}
+				}
+
+			if (success_flag && (request_p -> sr_genes_s))
+				{
+					if ((search_p -> as_request.sr_genes_s = EasyCopyToNewString (request_p -> sr_genes_s)) == NULL)
+						{
+							success_flag = false;
+						}
+				}
+
+			if (success_flag && (request_p -> sr_fields_s))
+				{
+					if ((search_p -> as_request.sr_fields_s = EasyCopyToNewString (request_p -> sr_fields_s)) == NULL)
+						{
+							success_flag = false;
+						}
+				}
+
+			if (success_flag && (request_p -> sr_page_token_s))
+				{
+					if ((search_p -> as_request.sr_page_token_s = EasyCopyToNewString (request_p -> sr_page_token_s)) == NULL)
+						{
+							success_flag = false;
+						}
+				}
+
+			if (success_flag && (request_p -> sr_export_s))
+				{
+					if ((search_p -> as_request.sr_export_s = EasyCopyToNewString (request_p -> sr_export_s)) == NULL)
+						{
+							success_flag = false;
+						}
+				}
+
+			if (request_p -> sr_cluster_p)
+				{
+					search_p -> as_cluster = * (request_p -> sr_cluster_p);
+					search_p -> as_request.sr_cluster_p = & (search_p -> as_cluster);
+				}
+
+			if (request_p -> sr_limit_p)
+				{
+					search_p -> as_limit = * (request_p -> sr_limit_p);
+					search_p -> as_request.sr_limit_p = & (search_p -> as_limit);
+				}
+
+			if (request_p -> sr_tree_leaves_p)
+				{
+					search_p -> as_tree_leaves = * (request_p -> sr_tree_leaves_p);
+					search_p -> as_request.sr_tree_leaves_p = & (search_p -> as_tree_leaves);
+				}
+
+			if (request_p -> sr_last_cluster_p)
+				{
+					search_p -> as_last_cluster = * (request_p -> sr_last_cluster_p);
+					search_p -> as_request.sr_last_cluster_p = & (search_p -> as_last_cluster);
+				}
+
+			if (success_flag)
+				{
+					return search_p;
+				}
+
+			FreeAsyncSearch (search_p);
+		}		/* if (search_p) */
+
+	return NULL;
+}
+
+
+static void FreeAsyncSearch (AsyncSearch *search_p)
+{
+	if (search_p -> as_request.sr_gene_s)
+		{
+			FreeCopiedString ((char *) (search_p -> as_request.sr_gene_s));
+		}
+
+	if (search_p -> as_request.sr_genes_s)
+		{
+			FreeCopiedString ((char *) (search_p -> as_request.sr_genes_s));
+		}
+
+	if (search_p -> as_request.sr_fields_s)
+		{
+			FreeCopiedString ((char *) (search_p -> as_request.sr_fields_s));
+		}
+
+	if (search_p -> as_request.sr_page_token_s)
+		{
+			FreeCopiedString ((char *) (search_p -> as_request.sr_page_token_s));
+		}
+
+	if (search_p -> as_request.sr_export_s)
+		{
+			FreeCopiedString ((char *) (search_p -> as_request.sr_export_s));
+		}
+
+	if (search_p -> as_jobs_p)
+		{
+			FreeServiceJobSet (search_p -> as_jobs_p);
+		}
+
+	FreeMemory (search_p);
+}
+
+
+static void *RunAsyncSearch (void *data_p)
+{
+	AsyncSearch *search_p = (AsyncSearch *) data_p;
+	GeneTreesServiceData *service_data_p = search_p -> as_data_p;
+	ServiceJob *job_p = search_p -> as_job_p;
+
+	SetServiceJobStatus (job_p, OS_STARTED);
+	UpdateAsyncSearchJob (search_p -> as_jobs_manager_p, job_p);
+
+	if (!RunSearch (job_p, & (search_p -> as_request), service_data_p, true))
+		{
+			/* There was nothing to search for */
+			SetServiceJobStatus (job_p, OS_FAILED_TO_START);
+		}
+
+	UpdateAsyncSearchJob (search_p -> as_jobs_manager_p, job_p);
+	LogServiceJob (job_p);
+
+	FreeAsyncSearch (search_p);
+	ReleaseGeneTreesServiceData (service_data_p);
+
+	return NULL;
+}
+
+
+/*
+ * Store the current state of a job in the JobsManager, replacing any
+ * earlier state that it had for the same id. The JobsManager serialises
+ * the job under its own lock, so this is safe to call from a worker thread.
+ */
+static bool UpdateAsyncSearchJob (JobsManager *jobs_manager_p, ServiceJob *job_p)
+{
+	if (AddServiceJobToJobsManager (jobs_manager_p, job_p -> sj_id, job_p))
+		{
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to store asynchronous search job in the JobsManager");
+
+	return false;
+}
+
+
+static ServiceMetadata *GetGeneTreesSearchServiceMetadata (Service * UNUSED_PARAM (service_p))
+{
+	const char *term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "topic_0625";
+	SchemaTerm *category_p = AllocateSchemaTerm (term_url_s, "Genotype and phenotype",
+																							 "The study of genetic constitution of a living entity, such as an individual, and organism, a cell and so on, "
+																							 "typically with respect to a particular observable phenotypic traits, or resources concerning such traits, which "
+																							 "might be an aspect of biochemistry, physiology, morphology, anatomy, development and so on.");
+
+	if (category_p)
+		{
+			SchemaTerm *subcategory_p;
+
+			term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "operation_0304";
+			subcategory_p = AllocateSchemaTerm (term_url_s, "Query and retrieval", "Search or query a data resource and retrieve entries and / or annotation.");
+
+			if (subcategory_p)
+				{
+					ServiceMetadata *metadata_p = AllocateServiceMetadata (category_p, subcategory_p);
+
+					if (metadata_p)
+						{
+							SchemaTerm *input_p;
+
+							term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "data_0968";
+							input_p = AllocateSchemaTerm (term_url_s, "Keyword",
+																						"Boolean operators (AND, OR and NOT) and wildcard characters may be allowed. Keyword(s) or phrase(s) used (typically) for text-searching purposes.");
+
+							if (input_p)
+								{
+									if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p))
+										{
+											SchemaTerm *output_p;
+
+
+											/* Genotype */
+											term_url_s = CONTEXT_PREFIX_EXPERIMENTAL_FACTOR_ONTOLOGY_S "EFO_0000513";
+											output_p = AllocateSchemaTerm (term_url_s, "genotype", "Information, making the distinction between the actual physical material "
+																										 "(e.g. a cell) and the information about the genetic content (genotype).");
+
+											if (output_p)
+												{
+													if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p))
+														{
+															return metadata_p;
+														}		/* if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p)) */
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add output term %s to service metadata", term_url_s);
+															FreeSchemaTerm (output_p);
+														}
+
+												}		/* if (output_p) */
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate output term %s for service metadata", term_url_s);
+												}
+
+										}		/* if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p)) */
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add input term %s to service metadata", term_url_s);
+											FreeSchemaTerm (input_p);
+										}
+
+								}		/* if (input_p) */
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate input term %s for service metadata", term_url_s);
+								}
+
+							FreeServiceMetadata (metadata_p);
+						}		/* if (metadata_p) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate service metadata");
+						}
+
+				}		/* if (subcategory_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate sub-category term %s for service metadata", term_url_s);
+				}
+
+		}		/* if (category_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate category term %s for service metadata", term_url_s);
+		}
+
+	return NULL;
+}
+
+
+static ParameterSet *IsResourceForGeneTreesSearchService (Service * UNUSED_PARAM (service_p), DataResource * UNUSED_PARAM (resource_p), Handler * UNUSED_PARAM (handler_p))
+{
+	return NULL;
+}
+
+
+
+
+static void DoSearch (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const char *prefix_s, const uint32 * const cluster_p, const bson_t *opts_p, const uint32 limit, const char *page_token_s, const uint32 tree_leaves, const char *cache_key_s, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *query_p = GetSearchQuery (gene_s, genes_p, prefix_s, cluster_p, page_token_s);
+
+	if (query_p)
+		{
+			/*
+			 * Rather than pulling every matching document into a single
+			 * json_t array, walk the cursor and convert each hit into a
+			 * resource as it arrives so that we only ever hold one raw
+			 * document at a time.
+			 */
+			uint64 phase_start_ns = GetSearchTime ();
+
+			if (FindMatchingMongoDocumentsByBSON (mongo_p, query_p, opts_p))
+				{
+					SearchHits hits;
+					char *query_s = NULL;
+					
+					if (cluster_p)
+						{
+							char *cluster_s = ConvertUnsignedIntegerToString (*cluster_p);
+							
+							if (cluster_s)
+								{
+									if (gene_s)
+										{
+											query_s = ConcatenateVarargsStrings (gene_s, " - ", cluster_s, NULL);
+											FreeCopiedString (cluster_s);
+										} 
+									else
+										{
+											query_s = cluster_s;
+										}
+								}
+							else if (gene_s)
+								{
+									query_s = (char *) gene_s;
+								}
+						}
+
+					hits.sh_job_p = job_p;
+					hits.sh_gene_s = gene_s;
+					hits.sh_cluster_p = cluster_p;
+					hits.sh_query_s = query_s;
+					hits.sh_group_by_gene_flag = (genes_p != NULL) || (prefix_s != NULL);
+					hits.sh_current_gene_s = NULL;
+					hits.sh_current_gene_size = 0;
+					hits.sh_title_s = NULL;
+					hits.sh_title_size = 0;
+					hits.sh_gene_hit_index = 0;
+					hits.sh_num_genes = 0;
+					hits.sh_num_hits = 0;
+					hits.sh_num_added = 0;
+					/* Never cache a page under the key for the whole result set */
+					hits.sh_cached_results_p = (cache_key_s && (limit == 0) && (!page_token_s)) ? json_array () : NULL;
+					hits.sh_limit = limit;
+					hits.sh_next_page_token_s = NULL;
+					hits.sh_tree_leaves = tree_leaves;
+					hits.sh_tree_cache_p = data_p -> gtsd_tree_cache_p;
+					hits.sh_timer_p = timer_p;
+					hits.sh_phase_start_ns = phase_start_ns;
+
+					if (!IterateOverMongoResults (mongo_p, AddSearchHit, &hits))
+						{
+							if (cluster_p)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to iterate over results for \"%s\", cluster " UINT32_FMT, gene_s ? gene_s : "NULL", *cluster_p);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to iterate over results for \"%s\"", gene_s ? gene_s : "NULL");
+								}
+						}
+
+					/* Waiting for the rest of the cursor after the last hit */
+					AddSearchPhaseTime (timer_p, SP_QUERY, hits.sh_phase_start_ns);
+
+					if (hits.sh_group_by_gene_flag)
+						{
+							PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Found " SIZET_FMT " hits for " SIZET_FMT " genes", hits.sh_num_hits, hits.sh_num_genes);
+						}
+
+					if (hits.sh_current_gene_s)
+						{
+							FreeMemory (hits.sh_current_gene_s);
+						}
+
+					if (hits.sh_title_s)
+						{
+							FreeMemory (hits.sh_title_s);
+						}
+
+					if (hits.sh_next_page_token_s)
+						{
+							json_t *token_p = json_string (hits.sh_next_page_token_s);
+
+							if (! (token_p && AddSearchMetadata (job_p, S_NEXT_PAGE_TOKEN_S, token_p)))
+								{
+									AddGeneralErrorMessageToServiceJob (job_p, "Failed to add the token for the next page of hits");
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add next page token \"%s\" to job", hits.sh_next_page_token_s);
+
+									/* Without the token, the client can't get the rest of the hits */
+									hits.sh_num_hits = hits.sh_num_added + 1;
+								}
+
+							FreeCopiedString (hits.sh_next_page_token_s);
+						}
+
+					if (hits.sh_num_added == hits.sh_num_hits)
+						{
+							status = OS_SUCCEEDED;
+
+							if (hits.sh_cached_results_p)
+								{
+									if (!AddSearchResultsToCache (data_p -> gtsd_cache_p, cache_key_s, hits.sh_cached_results_p))
+										{
+											PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Did not cache results for \"%s\"", cache_key_s);
+										}
+								}
+						}
+					else if (hits.sh_num_added > 0)
+						{
+							status = OS_PARTIALLY_SUCCEEDED;
+						}
+					else
+						{
+							status = OS_FAILED;
+						}
+
+					if (query_s && (query_s != gene_s))
+						{
+							FreeCopiedString (query_s);
+						}
+
+					if (hits.sh_cached_results_p)
+						{
+							json_decref (hits.sh_cached_results_p);
+						}
+
+				}		/* if (FindMatchingMongoDocumentsByBSON (mongo_p, query_p, opts_p)) */
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to run query in \"%s\" -> \"%s\"", data_p -> gtsd_database_s, data_p -> gtsd_collection_s);
+				}
+
+			bson_destroy (query_p);
+		}		/* if (query_p) */
+
+	SetServiceJobStatus (job_p, status);
+}
+
+
+/*
+ * Build the query for the hits that match the given Gene ID(s) and/or
+ * Cluster ID. If page_token_s is set, only the hits from that Gene ID
+ * onwards are matched.
+ */
+static bson_t *GetSearchQuery (const char * const gene_s, const bson_t *genes_p, const char *prefix_s, const uint32 * const cluster_p, const char *page_token_s)
+{
+	bson_t *query_p = bson_new ();
+
+	if (query_p)
+		{
+			bool success_flag = true;
+			
+			if (genes_p)
+				{
+					bson_t in_query;
+
+					/*
+					 * Look up all of the genes in one round trip with
+					 * { gene_id: { $in: [ ... ] } }
+					 */
+					if (BSON_APPEND_DOCUMENT_BEGIN (query_p, GTS_GENE_ID_S, &in_query))
+						{
+							if (!BSON_APPEND_ARRAY (&in_query, "$in", genes_p))
+								{
+									success_flag = false;
+									PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, genes_p, "Failed to add \"$in\" for \"%s\"", GTS_GENE_ID_S);
+								}
+
+							if (page_token_s && success_flag)
+								{
+									if (!BSON_APPEND_UTF8 (&in_query, "$gte", page_token_s))
+										{
+											success_flag = false;
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"$gte\": \"%s\" for \"%s\"", page_token_s, GTS_GENE_ID_S);
+										}
+								}
+
+							if (!bson_append_document_end (query_p, &in_query))
+								{
+									success_flag = false;
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to end \"%s\" query", GTS_GENE_ID_S);
+								}
+						}
+					else
+						{
+							success_flag = false;
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to begin \"%s\" query", GTS_GENE_ID_S);
+						}
+				}
+			else if (gene_s)
+				{
+					if (!BSON_APPEND_UTF8 (query_p, GTS_GENE_ID_S, gene_s))
+						{
+							success_flag = false;
+							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to add \"%s\": \"%s\"", GTS_GENE_ID_S, gene_s);
+						}
+				}
+			else if (prefix_s)
+				{
+					success_flag = AddGenePrefixQuery (query_p, prefix_s, page_token_s);
+				}
+			else if (page_token_s)
+				{
+					bson_t page_query;
+
+					/*
+					 * A single Gene ID matches at most one hit so there are
+					 * only pages to start from when searching by cluster
+					 */
+					if (BSON_APPEND_DOCUMENT_BEGIN (query_p, GTS_GENE_ID_S, &page_query))
+						{
+							if (!BSON_APPEND_UTF8 (&page_query, "$gte", page_token_s))
+								{
+									success_flag = false;
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"$gte\": \"%s\" for \"%s\"", page_token_s, GTS_GENE_ID_S);
+								}
+
+							if (!bson_append_document_end (query_p, &page_query))
+								{
+									success_flag = false;
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to end \"%s\" query", GTS_GENE_ID_S);
+								}
+						}
+					else
+						{
+							success_flag = false;
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to begin \"%s\" query", GTS_GENE_ID_S);
+						}
+				}
+
+			if (cluster_p)
+				{
+					if (!BSON_APPEND_INT32 (query_p, GTS_CLUSTER_ID_S, *cluster_p))
+						{
+							success_flag = false;							
+							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to add \"%s\": " UINT32_FMT, GTS_CLUSTER_ID_S, *cluster_p);
+						}
+				}
+
+			if (success_flag)
+				{
+					return query_p;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to append \"%s\", %d to query", gene_s ? gene_s : "NULL", cluster_p ? *cluster_p : -1);
+			bson_destroy (query_p);
+		}		/* if (query_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create query for \"%s\", %d", gene_s ? gene_s : "NULL", cluster_p ? *cluster_p : -1);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Match the genes starting with prefix_s using
+ * { gene_id: { $gte: <prefix>, $lt: <prefix with its last byte incremented> } }
+ * rather than a regular expression, as this is a single range scan of the
+ * gene_id index. Gene IDs are compared bytewise, so this range is exactly
+ * the IDs with the prefix.
+ */
+static bool AddGenePrefixQuery (bson_t *query_p, const char *prefix_s, const char *page_token_s)
+{
+	bool success_flag = false;
+	char *upper_bound_s = EasyCopyToNewString (prefix_s);
+
+	if (upper_bound_s)
+		{
+			size_t i = strlen (upper_bound_s);
+			bson_t range_query;
+
+			/* Drop any trailing 0xFF bytes as they can't be incremented */
+			while ((i > 0) && (((unsigned char) upper_bound_s [i - 1]) == 0xFF))
+				{
+					-- i;
+				}
+
+			upper_bound_s [i] = '\0';
+
+			if (i > 0)
+				{
+					upper_bound_s [i - 1] = (char) (((unsigned char) upper_bound_s [i - 1]) + 1);
+				}
+
+			/* A page of hits starts from the later of the prefix and the token */
+			if (page_token_s && (strcmp (page_token_s, prefix_s) > 0))
+				{
+					prefix_s = page_token_s;
+				}
+
+			if (BSON_APPEND_DOCUMENT_BEGIN (query_p, GTS_GENE_ID_S, &range_query))
+				{
+					if (BSON_APPEND_UTF8 (&range_query, "$gte", prefix_s))
+						{
+							if ((i == 0) || BSON_APPEND_UTF8 (&range_query, "$lt", upper_bound_s))
+								{
+									success_flag = true;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"$lt\": \"%s\" for \"%s\"", upper_bound_s, GTS_GENE_ID_S);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"$gte\": \"%s\" for \"%s\"", prefix_s, GTS_GENE_ID_S);
+						}
+
+					if (!bson_append_document_end (query_p, &range_query))
+						{
+							success_flag = false;
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to end \"%s\" query", GTS_GENE_ID_S);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to begin \"%s\" query", GTS_GENE_ID_S);
+				}
+
+			FreeCopiedString (upper_bound_s);
+		}		/* if (upper_bound_s) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy gene prefix \"%s\"", prefix_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Get the prefix from a Gene ID ending in a *. Only a trailing
+ * wildcard is supported, as that is all that the index can use.
+ */
+static char *GetGenePrefix (const char *gene_s, ServiceJob *job_p)
+{
+	const size_t length = strlen (gene_s) - 1;
+
+	if (length == 0)
+		{
+			AddParameterErrorMessageToServiceJob (job_p, S_GENE_ID.npt_name_s, S_GENE_ID.npt_type, "A gene prefix needs at least one character before the *");
+		}
+	else if (memchr (gene_s, '*', length))
+		{
+			AddParameterErrorMessageToServiceJob (job_p, S_GENE_ID.npt_name_s, S_GENE_ID.npt_type, "Only a single * at the end of the Gene ID is supported");
+		}
+	else
+		{
+			char *prefix_s = CopyToNewString (gene_s, length, false);
+
+			if (prefix_s)
+				{
+					return prefix_s;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy gene prefix from \"%s\"", gene_s);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Rather than fetching the matching documents, get the server to count
+ * the matching genes in each cluster with
+ *
+ * [ { $match: query }, { $group: { _id: "$cluster_id", genes: { $sum: 1 } } }, { $sort: { _id: 1 } } ]
+ *
+ * Since this only needs the cluster and gene ids, it can be answered
+ * from the compound index without loading the sequences or trees.
+ */
+static void DoSummary (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const uint32 * const cluster_p, const char *cache_key_s, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *query_p = GetSearchQuery (gene_s, genes_p, NULL, cluster_p, NULL);
+
+	if (query_p)
+		{
+			char *group_key_s = ConcatenateStrings ("$", GTS_CLUSTER_ID_S);
+
+			if (group_key_s)
+				{
+					bson_t *pipeline_p = BCON_NEW ("pipeline", "[",
+						"{", "$match", BCON_DOCUMENT (query_p), "}",
+						"{", "$group", "{", "_id", BCON_UTF8 (group_key_s), "genes", "{", "$sum", BCON_INT32 (1), "}", "}", "}",
+						"{", "$sort", "{", "_id", BCON_INT32 (1), "}", "}",
+					"]");
+
+					if (pipeline_p)
+						{
+							uint64 phase_start_ns = GetSearchTime ();
+							mongoc_cursor_t *cursor_p = mongoc_collection_aggregate (mongo_p -> mt_collection_p, MONGOC_QUERY_NONE, pipeline_p, NULL, NULL);
+
+							if (cursor_p)
+								{
+									json_t *cached_results_p = cache_key_s ? json_array () : NULL;
+									const bson_t *document_p = NULL;
+									bson_error_t error;
+									size_t num_clusters = 0;
+									size_t num_added = 0;
+									json_int_t num_genes = 0;
+
+									while (mongoc_cursor_next (cursor_p, &document_p))
+										{
+											char *title_s = NULL;
+											json_t *summary_p = NULL;
+
+											phase_start_ns = AddSearchPhaseTime (timer_p, SP_QUERY, phase_start_ns);
+											summary_p = GetClusterSummary (document_p, &title_s);
+											phase_start_ns = AddSearchPhaseTime (timer_p, SP_CONVERT, phase_start_ns);
+
+											++ num_clusters;
+
+											if (summary_p)
+												{
+													num_genes += json_integer_value (json_object_get (summary_p, "genes"));
+
+													if (AddClusterSummaryToServiceJob (job_p, summary_p, title_s, &cached_results_p))
+														{
+															++ num_added;
+														}
+
+													json_decref (summary_p);
+												}		/* if (summary_p) */
+
+											if (title_s)
+												{
+													FreeCopiedString (title_s);
+												}
+
+											phase_start_ns = AddSearchPhaseTime (timer_p, SP_WRAP, phase_start_ns);
+										}		/* while (mongoc_cursor_next (cursor_p, &document_p)) */
+
+									AddSearchPhaseTime (timer_p, SP_QUERY, phase_start_ns);
+
+									if (mongoc_cursor_error (cursor_p, &error))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get cluster summary in \"%s\" -> \"%s\": %s", data_p -> gtsd_database_s, data_p -> gtsd_collection_s, error.message);
+											status = (num_added > 0) ? OS_PARTIALLY_SUCCEEDED : OS_FAILED;
+										}
+									else if (num_added == num_clusters)
+										{
+											status = OS_SUCCEEDED;
+
+											if (cached_results_p)
+												{
+													if (!AddSearchResultsToCache (data_p -> gtsd_cache_p, cache_key_s, cached_results_p))
+														{
+															PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Did not cache results for \"%s\"", cache_key_s);
+														}
+												}
+										}
+									else
+										{
+											status = (num_added > 0) ? OS_PARTIALLY_SUCCEEDED : OS_FAILED;
+										}
+
+									if (!AddSearchMetadata (job_p, "genes", json_integer (num_genes)))
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add number of genes to job metadata");
+										}
+
+									if (cached_results_p)
+										{
+											json_decref (cached_results_p);
+										}
+
+									mongoc_cursor_destroy (cursor_p);
+								}		/* if (cursor_p) */
+							else
+								{
+									PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, pipeline_p, "Failed to run aggregation in \"%s\" -> \"%s\"", data_p -> gtsd_database_s, data_p -> gtsd_collection_s);
+								}
+
+							bson_destroy (pipeline_p);
+						}		/* if (pipeline_p) */
+					else
+						{
+							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to create aggregation pipeline");
+						}
+
+					FreeCopiedString (group_key_s);
+				}		/* if (group_key_s) */
+
+			bson_destroy (query_p);
+		}		/* if (query_p) */
+
+	SetServiceJobStatus (job_p, status);
+}
+
+
+/*
+ * Convert a { _id: <cluster id>, genes: <count> } document from the
+ * summary aggregation into { cluster_id: <cluster id>, genes: <count> }.
+ * The genes without a cluster are grouped under a null cluster id.
+ */
+static json_t *GetClusterSummary (const bson_t *document_p, char **title_ss)
+{
+	json_t *summary_p = NULL;
+	bson_iter_t iter;
+	json_int_t num_genes = 0;
+
+	if (bson_iter_init_find (&iter, document_p, "genes"))
+		{
+			num_genes = (json_int_t) bson_iter_as_int64 (&iter);
+		}
+
+	if (bson_iter_init_find (&iter, document_p, "_id") && BSON_ITER_HOLDS_NUMBER (&iter))
+		{
+			const uint32 cluster_id = (uint32) bson_iter_as_int64 (&iter);
+
+			summary_p = AllocateClusterSummary (&cluster_id, num_genes, title_ss);
+		}
+	else
+		{
+			summary_p = AllocateClusterSummary (NULL, num_genes, title_ss);
+		}
+
+	if (!summary_p)
+		{
+			PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to convert cluster summary to json");
+		}
+
+	return summary_p;
+}
+
+
+/*
+ * Create { cluster_id: <cluster id>, genes: <count> } along with its title.
+ * If cluster_id_p is NULL, then this is the summary for the genes
+ * without a cluster.
+ */
+static json_t *AllocateClusterSummary (const uint32 *cluster_id_p, const json_int_t num_genes, char **title_ss)
+{
+	json_t *summary_p = json_object ();
+
+	if (summary_p)
+		{
+			json_t *cluster_p = NULL;
+
+			if (cluster_id_p)
+				{
+					char *id_s = ConvertUnsignedIntegerToString (*cluster_id_p);
+
+					cluster_p = json_integer (*cluster_id_p);
+
+					if (id_s)
+						{
+							*title_ss = ConcatenateStrings ("Cluster ", id_s);
+							FreeCopiedString (id_s);
+						}
+				}
+			else
+				{
+					cluster_p = json_null ();
+					*title_ss = EasyCopyToNewString ("Unclustered");
+				}
+
+			if (cluster_p && (json_object_set_new (summary_p, GTS_CLUSTER_ID_S, cluster_p) == 0))
+				{
+					if (SetJSONInteger (summary_p, "genes", num_genes))
+						{
+							return summary_p;
+						}
+				}
+
+			json_decref (summary_p);
+		}		/* if (summary_p) */
+
+	return NULL;
+}
+
+
+/*
+ * Add a cluster summary to the job's results and, if *cached_results_pp
+ * isn't NULL, to the results that will be cached too.
+ */
+static bool AddClusterSummaryToServiceJob (ServiceJob *job_p, json_t *summary_p, const char *title_s, json_t **cached_results_pp)
+{
+	bool success_flag = false;
+	json_t *resource_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, title_s, summary_p);
+
+	if (resource_p)
+		{
+			if (cached_results_pp && *cached_results_pp)
+				{
+					if (json_array_append (*cached_results_pp, resource_p) != 0)
+						{
+							json_decref (*cached_results_pp);
+							*cached_results_pp = NULL;
+						}
+				}
+
+			if (AddResultToServiceJob (job_p, resource_p))
+				{
+					success_flag = true;
+				}
+			else
+				{
+					PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, resource_p, "Failed to add cluster summary to service job");
+					json_decref (resource_p);
+				}
+		}
+	else
+		{
+			PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, summary_p, "Failed to create resource for cluster summary");
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Get the same summary as DoSummary () from the local gene cluster index.
+ * The index only has the genes that are in a cluster, so unlike the
+ * database there is never an "Unclustered" entry.
+ */
+static void DoIndexSummary (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const uint32 * const cluster_p, SearchTimer *timer_p, GeneTreesServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED;
+	const GeneClusterIndex *index_p = data_p -> gtsd_gene_index_p;
+	uint64 phase_start_ns = GetSearchTime ();
+	size_t num_clusters = 0;
+	size_t num_added = 0;
+	json_int_t num_genes = 0;
+	bool success_flag = true;
+
+	if (gene_s || genes_p)
+		{
+			/* Any single Gene ID is already in genes_p */
+			const uint32 max_genes = genes_p ? bson_count_keys (genes_p) : 1;
+			IndexedGene *found_genes_p = (IndexedGene *) AllocMemoryArray (max_genes, sizeof (IndexedGene));
+
+			if (found_genes_p)
+				{
+					size_t num_found = 0;
+					size_t i = 0;
+
+					if (genes_p)
+						{
+							bson_iter_t iter;
+
+							if (bson_iter_init (&iter, genes_p))
+								{
+									while (bson_iter_next (&iter))
+										{
+											if (BSON_ITER_HOLDS_UTF8 (&iter))
+												{
+													AddIndexedGene (index_p, bson_iter_utf8 (&iter, NULL), cluster_p, found_genes_p, &num_found);
+												}
+										}
+								}
+						}
+					else
+						{
+							AddIndexedGene (index_p, gene_s, cluster_p, found_genes_p, &num_found);
+						}
+
+					phase_start_ns = AddSearchPhaseTime (timer_p, SP_QUERY, phase_start_ns);
+
+					/*
+					 * Group the genes by cluster, only counting any that were
+					 * asked for more than once a single time as the database does.
+					 */
+					qsort (found_genes_p, num_found, sizeof (IndexedGene), CompareIndexedGenes);
+
+					while (i < num_found)
+						{
+							const uint32 cluster_id = found_genes_p [i].ig_cluster_id;
+							const char *previous_gene_s = NULL;
+							json_int_t cluster_size = 0;
+
+							while ((i < num_found) && (found_genes_p [i].ig_cluster_id == cluster_id))
+								{
+									if ((!previous_gene_s) || (strcmp (previous_gene_s, found_genes_p [i].ig_gene_s) != 0))
+										{
+											previous_gene_s = found_genes_p [i].ig_gene_s;
+											++ cluster_size;
+										}
+
+									++ i;
+								}
+
+							++ num_clusters;
+							num_genes += cluster_size;
+
+							if (AddIndexedClusterSummary (job_p, cluster_id, cluster_size, timer_p, &phase_start_ns))
+								{
+									++ num_added;
+								}
+						}		/* while (i < num_found) */
+
+					FreeMemory (found_genes_p);
+				}		/* if (found_genes_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " UINT32_FMT " indexed genes", max_genes);
+					success_flag = false;
+				}
+		}
+	else
+		{
+			const size_t cluster_size = GetGeneClusterIndexClusterSize (index_p, *cluster_p, NULL);
+
+			phase_start_ns = AddSearchPhaseTime (timer_p, SP_QUERY, phase_start_ns);
+
+			if (cluster_size > 0)
+				{
+					++ num_clusters;
+					num_genes = (json_int_t) cluster_size;
+
+					if (AddIndexedClusterSummary (job_p, *cluster_p, num_genes, timer_p, &phase_start_ns))
+						{
+							++ num_added;
+						}
+				}
+		}
+
+	if (success_flag)
+		{
+			if (num_added == num_clusters)
+				{
+					status = OS_SUCCEEDED;
+				}
+			else if (num_added > 0)
+				{
+					status = OS_PARTIALLY_SUCCEEDED;
+				}
+
+			if (!AddSearchMetadata (job_p, "genes", json_integer (num_genes)))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add number of genes to job metadata");
+				}
+		}
+
+	SetServiceJobStatus (job_p, status);
+}
+
+
+static void AddIndexedGene (const GeneClusterIndex *index_p, const char *gene_s, const uint32 * const cluster_p, IndexedGene *genes_p, size_t *num_genes_p)
+{
+	uint32_t cluster_id;
+
+	if (GetGeneClusterFromIndex (index_p, gene_s, &cluster_id))
+		{
+			if ((!cluster_p) || (*cluster_p == cluster_id))
+				{
+					IndexedGene *gene_p = genes_p + (*num_genes_p);
+
+					gene_p -> ig_cluster_id = cluster_id;
+					gene_p -> ig_gene_s = gene_s;
+
+					++ (*num_genes_p);
+				}
+		}
+}
+
+
+/*
+ * Sort by Cluster ID and then Gene ID so that any repeated
+ * genes are next to each other.
+ */
+static int CompareIndexedGenes (const void *v0_p, const void *v1_p)
+{
+	const IndexedGene *gene0_p = (const IndexedGene *) v0_p;
+	const IndexedGene *gene1_p = (const IndexedGene *) v1_p;
+
+	if (gene0_p -> ig_cluster_id < gene1_p -> ig_cluster_id)
+		{
+			return -1;
+		}
+	else if (gene0_p -> ig_cluster_id > gene1_p -> ig_cluster_id)
+		{
+			return 1;
+		}
+
+	return strcmp (gene0_p -> ig_gene_s, gene1_p -> ig_gene_s);
+}
+
+
+static bool AddIndexedClusterSummary (ServiceJob *job_p, const uint32 cluster_id, const json_int_t num_genes, SearchTimer *timer_p, uint64 *phase_start_ns_p)
+{
+	bool success_flag = false;
+	char *title_s = NULL;
+	json_t *summary_p = AllocateClusterSummary (&cluster_id, num_genes, &title_s);
+
+	*phase_start_ns_p = AddSearchPhaseTime (timer_p, SP_CONVERT, *phase_start_ns_p);
+
+	if (summary_p)
+		{
+			success_flag = AddClusterSummaryToServiceJob (job_p, summary_p, title_s, NULL);
+			json_decref (summary_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create summary for cluster " UINT32_FMT, cluster_id);
+		}
+
+	if (title_s)
+		{
+			FreeCopiedString (title_s);
+		}
+
+	*phase_start_ns_p = AddSearchPhaseTime (timer_p, SP_WRAP, *phase_start_ns_p);
+
+	return success_flag;
+}
+
+
+static bool AddSearchHit (const bson_t *document_p, void *data_p)
+{
+	SearchHits *hits_p = (SearchHits *) data_p;
+	const size_t i = hits_p -> sh_num_hits;
+	json_t *entry_p = NULL;
+	bson_t *unpacked_doc_p = NULL;
+
+	/* The time since the previous hit was spent waiting on the cursor */
+	hits_p -> sh_phase_start_ns = AddSearchPhaseTime (hits_p -> sh_timer_p, SP_QUERY, hits_p -> sh_phase_start_ns);
+
+	/*
+	 * We ask for one more hit than the limit so that we know whether
+	 * there is another page. If there is, it starts at this hit.
+	 */
+	if ((hits_p -> sh_limit > 0) && (i == hits_p -> sh_limit))
+		{
+			const char *hit_gene_s = GetHitGeneId (document_p);
+
+			if (hit_gene_s)
+				{
+					hits_p -> sh_next_page_token_s = EasyCopyToNewString (hit_gene_s);
+				}
+
+			if (! (hits_p -> sh_next_page_token_s))
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to get next page token");
+
+					/* Mark the results as partial */
+					++ (hits_p -> sh_num_hits);
+				}
+
+			return true;
+		}
+
+	/*
+	 * Any packed sequences or alignments are only unpacked here, so
+	 * those that aren't asked for in the fields are never unpacked
+	 */
+	unpacked_doc_p = GetUnpackedDocument (document_p);
+
+	if (unpacked_doc_p)
+		{
+			entry_p = ConvertBSONToJSON (unpacked_doc_p);
+			bson_destroy (unpacked_doc_p);
+		}
+	else
+		{
+			entry_p = ConvertBSONToJSON (document_p);
+		}
+
+	hits_p -> sh_phase_start_ns = AddSearchPhaseTime (hits_p -> sh_timer_p, SP_CONVERT, hits_p -> sh_phase_start_ns);
+
+	++ (hits_p -> sh_num_hits);
+
+	if (entry_p)
+		{
+			json_t *resource_p = NULL;
+			const char *title_s = NULL;
+			const char *prefix_s = hits_p -> sh_query_s;
+			size_t index = i;
+
+			if (hits_p -> sh_tree_leaves > 0)
+				{
+					TrimHitGeneTree (entry_p, document_p, hits_p);
+					hits_p -> sh_phase_start_ns = AddSearchPhaseTime (hits_p -> sh_timer_p, SP_CONVERT, hits_p -> sh_phase_start_ns);
+				}
+
+			if (hits_p -> sh_group_by_gene_flag)
+				{
+					/*
+					 * The hits are sorted by Gene ID, so start a new group
+					 * whenever it changes
+					 */
+					const char *hit_gene_s = GetHitGeneId (document_p);
+
+					if (hit_gene_s)
+						{
+							if (! ((hits_p -> sh_current_gene_s) && (strcmp (hits_p -> sh_current_gene_s, hit_gene_s) == 0)))
+								{
+									const size_t gene_size = strlen (hit_gene_s) + 1;
+
+									if (ReserveSearchHitsBuffer (& (hits_p -> sh_current_gene_s), & (hits_p -> sh_current_gene_size), gene_size))
+										{
+											memcpy (hits_p -> sh_current_gene_s, hit_gene_s, gene_size);
+										}
+									else if (hits_p -> sh_current_gene_s)
+										{
+											/* Fall back to the query's prefix rather than the previous gene's */
+											FreeMemory (hits_p -> sh_current_gene_s);
+											hits_p -> sh_current_gene_s = NULL;
+											hits_p -> sh_current_gene_size = 0;
+										}
+
+									hits_p -> sh_gene_hit_index = 0;
+									++ (hits_p -> sh_num_genes);
+								}
+
+							if (hits_p -> sh_current_gene_s)
+								{
+									prefix_s = hits_p -> sh_current_gene_s;
+									index = hits_p -> sh_gene_hit_index;
+								}
+
+							++ (hits_p -> sh_gene_hit_index);
+						}
+				}
+
+			if (prefix_s)
+				{
+					/* The prefix, " - " and up to 20 digits for the index */
+					const size_t title_size = strlen (prefix_s) + 24;
+
+					if (ReserveSearchHitsBuffer (& (hits_p -> sh_title_s), & (hits_p -> sh_title_size), title_size))
+						{
+							if (snprintf (hits_p -> sh_title_s, hits_p -> sh_title_size, "%s - " SIZET_FMT, prefix_s, index) > 0)
+								{
+									title_s = hits_p -> sh_title_s;
+								}
+						}
+				}
+
+			resource_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, title_s ? title_s : prefix_s, entry_p);
+
+			if (resource_p)
+				{
+					/*
+					 * The ServiceJob takes ownership of resource_p so if we are
+					 * caching the results, get our own reference to it first.
+					 */
+					if (hits_p -> sh_cached_results_p)
+						{
+							if (json_array_append (hits_p -> sh_cached_results_p, resource_p) != 0)
+								{
+									json_decref (hits_p -> sh_cached_results_p);
+									hits_p -> sh_cached_results_p = NULL;
+								}
+						}
+
+					if (AddResultToServiceJob (hits_p -> sh_job_p, resource_p))
+						{
+							++ (hits_p -> sh_num_added);
+						}
+					else
+						{
+							AddGeneralErrorMessageToServiceJob (hits_p -> sh_job_p, "Failed to add one or more hits to result");
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, resource_p, "Failed to add result " SIZET_FMT " for query \"%s\", %d to service job", i, hits_p -> sh_gene_s ? hits_p -> sh_gene_s : "NULL", hits_p -> sh_cluster_p ? * (hits_p -> sh_cluster_p) : -1);
+							json_decref (resource_p);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create resource for result " SIZET_FMT " to query \"%s\": \%d", i, hits_p -> sh_gene_s ? hits_p -> sh_gene_s : "NULL", hits_p -> sh_cluster_p ? * (hits_p -> sh_cluster_p) : -1);
+				}
+
+			/*
+			 * The resource takes its own reference to the hit so we can
+			 * release ours straight away.
+			 */
+			json_decref (entry_p);
+		}		/* if (entry_p) */
+	else
+		{
+			PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to convert result " SIZET_FMT " to json", i);
+		}
+
+	hits_p -> sh_phase_start_ns = AddSearchPhaseTime (hits_p -> sh_timer_p, SP_WRAP, hits_p -> sh_phase_start_ns);
+
+	/*
+	 * Keep going even if this hit failed, the job status will show
+	 * that the results are partial.
+	 */
+	return true;
+}
+
+
+/*
+ * Make sure that a buffer that is reused between hits can hold at least
+ * required_size bytes. Since the titles for the hits of a search are
+ * all of a similar length, this only allocates a handful of times per
+ * search rather than once for every hit. The buffer's previous contents
+ * are not kept.
+ */
+static bool ReserveSearchHitsBuffer (char **buffer_ss, size_t *buffer_size_p, const size_t required_size)
+{
+	if (*buffer_size_p < required_size)
+		{
+			size_t new_size = (*buffer_size_p > 0) ? *buffer_size_p : 64;
+			char *buffer_s = NULL;
+
+			while (new_size < required_size)
+				{
+					new_size <<= 1;
+				}
+
+			buffer_s = (char *) AllocMemory (new_size);
+
+			if (!buffer_s)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for search hits", new_size);
+					return false;
+				}
+
+			if (*buffer_ss)
+				{
+					FreeMemory (*buffer_ss);
+				}
+
+			*buffer_ss = buffer_s;
+			*buffer_size_p = new_size;
+		}
+
+	return true;
+}
+
+
+/*
+ * Replace a hit's gene tree with the subtree around the hit's gene. If
+ * the tree can't be parsed or the gene isn't in it, the whole tree is kept.
+ */
+static void TrimHitGeneTree (json_t *entry_p, const bson_t *document_p, const SearchHits *hits_p)
+{
+	const char *newick_s = json_string_value (json_object_get (entry_p, GTS_GENETREE_S));
+
+	if (newick_s)
+		{
+			const char *hit_gene_s = GetHitGeneId (document_p);
+
+			if (hit_gene_s)
+				{
+					bson_iter_t iter;
+					uint32 cluster_id = 0;
+					const uint32 *cluster_p = NULL;
+					char *subtree_s = NULL;
+
+					if (bson_iter_init_find (&iter, document_p, GTS_CLUSTER_ID_S) && BSON_ITER_HOLDS_NUMBER (&iter))
+						{
+							cluster_id = (uint32) bson_iter_as_int64 (&iter);
+							cluster_p = &cluster_id;
+						}
+
+					subtree_s = GetCachedGeneSubtree (hits_p -> sh_tree_cache_p, cluster_p, newick_s, hit_gene_s, hits_p -> sh_tree_leaves);
+
+					if (subtree_s)
+						{
+							if (json_object_set_new (entry_p, GTS_GENETREE_S, json_string (subtree_s)) != 0)
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set subtree for \"%s\"", hit_gene_s);
+								}
+
+							FreeMemory (subtree_s);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "No subtree for \"%s\", returning the whole tree", hit_gene_s);
+						}
+				}
+		}
+}
+
+
+/*
+ * Get the find options for a search. If fields_s is not empty it is
+ * converted into a projection and if sort_by_gene_flag is true, the hits
+ * are sorted by Gene ID. If subtree_flag is true, the gene trees are going
+ * to be trimmed, so the projection keeps what is needed for that. If limit is greater than 0, one more hit than this
+ * is asked for so that we can tell if there is another page. If none of
+ * these are needed, *opts_pp is set to NULL.
+ */
+static bool GetSearchOptions (const char *fields_s, const bool sort_by_gene_flag, const bool subtree_flag, const uint32 limit, bson_t **opts_pp, ServiceJob *job_p)
+{
+	bool success_flag = true;
+
+	*opts_pp = NULL;
+
+	if (sort_by_gene_flag || (limit > 0) || !IsStringEmpty (fields_s))
+		{
+			bson_t *opts_p = bson_new ();
+
+			if (opts_p)
+				{
+					if (!IsStringEmpty (fields_s))
+						{
+							success_flag = AddProjection (opts_p, fields_s, sort_by_gene_flag, subtree_flag, job_p);
+						}
+
+					if (success_flag && sort_by_gene_flag)
+						{
+							bson_t sort;
+
+							if (BSON_APPEND_DOCUMENT_BEGIN (opts_p, "sort", &sort))
+								{
+									if (!BSON_APPEND_INT32 (&sort, GTS_GENE_ID_S, 1))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to sort", GTS_GENE_ID_S);
+											success_flag = false;
+										}
+
+									if (!bson_append_document_end (opts_p, &sort))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to end sort document");
+											success_flag = false;
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to begin sort document");
+									success_flag = false;
+								}
+						}
+
+					if (success_flag && (limit > 0))
+						{
+							if (!BSON_APPEND_INT64 (opts_p, "limit", ((int64) limit) + 1))
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add limit " UINT32_FMT, limit);
+									success_flag = false;
+								}
+						}
+
+					if (success_flag && !bson_empty (opts_p))
+						{
+							*opts_pp = opts_p;
+						}
+					else
+						{
+							bson_destroy (opts_p);
+						}
+
+				}		/* if (opts_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate search options");
+					success_flag = false;
+				}
+
+		}		/* if (sort_by_gene_flag || (limit > 0) || !IsStringEmpty (fields_s)) */
+
+	return success_flag;
+}
+
+
+/*
+ * Convert a comma-separated list of field names into a projection
+ * so that only the requested fields are sent back by the server.
+ * When sorting by gene, the Gene ID is always included. When trimming
+ * the gene trees, the Gene and Cluster IDs are included along with them.
+ */
+static bool AddProjection (bson_t *opts_p, const char *fields_s, const bool sort_by_gene_flag, const bool subtree_flag, ServiceJob *job_p)
+{
+	bool success_flag = true;
+	bson_t projection;
+
+	if (BSON_APPEND_DOCUMENT_BEGIN (opts_p, "projection", &projection))
+		{
+			const char * const separators_s = ", \t\r\n";
+			const char *start_s = fields_s;
+			size_t num_fields = 0;
+			bool gene_flag = false;
+			bool cluster_flag = false;
+			bool tree_flag = false;
+
+			while ((*start_s != '\0') && success_flag)
+				{
+					size_t length;
+
+					start_s += strspn (start_s, separators_s);
+					length = strcspn (start_s, separators_s);
+
+					if (length > 0)
+						{
+							const char *field_s = GetProjectableField (start_s, length);
+
+							if (field_s)
+								{
+									if (BSON_APPEND_INT32 (&projection, field_s, 1))
+										{
+											++ num_fields;
+
+											if (field_s == GTS_GENE_ID_S)
+												{
+													gene_flag = true;
+												}
+											else if (field_s == GTS_CLUSTER_ID_S)
+												{
+													cluster_flag = true;
+												}
+											else if (field_s == GTS_GENETREE_S)
+												{
+													tree_flag = true;
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to projection", field_s);
+											success_flag = false;
+										}
+								}
+							else
+								{
+									AddParameterErrorMessageToServiceJob (job_p, S_FIELDS.npt_name_s, S_FIELDS.npt_type, "Unknown field requested");
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Unknown field in \"%s\"", fields_s);
+									success_flag = false;
+								}
+
+							start_s += length;
+						}		/* if (length > 0) */
+
+				}		/* while ((*start_s != '\0') && success_flag) */
+
+			if (success_flag && (sort_by_gene_flag || (subtree_flag && tree_flag)) && (num_fields > 0) && !gene_flag)
+				{
+					if (!BSON_APPEND_INT32 (&projection, GTS_GENE_ID_S, 1))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to projection", GTS_GENE_ID_S);
+							success_flag = false;
+						}
+				}
+
+			/* The Cluster ID is what the parsed trees are cached by */
+			if (success_flag && subtree_flag && tree_flag && !cluster_flag)
+				{
+					if (!BSON_APPEND_INT32 (&projection, GTS_CLUSTER_ID_S, 1))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to projection", GTS_CLUSTER_ID_S);
+							success_flag = false;
+						}
+				}
+
+			if (!bson_append_document_end (opts_p, &projection))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to end projection document for \"%s\"", fields_s);
+					success_flag = false;
+				}
+
+		}		/* if (BSON_APPEND_DOCUMENT_BEGIN (opts_p, "projection", &projection)) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to begin projection document for \"%s\"", fields_s);
+			success_flag = false;
+		}
+
+	return success_flag;
+}
+
+
+static const char *GetProjectableField (const char *field_s, const size_t length)
+{
+	const char * const * const *field_ppp = S_PROJECTABLE_FIELDS_SS;
+
+	while (*field_ppp)
+		{
+			const char *projectable_s = **field_ppp;
+
+			if ((strncmp (projectable_s, field_s, length) == 0) && (* (projectable_s + length) == '\0'))
+				{
+					return projectable_s;
+				}
+
+			++ field_ppp;
+		}
+
+	return NULL;
+}
+
+
+
+
+/*
+ * Split a list of Gene IDs separated by new lines, commas or
+ * whitespace into a BSON array suitable for an $in query.
+ */
+static bson_t *GetGeneIdsArray (const char *genes_s, const char *gene_s, uint32 *num_genes_p)
+{
+	bson_t *genes_p = bson_new ();
+
+	if (genes_p)
+		{
+			const char * const separators_s = ", ;\t\r\n";
+			const char *start_s = genes_s;
+			uint32 num_genes = 0;
+			bool success_flag = true;
+
+			if (gene_s)
+				{
+					if (BSON_APPEND_UTF8 (genes_p, "0", gene_s))
+						{
+							++ num_genes;
+						}
+					else
+						{
+							success_flag = false;
+						}
+				}
+
+			while ((*start_s != '\0') && success_flag)
+				{
+					size_t length;
+
+					start_s += strspn (start_s, separators_s);
+					length = strcspn (start_s, separators_s);
+
+					if (length > 0)
+						{
+							char index_buffer [16];
+							const char *index_s = NULL;
+							const size_t index_length = bson_uint32_to_string (num_genes, &index_s, index_buffer, sizeof (index_buffer));
+
+							if (bson_append_utf8 (genes_p, index_s, (int) index_length, start_s, (int) length))
+								{
+									++ num_genes;
+								}
+							else
+								{
+									success_flag = false;
+								}
+
+							start_s += length;
+						}		/* if (length > 0) */
+
+				}		/* while ((*start_s != '\0') && success_flag) */
+
+			if (success_flag)
+				{
+					*num_genes_p = num_genes;
+					return genes_p;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add Gene ID " UINT32_FMT " to list", num_genes);
+				}
+
+			bson_destroy (genes_p);
+		}		/* if (genes_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate list of Gene IDs");
+		}
+
+	return NULL;
+}
+
+
+static const char *GetHitGeneId (const bson_t *document_p)
+{
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, GTS_GENE_ID_S))
+		{
+			if (BSON_ITER_HOLDS_UTF8 (&iter))
+				{
+					return bson_iter_utf8 (&iter, NULL);
+				}
+		}
+
+	return NULL;
+}
+
+
+
+/*
+ * Build the key used to store the results of a search in the
+ * cache. Any of the values can be NULL and the fields are separated
+ * by a character that won't appear in any of them.
+ */
+static char *GetSearchCacheKey (const char *gene_s, const char *genes_s, const uint32 *cluster_p, const char *fields_s, const bool summary_flag, const uint32 tree_leaves, const bool homologs_flag)
+{
+	char *key_s = NULL;
+	char *cluster_s = NULL;
+	char *leaves_s = NULL;
+
+	if (cluster_p)
+		{
+			cluster_s = ConvertUnsignedIntegerToString (*cluster_p);
+
+			if (!cluster_s)
 				{
-					if (!BSON_APPEND_INT32 (query_p, GTS_CLUSTER_ID_S, *cluster_p))
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to convert " UINT32_FMT " to string", *cluster_p);
+					return NULL;
+				}
+		}
+
+	if (tree_leaves > 0)
+		{
+			leaves_s = ConvertUnsignedIntegerToString (tree_leaves);
+
+			if (!leaves_s)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to convert " UINT32_FMT " to string", tree_leaves);
+
+					if (cluster_s)
 						{
-							success_flag = false;							
-							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to add \"%s\": " UINT32_FMT, GTS_CLUSTER_ID_S, *cluster_p);
+							FreeCopiedString (cluster_s);
 						}
+
+					return NULL;
 				}
+		}
 
-			if (success_flag)
+	key_s = ConcatenateVarargsStrings ("g=", gene_s ? gene_s : "",
+																		 "\x1f" "G=", genes_s ? genes_s : "",
+																		 "\x1f" "c=", cluster_s ? cluster_s : "",
+																		 "\x1f" "f=", fields_s ? fields_s : "",
+																		 "\x1f" "s=", summary_flag ? "1" : "",
+																		 "\x1f" "t=", leaves_s ? leaves_s : "",
+																		 "\x1f" "h=", homologs_flag ? "1" : "",
+																		 NULL);
+
+	if (!key_s)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to make search cache key");
+		}
+
+	if (cluster_s)
+		{
+			FreeCopiedString (cluster_s);
+		}
+
+	if (leaves_s)
+		{
+			FreeCopiedString (leaves_s);
+		}
+
+	return key_s;
+}
+
+
+static bool AddCachedResultsToServiceJob (ServiceJob *job_p, const char *cache_key_s, GeneTreesServiceData *data_p)
+{
+	bool success_flag = false;
+	json_t *results_p = GetCachedSearchResults (data_p -> gtsd_cache_p, cache_key_s);
+
+	if (results_p)
+		{
+			const size_t num_results = json_array_size (results_p);
+			size_t i;
+
+			success_flag = true;
+
+			for (i = 0; i < num_results; ++ i)
 				{
-					json_t *results_p = GetAllMongoResultsAsJSON (data_p -> gtsd_mongo_p, query_p, NULL);
+					json_t *resource_p = json_array_get (results_p, i);
+
+					/* The ServiceJob takes ownership of this reference */
+					json_incref (resource_p);
 
-					if (results_p)
+					if (!AddResultToServiceJob (job_p, resource_p))
 						{
-							const size_t num_results = json_array_size (results_p);
-							size_t i = 0;
-							size_t num_added = 0;
-							char *query_s = NULL;
-							
-							if (cluster_p)
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, resource_p, "Failed to add cached result " SIZET_FMT " to service job", i);
+							json_decref (resource_p);
+							success_flag = false;
+						}
+				}
+
+			SetServiceJobStatus (job_p, success_flag ? OS_SUCCEEDED : OS_PARTIALLY_SUCCEEDED);
+
+			/*
+			 * We've added something to the job, so there's no
+			 * need to run the search again.
+			 */
+			success_flag = true;
+
+			json_decref (results_p);
+		}		/* if (results_p) */
+
+	return success_flag;
+}
+
+
+
+/*
+ * Find the orthologs and paralogs of a gene from its cluster's gene tree.
+ * Only the gene's own document is fetched from the database and its tree
+ * is only parsed if it isn't already in the GeneTreeCache.
+ */
+static void DoHomologSearch (ServiceJob *job_p, const char * const gene_s, const uint32 * const cluster_p, const bson_t *opts_p, const char *cache_key_s, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *query_p = GetSearchQuery (gene_s, NULL, NULL, cluster_p, NULL);
+
+	if (query_p)
+		{
+			uint64 phase_start_ns = GetSearchTime ();
+
+			if (FindMatchingMongoDocumentsByBSON (mongo_p, query_p, opts_p))
+				{
+					HomologSearch search;
+
+					search.hs_job_p = job_p;
+					search.hs_data_p = data_p;
+					search.hs_cached_results_p = cache_key_s ? json_array () : NULL;
+					search.hs_timer_p = timer_p;
+					search.hs_phase_start_ns = phase_start_ns;
+					search.hs_num_hits = 0;
+					search.hs_num_added = 0;
+
+					if (!IterateOverMongoResults (mongo_p, AddGeneHomologs, &search))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to iterate over results for homologs of \"%s\"", gene_s);
+						}
+
+					AddSearchPhaseTime (timer_p, SP_QUERY, search.hs_phase_start_ns);
+
+					if (search.hs_num_added == search.hs_num_hits)
+						{
+							status = OS_SUCCEEDED;
+
+							if (search.hs_cached_results_p)
 								{
-									char *cluster_s = ConvertUnsignedIntegerToString (*cluster_p);
-									
-									if (cluster_s)
-										{
-											if (gene_s)
-												{
-													query_s = ConcatenateVarargsStrings (gene_s, " - ", cluster_s, NULL);
-													FreeCopiedString (cluster_s);
-												} 
-											else
-												{
-													query_s = cluster_s;
-												}
-										}
-									else if (gene_s)
+									if (!AddSearchResultsToCache (data_p -> gtsd_cache_p, cache_key_s, search.hs_cached_results_p))
 										{
-											query_s = (char *) gene_s;
+											PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Did not cache results for \"%s\"", cache_key_s);
 										}
 								}
+						}
+					else if (search.hs_num_added > 0)
+						{
+							status = OS_PARTIALLY_SUCCEEDED;
+						}
+					else
+						{
+							status = OS_FAILED;
+						}
+
+					if (search.hs_cached_results_p)
+						{
+							json_decref (search.hs_cached_results_p);
+						}
+
+				}		/* if (FindMatchingMongoDocumentsByBSON (mongo_p, query_p, opts_p)) */
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to run query in \"%s\" -> \"%s\"", data_p -> gtsd_database_s, data_p -> gtsd_collection_s);
+				}
+
+			bson_destroy (query_p);
+		}		/* if (query_p) */
+
+	SetServiceJobStatus (job_p, status);
+}
 
-							while (i < num_results)
+
+/*
+ * Add { gene_id: <gene id>, cluster_id: <cluster id>, homologs: [ ... ] }
+ * for a gene's document.
+ */
+static bool AddGeneHomologs (const bson_t *document_p, void *data_p)
+{
+	HomologSearch *search_p = (HomologSearch *) data_p;
+	ServiceJob *job_p = search_p -> hs_job_p;
+	const char *gene_s = GetHitGeneId (document_p);
+	const char *newick_s = NULL;
+	const uint32 *cluster_p = NULL;
+	uint32 cluster_id = 0;
+	bson_iter_t iter;
+
+	search_p -> hs_phase_start_ns = AddSearchPhaseTime (search_p -> hs_timer_p, SP_QUERY, search_p -> hs_phase_start_ns);
+	++ (search_p -> hs_num_hits);
+
+	if (bson_iter_init_find (&iter, document_p, GTS_GENETREE_S) && BSON_ITER_HOLDS_UTF8 (&iter))
+		{
+			newick_s = bson_iter_utf8 (&iter, NULL);
+		}
+
+	if (bson_iter_init_find (&iter, document_p, GTS_CLUSTER_ID_S) && BSON_ITER_HOLDS_NUMBER (&iter))
+		{
+			cluster_id = (uint32) bson_iter_as_int64 (&iter);
+			cluster_p = &cluster_id;
+		}
+
+	if (gene_s && newick_s)
+		{
+			GeneTreeCache *cache_p = search_p -> hs_data_p -> gtsd_tree_cache_p;
+			GeneTree *tree_p = GetCachedGeneTree (cache_p, cluster_p, newick_s);
+
+			if (tree_p)
+				{
+					const uint32 leaf = FindGeneTreeLeaf (tree_p, gene_s);
+
+					if (leaf != GT_NO_NODE)
+						{
+							json_t *homologs_p = GetGeneTreeHomologs (tree_p, leaf, search_p -> hs_data_p -> gtsd_species_prefix_length);
+
+							if (homologs_p)
 								{
-									json_t *entry_p = json_array_get (results_p, i);
-									json_t *resource_p = NULL;
-									char *index_s = ConvertSizeTToString (i);
-									char *title_s = NULL;
+									json_t *result_p = json_object ();
 
-									if (query_s)
+									if (result_p)
 										{
-											if (index_s)
+											if ((json_object_set_new (result_p, GTS_GENE_ID_S, json_string (gene_s)) == 0) &&
+												((!cluster_p) || (json_object_set_new (result_p, GTS_CLUSTER_ID_S, json_integer (cluster_id)) == 0)) &&
+												(json_object_set (result_p, "homologs", homologs_p) == 0))
 												{
-													title_s = ConcatenateVarargsStrings (query_s, " - ", index_s, NULL);
-													FreeCopiedString (index_s);
+													json_t *resource_p = NULL;
+
+													search_p -> hs_phase_start_ns = AddSearchPhaseTime (search_p -> hs_timer_p, SP_CONVERT, search_p -> hs_phase_start_ns);
+
+													resource_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, gene_s, result_p);
+
+													if (resource_p)
+														{
+															if (search_p -> hs_cached_results_p)
+																{
+																	if (json_array_append (search_p -> hs_cached_results_p, resource_p) != 0)
+																		{
+																			json_decref (search_p -> hs_cached_results_p);
+																			search_p -> hs_cached_results_p = NULL;
+																		}
+																}
+
+															if (AddResultToServiceJob (job_p, resource_p))
+																{
+																	++ (search_p -> hs_num_added);
+																}
+															else
+																{
+																	PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, resource_p, "Failed to add homologs of \"%s\" to service job", gene_s);
+																	json_decref (resource_p);
+																}
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create resource for homologs of \"%s\"", gene_s);
+														}
 												}
 											else
 												{
-													PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to convert " SIZET_FMT " to string", i);
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to fill in homologs of \"%s\"", gene_s);
 												}
 
-										}
+											json_decref (result_p);
+										}		/* if (result_p) */
+
+									json_decref (homologs_p);
+								}		/* if (homologs_p) */
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get homologs of \"%s\"", gene_s);
+								}
+						}
+					else
+						{
+							AddGeneralErrorMessageToServiceJob (job_p, "The gene is not in its cluster's gene tree");
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "\"%s\" is not in the gene tree for cluster " UINT32_FMT, gene_s, cluster_id);
+						}
+
+					ReleaseCachedGeneTree (cache_p, tree_p);
+				}		/* if (tree_p) */
+			else
+				{
+					AddGeneralErrorMessageToServiceJob (job_p, "Failed to parse the gene's tree");
+				}
+		}		/* if (gene_s && newick_s) */
+	else
+		{
+			AddGeneralErrorMessageToServiceJob (job_p, "The gene doesn't have a gene tree");
+			PrintBSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, document_p, "No gene tree for homologs");
+		}
+
+	search_p -> hs_phase_start_ns = AddSearchPhaseTime (search_p -> hs_timer_p, SP_WRAP, search_p -> hs_phase_start_ns);
+
+	return true;
+}
+
+
+/*
+ * Write every hit to a file in the export directory as it comes back
+ * from the database. Nothing is added to the job apart from a single
+ * resource pointing at the file, so the hits are never built up in
+ * memory however many of them there are.
+ */
+static void DoExport (ServiceJob *job_p, const char * const gene_s, const bson_t *genes_p, const char *prefix_s, const uint32 * const cluster_p, const uint32 * const last_cluster_p, const bson_t *opts_p, const GeneExportFormat format, MongoTool *mongo_p, SearchTimer *timer_p, GeneTreesServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *query_p = GetSearchQuery (gene_s, genes_p, prefix_s, last_cluster_p ? NULL : cluster_p, NULL);
+
+	if (query_p)
+		{
+			if ((!last_cluster_p) || AddClusterRangeQuery (query_p, cluster_p, *last_cluster_p))
+				{
+					GeneExport *export_p = NULL;
+
+					if (data_p -> gtsd_export_max_age > 0)
+						{
+							const uint32 num_removed = RemoveOldGeneExports (data_p -> gtsd_export_directory_s, data_p -> gtsd_export_max_age);
+
+							if (num_removed > 0)
+								{
+									PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Removed " UINT32_FMT " old exports from \"%s\"", num_removed, data_p -> gtsd_export_directory_s);
+								}
+						}
+
+					export_p = AllocateGeneExport (data_p -> gtsd_export_directory_s, format);
 
-									resource_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, title_s ? title_s : query_s, entry_p);
+					if (export_p)
+						{
+							ExportHits hits;
+							bool success_flag = false;
+
+							hits.eh_export_p = export_p;
+							hits.eh_timer_p = timer_p;
+							hits.eh_phase_start_ns = GetSearchTime ();
 
-									if (title_s)
+							if (FindMatchingMongoDocumentsByBSON (mongo_p, query_p, opts_p))
+								{
+									if (IterateOverMongoResults (mongo_p, WriteExportHit, &hits))
+										{
+											success_flag = true;
+										}
+									else
 										{
-											FreeCopiedString (title_s);
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to iterate over results for export to \"%s\"", export_p -> ge_filename_s);
 										}
+								}
+							else
+								{
+									PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "Failed to run query in \"%s\" -> \"%s\"", data_p -> gtsd_database_s, data_p -> gtsd_collection_s);
+								}
+
+							AddSearchPhaseTime (timer_p, SP_QUERY, hits.eh_phase_start_ns);
+
+							if (CloseGeneExport (export_p) && success_flag)
+								{
+									json_t *export_data_p = json_pack ("{s:s,s:I,s:I}", "format", GetGeneExportFormatAsString (format),
+										"num_genes", (json_int_t) (export_p -> ge_num_genes), "num_skipped", (json_int_t) (export_p -> ge_num_skipped));
 
-									if (resource_p)
+									if (export_data_p)
 										{
-											if (AddResultToServiceJob (job_p, resource_p))
+											json_t *resource_p = GetDataResourceAsJSONByParts (PROTOCOL_FILE_S, export_p -> ge_filename_s, "Export", export_data_p);
+
+											if (resource_p)
 												{
-													++ num_added;
+													if (AddResultToServiceJob (job_p, resource_p))
+														{
+															status = OS_SUCCEEDED;
+														}
+													else
+														{
+															PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, resource_p, "Failed to add export to service job");
+															json_decref (resource_p);
+														}
 												}
 											else
 												{
-													AddGeneralErrorMessageToServiceJob (job_p, "Failed to add one or more hits to result");
-													PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, resource_p, "Failed to add result " SIZET_FMT " for query \"%s\", %d to service job", i, gene_s ? gene_s : "NULL", cluster_p ? *cluster_p : -1);
-													json_decref (resource_p);
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create resource for export \"%s\"", export_p -> ge_filename_s);
 												}
+
+											json_decref (export_data_p);
 										}
 									else
 										{
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create resource for result " SIZET_FMT " to query \"%s\": \%d", i, gene_s ? gene_s : "NULL", cluster_p ? *cluster_p : -1);
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create details for export \"%s\"", export_p -> ge_filename_s);
 										}
-
-									++ i;
-								}		/* while ((i < num_results) && success_flag) */
-
-							if (num_added == num_results)
-								{
-									status = OS_SUCCEEDED;
-								}
-							else if (num_added > 0)
-								{
-									status = OS_PARTIALLY_SUCCEEDED;
 								}
 							else
 								{
+									AddGeneralErrorMessageToServiceJob (job_p, "Failed to write the export");
 									status = OS_FAILED;
 								}
 
-							if (query_s && (query_s != gene_s))
-								{
-									FreeCopiedString (query_s);
-								}
-
-							json_decref (results_p);
-						}		/* if (results_p) */
-
-				}		/* if (BSON_APPEND_UTF8 (query_p, PGS_POPULATION_NAME_S, gene_s)) */
+							/* Don't leave incomplete exports lying around */
+							FreeGeneExport (export_p, status != OS_SUCCEEDED);
+						}		/* if (export_p) */
+					else
+						{
+							AddGeneralErrorMessageToServiceJob (job_p, "Failed to create the export file");
+						}
+				}
 			else
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to append \"%s\", %d to query", gene_s ? gene_s : "NULL", cluster_p ? *cluster_p : -1);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add cluster range to export query");
 				}
+
 			bson_destroy (query_p);
 		}		/* if (query_p) */
+
+	SetServiceJobStatus (job_p, status);
+}
+
+
+/*
+ * Match the clusters from first_cluster_p, or the start of the collection
+ * if it is NULL, up to and including last_cluster using
+ * { cluster_id: { $gte: <first>, $lte: <last> } }
+ * which is a single range scan of the compound (cluster_id, gene_id)
+ * index, as cluster_id is its leading key.
+ */
+static bool AddClusterRangeQuery (bson_t *query_p, const uint32 * const first_cluster_p, const uint32 last_cluster)
+{
+	bool success_flag = false;
+	bson_t range_query;
+
+	if (BSON_APPEND_DOCUMENT_BEGIN (query_p, GTS_CLUSTER_ID_S, &range_query))
+		{
+			success_flag = true;
+
+			if (first_cluster_p)
+				{
+					if (!BSON_APPEND_INT64 (&range_query, "$gte", *first_cluster_p))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"$gte\": " UINT32_FMT " for \"%s\"", *first_cluster_p, GTS_CLUSTER_ID_S);
+							success_flag = false;
+						}
+				}
+
+			if (success_flag)
+				{
+					if (!BSON_APPEND_INT64 (&range_query, "$lte", last_cluster))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"$lte\": " UINT32_FMT " for \"%s\"", last_cluster, GTS_CLUSTER_ID_S);
+							success_flag = false;
+						}
+				}
+
+			if (!bson_append_document_end (query_p, &range_query))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to end \"%s\" query", GTS_CLUSTER_ID_S);
+					success_flag = false;
+				}
+		}
 	else
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create query for \"%s\", %d", gene_s ? gene_s : "NULL", cluster_p ? *cluster_p : -1);
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to begin \"%s\" query", GTS_CLUSTER_ID_S);
 		}
 
-	SetServiceJobStatus (job_p, status);
+	return success_flag;
+}
+
+
+static bool WriteExportHit (const bson_t *document_p, void *data_p)
+{
+	ExportHits *hits_p = (ExportHits *) data_p;
+	bool success_flag;
+
+	hits_p -> eh_phase_start_ns = AddSearchPhaseTime (hits_p -> eh_timer_p, SP_QUERY, hits_p -> eh_phase_start_ns);
+
+	success_flag = WriteGeneExportDocument (hits_p -> eh_export_p, document_p);
+
+	hits_p -> eh_phase_start_ns = AddSearchPhaseTime (hits_p -> eh_timer_p, SP_CONVERT, hits_p -> eh_phase_start_ns);
+
+	/* Stop as soon as the file can't be written to */
+	return success_flag;
+}
+
+
+/*
+ * Add a value to the job's metadata, creating the metadata if needed.
+ * This takes ownership of value_p.
+ */
+static bool AddSearchMetadata (ServiceJob *job_p, const char *key_s, json_t *value_p)
+{
+	if (! (job_p -> sj_metadata_p))
+		{
+			if ((job_p -> sj_metadata_p = json_object ()) == NULL)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate job metadata");
+					json_decref (value_p);
+					return false;
+				}
+		}
+
+	if (json_object_set_new (job_p -> sj_metadata_p, key_s, value_p) == 0)
+		{
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to job metadata", key_s);
+	return false;
 }
 
 
+/*
+ * Attach the phase times for a search to its job, so that they are
+ * logged along with it, and add them to the service's histograms.
+ */
+static void AddSearchTimings (ServiceJob *job_p, const SearchTimer *timer_p, GeneTreesServiceData *data_p)
+{
+	json_t *timings_p = GetSearchTimerAsJSON (timer_p);
+
+	if (timings_p)
+		{
+			PrintJSONToLog (STM_LEVEL_FINE, __FILE__, __LINE__, timings_p, "Search timings in ms: ");
+
+			if (!AddSearchMetadata (job_p, "timings_ms", timings_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add search timings to job metadata");
+				}
+		}
 
+	if (data_p -> gtsd_timings_p)
+		{
+			AddSearchTimerToTimings (data_p -> gtsd_timings_p, timer_p);
+		}
+}
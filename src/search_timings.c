@@ -0,0 +1,552 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_timings.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "search_timings.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+/*
+ * The names used for each phase in the job metadata and metrics file
+ */
+static const char * const S_PHASE_NAMES_SS [SP_NUM_PHASES] =
+{
+	"connection",
+	"query",
+	"convert",
+	"wrap",
+	"total"
+};
+
+
+/*
+ * The upper bounds, in seconds, of the histogram buckets
+ */
+static const double S_BUCKET_BOUNDS_AR [ST_NUM_BUCKETS] =
+{
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+
+/*
+ * A file that one or more services' histograms are written to.
+ */
+typedef struct MetricsFile
+{
+	char *mf_file_s;
+
+	/* The SearchTimings written to this file, linked by sts_next_p */
+	SearchTimings *mf_timings_p;
+
+	time_t mf_write_interval;
+
+	time_t mf_last_write;
+
+	bool mf_writing_flag;
+
+	struct MetricsFile *mf_next_p;
+} MetricsFile;
+
+
+/*
+ * A copy of a service's histograms, taken so that the file can be
+ * written without holding any of the locks.
+ */
+typedef struct SearchTimingsSnapshot
+{
+	const char *sts_label_s;
+
+	uint64 sts_buckets [SP_NUM_PHASES][ST_NUM_BUCKETS + 1];
+
+	uint64 sts_sums_ns [SP_NUM_PHASES];
+
+	uint64 sts_count;
+} SearchTimingsSnapshot;
+
+
+/*
+ * Every metrics file in the process. This lock is always taken before
+ * any SearchTimings' own lock.
+ */
+static MetricsFile *s_metrics_files_p = NULL;
+
+static pthread_mutex_t s_metrics_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static SearchTimings *AllocateSharedSearchTimings (const char *label_s, const char *metrics_file_s, const time_t write_interval);
+
+static SearchTimings *AllocateSearchTimingsHistograms (const char *label_s);
+
+static MetricsFile *GetMetricsFile (const char *metrics_file_s, const time_t write_interval);
+
+static void WriteMetricsFile (MetricsFile *metrics_file_p);
+
+static bool WriteSearchTimings (FILE *out_f, const SearchTimingsSnapshot *snapshot_p);
+
+static bool WriteLabelValue (FILE *out_f, const char *value_s);
+
+
+uint64 GetSearchTime (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (((uint64) now.tv_sec) * 1000000000ULL) + ((uint64) now.tv_nsec);
+}
+
+
+void InitSearchTimer (SearchTimer *timer_p)
+{
+	memset (timer_p -> st_phase_ns, 0, sizeof (timer_p -> st_phase_ns));
+}
+
+
+uint64 AddSearchPhaseTime (SearchTimer *timer_p, const SearchPhase phase, const uint64 start_ns)
+{
+	const uint64 now_ns = GetSearchTime ();
+
+	if (timer_p && (now_ns > start_ns))
+		{
+			timer_p -> st_phase_ns [phase] += now_ns - start_ns;
+		}
+
+	return now_ns;
+}
+
+
+json_t *GetSearchTimerAsJSON (const SearchTimer *timer_p)
+{
+	json_t *timings_p = json_object ();
+
+	if (timings_p)
+		{
+			size_t i;
+
+			for (i = 0; i < SP_NUM_PHASES; ++ i)
+				{
+					if (json_object_set_new (timings_p, * (S_PHASE_NAMES_SS + i), json_real (((double) (timer_p -> st_phase_ns [i])) / 1000000.0)) != 0)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" timing", * (S_PHASE_NAMES_SS + i));
+							json_decref (timings_p);
+							return NULL;
+						}
+				}
+		}
+
+	return timings_p;
+}
+
+
+SearchTimings *AllocateSearchTimings (const char *label_s, const char *metrics_file_s, const time_t write_interval)
+{
+	if (metrics_file_s)
+		{
+			if (label_s)
+				{
+					return AllocateSharedSearchTimings (label_s, metrics_file_s, write_interval);
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "No service name to label the search timings in \"%s\" with", metrics_file_s);
+			return NULL;
+		}
+
+	return AllocateSearchTimingsHistograms (NULL);
+}
+
+
+void FreeSearchTimings (SearchTimings *timings_p)
+{
+	/*
+	 * Those written to a metrics file are kept for the next instance
+	 * of the service
+	 */
+	if (! (timings_p -> sts_metrics_file_p))
+		{
+			pthread_mutex_destroy (& (timings_p -> sts_lock));
+			FreeMemory (timings_p);
+		}
+}
+
+
+void AddSearchTimerToTimings (SearchTimings *timings_p, const SearchTimer *timer_p)
+{
+	if (pthread_mutex_lock (& (timings_p -> sts_lock)) == 0)
+		{
+			size_t i;
+
+			for (i = 0; i < SP_NUM_PHASES; ++ i)
+				{
+					const double phase_time = ((double) (timer_p -> st_phase_ns [i])) / 1000000000.0;
+					size_t j = 0;
+
+					while ((j < ST_NUM_BUCKETS) && (phase_time > S_BUCKET_BOUNDS_AR [j]))
+						{
+							++ j;
+						}
+
+					++ (timings_p -> sts_buckets [i][j]);
+					timings_p -> sts_sums_ns [i] += timer_p -> st_phase_ns [i];
+				}
+
+			++ (timings_p -> sts_count);
+
+			pthread_mutex_unlock (& (timings_p -> sts_lock));
+		}		/* if (pthread_mutex_lock (& (timings_p -> sts_lock)) == 0) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock SearchTimings");
+		}
+
+	/*
+	 * If another search has the registry, it is either writing the
+	 * file or will check whether it is due, so don't wait for it.
+	 */
+	if (timings_p -> sts_metrics_file_p)
+		{
+			if (pthread_mutex_trylock (&s_metrics_files_lock) == 0)
+				{
+					MetricsFile *metrics_file_p = timings_p -> sts_metrics_file_p;
+					const time_t now = time (NULL);
+
+					if ((!metrics_file_p -> mf_writing_flag) && (now - (metrics_file_p -> mf_last_write) >= metrics_file_p -> mf_write_interval))
+						{
+							metrics_file_p -> mf_last_write = now;
+							WriteMetricsFile (metrics_file_p);
+						}
+
+					pthread_mutex_unlock (&s_metrics_files_lock);
+				}
+		}
+}
+
+
+/*
+ * Get the histograms for a service that writes to a metrics file, carrying
+ * on from those of any earlier instance of it.
+ */
+static SearchTimings *AllocateSharedSearchTimings (const char *label_s, const char *metrics_file_s, const time_t write_interval)
+{
+	SearchTimings *timings_p = NULL;
+
+	if (pthread_mutex_lock (&s_metrics_files_lock) == 0)
+		{
+			MetricsFile *metrics_file_p = GetMetricsFile (metrics_file_s, write_interval);
+
+			if (metrics_file_p)
+				{
+					timings_p = metrics_file_p -> mf_timings_p;
+
+					while (timings_p && (strcmp (timings_p -> sts_label_s, label_s) != 0))
+						{
+							timings_p = timings_p -> sts_next_p;
+						}
+
+					if (!timings_p)
+						{
+							if ((timings_p = AllocateSearchTimingsHistograms (label_s)) != NULL)
+								{
+									timings_p -> sts_metrics_file_p = metrics_file_p;
+									timings_p -> sts_next_p = metrics_file_p -> mf_timings_p;
+									metrics_file_p -> mf_timings_p = timings_p;
+								}
+						}
+				}		/* if (metrics_file_p) */
+
+			pthread_mutex_unlock (&s_metrics_files_lock);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock metrics files");
+		}
+
+	return timings_p;
+}
+
+
+static SearchTimings *AllocateSearchTimingsHistograms (const char *label_s)
+{
+	SearchTimings *timings_p = (SearchTimings *) AllocMemory (sizeof (SearchTimings));
+
+	if (timings_p)
+		{
+			memset (timings_p -> sts_buckets, 0, sizeof (timings_p -> sts_buckets));
+			memset (timings_p -> sts_sums_ns, 0, sizeof (timings_p -> sts_sums_ns));
+			timings_p -> sts_count = 0;
+			timings_p -> sts_label_s = NULL;
+			timings_p -> sts_metrics_file_p = NULL;
+			timings_p -> sts_next_p = NULL;
+
+			if ((!label_s) || ((timings_p -> sts_label_s = EasyCopyToNewString (label_s)) != NULL))
+				{
+					if (pthread_mutex_init (& (timings_p -> sts_lock), NULL) == 0)
+						{
+							return timings_p;
+						}
+
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise SearchTimings lock");
+
+					if (timings_p -> sts_label_s)
+						{
+							FreeCopiedString (timings_p -> sts_label_s);
+						}
+				}
+
+			FreeMemory (timings_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Find or add a metrics file. This must be called with
+ * s_metrics_files_lock held.
+ */
+static MetricsFile *GetMetricsFile (const char *metrics_file_s, const time_t write_interval)
+{
+	MetricsFile *metrics_file_p = s_metrics_files_p;
+
+	while (metrics_file_p && (strcmp (metrics_file_p -> mf_file_s, metrics_file_s) != 0))
+		{
+			metrics_file_p = metrics_file_p -> mf_next_p;
+		}
+
+	if (metrics_file_p)
+		{
+			if (write_interval < metrics_file_p -> mf_write_interval)
+				{
+					metrics_file_p -> mf_write_interval = write_interval;
+				}
+		}
+	else
+		{
+			if ((metrics_file_p = (MetricsFile *) AllocMemory (sizeof (MetricsFile))) != NULL)
+				{
+					if ((metrics_file_p -> mf_file_s = EasyCopyToNewString (metrics_file_s)) != NULL)
+						{
+							metrics_file_p -> mf_timings_p = NULL;
+							metrics_file_p -> mf_write_interval = write_interval;
+							metrics_file_p -> mf_last_write = 0;
+							metrics_file_p -> mf_writing_flag = false;
+							metrics_file_p -> mf_next_p = s_metrics_files_p;
+							s_metrics_files_p = metrics_file_p;
+						}
+					else
+						{
+							FreeMemory (metrics_file_p);
+							metrics_file_p = NULL;
+						}
+				}
+
+			if (!metrics_file_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add metrics file \"%s\"", metrics_file_s);
+				}
+		}
+
+	return metrics_file_p;
+}
+
+
+/*
+ * Write the histograms of every service that uses a metrics file, in the
+ * Prometheus text format. They are written to a temporary file which is
+ * then renamed, so that a scraper never sees a partially-written file.
+ *
+ * This is called with s_metrics_files_lock held, which it releases while
+ * writing, so the file's mf_writing_flag stops any other thread from
+ * writing it at the same time. As the SearchTimings are never freed, the
+ * copies of their labels stay valid.
+ */
+static void WriteMetricsFile (MetricsFile *metrics_file_p)
+{
+	SearchTimings *timings_p = metrics_file_p -> mf_timings_p;
+	SearchTimingsSnapshot *snapshots_p = NULL;
+	size_t num_timings = 0;
+
+	while (timings_p)
+		{
+			++ num_timings;
+			timings_p = timings_p -> sts_next_p;
+		}
+
+	if ((snapshots_p = (SearchTimingsSnapshot *) AllocMemoryArray (num_timings, sizeof (SearchTimingsSnapshot))) != NULL)
+		{
+			char *temp_file_s = ConcatenateStrings (metrics_file_p -> mf_file_s, ".tmp");
+
+			if (temp_file_s)
+				{
+					const char *metrics_file_s = metrics_file_p -> mf_file_s;
+					FILE *out_f = NULL;
+					size_t i = 0;
+
+					for (timings_p = metrics_file_p -> mf_timings_p; timings_p; timings_p = timings_p -> sts_next_p, ++ i)
+						{
+							SearchTimingsSnapshot *snapshot_p = snapshots_p + i;
+
+							snapshot_p -> sts_label_s = timings_p -> sts_label_s;
+
+							if (pthread_mutex_lock (& (timings_p -> sts_lock)) == 0)
+								{
+									memcpy (snapshot_p -> sts_buckets, timings_p -> sts_buckets, sizeof (snapshot_p -> sts_buckets));
+									memcpy (snapshot_p -> sts_sums_ns, timings_p -> sts_sums_ns, sizeof (snapshot_p -> sts_sums_ns));
+									snapshot_p -> sts_count = timings_p -> sts_count;
+
+									pthread_mutex_unlock (& (timings_p -> sts_lock));
+								}
+							else
+								{
+									memset (snapshot_p -> sts_buckets, 0, sizeof (snapshot_p -> sts_buckets));
+									memset (snapshot_p -> sts_sums_ns, 0, sizeof (snapshot_p -> sts_sums_ns));
+									snapshot_p -> sts_count = 0;
+								}
+						}
+
+					metrics_file_p -> mf_writing_flag = true;
+					pthread_mutex_unlock (&s_metrics_files_lock);
+
+					if ((out_f = fopen (temp_file_s, "w")) != NULL)
+						{
+							bool success_flag = (fprintf (out_f, "# HELP gene_trees_search_phase_seconds The time spent in each phase of a gene trees search.\n"
+								"# TYPE gene_trees_search_phase_seconds histogram\n") >= 0);
+
+							for (i = 0; (i < num_timings) && success_flag; ++ i)
+								{
+									success_flag = WriteSearchTimings (out_f, snapshots_p + i);
+								}
+
+							if (fclose (out_f) != 0)
+								{
+									success_flag = false;
+								}
+
+							if (success_flag)
+								{
+									if (rename (temp_file_s, metrics_file_s) != 0)
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to rename \"%s\" to \"%s\"", temp_file_s, metrics_file_s);
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to write search timings to \"%s\"", temp_file_s);
+									remove (temp_file_s);
+								}
+
+						}		/* if (out_f) */
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to open \"%s\" to write search timings", temp_file_s);
+						}
+
+					FreeCopiedString (temp_file_s);
+
+					/* The caller expects the lock to be held again */
+					pthread_mutex_lock (&s_metrics_files_lock);
+					metrics_file_p -> mf_writing_flag = false;
+				}		/* if (temp_file_s) */
+
+			FreeMemory (snapshots_p);
+		}		/* if (snapshots_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " search timings to write to \"%s\"", num_timings, metrics_file_p -> mf_file_s);
+		}
+}
+
+
+static bool WriteSearchTimings (FILE *out_f, const SearchTimingsSnapshot *snapshot_p)
+{
+	bool success_flag = true;
+	size_t i;
+
+	for (i = 0; (i < SP_NUM_PHASES) && success_flag; ++ i)
+		{
+			const char *phase_s = * (S_PHASE_NAMES_SS + i);
+			uint64 cumulative_count = 0;
+			size_t j;
+
+			for (j = 0; (j <= ST_NUM_BUCKETS) && success_flag; ++ j)
+				{
+					cumulative_count += snapshot_p -> sts_buckets [i][j];
+
+					success_flag = (fputs ("gene_trees_search_phase_seconds_bucket{service=\"", out_f) >= 0)
+						&& WriteLabelValue (out_f, snapshot_p -> sts_label_s)
+						&& ((j < ST_NUM_BUCKETS) ?
+							(fprintf (out_f, "\",phase=\"%s\",le=\"%g\"} %llu\n", phase_s, S_BUCKET_BOUNDS_AR [j], (unsigned long long) cumulative_count) >= 0) :
+							(fprintf (out_f, "\",phase=\"%s\",le=\"+Inf\"} %llu\n", phase_s, (unsigned long long) cumulative_count) >= 0));
+				}
+
+			if (success_flag)
+				{
+					success_flag = (fputs ("gene_trees_search_phase_seconds_sum{service=\"", out_f) >= 0)
+						&& WriteLabelValue (out_f, snapshot_p -> sts_label_s)
+						&& (fprintf (out_f, "\",phase=\"%s\"} %.9f\n", phase_s, ((double) (snapshot_p -> sts_sums_ns [i])) / 1000000000.0) >= 0)
+						&& (fputs ("gene_trees_search_phase_seconds_count{service=\"", out_f) >= 0)
+						&& WriteLabelValue (out_f, snapshot_p -> sts_label_s)
+						&& (fprintf (out_f, "\",phase=\"%s\"} %llu\n", phase_s, (unsigned long long) (snapshot_p -> sts_count)) >= 0);
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Backslashes, double quotes and newlines need escaping in label values
+ */
+static bool WriteLabelValue (FILE *out_f, const char *value_s)
+{
+	for ( ; *value_s != '\0'; ++ value_s)
+		{
+			int res;
+
+			switch (*value_s)
+				{
+					case '\\':
+						res = fputs ("\\\\", out_f);
+						break;
+
+					case '"':
+						res = fputs ("\\\"", out_f);
+						break;
+
+					case '\n':
+						res = fputs ("\\n", out_f);
+						break;
+
+					default:
+						res = fputc (*value_s, out_f);
+						break;
+				}
+
+			if (res == EOF)
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
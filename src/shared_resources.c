@@ -0,0 +1,163 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * shared_resources.c
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "shared_resources.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+/*
+ * A resource along with the number of service
+ * instances and searches that are using it.
+ */
+typedef struct SharedResource
+{
+	char *sr_key_s;
+
+	void *sr_resource_p;
+
+	void (*sr_free_fn) (void *resource_p);
+
+	size_t sr_num_references;
+
+	struct SharedResource *sr_next_p;
+} SharedResource;
+
+
+static SharedResource *s_resources_p = NULL;
+
+static pthread_mutex_t s_resources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static SharedResource *AllocateSharedResource (const char *key_s, void *resource_p, void (*free_fn) (void *resource_p));
+
+
+void *AcquireSharedResource (const char *key_s, void *(*allocate_fn) (void *allocate_data_p), void (*free_fn) (void *resource_p), void *allocate_data_p)
+{
+	void *resource_p = NULL;
+	SharedResource *shared_p;
+
+	pthread_mutex_lock (&s_resources_lock);
+
+	for (shared_p = s_resources_p; shared_p; shared_p = shared_p -> sr_next_p)
+		{
+			if (strcmp (shared_p -> sr_key_s, key_s) == 0)
+				{
+					++ (shared_p -> sr_num_references);
+					resource_p = shared_p -> sr_resource_p;
+					break;
+				}
+		}
+
+	if (!shared_p)
+		{
+			void *new_resource_p = allocate_fn (allocate_data_p);
+
+			if (new_resource_p)
+				{
+					if ((shared_p = AllocateSharedResource (key_s, new_resource_p, free_fn)) != NULL)
+						{
+							shared_p -> sr_next_p = s_resources_p;
+							s_resources_p = shared_p;
+
+							resource_p = new_resource_p;
+						}
+					else
+						{
+							free_fn (new_resource_p);
+						}
+				}
+		}
+
+	pthread_mutex_unlock (&s_resources_lock);
+
+	return resource_p;
+}
+
+
+void ReleaseSharedResource (void *resource_p)
+{
+	SharedResource *shared_p;
+	SharedResource **shared_pp = &s_resources_p;
+
+	pthread_mutex_lock (&s_resources_lock);
+
+	while (((shared_p = *shared_pp) != NULL) && (shared_p -> sr_resource_p != resource_p))
+		{
+			shared_pp = & (shared_p -> sr_next_p);
+		}
+
+	if (shared_p)
+		{
+			-- (shared_p -> sr_num_references);
+
+			if (shared_p -> sr_num_references == 0)
+				{
+					*shared_pp = shared_p -> sr_next_p;
+				}
+			else
+				{
+					shared_p = NULL;
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Released a resource that isn't shared");
+		}
+
+	pthread_mutex_unlock (&s_resources_lock);
+
+	/* Freeing it can take a while, so do it outside of the lock */
+	if (shared_p)
+		{
+			shared_p -> sr_free_fn (shared_p -> sr_resource_p);
+			FreeCopiedString (shared_p -> sr_key_s);
+			FreeMemory (shared_p);
+		}
+}
+
+
+static SharedResource *AllocateSharedResource (const char *key_s, void *resource_p, void (*free_fn) (void *resource_p))
+{
+	SharedResource *shared_p = (SharedResource *) AllocMemory (sizeof (SharedResource));
+
+	if (shared_p)
+		{
+			if ((shared_p -> sr_key_s = EasyCopyToNewString (key_s)) != NULL)
+				{
+					shared_p -> sr_resource_p = resource_p;
+					shared_p -> sr_free_fn = free_fn;
+					shared_p -> sr_num_references = 1;
+					shared_p -> sr_next_p = NULL;
+
+					return shared_p;
+				}
+
+			FreeMemory (shared_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate shared resource \"%s\"", key_s);
+
+	return NULL;
+}
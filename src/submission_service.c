@@ -20,10 +20,13 @@
  *      Author: billy
  */
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "submission_service.h"
 #include "gene_trees_service.h"
+#include "accession_mappings.h"
 
 #include "audit.h"
 #include "streams.h"
@@ -39,6 +42,131 @@
 
 static const char * const S_ID_S = "id";
 
+static const char * const S_POPULATION_ID_S = "population_id";
+
+static const char * const S_CHUNK_S = "chunk";
+
+static const char * const S_VARIETY_NAME_INDEX_S = "name_1";
+
+
+/*
+ * The number of times to send a population's variety upserts when
+ * they fail with a duplicate key error.
+ */
+static const uint32 S_NUM_VARIETY_UPSERT_ATTEMPTS = 3;
+
+
+/*
+ * A varieties collection, as "<database>.<collection>", that has
+ * its unique index on the varieties' names.
+ */
+typedef struct IndexedCollection
+{
+	char *ic_name_s;
+
+	struct IndexedCollection *ic_next_p;
+} IndexedCollection;
+
+
+/*
+ * The unique index on the varieties' names is only created once per
+ * process for each collection rather than by every submission. The
+ * entries live for as long as the process does.
+ */
+static pthread_mutex_t s_variety_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static IndexedCollection *s_indexed_collections_p = NULL;
+
+
+/*
+ * The compiled "name_mappings" of an instance of this service
+ */
+typedef struct ServiceMappings
+{
+	const GeneTreesServiceData *sm_data_p;
+
+	AccessionMappings *sm_mappings_p;
+
+	struct ServiceMappings *sm_next_p;
+} ServiceMappings;
+
+
+/*
+ * The search services share GeneTreesServiceData but never use the
+ * name mappings, so each instance's mappings are kept here, keyed by
+ * its data, rather than in it. They are freed when it is closed.
+ */
+static pthread_mutex_t s_mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ServiceMappings *s_service_mappings_p = NULL;
+
+
+/*
+ * libbson allows documents of up to 2GB but the server only accepts
+ * them up to 16MB, so the markers are saved in chunks that are well
+ * under that.
+ */
+#define S_MAX_DOCUMENT_SIZE (16 * 1024 * 1024)
+
+#define S_MARKER_CHUNK_SIZE (4 * 1024 * 1024)
+
+/*
+ * The most that is queued in a bulk insert before it is sent, which is
+ * the largest message that the server accepts.
+ */
+#define S_MAX_BULK_INSERT_SIZE (48 * 1024 * 1024)
+
+
+/*
+ * The rows of the uploaded table
+ */
+#define S_CHROMOSOMES_ROW (0)
+#define S_MAPPINGS_ROW (1)
+#define S_PARENT_A_ROW (2)
+#define S_PARENT_B_ROW (3)
+#define S_FIRST_GENOTYPE_ROW (4)
+
+
+/*
+ * An uploaded population, which is read down each marker's column
+ * to build the marker's document.
+ */
+typedef struct PopulationTable
+{
+	/* All of the rows of the table */
+	const json_t *pt_rows_p;
+
+	/* The chromosome for each marker, which also gives the markers' names */
+	json_t *pt_chromosomes_p;
+
+	/* The genetic mapping position for each marker */
+	json_t *pt_mappings_p;
+
+	const char *pt_parent_a_s;
+
+	const char *pt_parent_b_s;
+
+	/* "<parent a> x <parent b>" */
+	char *pt_name_s;
+
+	/* The accession for each of the rows from S_FIRST_GENOTYPE_ROW onwards */
+	char **pt_accessions_ss;
+
+	size_t pt_num_genotypes;
+
+	/*
+	 * The escaped name of each marker, in the order of the chromosomes row.
+	 * Names without any full stops point at the row's own keys and the rest
+	 * point into pt_escaped_markers_s.
+	 */
+	const char **pt_marker_keys_ss;
+
+	/* The escaped names of the markers that have full stops in them */
+	char *pt_escaped_markers_s;
+
+	size_t pt_num_markers;
+} PopulationTable;
+
 static NamedParameterType S_SET_DATA = { "Data", PT_JSON_TABLE };
 
 
@@ -64,22 +192,54 @@ static ServiceMetadata *GetGeneTreesSubmissionServiceMetadata (Service *service_
 
 static bool GetGeneTreesSubmissionServiceParameterTypesForNamedParameters (const Service *service_p, const char *param_name_s, ParameterType *pt_p);
 
+static bool ConfigureAccessionMappings (GeneTreesServiceData *data_p, const json_t *service_config_p);
+
+static bool AddServiceMappings (const GeneTreesServiceData *data_p, AccessionMappings *mappings_p);
+
+static const AccessionMappings *GetServiceMappings (const GeneTreesServiceData *data_p);
+
+static void RemoveServiceMappings (const GeneTreesServiceData *data_p);
+
+
+static bool InitPopulationTable (PopulationTable *table_p, const json_t *data_json_p, GeneTreesServiceData *data_p);
+
+static void ClearPopulationTable (PopulationTable *table_p);
+
+static bool CheckMarkerRow (json_t *row_p, json_t *chromosomes_p);
 
-static bool AddChromosomes (json_t *doc_p, json_t *chromosomes_p);
+static bool CheckAccessionsAreUnique (const PopulationTable *table_p);
 
-static bool AddGeneticMappingPositions (json_t *doc_p, json_t *mappings_p);
+static int CompareAccessions (const void *v0_p, const void *v1_p);
 
-static const char *AddParentRow (json_t *doc_p, json_t *genotypes_p, const char *key_s);
+static bool InitMarkerKeys (PopulationTable *table_p);
 
-static bool AddGenotypesRow (json_t *doc_p, json_t *genotypes_p, GeneTreesServiceData *data_p);
+static bool AddMarker (bson_t *marker_p, const char *marker_s, const char *chromosome_s, const PopulationTable *table_p);
 
 static bson_oid_t *SaveMarkers (const char **parent_a_ss, const char **parent_b_ss, const json_t *data_json_p, GeneTreesServiceData *data_p);
 
+static bool SaveMarkerChunks (const PopulationTable *table_p, const bson_oid_t *id_p, GeneTreesServiceData *data_p);
+
+static bson_t *AllocateMarkerChunk (const PopulationTable *table_p, const bson_oid_t *id_p, const uint32 chunk);
+
+static bool InsertMarkerChunk (mongoc_bulk_operation_t **bulk_pp, size_t *queued_size_p, const bson_t *chunk_p, MongoTool *tool_p);
+
+static bool SendMarkerChunks (mongoc_bulk_operation_t **bulk_pp, size_t *queued_size_p);
+
+static void RemoveMarkerChunks (const bson_oid_t *id_p, MongoTool *tool_p);
+
 static bool SaveVarieties (const char *parent_a_s, const char *parent_b_s, const bson_oid_t *id_p, GeneTreesServiceData *data_p);
 
-static bool SaveVariety (const char *parent_s, const bson_oid_t *id_p, MongoTool *mongo_p);
+static bool RunVarietyUpserts (const char *parent_a_s, const char *parent_b_s, const bson_oid_t *id_p, GeneTreesServiceData *data_p, bool *duplicate_flag_p);
+
+static void EnsureVarietyNameIndex (GeneTreesServiceData *data_p);
+
+static bool IsCollectionIndexed (const char *name_s);
+
+static void SetCollectionIndexed (char *name_s);
 
-static char *GetAccession (const json_t *genotypes_p, GeneTreesServiceData *data_p);
+static bool AddVarietyUpsert (mongoc_bulk_operation_t *bulk_p, const char *parent_s, const bson_oid_t *id_p);
+
+static char *GetAccession (const json_t *genotypes_p, const AccessionMappings *mappings_p);
 
 
 /*
@@ -119,12 +279,15 @@ Service *GetGeneTreesSubmissionService (GrassrootsServer *grassroots_p)
 
 							if (ConfigureGeneTreesService (data_p, grassroots_p))
 								{
-									return service_p;
+									if (ConfigureAccessionMappings (data_p, data_p -> gtsd_base_data.sd_config_p))
+										{
+											return service_p;
+										}
 								}
 						}		/* if (InitialiseService (.... */
 					else
 						{
-							FreeGeneTreesServiceData (data_p);
+							ReleaseGeneTreesServiceData (data_p);
 						}
 
 				}		/* if (data_p) */
@@ -136,6 +299,129 @@ Service *GetGeneTreesSubmissionService (GrassrootsServer *grassroots_p)
 }
 
 
+/*
+ * "name_mappings" is an object of the genotype name prefixes to
+ * replace with their accession prefixes, e.g. "Paragon x Watkins 1190"
+ * to "ParW". They are compiled once here rather than scanned for each
+ * genotype of each population that is submitted. Only this service
+ * uses them, so they aren't part of ConfigureGeneTreesService () and
+ * a bad value doesn't stop the search services from starting.
+ */
+static bool ConfigureAccessionMappings (GeneTreesServiceData *data_p, const json_t *service_config_p)
+{
+	const json_t *mappings_p = json_object_get (service_config_p, "name_mappings");
+
+	if (mappings_p)
+		{
+			if (json_is_object (mappings_p))
+				{
+					AccessionMappings *accession_mappings_p = AllocateAccessionMappings (mappings_p);
+
+					if (accession_mappings_p)
+						{
+							if (AddServiceMappings (data_p, accession_mappings_p))
+								{
+									return true;
+								}
+
+							FreeAccessionMappings (accession_mappings_p);
+						}
+					else
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, mappings_p, "Failed to compile name_mappings");
+						}
+
+					return false;
+				}
+			else
+				{
+					PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, mappings_p, "name_mappings is not an object");
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static bool AddServiceMappings (const GeneTreesServiceData *data_p, AccessionMappings *mappings_p)
+{
+	ServiceMappings *service_mappings_p = (ServiceMappings *) AllocMemory (sizeof (ServiceMappings));
+
+	if (service_mappings_p)
+		{
+			service_mappings_p -> sm_data_p = data_p;
+			service_mappings_p -> sm_mappings_p = mappings_p;
+
+			pthread_mutex_lock (&s_mappings_lock);
+
+			service_mappings_p -> sm_next_p = s_service_mappings_p;
+			s_service_mappings_p = service_mappings_p;
+
+			pthread_mutex_unlock (&s_mappings_lock);
+
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate name mappings entry");
+
+	return false;
+}
+
+
+/*
+ * The mappings are only freed when the service is closed, which
+ * is after its last submission, so they can be used unlocked.
+ */
+static const AccessionMappings *GetServiceMappings (const GeneTreesServiceData *data_p)
+{
+	const AccessionMappings *mappings_p = NULL;
+	const ServiceMappings *service_mappings_p;
+
+	pthread_mutex_lock (&s_mappings_lock);
+
+	for (service_mappings_p = s_service_mappings_p; service_mappings_p; service_mappings_p = service_mappings_p -> sm_next_p)
+		{
+			if (service_mappings_p -> sm_data_p == data_p)
+				{
+					mappings_p = service_mappings_p -> sm_mappings_p;
+					break;
+				}
+		}
+
+	pthread_mutex_unlock (&s_mappings_lock);
+
+	return mappings_p;
+}
+
+
+static void RemoveServiceMappings (const GeneTreesServiceData *data_p)
+{
+	ServiceMappings *service_mappings_p = NULL;
+	ServiceMappings **next_pp;
+
+	pthread_mutex_lock (&s_mappings_lock);
+
+	for (next_pp = &s_service_mappings_p; *next_pp; next_pp = & ((*next_pp) -> sm_next_p))
+		{
+			if ((*next_pp) -> sm_data_p == data_p)
+				{
+					service_mappings_p = *next_pp;
+					*next_pp = service_mappings_p -> sm_next_p;
+					break;
+				}
+		}
+
+	pthread_mutex_unlock (&s_mappings_lock);
+
+	if (service_mappings_p)
+		{
+			FreeAccessionMappings (service_mappings_p -> sm_mappings_p);
+			FreeMemory (service_mappings_p);
+		}
+}
+
+
 
 static const char *GetGeneTreesSubmissionServiceName (const Service * UNUSED_PARAM (service_p))
 {
@@ -222,8 +508,10 @@ static void ReleaseGeneTreesSubmissionServiceParameters (Service * UNUSED_PARAM
 static bool CloseGeneTreesSubmissionService (Service *service_p)
 {
 	bool success_flag = true;
+	GeneTreesServiceData *data_p = (GeneTreesServiceData *) (service_p -> se_data_p);
 
-	FreeGeneTreesServiceData ((GeneTreesServiceData *) (service_p -> se_data_p));;
+	RemoveServiceMappings (data_p);
+	ReleaseGeneTreesServiceData (data_p);
 
 	return success_flag;
 }
@@ -373,219 +661,430 @@ static ServiceMetadata *GetGeneTreesSubmissionServiceMetadata (Service *service_
 }
 
 
-static bool AddChromosomes (json_t *doc_p, json_t *chromosomes_p)
+static bool InitPopulationTable (PopulationTable *table_p, const json_t *data_json_p, GeneTreesServiceData *data_p)
 {
-	bool success_flag = true;
-	void *iter_p = json_object_iter (chromosomes_p);
-
-	while (iter_p && success_flag)
+	const AccessionMappings *mappings_p = GetServiceMappings (data_p);
+
+	table_p -> pt_rows_p = data_json_p;
+	table_p -> pt_chromosomes_p = NULL;
+	table_p -> pt_mappings_p = NULL;
+	table_p -> pt_parent_a_s = NULL;
+	table_p -> pt_parent_b_s = NULL;
+	table_p -> pt_name_s = NULL;
+	table_p -> pt_accessions_ss = NULL;
+	table_p -> pt_num_genotypes = 0;
+	table_p -> pt_marker_keys_ss = NULL;
+	table_p -> pt_escaped_markers_s = NULL;
+	table_p -> pt_num_markers = 0;
+
+	/*
+	 * There are 4 header rows, so the actual genotype data doesn't
+	 * start until row 5
+	 */
+	if (json_is_array (data_json_p) && (json_array_size (data_json_p) >= S_FIRST_GENOTYPE_ROW))
 		{
-			const char *key_s = json_object_iter_key (iter_p);
+			table_p -> pt_chromosomes_p = json_array_get (data_json_p, S_CHROMOSOMES_ROW);
+			table_p -> pt_mappings_p = json_array_get (data_json_p, S_MAPPINGS_ROW);
+			table_p -> pt_parent_a_s = GetJSONString (json_array_get (data_json_p, S_PARENT_A_ROW), S_ID_S);
+			table_p -> pt_parent_b_s = GetJSONString (json_array_get (data_json_p, S_PARENT_B_ROW), S_ID_S);
 
-			if (strcmp (key_s, S_ID_S) != 0)
+			if ((table_p -> pt_parent_a_s) && (table_p -> pt_parent_b_s))
 				{
-					const char *value_s = GetJSONString (chromosomes_p, key_s);
+					table_p -> pt_name_s = ConcatenateVarargsStrings (table_p -> pt_parent_a_s, " x ", table_p -> pt_parent_b_s, NULL);
 
-					if (value_s)
+					if (table_p -> pt_name_s)
 						{
-							bool added_flag = false;
-							json_t *marker_p = json_object ();
-
-							if (marker_p)
+							if (CheckMarkerRow (table_p -> pt_chromosomes_p, table_p -> pt_chromosomes_p) && CheckMarkerRow (table_p -> pt_mappings_p, table_p -> pt_chromosomes_p))
 								{
-									/*
-									 * The marker name may contain full stops and although MongoDB 3.6+
-									 * allows these, the current version of the mongo-c driver (1.13)
-									 * does not, so we need to do the escaping ourselves
-									 */
-									char *escaped_marker_s = NULL;
-
-									if (SearchAndReplaceInString (key_s, &escaped_marker_s, ".", PGS_ESCAPED_DOT_S))
+									const size_t num_genotypes = json_array_size (data_json_p) - S_FIRST_GENOTYPE_ROW;
+									bool success_flag = true;
+
+									if (num_genotypes > 0)
 										{
-											if (json_object_set_new (doc_p, escaped_marker_s ? escaped_marker_s : key_s, marker_p)  == 0)
+											table_p -> pt_accessions_ss = (char **) AllocMemoryArray (num_genotypes, sizeof (char *));
+
+											if (table_p -> pt_accessions_ss)
 												{
-													if (SetJSONString (marker_p, PGS_CHROMOSOME_S, value_s))
+													while ((table_p -> pt_num_genotypes < num_genotypes) && success_flag)
 														{
-															added_flag = true;
+															json_t *row_p = json_array_get (data_json_p, S_FIRST_GENOTYPE_ROW + table_p -> pt_num_genotypes);
+
+															if (CheckMarkerRow (row_p, table_p -> pt_chromosomes_p))
+																{
+																	char *accession_s = GetAccession (row_p, mappings_p);
+
+																	if (accession_s)
+																		{
+																			table_p -> pt_accessions_ss [table_p -> pt_num_genotypes] = accession_s;
+																			++ (table_p -> pt_num_genotypes);
+																		}
+																	else
+																		{
+																			PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, row_p, "Failed to get %s", S_ID_S);
+																			success_flag = false;
+																		}
+																}
+															else
+																{
+																	success_flag = false;
+																}
 														}
 												}
-
-											if (escaped_marker_s)
+											else
 												{
-													FreeCopiedString (escaped_marker_s);
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " accessions", num_genotypes);
+													success_flag = false;
 												}
+										}		/* if (num_genotypes > 0) */
 
-										}		/* if (SearchAndReplaceInString (key_s, &escaped_marker_s, ".", PGS_DOT_S)) */
-
-									if (!added_flag)
+									if (success_flag && CheckAccessionsAreUnique (table_p) && InitMarkerKeys (table_p))
 										{
-											success_flag = false;
-											json_decref (marker_p);
+											return true;
 										}
 
-								}		/* if (marker_p) */
-							else
-								{
-									success_flag = false;
-								}
+								}		/* if (CheckMarkerRow (...) && CheckMarkerRow (...)) */
 
-						}		/* if (value_s) */
+						}		/* if (table_p -> pt_name_s) */
 					else
 						{
-							success_flag = false;
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make population name from \"%s\" and \"%s\"", table_p -> pt_parent_a_s, table_p -> pt_parent_b_s);
 						}
 
-				}		/* if (strcmp (key_s, S_ID_S) != 0) */
-
+				}		/* if ((table_p -> pt_parent_a_s) && (table_p -> pt_parent_b_s)) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get the parents of the population");
+				}
 
+		}		/* if (json_is_array (data_json_p) && ...) */
 
-			iter_p = json_object_iter_next (chromosomes_p, iter_p);
-		}
+	ClearPopulationTable (table_p);
 
-	return success_flag;
+	return false;
 }
 
 
-
-static bool AddGeneticMappingPositions (json_t *doc_p, json_t *mappings_p)
+static void ClearPopulationTable (PopulationTable *table_p)
 {
-	bool success_flag = true;
-	void *iter_p = json_object_iter (mappings_p);
-
-	while (iter_p && success_flag)
+	if (table_p -> pt_accessions_ss)
 		{
-			const char *key_s = json_object_iter_key (iter_p);
+			size_t i;
 
-			if (strcmp (key_s, S_ID_S) != 0)
+			for (i = 0; i < table_p -> pt_num_genotypes; ++ i)
 				{
-					const char *value_s = GetJSONString (mappings_p, key_s);
+					FreeCopiedString (table_p -> pt_accessions_ss [i]);
+				}
 
-					if (value_s)
-						{
-							/*
-							 * The marker name may contain full stops and although MongoDB 3.6+
-							 * allows these, the current version of the mongo-c driver (1.13)
-							 * does not, so we need to do the escaping ourselves
-							 */
-							char *escaped_key_s = NULL;
-
-							if (SearchAndReplaceInString (key_s, &escaped_key_s, ".", PGS_ESCAPED_DOT_S))
-								{
-									/* use key and value ... */
-									json_t *marker_p = json_object_get (doc_p, escaped_key_s ? escaped_key_s : key_s);
+			FreeMemory (table_p -> pt_accessions_ss);
+			table_p -> pt_accessions_ss = NULL;
+		}
 
-									if (marker_p)
-										{
-											if (!SetJSONString (marker_p, PGS_MAPPING_POSITION_S, value_s))
-												{
-													PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, marker_p, "Failed to set \"%s\": \"%s\"", PGS_MAPPING_POSITION_S, value_s);
-													success_flag = false;
-												}
-										}		/* if (marker_p) */
-									else
-										{
-											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, doc_p, "Failed to get \"%s\"", key_s);
-											success_flag = false;
-										}
+	if (table_p -> pt_name_s)
+		{
+			FreeCopiedString (table_p -> pt_name_s);
+			table_p -> pt_name_s = NULL;
+		}
 
-									if (escaped_key_s)
-										{
-											FreeCopiedString (escaped_key_s);
-										}
+	table_p -> pt_num_genotypes = 0;
+
+	if (table_p -> pt_marker_keys_ss)
+		{
+			FreeMemory (table_p -> pt_marker_keys_ss);
+			table_p -> pt_marker_keys_ss = NULL;
+		}
+
+	if (table_p -> pt_escaped_markers_s)
+		{
+			FreeMemory (table_p -> pt_escaped_markers_s);
+			table_p -> pt_escaped_markers_s = NULL;
+		}
+
+	table_p -> pt_num_markers = 0;
+}
 
-								}		/* if (SearchAndReplaceInString (key_s, &escaped_marker_s, ".", PGS_DOT_S)) */
 
+/*
+ * Check that every value in a row, apart from its id, is a string
+ * for one of the markers in the chromosomes row.
+ */
+static bool CheckMarkerRow (json_t *row_p, json_t *chromosomes_p)
+{
+	bool success_flag = json_is_object (row_p);
 
+	if (success_flag)
+		{
+			void *iter_p = json_object_iter (row_p);
 
-						}		/* if (value_s) */
-					else
+			while (iter_p && success_flag)
+				{
+					const char *key_s = json_object_iter_key (iter_p);
+
+					if (strcmp (key_s, S_ID_S) != 0)
 						{
-							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, mappings_p, "Failed to get value for \"%s\"", key_s);
-							success_flag = false;
+							if (!json_is_string (json_object_iter_value (iter_p)))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, row_p, "Value for \"%s\" is not a string", key_s);
+									success_flag = false;
+								}
+							else if (!json_object_get (chromosomes_p, key_s))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, row_p, "Failed to get marker for %s", key_s);
+									success_flag = false;
+								}
 						}
 
-				}		/* if (strcmp (key_s, S_ID_S) != 0) */
-
-			iter_p = json_object_iter_next (mappings_p, iter_p);
+					iter_p = json_object_iter_next (row_p, iter_p);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Row is not an object");
 		}
 
 	return success_flag;
 }
 
 
-static const char *AddParentRow (json_t *doc_p, json_t *genotypes_p, const char *key_s)
+/*
+ * Each accession is a key in every marker's document, so two rows with
+ * the same accession would give documents with repeated keys. Different
+ * genotype names can map to the same accession, so rather than silently
+ * dropping one of the rows, the whole table is rejected.
+ */
+static bool CheckAccessionsAreUnique (const PopulationTable *table_p)
 {
-	const char *parent_s = GetJSONString (genotypes_p, S_ID_S);
+	bool success_flag = true;
 
-	if (parent_s)
+	if (table_p -> pt_num_genotypes > 1)
 		{
-			if (SetJSONString (doc_p, key_s, parent_s))
+			const char **accessions_ss = (const char **) AllocMemoryArray (table_p -> pt_num_genotypes, sizeof (const char *));
+
+			if (accessions_ss)
+				{
+					size_t i;
+
+					memcpy (accessions_ss, table_p -> pt_accessions_ss, (table_p -> pt_num_genotypes) * sizeof (const char *));
+					qsort (accessions_ss, table_p -> pt_num_genotypes, sizeof (const char *), CompareAccessions);
+
+					for (i = 1; (i < table_p -> pt_num_genotypes) && success_flag; ++ i)
+						{
+							if (strcmp (accessions_ss [i - 1], accessions_ss [i]) == 0)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "More than one genotype in population \"%s\" has the accession \"%s\"", table_p -> pt_name_s, accessions_ss [i]);
+									success_flag = false;
+								}
+						}
+
+					FreeMemory (accessions_ss);
+				}
+			else
 				{
-					return parent_s;
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " accessions to check", table_p -> pt_num_genotypes);
+					success_flag = false;
 				}
 		}
 
-	return NULL;
+	return success_flag;
+}
+
+
+static int CompareAccessions (const void *v0_p, const void *v1_p)
+{
+	return strcmp (* ((const char * const *) v0_p), * ((const char * const *) v1_p));
 }
 
 
 /*
- * Paragon x Watkins 1190[0-9][0-9][0-9]" to "ParW[0-9][0-9][0-9]"
+ * The marker names may contain full stops and although MongoDB 3.6+
+ * allows these, the current version of the mongo-c driver (1.13)
+ * does not, so we need to do the escaping ourselves. Each name is
+ * escaped once, here, rather than for every row, and all of the
+ * escaped names share a single buffer.
  */
-static char *GetAccession (const json_t *genotypes_p, GeneTreesServiceData *data_p)
+static bool InitMarkerKeys (PopulationTable *table_p)
 {
-	char *parents_s = NULL;
-	const char *accession_s = GetJSONString (genotypes_p, S_ID_S);
+	const size_t escaped_dot_length = strlen (PGS_ESCAPED_DOT_S);
+	size_t escaped_size = 0;
+	size_t num_markers = 0;
+	void *iter_p = json_object_iter (table_p -> pt_chromosomes_p);
 
-	if (accession_s)
+	while (iter_p)
 		{
-			bool success_flag = true;
+			const char *key_s = json_object_iter_key (iter_p);
 
-			if (data_p -> pgsd_name_mappings_p)
+			if (strcmp (key_s, S_ID_S) != 0)
 				{
-					void *iterator_p = json_object_iter (data_p -> pgsd_name_mappings_p);
+					const char *dot_s = strchr (key_s, '.');
 
-					while (iterator_p && success_flag)
+					if (dot_s)
 						{
-							const char *key_s = json_object_iter_key (iterator_p);
-					    const size_t key_length = strlen (key_s);
+							size_t size = strlen (key_s) + 1;
 
-							if (strncmp (accession_s, key_s, key_length) == 0)
+							while (dot_s)
 								{
-									json_t *value_p = json_object_iter_value (iterator_p);
+									size += escaped_dot_length - 1;
+									dot_s = strchr (dot_s + 1, '.');
+								}
 
-									if (json_is_string (value_p))
-										{
-											const char *value_s = json_string_value (value_p);
+							escaped_size += size;
+						}
 
-											accession_s += key_length;
-											parents_s = ConcatenateStrings (value_s, accession_s);
+					++ num_markers;
+				}
 
-											if (!parents_s)
+			iter_p = json_object_iter_next (table_p -> pt_chromosomes_p, iter_p);
+		}
+
+	if (num_markers == 0)
+		{
+			return true;
+		}
+
+	table_p -> pt_marker_keys_ss = (const char **) AllocMemoryArray (num_markers, sizeof (const char *));
+
+	if (table_p -> pt_marker_keys_ss)
+		{
+			if ((escaped_size == 0) || ((table_p -> pt_escaped_markers_s = (char *) AllocMemory (escaped_size)) != NULL))
+				{
+					char *escaped_s = table_p -> pt_escaped_markers_s;
+
+					iter_p = json_object_iter (table_p -> pt_chromosomes_p);
+
+					while (iter_p)
+						{
+							const char *key_s = json_object_iter_key (iter_p);
+
+							if (strcmp (key_s, S_ID_S) != 0)
+								{
+									if (strchr (key_s, '.'))
+										{
+											const char *c_p;
+
+											table_p -> pt_marker_keys_ss [table_p -> pt_num_markers] = escaped_s;
+
+											for (c_p = key_s; *c_p != '\0'; ++ c_p)
 												{
-													success_flag = false;
-													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to concatenate \"%s\" and \"%s\"", value_s, accession_s);
-												}		/* if (!parents_s) */
+													if (*c_p == '.')
+														{
+															memcpy (escaped_s, PGS_ESCAPED_DOT_S, escaped_dot_length);
+															escaped_s += escaped_dot_length;
+														}
+													else
+														{
+															*escaped_s = *c_p;
+															++ escaped_s;
+														}
+												}
 
-										}		/* if (json_is_string (value_p)) */
+											*escaped_s = '\0';
+											++ escaped_s;
+										}
 									else
 										{
-											success_flag  = false;
-											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, data_p -> pgsd_name_mappings_p, "Value for \"%s\" is not a string", key_s);
+											table_p -> pt_marker_keys_ss [table_p -> pt_num_markers] = key_s;
 										}
 
-								}		/* if (strncmp (accession_s, key_s, key_length) == 0) */
+									++ (table_p -> pt_num_markers);
+								}
+
+							iter_p = json_object_iter_next (table_p -> pt_chromosomes_p, iter_p);
+						}
+
+					return true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for escaped marker names", escaped_size);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " marker names", num_markers);
+		}
+
+	return false;
+}
+
+
+/*
+ * Fill in a marker's document by reading down its column of the table:
+ * its chromosome, its genetic mapping position and then the value for
+ * each individual keyed by their accession.
+ */
+static bool AddMarker (bson_t *marker_p, const char *marker_s, const char *chromosome_s, const PopulationTable *table_p)
+{
+	bool success_flag = false;
+
+	if (BSON_APPEND_UTF8 (marker_p, PGS_CHROMOSOME_S, chromosome_s))
+		{
+			const char *position_s = GetJSONString (table_p -> pt_mappings_p, marker_s);
+
+			if ((!position_s) || BSON_APPEND_UTF8 (marker_p, PGS_MAPPING_POSITION_S, position_s))
+				{
+					size_t i;
+
+					success_flag = true;
 
-							if (success_flag)
+					for (i = 0; (i < table_p -> pt_num_genotypes) && success_flag; ++ i)
+						{
+							const char *accession_s = table_p -> pt_accessions_ss [i];
+							const char *value_s = GetJSONString (json_array_get (table_p -> pt_rows_p, S_FIRST_GENOTYPE_ROW + i), marker_s);
+
+							if (value_s)
 								{
-									iterator_p = json_object_iter_next (data_p -> pgsd_name_mappings_p, iterator_p);
+									if (!BSON_APPEND_UTF8 (marker_p, accession_s, value_s))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set \"%s\": \"%s\" for \"%s\"", accession_s, value_s, marker_s);
+											success_flag = false;
+										}
 								}
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set \"%s\": \"%s\" for \"%s\"", PGS_MAPPING_POSITION_S, position_s, marker_s);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set \"%s\": \"%s\" for \"%s\"", PGS_CHROMOSOME_S, chromosome_s, marker_s);
+		}
 
-						}		/* while (iterator_p && success_flag) */
+	return success_flag;
+}
 
-				}		/* if (data_p -> pgsd_name_mappings_p) */
 
-			if (success_flag && (parents_s == NULL))
+/*
+ * Paragon x Watkins 1190[0-9][0-9][0-9]" to "ParW[0-9][0-9][0-9]"
+ *
+ * The longest of the configured name prefixes that matches is replaced
+ * and if none of them match, the name is used as it is.
+ */
+static char *GetAccession (const json_t *genotypes_p, const AccessionMappings *mappings_p)
+{
+	char *parents_s = NULL;
+	const char *accession_s = GetJSONString (genotypes_p, S_ID_S);
+
+	if (accession_s)
+		{
+			const char *value_s = NULL;
+			size_t prefix_length = 0;
+
+			if (mappings_p)
+				{
+					value_s = GetAccessionMapping (mappings_p, accession_s, &prefix_length);
+				}
+
+			if (value_s)
+				{
+					parents_s = ConcatenateStrings (value_s, accession_s + prefix_length);
+
+					if (!parents_s)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to concatenate \"%s\" and \"%s\"", value_s, accession_s + prefix_length);
+						}		/* if (!parents_s) */
+				}
+			else
 				{
 					parents_s = EasyCopyToNewString (accession_s);
 
@@ -593,7 +1092,6 @@ static char *GetAccession (const json_t *genotypes_p, GeneTreesServiceData *data
 						{
 							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy \"%s\"", accession_s);
 						}		/* if (!parents_s) */
-
 				}
 
 		}		/* if (accession_s) */
@@ -602,376 +1100,553 @@ static char *GetAccession (const json_t *genotypes_p, GeneTreesServiceData *data
 }
 
 
-static bool AddGenotypesRow (json_t *doc_p, json_t *genotypes_p, GeneTreesServiceData *data_p)
+static bson_oid_t *SaveMarkers (const char **parent_a_ss, const char **parent_b_ss, const json_t *data_json_p, GeneTreesServiceData *data_p)
 {
-	bool success_flag = true;
-	char *accession_s = GetAccession (genotypes_p, data_p);
+	bson_oid_t *id_p = NULL;
+	PopulationTable table;
+
+	/*
+		The organisation is:
+		1 row = marker name
+		2 row = chromosome / linkage group name
+		3 row = genetic mapping position
+		4 row = Parent A (always Paragon for this set)
+		5 row = Parent B (always a Watkins landrace accession in format "Watkins 1190[0-9][0-9][0-9]"
+		6 to last row = individuals of that population, progenies from the cross of Parent A with Parent B
+
+		We abbreviate the population names from correctly: "Paragon x Watkins 1190[0-9][0-9][0-9]" to "ParW[0-9][0-9][0-9]".
+		The code 1190xxx was the original number these lines were stored in the germplasm resource unit.
+
+		Since the first row, the marker names, is used as the headers, the first entry of the
+		table is the chromosome / linkage group name.
+	 */
+	if (InitPopulationTable (&table, data_json_p, data_p))
+		{
+			id_p = GetNewBSONOid ();
 
-	if (accession_s)
+			if (id_p)
+				{
+					if (SaveMarkerChunks (&table, id_p, data_p))
+						{
+							*parent_a_ss = table.pt_parent_a_s;
+							*parent_b_ss = table.pt_parent_b_s;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to save \"%s\" to \"%s\" -> \"%s\"", table.pt_name_s, data_p -> pgsd_database_s, data_p -> pgsd_populations_collection_s);
+							FreeBSONOid (id_p);
+							id_p = NULL;
+						}
+				}
+
+			ClearPopulationTable (&table);
+		}		/* if (InitPopulationTable (&table, data_json_p, data_p)) */
+
+	return id_p;
+}
+
+
+/*
+ * Save a population as a number of chunks, each with its own share of the
+ * markers along with the population's parents and name. Each marker's
+ * document is built straight into BSON from its column of the table, so
+ * apart from the table itself only one chunk of up to S_MARKER_CHUNK_SIZE
+ * bytes is being built at a time.
+ *
+ * Every chunk has "population_id" set to the population's id and "chunk"
+ * set to its index, and the first chunk also uses the population's id as
+ * its own _id so that looking the population up by its id still finds it.
+ * The remaining chunks are found with { population_id: <id> } sorted by
+ * "chunk". The chunks are sent with ordered bulk inserts and if any of
+ * them fail, those that were saved are removed again.
+ */
+static bool SaveMarkerChunks (const PopulationTable *table_p, const bson_oid_t *id_p, GeneTreesServiceData *data_p)
+{
+	bool success_flag = false;
+	MongoTool *tool_p = data_p -> pgsd_mongo_p;
+
+	if (SetMongoToolCollection (tool_p, data_p -> pgsd_populations_collection_s))
 		{
-			void *iter_p = json_object_iter (genotypes_p);
+			mongoc_bulk_operation_t *bulk_p = NULL;
+			size_t queued_size = 0;
+			uint32 num_chunks = 0;
+			uint32 num_markers = 0;
+			bson_t *chunk_p = AllocateMarkerChunk (table_p, id_p, num_chunks);
 
-			while (iter_p && success_flag)
+			if (chunk_p)
 				{
-					const char *key_s = json_object_iter_key (iter_p);
+					void *iter_p = json_object_iter (table_p -> pt_chromosomes_p);
+					size_t marker_index = 0;
+					bson_t marker;
 
-					if (strcmp (key_s, S_ID_S) != 0)
+					bson_init (&marker);
+					success_flag = true;
+
+					while (iter_p && success_flag)
 						{
-							const char *value_s = GetJSONString (genotypes_p, key_s);
+							const char *key_s = json_object_iter_key (iter_p);
 
-							if (value_s)
+							if (strcmp (key_s, S_ID_S) != 0)
 								{
-									/*
-									 * The marker name may contain full stops and although MongoDB 3.6+
-									 * allows these, the current version of the mongo-c driver (1.13)
-									 * does not, so we need to do the escaping ourselves
-									 */
-									char *escaped_key_s = NULL;
-
-									if (SearchAndReplaceInString (key_s, &escaped_key_s, ".", PGS_ESCAPED_DOT_S))
+									const char *marker_s = table_p -> pt_marker_keys_ss [marker_index];
+
+									++ marker_index;
+
+									bson_reinit (&marker);
+
+									if (AddMarker (&marker, key_s, json_string_value (json_object_iter_value (iter_p)), table_p))
 										{
-											/*
-											 * use key and value ...
-											 */
-											json_t *marker_p = json_object_get (doc_p, escaped_key_s ? escaped_key_s : key_s);
+											/* The type byte, the key and its terminator, then the value */
+											const size_t entry_size = 2 + strlen (marker_s) + marker.len;
 
-											if (marker_p)
+											if (entry_size >= S_MAX_DOCUMENT_SIZE)
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Marker \"%s\" is too big to save at " SIZET_FMT " bytes", marker_s, entry_size);
+													success_flag = false;
+												}
+											else if ((num_markers > 0) && (chunk_p -> len + entry_size > S_MARKER_CHUNK_SIZE))
 												{
-													if (!SetJSONString (marker_p, accession_s, value_s))
+													success_flag = InsertMarkerChunk (&bulk_p, &queued_size, chunk_p, tool_p);
+
+													bson_destroy (chunk_p);
+													num_markers = 0;
+
+													if ((chunk_p = AllocateMarkerChunk (table_p, id_p, ++ num_chunks)) == NULL)
 														{
-															PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, marker_p, "Failed to set \"%s\": \"%s\"", accession_s, value_s);
 															success_flag = false;
 														}
-
-												}		/* if (marker_p) */
-											else
-												{
-													PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, doc_p, "Failed to get marker for %s", key_s);
-													success_flag = false;
 												}
 
-											if (escaped_key_s)
+											if (success_flag)
 												{
-													FreeCopiedString (escaped_key_s);
+													if (BSON_APPEND_DOCUMENT (chunk_p, marker_s, &marker))
+														{
+															++ num_markers;
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add marker \"%s\" to chunk " UINT32_FMT, marker_s, num_chunks);
+															success_flag = false;
+														}
 												}
+										}
+									else
+										{
+											success_flag = false;
+										}
 
-										}		/* if (SearchAndReplaceInString (key_s, &escaped_marker_s, ".", PGS_DOT_S)) */
+								}		/* if (strcmp (key_s, S_ID_S) != 0) */
 
-								}		/* if (value_s) */
-							else
+							iter_p = json_object_iter_next (table_p -> pt_chromosomes_p, iter_p);
+						}		/* while (iter_p && success_flag) */
+
+					bson_destroy (&marker);
+
+					if (chunk_p)
+						{
+							/* A population without any markers is still saved */
+							if (success_flag && ((num_markers > 0) || (num_chunks == 0)))
 								{
-									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, genotypes_p, "Failed to get %s", key_s);
-									success_flag = false;
+									success_flag = InsertMarkerChunk (&bulk_p, &queued_size, chunk_p, tool_p);
 								}
 
-						}		/* if (strcmp (key_s, S_ID_S) == 0) else ... */
+							bson_destroy (chunk_p);
+						}
 
-					iter_p = json_object_iter_next (genotypes_p, iter_p);
+				}		/* if (chunk_p) */
+
+			if (!SendMarkerChunks (&bulk_p, &queued_size))
+				{
+					success_flag = false;
 				}
 
-			FreeCopiedString (accession_s);
-		}		/* if (accession_s) */
-	else
-		{
-			PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, genotypes_p, "Failed to get %s", S_ID_S);
-			success_flag = false;
-		}
+			if ((!success_flag) && (num_chunks > 0))
+				{
+					RemoveMarkerChunks (id_p, tool_p);
+				}
 
+		}		/* if (SetMongoToolCollection (tool_p, data_p -> pgsd_populations_collection_s)) */
 
 	return success_flag;
 }
 
 
-static bson_oid_t *SaveMarkers (const char **parent_a_ss, const char **parent_b_ss, const json_t *data_json_p, GeneTreesServiceData *data_p)
+/*
+ * Start a chunk of a population with its ids and the population's
+ * parents and name.
+ */
+static bson_t *AllocateMarkerChunk (const PopulationTable *table_p, const bson_oid_t *id_p, const uint32 chunk)
 {
-	bson_oid_t *id_p = NULL;
-	bool success_flag = false;
-	json_t *doc_p = json_object ();
+	bson_t *chunk_p = bson_new ();
 
-	if (doc_p)
+	if (chunk_p)
 		{
-			id_p = GetNewBSONOid ();
+			bool success_flag = true;
 
-			if (id_p)
+			/* Any later chunks get their _id from the driver */
+			if (chunk == 0)
 				{
-					if (AddCompoundIdToJSON (doc_p, id_p))
-						{
-							/*
-								The organisation is:
-								1 row = marker name
-								2 row = chromosome / linkage group name
-								3 row = genetic mapping position
-								4 row = Parent A (always Paragon for this set)
-								5 row = Parent B (always a Watkins landrace accession in format "Watkins 1190[0-9][0-9][0-9]"
-								6 to last row = individuals of that population, progenies from the cross of Parent A with Parent B
-
-								We abbreviate the population names from correctly: "Paragon x Watkins 1190[0-9][0-9][0-9]" to "ParW[0-9][0-9][0-9]".
-								The code 1190xxx was the original number these lines were stored in the germplasm resource unit.
-							 */
-							if (json_is_array (data_json_p))
-								{
-									const size_t num_rows = json_array_size (data_json_p);
-
-									/*
-									 * There are 2 header rows, so the actual genotype data doesn't
-									 * start until row 3
-									 */
-									if (num_rows >= 3)
-										{
-											/*
-											 * Since the first row, the marker names, is used as the headers, the first entry should be
-											 * the chromosome / linkage group name
-											 */
-											size_t row_index = 0;
-											json_t *row_p = json_array_get (data_json_p, row_index);
-
-											if (AddChromosomes (doc_p, row_p))
-												{
-													/*
-													 * genetic mapping position
-													 */
-													row_p = json_array_get (data_json_p, ++ row_index);
-
-													if (AddGeneticMappingPositions (doc_p, row_p))
-														{
-															row_p = json_array_get (data_json_p, ++ row_index);
-															const char *parent_a_s = AddParentRow (doc_p, row_p, PGS_PARENT_A_S);
-
-															if (parent_a_s)
-																{
-																	row_p = json_array_get (data_json_p, ++ row_index);
-																	const char *parent_b_s = AddParentRow (doc_p, row_p, PGS_PARENT_B_S);
-
-																	if (parent_b_s)
-																		{
-																			char *name_s = ConcatenateVarargsStrings (parent_a_s, " x ", parent_b_s, NULL);
-
-																			if (name_s)
-																				{
-																					if (SetJSONString (doc_p, PGS_POPULATION_NAME_S, name_s))
-																						{
-																							success_flag = true;
-
-																							++ row_index;
+					success_flag = BSON_APPEND_OID (chunk_p, MONGO_ID_S, id_p);
+				}
 
-																							while ((row_index < num_rows) && success_flag)
-																								{
-																									row_p = json_array_get (data_json_p, row_index);
+			if (success_flag &&
+				BSON_APPEND_OID (chunk_p, S_POPULATION_ID_S, id_p) &&
+				BSON_APPEND_INT32 (chunk_p, S_CHUNK_S, (int32) chunk) &&
+				BSON_APPEND_UTF8 (chunk_p, PGS_PARENT_A_S, table_p -> pt_parent_a_s) &&
+				BSON_APPEND_UTF8 (chunk_p, PGS_PARENT_B_S, table_p -> pt_parent_b_s) &&
+				BSON_APPEND_UTF8 (chunk_p, PGS_POPULATION_NAME_S, table_p -> pt_name_s))
+				{
+					return chunk_p;
+				}
 
-																									if (AddGenotypesRow (doc_p, row_p, data_p))
-																										{
-																											++ row_index;
-																										}
-																									else
-																										{
-																											success_flag = false;
-																										}
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to start chunk " UINT32_FMT " of \"%s\"", chunk, table_p -> pt_name_s);
+			bson_destroy (chunk_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate chunk " UINT32_FMT " of \"%s\"", chunk, table_p -> pt_name_s);
+		}
 
-																								}		/* while ((row_index < num_rows) && success_flag) */
+	return NULL;
+}
 
-																							if (success_flag)
-																								{
-																									/*
-																									 * Save the document
-																									 */
-																									bson_t *bson_doc_p = ConvertJSONToBSON (doc_p);
 
-																									if (bson_doc_p)
-																										{
-																											/*
-																											 * Is the doc ok to save in one go?
-																											 */
-																											if (bson_doc_p -> len < BSON_MAX_SIZE)
-																												{
-																													if (SaveMongoDataFromBSON (data_p -> pgsd_mongo_p, bson_doc_p, data_p -> pgsd_populations_collection_s, NULL))
-																														{
-																															*parent_a_ss = parent_a_s;
-																															*parent_b_ss = parent_b_s;
-																														}
-																													else
-																														{
-																															success_flag = false;
-																															PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, doc_p, "Failed to save to \"%s\" -> \"%s\"", data_p -> pgsd_database_s, data_p -> pgsd_populations_collection_s);
-																														}
+/*
+ * Queue a chunk to be inserted. A bulk insert keeps its own copy of each
+ * chunk, so once S_MAX_BULK_INSERT_SIZE bytes are queued they are sent
+ * and the next chunk starts a new bulk insert. This keeps the memory
+ * used bounded however big the population is.
+ */
+static bool InsertMarkerChunk (mongoc_bulk_operation_t **bulk_pp, size_t *queued_size_p, const bson_t *chunk_p, MongoTool *tool_p)
+{
+	bool success_flag = false;
 
-																													bson_destroy (bson_doc_p);
-																												}
-																											else
-																												{
-																													/*
-																													 * We need to break the doc up into more
-																													 * manageable chunks so make a guess at how
-																													 * many docs we need
-																													 */
-																													size_t num_docs = (size_t) ((double) (bson_doc_p -> len) / (double) BSON_MAX_SIZE) + 1;
+	if (! (*bulk_pp))
+		{
+			*bulk_pp = mongoc_collection_create_bulk_operation_with_opts (tool_p -> mt_collection_p, NULL);
+		}
 
+	if (*bulk_pp)
+		{
+			bson_error_t error;
 
-																													/*
-																													 * Free the memory of the large doc
-																													 */
-																													bson_destroy (bson_doc_p);
+			if (mongoc_bulk_operation_insert_with_opts (*bulk_pp, chunk_p, NULL, &error))
+				{
+					*queued_size_p += chunk_p -> len;
+					success_flag = true;
 
-																												}
+					if (*queued_size_p >= S_MAX_BULK_INSERT_SIZE)
+						{
+							success_flag = SendMarkerChunks (bulk_pp, queued_size_p);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add chunk to bulk insert: %s", error.message);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create bulk insert");
+		}
 
+	return success_flag;
+}
 
-																										}		/* if (bson_doc_p) */
 
+/*
+ * Send any queued chunks to the server.
+ */
+static bool SendMarkerChunks (mongoc_bulk_operation_t **bulk_pp, size_t *queued_size_p)
+{
+	bool success_flag = true;
 
-																								}
+	if (*bulk_pp)
+		{
+			bson_error_t error;
+			bson_t reply;
 
-																						}		/* if (SetJSONString (doc_p, PGS_POPULATION_NAME_S, name_s)) */
+			if (!mongoc_bulk_operation_execute (*bulk_pp, &reply, &error))
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, &reply, "Failed to save " SIZET_FMT " bytes of chunks: %s", *queued_size_p, error.message);
+					success_flag = false;
+				}
 
-																					FreeCopiedString (name_s);
-																				}		/* if (name_s) */
+			bson_destroy (&reply);
+			mongoc_bulk_operation_destroy (*bulk_pp);
 
+			*bulk_pp = NULL;
+			*queued_size_p = 0;
+		}
 
-																		}		/* if (parent_b_s) */
+	return success_flag;
+}
 
-																}		/* if (parent_a_s) */
 
-														}		/* if (AddGeneticMappingPositions (doc_p, row_p)) */
+/*
+ * Remove any chunks of a population that were saved before one of
+ * the others failed.
+ */
+static void RemoveMarkerChunks (const bson_oid_t *id_p, MongoTool *tool_p)
+{
+	bson_t *query_p = BCON_NEW (S_POPULATION_ID_S, BCON_OID (id_p));
 
-												}		/* if (AddChromosomes (doc_p, chromosomes_p)) */
+	if (query_p)
+		{
+			bson_error_t error;
 
-										}		/* if (num_rows >= 3) */
+			if (!mongoc_collection_delete_many (tool_p -> mt_collection_p, query_p, NULL, NULL, &error))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to remove incomplete population chunks: %s", error.message);
+				}
 
-								}		/* if (json_is_array (data_json_p)) */
+			bson_destroy (query_p);
+		}
+}
 
-						}		/* if (AddCompoundIdToJSON (doc_p, id_p)) */
 
-				}		/* if (id_p) */
+/*
+ * Add the population's id to both of its parents' varieties. Each parent
+ * is a single atomic upsert that uses $addToSet, so the server does the
+ * update without the variety being read first, concurrent submissions
+ * can't overwrite each other's ids and an id is only added once.
+ *
+ * Two submissions that both upsert a new variety at the same time can
+ * both try to insert it. The unique index on the varieties' names makes
+ * all but one of them fail with a duplicate key error and sending the
+ * upserts again then updates the variety that was inserted. Any upsert
+ * that did succeed is harmless to repeat because of the $addToSet.
+ */
+static bool SaveVarieties (const char *parent_a_s, const char *parent_b_s, const bson_oid_t *id_p, GeneTreesServiceData *data_p)
+{
+	bool success_flag = false;
 
+	if (SetMongoToolCollection (data_p -> pgsd_mongo_p, data_p -> pgsd_varieties_collection_s))
+		{
+			bool duplicate_flag = true;
+			uint32 i;
 
-			json_decref (doc_p);
-		}		/* if (doc_p) */
+			EnsureVarietyNameIndex (data_p);
 
-	if (!success_flag)
-		{
-			if (id_p)
+			for (i = 0; (i < S_NUM_VARIETY_UPSERT_ATTEMPTS) && duplicate_flag && (!success_flag); ++ i)
 				{
-					FreeBSONOid (id_p);
+					success_flag = RunVarietyUpserts (parent_a_s, parent_b_s, id_p, data_p, &duplicate_flag);
 				}
-		}
 
+		}		/* if (SetMongoToolCollection (data_p -> pgsd_mongo_p, data_p -> pgsd_varieties_collection_s)) */
 
-	return success_flag ? id_p : NULL;
+	return success_flag;
 }
 
 
-static bool SaveVarieties (const char *parent_a_s, const char *parent_b_s, const bson_oid_t *id_p, GeneTreesServiceData *data_p)
+/*
+ * Send the upserts for both parents together in one bulk operation.
+ * duplicate_flag_p is set to whether it failed with a duplicate key
+ * error, in which case it is worth trying again.
+ */
+static bool RunVarietyUpserts (const char *parent_a_s, const char *parent_b_s, const bson_oid_t *id_p, GeneTreesServiceData *data_p, bool *duplicate_flag_p)
 {
 	bool success_flag = false;
-	MongoTool *tool_p = data_p -> pgsd_mongo_p;
+	mongoc_bulk_operation_t *bulk_p = mongoc_collection_create_bulk_operation_with_opts (data_p -> pgsd_mongo_p -> mt_collection_p, NULL);
 
-	if (SetMongoToolCollection (tool_p, data_p -> pgsd_varieties_collection_s))
+	*duplicate_flag_p = false;
+
+	if (bulk_p)
 		{
-			if (SaveVariety (parent_a_s, id_p, tool_p))
+			if (AddVarietyUpsert (bulk_p, parent_a_s, id_p))
 				{
-					if (SaveVariety (parent_b_s, id_p, tool_p))
+					/* A population could be a cross of a variety with itself */
+					if ((strcmp (parent_a_s, parent_b_s) == 0) || AddVarietyUpsert (bulk_p, parent_b_s, id_p))
 						{
-							success_flag = true;
-						}
+							bson_error_t error;
+							bson_t reply;
 
+							if (mongoc_bulk_operation_execute (bulk_p, &reply, &error))
+								{
+									success_flag = true;
+								}
+							else if (error.code == MONGOC_ERROR_DUPLICATE_KEY)
+								{
+									PrintErrors (STM_LEVEL_INFO, __FILE__, __LINE__, "Another submission added variety \"%s\" or \"%s\" at the same time, trying again", parent_a_s, parent_b_s);
+									*duplicate_flag_p = true;
+								}
+							else
+								{
+									PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, &reply, "Failed to save varieties \"%s\" and \"%s\" to \"%s\" -> \"%s\": %s", parent_a_s, parent_b_s, data_p -> pgsd_database_s, data_p -> pgsd_varieties_collection_s, error.message);
+								}
+
+							bson_destroy (&reply);
+						}
 				}
 
-		}		/* if (SetMongoToolCollection (data_p -> pgsd_mongo_p, data_p -> pgsd_accessions_collection_s)) */
+			mongoc_bulk_operation_destroy (bulk_p);
+		}		/* if (bulk_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create bulk operation for \"%s\"", data_p -> pgsd_varieties_collection_s);
+		}
 
 	return success_flag;
 }
 
 
-static bool SaveVariety (const char *parent_s, const bson_oid_t *id_p, MongoTool *mongo_p)
+/*
+ * Create the unique index on the varieties' names that stops concurrent
+ * upserts from inserting the same variety twice. createIndexes is a no-op
+ * if the index already exists. If it can't be built, e.g. because the
+ * collection already has repeated names, the upserts still work but
+ * concurrent submissions of a new variety could add it twice, so the
+ * failure is logged and it is tried again by the next submission.
+ */
+static void EnsureVarietyNameIndex (GeneTreesServiceData *data_p)
 {
-	bool success_flag = false;
-	bson_t *query_p = bson_new ();
+	char *name_s = ConcatenateVarargsStrings (data_p -> pgsd_database_s, ".", data_p -> pgsd_varieties_collection_s, NULL);
 
-	if (query_p)
+	if (name_s)
 		{
-			if (BSON_APPEND_UTF8 (query_p, PGS_POPULATION_NAME_S, parent_s))
-				{
-					bool done_flag = false;
-
-					/*
-					 * Is the accession already in the collection
-					 */
-					json_t *results_p = GetAllMongoResultsAsJSON (mongo_p, query_p, NULL);
+			pthread_mutex_lock (&s_variety_index_lock);
 
-					if (results_p)
+			if (!IsCollectionIndexed (name_s))
+				{
+					bson_t *command_p = BCON_NEW ("createIndexes", BCON_UTF8 (data_p -> pgsd_varieties_collection_s),
+						"indexes", "[",
+							"{",
+								"key", "{", PGS_POPULATION_NAME_S, BCON_INT32 (1), "}",
+								"name", BCON_UTF8 (S_VARIETY_NAME_INDEX_S),
+								"unique", BCON_BOOL (true),
+							"}",
+						"]");
+
+					if (command_p)
 						{
-							if (json_is_array (results_p))
+							mongoc_database_t *database_p = mongoc_client_get_database (data_p -> pgsd_mongo_p -> mt_client_p, data_p -> pgsd_database_s);
+
+							if (database_p)
 								{
-									const size_t num_results = json_array_size (results_p);
+									bson_t reply;
+									bson_error_t error;
 
-									if (num_results == 1)
+									if (mongoc_database_write_command_with_opts (database_p, command_p, NULL, &reply, &error))
 										{
-											json_t *accession_data_p = json_array_get (results_p, 0);
-											json_t *marker_ids_p = json_object_get (accession_data_p, PGS_VARIETY_IDS_S);
-
-											if (marker_ids_p)
-												{
-													done_flag = true;
-
-													if (json_is_array (marker_ids_p))
-														{
-															if (AddCompoundIdToJSONArray (marker_ids_p, id_p))
-																{
-																	if (SaveMongoData (mongo_p, accession_data_p, NULL, query_p))
-																		{
-																			success_flag = true;
-																		}
-																}
-														}
-												}
+											SetCollectionIndexed (name_s);
+											name_s = NULL;
 										}
+									else
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create unique index on \"%s\" for db \"%s\" collection \"%s\": %s", PGS_POPULATION_NAME_S, data_p -> pgsd_database_s, data_p -> pgsd_varieties_collection_s, error.message);
+										}
+
+									bson_destroy (&reply);
+									mongoc_database_destroy (database_p);
+								}		/* if (database_p) */
+							else
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to get database \"%s\"", data_p -> pgsd_database_s);
 								}
 
-							json_decref (results_p);
-						}		/* if (results_p) */
+							bson_destroy (command_p);
+						}		/* if (command_p) */
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create index command for db \"%s\" collection \"%s\"", data_p -> pgsd_database_s, data_p -> pgsd_varieties_collection_s);
+						}
+				}		/* if (!IsCollectionIndexed (name_s)) */
 
+			pthread_mutex_unlock (&s_variety_index_lock);
 
-					/*
-					 * Do we need to do an insert?
-					 */
-					if (! (success_flag && done_flag))
-						{
-							json_t *accession_data_p = json_object ();
+			if (name_s)
+				{
+					FreeCopiedString (name_s);
+				}
+		}		/* if (name_s) */
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to make name for db \"%s\" collection \"%s\"", data_p -> pgsd_database_s, data_p -> pgsd_varieties_collection_s);
+		}
+}
 
-							if (accession_data_p)
-								{
-									if (SetJSONString (accession_data_p, PGS_POPULATION_NAME_S, parent_s))
-										{
-											json_t *marker_ids_p = json_array ();
 
-											if (marker_ids_p)
-												{
-													if (json_object_set_new (accession_data_p, PGS_VARIETY_IDS_S, marker_ids_p) == 0)
-														{
-															if (AddCompoundIdToJSONArray (marker_ids_p, id_p))
-																{
-																	if (SaveMongoData (mongo_p, accession_data_p, NULL, NULL))
-																		{
-																			success_flag = true;
-																		}
-																}
-														}		/* if (json_object_set_new (accession_data_p, PGS_MARKER_IDS_S, marker_ids_p) == 0) */
-													else
-														{
-															json_decref (marker_ids_p);
-														}
+static bool IsCollectionIndexed (const char *name_s)
+{
+	const IndexedCollection *indexed_p;
 
-												}		/* if (marker_ids_p) */
+	for (indexed_p = s_indexed_collections_p; indexed_p; indexed_p = indexed_p -> ic_next_p)
+		{
+			if (strcmp (indexed_p -> ic_name_s, name_s) == 0)
+				{
+					return true;
+				}
+		}
 
-										}		/* if (SetJSONString (accession_data_p, PGS_POPULATION_NAME_S, parent_s)) */
+	return false;
+}
 
-									json_decref (accession_data_p);
-								}		/* if (accession_data_p) */
 
-						}		/* if (! (success_flag && done_flag)) */
+/*
+ * If this fails, the only cost is that the index is created again
+ */
+static void SetCollectionIndexed (char *name_s)
+{
+	IndexedCollection *indexed_p = (IndexedCollection *) AllocMemory (sizeof (IndexedCollection));
 
-				}		/* if (BSON_APPEND_UTF8 (query_p, PGS_POPULATION_NAME_S, parent_s)) */
+	if (indexed_p)
+		{
+			indexed_p -> ic_name_s = name_s;
+			indexed_p -> ic_next_p = s_indexed_collections_p;
+			s_indexed_collections_p = indexed_p;
+		}
+	else
+		{
+			FreeCopiedString (name_s);
+		}
+}
 
 
-			bson_destroy (query_p);
+/*
+ * Add
+ *
+ *   { name: <parent> }, { $addToSet: { variety_ids: <id> } }, { upsert: true }
+ *
+ * to the bulk operation, which creates the variety if it isn't
+ * already in the collection.
+ */
+static bool AddVarietyUpsert (mongoc_bulk_operation_t *bulk_p, const char *parent_s, const bson_oid_t *id_p)
+{
+	bool success_flag = false;
+	bson_t *selector_p = BCON_NEW (PGS_POPULATION_NAME_S, BCON_UTF8 (parent_s));
+
+	if (selector_p)
+		{
+			bson_t *update_p = BCON_NEW ("$addToSet", "{", PGS_VARIETY_IDS_S, BCON_OID (id_p), "}");
+
+			if (update_p)
+				{
+					bson_t *opts_p = BCON_NEW ("upsert", BCON_BOOL (true));
+
+					if (opts_p)
+						{
+							bson_error_t error;
+
+							if (mongoc_bulk_operation_update_one_with_opts (bulk_p, selector_p, update_p, opts_p, &error))
+								{
+									success_flag = true;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add upsert for variety \"%s\": %s", parent_s, error.message);
+								}
+
+							bson_destroy (opts_p);
+						}
+
+					bson_destroy (update_p);
+				}
+
+			bson_destroy (selector_p);
+		}		/* if (selector_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create selector for variety \"%s\"", parent_s);
 		}
 
 	return success_flag;
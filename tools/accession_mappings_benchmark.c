@@ -0,0 +1,312 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * accession_mappings_benchmark.c
+ *
+ * Check the AccessionMappings trie against a scan of every name mapping
+ * for the longest matching prefix, which is what GetAccession () used to
+ * do, and time them both. The mappings and names are like those of the
+ * Watkins populations, including prefixes that are prefixes of each
+ * other and names that stop part of the way through a prefix.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jansson.h"
+
+#include "accession_mappings.h"
+#include "memory_allocations.h"
+
+
+#define AMB_DEFAULT_NUM_NAMES (200000)
+#define AMB_DEFAULT_NUM_MAPPINGS (1200)
+
+
+static json_t *GetNameMappings (const uint32 num_mappings);
+
+static void GetName (char *name_s, const size_t name_size, const uint32 num_mappings, unsigned int *seed_p);
+
+static const char *GetLinearAccessionMapping (const json_t *mappings_p, const char *name_s, size_t *prefix_length_p);
+
+static double GetTime (void);
+
+static void PrintUsage (const char *program_s);
+
+
+int main (int argc, char *argv [])
+{
+	unsigned long num_names = AMB_DEFAULT_NUM_NAMES;
+	unsigned long num_mappings = AMB_DEFAULT_NUM_MAPPINGS;
+	unsigned int seed = 1;
+	int ret = 1;
+	int c;
+
+	while ((c = getopt (argc, argv, "n:m:r:h")) != -1)
+		{
+			switch (c)
+				{
+					case 'n':
+						num_names = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'm':
+						num_mappings = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'r':
+						seed = (unsigned int) strtoul (optarg, NULL, 10);
+						break;
+
+					default:
+						PrintUsage (argv [0]);
+						return 1;
+				}
+		}
+
+	if ((num_names == 0) || (num_names > UINT32_MAX) || (num_mappings > 9999))
+		{
+			PrintUsage (argv [0]);
+		}
+	else
+		{
+			json_t *mappings_p = GetNameMappings ((uint32) num_mappings);
+
+			if (mappings_p)
+				{
+					AccessionMappings *accession_mappings_p = AllocateAccessionMappings (mappings_p);
+
+					if (accession_mappings_p)
+						{
+							const unsigned int names_seed = seed;
+							uint64 num_mismatches = 0;
+							size_t trie_checksum = 0;
+							size_t linear_checksum = 0;
+							double trie_time = 0.0;
+							double linear_time = 0.0;
+							char name_s [64];
+							uint32 i;
+
+							printf ("%lu mappings, %u trie nodes in %u edge slots\n", (unsigned long) json_object_size (mappings_p), accession_mappings_p -> am_num_nodes, accession_mappings_p -> am_num_edge_slots);
+
+							for (i = 0; i < num_names; ++ i)
+								{
+									size_t trie_length = 0;
+									size_t linear_length = 0;
+									const char *trie_value_s;
+									const char *linear_value_s;
+
+									GetName (name_s, sizeof (name_s), (uint32) num_mappings, &seed);
+
+									trie_value_s = GetAccessionMapping (accession_mappings_p, name_s, &trie_length);
+									linear_value_s = GetLinearAccessionMapping (mappings_p, name_s, &linear_length);
+
+									if ((trie_value_s == NULL) != (linear_value_s == NULL)
+											|| (trie_value_s && ((strcmp (trie_value_s, linear_value_s) != 0) || (trie_length != linear_length))))
+										{
+											if (num_mismatches < 10)
+												{
+													printf ("Mismatch for \"%s\": trie \"%s\" %zu, scan \"%s\" %zu\n", name_s, trie_value_s ? trie_value_s : "NULL", trie_length, linear_value_s ? linear_value_s : "NULL", linear_length);
+												}
+
+											++ num_mismatches;
+										}
+								}
+
+							printf ("%lu names checked, %llu mismatches\n", num_names, (unsigned long long) num_mismatches);
+
+							/*
+							 * Time each of them separately over the same names, so
+							 * that they are both timed with warm caches
+							 */
+							seed = names_seed;
+							trie_time = GetTime ();
+
+							for (i = 0; i < num_names; ++ i)
+								{
+									size_t length = 0;
+
+									GetName (name_s, sizeof (name_s), (uint32) num_mappings, &seed);
+
+									if (GetAccessionMapping (accession_mappings_p, name_s, &length))
+										{
+											trie_checksum += length;
+										}
+								}
+
+							trie_time = GetTime () - trie_time;
+
+							seed = names_seed;
+							linear_time = GetTime ();
+
+							for (i = 0; i < num_names; ++ i)
+								{
+									size_t length = 0;
+
+									GetName (name_s, sizeof (name_s), (uint32) num_mappings, &seed);
+
+									if (GetLinearAccessionMapping (mappings_p, name_s, &length))
+										{
+											linear_checksum += length;
+										}
+								}
+
+							linear_time = GetTime () - linear_time;
+
+							printf ("trie %.3f us/name, scan %.3f us/name, including making the names\n", trie_time * 1.0e6 / num_names, linear_time * 1.0e6 / num_names);
+
+							if ((num_mismatches == 0) && (trie_checksum == linear_checksum))
+								{
+									ret = 0;
+								}
+
+							FreeAccessionMappings (accession_mappings_p);
+						}		/* if (accession_mappings_p) */
+					else
+						{
+							fprintf (stderr, "Failed to compile %lu name mappings\n", (unsigned long) json_object_size (mappings_p));
+						}
+
+					json_decref (mappings_p);
+				}		/* if (mappings_p) */
+			else
+				{
+					fprintf (stderr, "Failed to create %lu name mappings\n", num_mappings);
+				}
+		}
+
+	return ret;
+}
+
+
+/*
+ * "Paragon x Watkins 1190" to "ParW", along with a shorter prefix of
+ * it, a single letter and num_mappings other crosses
+ */
+static json_t *GetNameMappings (const uint32 num_mappings)
+{
+	json_t *mappings_p = json_object ();
+
+	if (mappings_p)
+		{
+			bool success_flag = (json_object_set_new (mappings_p, "Paragon x Watkins 1190", json_string ("ParW")) == 0)
+				&& (json_object_set_new (mappings_p, "Paragon x Watkins", json_string ("ParWat")) == 0)
+				&& (json_object_set_new (mappings_p, "P", json_string ("X")) == 0);
+			uint32 i;
+
+			for (i = 0; (i < num_mappings) && success_flag; ++ i)
+				{
+					char key_s [64];
+					char value_s [16];
+
+					snprintf (key_s, sizeof (key_s), "Cross %04u x Watkins 1190", i);
+					snprintf (value_s, sizeof (value_s), "C%04uW", i);
+
+					success_flag = (json_object_set_new (mappings_p, key_s, json_string (value_s)) == 0);
+				}
+
+			if (success_flag)
+				{
+					return mappings_p;
+				}
+
+			json_decref (mappings_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Make a name that matches the longest prefix, a shorter one, none of
+ * them or stops part of the way through one. Some of the crosses don't
+ * have mappings.
+ */
+static void GetName (char *name_s, const size_t name_size, const uint32 num_mappings, unsigned int *seed_p)
+{
+	const uint32 r = (uint32) rand_r (seed_p);
+	const uint32 cross = (r >> 3) % (num_mappings + (num_mappings >> 3) + 1);
+	const uint32 line = (r >> 16) % 1000;
+
+	switch (r % 5)
+		{
+			case 0:
+				snprintf (name_s, name_size, "Paragon x Watkins 1190%03u", line);
+				break;
+
+			case 1:
+				snprintf (name_s, name_size, "Paragon x Watkins 2%03u", line);
+				break;
+
+			case 2:
+				snprintf (name_s, name_size, "Cross %04u x Watkins 1190%03u", cross, line);
+				break;
+
+			case 3:
+				snprintf (name_s, name_size, "Other %u", line);
+				break;
+
+			default:
+				snprintf (name_s, name_size, "Cross %04u x Wat", cross);
+				break;
+		}
+}
+
+
+static const char *GetLinearAccessionMapping (const json_t *mappings_p, const char *name_s, size_t *prefix_length_p)
+{
+	const char *value_s = NULL;
+	const char *key_s;
+	json_t *value_p;
+
+	json_object_foreach ((json_t *) mappings_p, key_s, value_p)
+		{
+			const size_t key_length = strlen (key_s);
+
+			if ((strncmp (name_s, key_s, key_length) == 0) && ((!value_s) || (key_length > *prefix_length_p)))
+				{
+					value_s = json_string_value (value_p);
+					*prefix_length_p = key_length;
+				}
+		}
+
+	return value_s;
+}
+
+
+static double GetTime (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + (t.tv_nsec * 1.0e-9);
+}
+
+
+static void PrintUsage (const char *program_s)
+{
+	fprintf (stderr,
+		"Usage: %s [-n <names>] [-m <mappings>] [-r <seed>]\n"
+		"\n"
+		"  -n  The number of names to check and to time, the default is %d.\n"
+		"  -m  The number of crosses to map, up to 9999, the default is %d.\n"
+		"  -r  The seed for the random names, the default is 1.\n",
+		program_s, AMB_DEFAULT_NUM_NAMES, AMB_DEFAULT_NUM_MAPPINGS);
+}
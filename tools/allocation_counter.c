@@ -0,0 +1,122 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * allocation_counter.c
+ *
+ * The wrappers forward to glibc's own allocator through its __libc_*
+ * entry points, so this only builds against glibc. Aligned allocations,
+ * such as posix_memalign (), aren't counted.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "allocation_counter.h"
+
+
+extern void *__libc_malloc (size_t size);
+
+extern void *__libc_calloc (size_t num, size_t size);
+
+extern void *__libc_realloc (void *ptr, size_t size);
+
+extern void __libc_free (void *ptr);
+
+
+static AllocationCounts s_counts = { 0, 0, 0 };
+
+
+void *malloc (size_t size)
+{
+	__atomic_add_fetch (& (s_counts.ac_num_allocations), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (& (s_counts.ac_num_bytes), size, __ATOMIC_RELAXED);
+
+	return __libc_malloc (size);
+}
+
+
+void *calloc (size_t num, size_t size)
+{
+	__atomic_add_fetch (& (s_counts.ac_num_allocations), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (& (s_counts.ac_num_bytes), num * size, __ATOMIC_RELAXED);
+
+	return __libc_calloc (num, size);
+}
+
+
+void *realloc (void *ptr, size_t size)
+{
+	__atomic_add_fetch (& (s_counts.ac_num_allocations), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (& (s_counts.ac_num_bytes), size, __ATOMIC_RELAXED);
+
+	return __libc_realloc (ptr, size);
+}
+
+
+void free (void *ptr)
+{
+	if (ptr)
+		{
+			__atomic_add_fetch (& (s_counts.ac_num_frees), 1, __ATOMIC_RELAXED);
+		}
+
+	__libc_free (ptr);
+}
+
+
+void GetAllocationCounts (AllocationCounts *counts_p)
+{
+	counts_p -> ac_num_allocations = __atomic_load_n (& (s_counts.ac_num_allocations), __ATOMIC_RELAXED);
+	counts_p -> ac_num_frees = __atomic_load_n (& (s_counts.ac_num_frees), __ATOMIC_RELAXED);
+	counts_p -> ac_num_bytes = __atomic_load_n (& (s_counts.ac_num_bytes), __ATOMIC_RELAXED);
+}
+
+
+size_t GetCurrentRSS (void)
+{
+	size_t rss = 0;
+	FILE *statm_f = fopen ("/proc/self/statm", "r");
+
+	if (statm_f)
+		{
+			unsigned long size;
+			unsigned long resident;
+
+			if (fscanf (statm_f, "%lu %lu", &size, &resident) == 2)
+				{
+					rss = ((size_t) resident) * ((size_t) sysconf (_SC_PAGESIZE));
+				}
+
+			fclose (statm_f);
+		}
+
+	return rss;
+}
+
+
+size_t GetPeakRSS (void)
+{
+	struct rusage usage;
+
+	if (getrusage (RUSAGE_SELF, &usage) == 0)
+		{
+			/* Linux reports this in kilobytes */
+			return ((size_t) usage.ru_maxrss) << 10;
+		}
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * allocation_counter.h
+ *
+ * Count the heap allocations made by a benchmark and read its memory
+ * usage. The counts come from wrapping malloc (), calloc () and realloc ()
+ * themselves, so they include the allocations made inside jansson, libbson
+ * and the Grassroots libraries as well as the service's own.
+ */
+
+#ifndef GENE_TREES_SERVICE_TOOLS_ALLOCATION_COUNTER_H_
+#define GENE_TREES_SERVICE_TOOLS_ALLOCATION_COUNTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct AllocationCounts
+{
+	/* The number of calls to malloc (), calloc () and realloc () */
+	uint64_t ac_num_allocations;
+
+	/* The number of calls to free () with a non-NULL pointer */
+	uint64_t ac_num_frees;
+
+	/* The number of bytes asked for by those allocations */
+	uint64_t ac_num_bytes;
+} AllocationCounts;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+void GetAllocationCounts (AllocationCounts *counts_p);
+
+
+/* The resident set size, in bytes, or 0 if it can't be read */
+size_t GetCurrentRSS (void);
+
+
+/* The largest resident set size so far, in bytes */
+size_t GetPeakRSS (void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GENE_TREES_SERVICE_TOOLS_ALLOCATION_COUNTER_H_ */
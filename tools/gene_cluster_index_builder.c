@@ -0,0 +1,1340 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_cluster_index_builder.c
+ *
+ * Build a gene cluster index file for the "gene_index_file" key from a
+ * MongoDB collection, a tab-separated file of Gene and Cluster IDs or a
+ * mongoexport JSON dump. The input doesn't need to be sorted and any
+ * amount of it can be indexed using a fixed amount of memory, as the
+ * records are sorted in runs that are written to temporary files and
+ * then merged.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jansson.h"
+#include "mongoc.h"
+
+#include "gene_cluster_index.h"
+
+
+/* These are the same keys that the service uses */
+#define GCIB_GENE_ID_S "gene_id"
+#define GCIB_CLUSTER_ID_S "cluster_id"
+
+/** The default amount of memory to use for sorting. */
+#define GCIB_DEFAULT_MEGABYTES (256)
+
+/** The most runs that are merged in one go, so that there aren't too many open files. */
+#define GCIB_MAX_MERGE_RUNS (64)
+
+
+/**
+ * A record being sorted. When sorting the genes, sr_value is the
+ * length of sr_gene_s. When sorting them by cluster, it is the
+ * index of the gene's entry and sr_gene_s is unused.
+ */
+typedef struct SortRecord
+{
+	uint32_t sr_cluster_id;
+
+	uint32_t sr_value;
+
+	const char *sr_gene_s;
+} SortRecord;
+
+
+/**
+ * An external sort of SortRecords.
+ */
+typedef struct Sorter
+{
+	/** Does each record have a Gene ID? */
+	bool so_genes_flag;
+
+	/** The function used to order the records. */
+	int (*so_compare_fn) (const void *v0_p, const void *v1_p);
+
+	/** The records in the current run. */
+	SortRecord *so_records_p;
+
+	size_t so_num_records;
+
+	size_t so_max_records;
+
+	/** The storage for the Gene IDs in the current run. */
+	char *so_arena_p;
+
+	size_t so_arena_used;
+
+	size_t so_arena_size;
+
+	/** The directory for the temporary files. */
+	const char *so_temp_dir_s;
+
+	/** The sorted runs that have been written out so far. */
+	FILE **so_runs_pp;
+
+	size_t so_num_runs;
+
+	size_t so_max_runs;
+} Sorter;
+
+
+/**
+ * A sorted run that is being read back in during a merge.
+ */
+typedef struct RunReader
+{
+	FILE *rr_file_p;
+
+	SortRecord rr_record;
+
+	char *rr_buffer_s;
+
+	size_t rr_buffer_size;
+} RunReader;
+
+
+/**
+ * The state used while the output file's sections are written.
+ */
+typedef struct IndexBuilder
+{
+	/** The entries section. */
+	FILE *ib_entries_p;
+
+	/** The Gene IDs section. */
+	FILE *ib_strings_p;
+
+	/** The cluster order section. */
+	FILE *ib_order_p;
+
+	/** The sorter used to order the entries by Cluster ID. */
+	Sorter *ib_cluster_sorter_p;
+
+	uint64_t ib_num_entries;
+
+	uint64_t ib_strings_size;
+
+	/** The previous Gene ID, so that repeated genes can be dropped. */
+	char *ib_previous_gene_s;
+
+	size_t ib_previous_gene_length;
+
+	size_t ib_previous_gene_size;
+
+	uint32_t ib_previous_cluster_id;
+
+	uint64_t ib_num_duplicates;
+
+	uint64_t ib_num_conflicts;
+} IndexBuilder;
+
+
+typedef bool (*RecordCallback) (const SortRecord *record_p, void *data_p);
+
+
+static Sorter *AllocateSorter (const bool genes_flag, const size_t memory_size, const char *temp_dir_s);
+
+static void FreeSorter (Sorter *sorter_p);
+
+static bool AddSortRecord (Sorter *sorter_p, const uint32_t cluster_id, const uint32_t value, const char *gene_s);
+
+static bool FlushSorter (Sorter *sorter_p);
+
+static bool MergeSorter (Sorter *sorter_p, RecordCallback callback_fn, void *callback_data_p);
+
+static bool MergeRuns (Sorter *sorter_p, FILE **runs_pp, const size_t num_runs, RecordCallback callback_fn, void *callback_data_p);
+
+static bool WriteRunRecord (const SortRecord *record_p, void *data_p);
+
+static bool ReadRunRecord (RunReader *reader_p, const bool genes_flag);
+
+static void SiftDownRunReaders (RunReader **readers_pp, const size_t num_readers, size_t i, int (*compare_fn) (const void *v0_p, const void *v1_p));
+
+static int CompareGeneRecords (const void *v0_p, const void *v1_p);
+
+static int CompareClusterRecords (const void *v0_p, const void *v1_p);
+
+static FILE *OpenTemporaryFile (const char *temp_dir_s);
+
+static bool ReadTabularGenes (FILE *in_p, Sorter *sorter_p);
+
+static bool ReadJSONGenes (FILE *in_p, Sorter *sorter_p);
+
+static bool GetJSONClusterId (const json_t *value_p, uint32_t *cluster_id_p);
+
+static bool ReadMongoGenes (const char *uri_s, const char *database_s, const char *collection_s, Sorter *sorter_p);
+
+static bool AddGene (Sorter *sorter_p, const char *gene_s, const size_t gene_length, const int64_t cluster_id);
+
+static bool AddIndexEntry (const SortRecord *record_p, void *data_p);
+
+static bool AddClusterOrder (const SortRecord *record_p, void *data_p);
+
+static bool WriteIndexFile (const char *filename_s, IndexBuilder *builder_p);
+
+static bool CopySection (FILE *in_p, FILE *out_p, uint64_t *checksum_p);
+
+static void PrintUsage (const char *program_s);
+
+
+int main (int argc, char *argv [])
+{
+	const char *output_s = NULL;
+	const char *input_s = NULL;
+	const char *format_s = "tsv";
+	const char *uri_s = "mongodb://localhost:27017";
+	const char *database_s = NULL;
+	const char *collection_s = NULL;
+	const char *temp_dir_s = getenv ("TMPDIR");
+	long megabytes = GCIB_DEFAULT_MEGABYTES;
+	int ret = 1;
+	int c;
+
+	while ((c = getopt (argc, argv, "o:i:f:u:d:c:m:t:h")) != -1)
+		{
+			switch (c)
+				{
+					case 'o':
+						output_s = optarg;
+						break;
+
+					case 'i':
+						input_s = optarg;
+						break;
+
+					case 'f':
+						format_s = optarg;
+						break;
+
+					case 'u':
+						uri_s = optarg;
+						break;
+
+					case 'd':
+						database_s = optarg;
+						break;
+
+					case 'c':
+						collection_s = optarg;
+						break;
+
+					case 'm':
+						megabytes = strtol (optarg, NULL, 10);
+						break;
+
+					case 't':
+						temp_dir_s = optarg;
+						break;
+
+					default:
+						PrintUsage (argv [0]);
+						return 1;
+				}
+		}
+
+	if (!temp_dir_s)
+		{
+			temp_dir_s = "/tmp";
+		}
+
+	if ((!output_s) || (megabytes <= 0) || ((!input_s) == (!(database_s && collection_s))) || ((strcmp (format_s, "tsv") != 0) && (strcmp (format_s, "json") != 0)))
+		{
+			PrintUsage (argv [0]);
+		}
+	else
+		{
+			/*
+			 * Most of the memory goes on sorting the genes. Ordering them by
+			 * cluster afterwards only needs small fixed-size records.
+			 */
+			const size_t memory_size = ((size_t) megabytes) << 20;
+			Sorter *gene_sorter_p = AllocateSorter (true, memory_size, temp_dir_s);
+			Sorter *cluster_sorter_p = AllocateSorter (false, memory_size >> 2, temp_dir_s);
+
+			if (gene_sorter_p && cluster_sorter_p)
+				{
+					bool read_flag = false;
+
+					if (input_s)
+						{
+							FILE *in_p = (strcmp (input_s, "-") == 0) ? stdin : fopen (input_s, "r");
+
+							if (in_p)
+								{
+									read_flag = (strcmp (format_s, "json") == 0) ? ReadJSONGenes (in_p, gene_sorter_p) : ReadTabularGenes (in_p, gene_sorter_p);
+
+									if (in_p != stdin)
+										{
+											fclose (in_p);
+										}
+								}
+							else
+								{
+									fprintf (stderr, "Failed to open \"%s\": %s\n", input_s, strerror (errno));
+								}
+						}
+					else
+						{
+							read_flag = ReadMongoGenes (uri_s, database_s, collection_s, gene_sorter_p);
+						}
+
+					if (read_flag)
+						{
+							IndexBuilder builder;
+
+							memset (&builder, 0, sizeof (builder));
+							builder.ib_cluster_sorter_p = cluster_sorter_p;
+
+							builder.ib_entries_p = OpenTemporaryFile (temp_dir_s);
+							builder.ib_strings_p = OpenTemporaryFile (temp_dir_s);
+							builder.ib_order_p = OpenTemporaryFile (temp_dir_s);
+
+							if (builder.ib_entries_p && builder.ib_strings_p && builder.ib_order_p)
+								{
+									if (MergeSorter (gene_sorter_p, AddIndexEntry, &builder))
+										{
+											if (MergeSorter (cluster_sorter_p, AddClusterOrder, &builder))
+												{
+													if (WriteIndexFile (output_s, &builder))
+														{
+															GeneClusterIndex *index_p = OpenGeneClusterIndex (output_s, true);
+
+															if (index_p)
+																{
+																	printf ("Wrote %llu genes to \"%s\"\n", (unsigned long long) builder.ib_num_entries, output_s);
+																	CloseGeneClusterIndex (index_p);
+																	ret = 0;
+																}
+															else
+																{
+																	fprintf (stderr, "Failed to check \"%s\"\n", output_s);
+																}
+														}
+												}
+										}
+
+									if (builder.ib_num_duplicates > 0)
+										{
+											fprintf (stderr, "Ignored %llu repeated genes, %llu of which had a different Cluster ID\n", (unsigned long long) builder.ib_num_duplicates, (unsigned long long) builder.ib_num_conflicts);
+										}
+								}
+
+							if (builder.ib_entries_p)
+								{
+									fclose (builder.ib_entries_p);
+								}
+
+							if (builder.ib_strings_p)
+								{
+									fclose (builder.ib_strings_p);
+								}
+
+							if (builder.ib_order_p)
+								{
+									fclose (builder.ib_order_p);
+								}
+
+							if (builder.ib_previous_gene_s)
+								{
+									free (builder.ib_previous_gene_s);
+								}
+						}		/* if (read_flag) */
+
+				}		/* if (gene_sorter_p && cluster_sorter_p) */
+			else
+				{
+					fprintf (stderr, "Failed to allocate %ld MB for sorting\n", megabytes);
+				}
+
+			if (gene_sorter_p)
+				{
+					FreeSorter (gene_sorter_p);
+				}
+
+			if (cluster_sorter_p)
+				{
+					FreeSorter (cluster_sorter_p);
+				}
+		}
+
+	return ret;
+}
+
+
+static void PrintUsage (const char *program_s)
+{
+	fprintf (stderr,
+		"Usage: %s -o <index file> (-i <input file> [-f tsv|json] | [-u <uri>] -d <database> -c <collection>) [-m <megabytes>] [-t <temp dir>]\n"
+		"\n"
+		"  -o  The gene cluster index file to write.\n"
+		"  -i  The file to read, or - for stdin. For tsv, each line is a Gene ID and a Cluster ID\n"
+		"      separated by a tab. For json, each line is a document as written by mongoexport.\n"
+		"  -u  The MongoDB connection uri, the default is mongodb://localhost:27017.\n"
+		"  -d  The MongoDB database, as in the service's \"database\" key.\n"
+		"  -c  The MongoDB collection, as in the service's \"collection\" key.\n"
+		"  -m  The memory to use for sorting, the default is %d MB.\n"
+		"  -t  The directory for temporary files, the default is $TMPDIR or /tmp.\n",
+		program_s, GCIB_DEFAULT_MEGABYTES);
+}
+
+
+/*
+ * Genes without a Cluster ID aren't indexed, so anything that doesn't
+ * have one, such as a header line, is skipped.
+ */
+static bool ReadTabularGenes (FILE *in_p, Sorter *sorter_p)
+{
+	bool success_flag = true;
+	char *line_s = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+
+	while (success_flag && ((length = getline (&line_s, &line_size, in_p)) != -1))
+		{
+			char *tab_s = strchr (line_s, '\t');
+
+			if (tab_s && (tab_s != line_s))
+				{
+					char *end_s = NULL;
+					long long cluster_id;
+
+					errno = 0;
+					cluster_id = strtoll (tab_s + 1, &end_s, 10);
+
+					if ((errno == 0) && (end_s != tab_s + 1) && ((*end_s == '\0') || (*end_s == '\n') || (*end_s == '\r') || (*end_s == '\t')))
+						{
+							success_flag = AddGene (sorter_p, line_s, (size_t) (tab_s - line_s), (int64_t) cluster_id);
+						}
+				}
+		}
+
+	if (ferror (in_p))
+		{
+			fprintf (stderr, "Failed to read input: %s\n", strerror (errno));
+			success_flag = false;
+		}
+
+	if (line_s)
+		{
+			free (line_s);
+		}
+
+	return success_flag;
+}
+
+
+static bool ReadJSONGenes (FILE *in_p, Sorter *sorter_p)
+{
+	bool success_flag = true;
+	char *line_s = NULL;
+	size_t line_size = 0;
+	unsigned long long line_number = 0;
+
+	while (success_flag && (getline (&line_s, &line_size, in_p) != -1))
+		{
+			json_error_t error;
+			json_t *doc_p = NULL;
+
+			++ line_number;
+
+			if (line_s [strspn (line_s, " \t\r\n")] == '\0')
+				{
+					continue;
+				}
+
+			doc_p = json_loads (line_s, 0, &error);
+
+			if (doc_p)
+				{
+					const json_t *gene_p = json_object_get (doc_p, GCIB_GENE_ID_S);
+					uint32_t cluster_id;
+
+					if (json_is_string (gene_p) && GetJSONClusterId (json_object_get (doc_p, GCIB_CLUSTER_ID_S), &cluster_id))
+						{
+							success_flag = AddGene (sorter_p, json_string_value (gene_p), json_string_length (gene_p), (int64_t) cluster_id);
+						}
+
+					json_decref (doc_p);
+				}
+			else
+				{
+					fprintf (stderr, "Failed to parse line %llu: %s\n", line_number, error.text);
+					success_flag = false;
+				}
+		}
+
+	if (ferror (in_p))
+		{
+			fprintf (stderr, "Failed to read input: %s\n", strerror (errno));
+			success_flag = false;
+		}
+
+	if (line_s)
+		{
+			free (line_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * mongoexport writes numbers either as they are or, in canonical mode,
+ * as { "$numberInt": "42" } or { "$numberLong": "42" }.
+ */
+static bool GetJSONClusterId (const json_t *value_p, uint32_t *cluster_id_p)
+{
+	if (json_is_integer (value_p))
+		{
+			const json_int_t i = json_integer_value (value_p);
+
+			if ((i >= 0) && (i <= UINT32_MAX))
+				{
+					*cluster_id_p = (uint32_t) i;
+					return true;
+				}
+		}
+	else if (json_is_object (value_p))
+		{
+			const json_t *number_p = json_object_get (value_p, "$numberInt");
+
+			if (!number_p)
+				{
+					number_p = json_object_get (value_p, "$numberLong");
+				}
+
+			if (json_is_string (number_p))
+				{
+					char *end_s = NULL;
+					const long long i = strtoll (json_string_value (number_p), &end_s, 10);
+
+					if ((*end_s == '\0') && (i >= 0) && (i <= UINT32_MAX))
+						{
+							*cluster_id_p = (uint32_t) i;
+							return true;
+						}
+				}
+		}
+
+	return false;
+}
+
+
+static bool ReadMongoGenes (const char *uri_s, const char *database_s, const char *collection_s, Sorter *sorter_p)
+{
+	bool success_flag = false;
+	mongoc_client_t *client_p = NULL;
+
+	mongoc_init ();
+
+	client_p = mongoc_client_new (uri_s);
+
+	if (client_p)
+		{
+			mongoc_collection_t *collection_p = mongoc_client_get_collection (client_p, database_s, collection_s);
+
+			if (collection_p)
+				{
+					bson_t *filter_p = BCON_NEW (GCIB_CLUSTER_ID_S, "{", "$exists", BCON_BOOL (true), "}");
+					bson_t *opts_p = BCON_NEW ("projection", "{", GCIB_GENE_ID_S, BCON_INT32 (1), GCIB_CLUSTER_ID_S, BCON_INT32 (1), "_id", BCON_INT32 (0), "}", "batchSize", BCON_INT32 (10000));
+
+					if (filter_p && opts_p)
+						{
+							mongoc_cursor_t *cursor_p = mongoc_collection_find_with_opts (collection_p, filter_p, opts_p, NULL);
+
+							if (cursor_p)
+								{
+									const bson_t *doc_p = NULL;
+									bson_error_t error;
+
+									success_flag = true;
+
+									while (success_flag && mongoc_cursor_next (cursor_p, &doc_p))
+										{
+											bson_iter_t gene_iter;
+											bson_iter_t cluster_iter;
+
+											if (bson_iter_init_find (&gene_iter, doc_p, GCIB_GENE_ID_S) && BSON_ITER_HOLDS_UTF8 (&gene_iter) &&
+													bson_iter_init_find (&cluster_iter, doc_p, GCIB_CLUSTER_ID_S) && BSON_ITER_HOLDS_NUMBER (&cluster_iter))
+												{
+													uint32_t gene_length = 0;
+													const char *gene_s = bson_iter_utf8 (&gene_iter, &gene_length);
+
+													success_flag = AddGene (sorter_p, gene_s, gene_length, bson_iter_as_int64 (&cluster_iter));
+												}
+										}
+
+									if (mongoc_cursor_error (cursor_p, &error))
+										{
+											fprintf (stderr, "Failed to read \"%s\" -> \"%s\": %s\n", database_s, collection_s, error.message);
+											success_flag = false;
+										}
+
+									mongoc_cursor_destroy (cursor_p);
+								}
+						}
+
+					if (filter_p)
+						{
+							bson_destroy (filter_p);
+						}
+
+					if (opts_p)
+						{
+							bson_destroy (opts_p);
+						}
+
+					mongoc_collection_destroy (collection_p);
+				}		/* if (collection_p) */
+
+			mongoc_client_destroy (client_p);
+		}		/* if (client_p) */
+	else
+		{
+			fprintf (stderr, "Failed to connect to \"%s\"\n", uri_s);
+		}
+
+	mongoc_cleanup ();
+
+	return success_flag;
+}
+
+
+static bool AddGene (Sorter *sorter_p, const char *gene_s, const size_t gene_length, const int64_t cluster_id)
+{
+	if ((cluster_id < 0) || (cluster_id > UINT32_MAX))
+		{
+			fprintf (stderr, "Ignoring \"%.*s\" as its Cluster ID %lld is out of range\n", (int) gene_length, gene_s, (long long) cluster_id);
+			return true;
+		}
+
+	if ((gene_length == 0) || (gene_length > UINT32_MAX))
+		{
+			return true;
+		}
+
+	return AddSortRecord (sorter_p, (uint32_t) cluster_id, (uint32_t) gene_length, gene_s);
+}
+
+
+/*
+ * The genes come out of the merge sorted by Gene ID, so this writes
+ * their entries and IDs in order and queues each entry's index to be
+ * sorted by Cluster ID.
+ */
+static bool AddIndexEntry (const SortRecord *record_p, void *data_p)
+{
+	IndexBuilder *builder_p = (IndexBuilder *) data_p;
+	GeneClusterIndexEntry entry;
+
+	if ((builder_p -> ib_previous_gene_s) && (builder_p -> ib_previous_gene_length == record_p -> sr_value) &&
+			(memcmp (builder_p -> ib_previous_gene_s, record_p -> sr_gene_s, record_p -> sr_value) == 0))
+		{
+			++ (builder_p -> ib_num_duplicates);
+
+			if (builder_p -> ib_previous_cluster_id != record_p -> sr_cluster_id)
+				{
+					fprintf (stderr, "\"%.*s\" is in clusters %u and %u, using %u\n", (int) record_p -> sr_value, record_p -> sr_gene_s,
+						builder_p -> ib_previous_cluster_id, record_p -> sr_cluster_id, builder_p -> ib_previous_cluster_id);
+					++ (builder_p -> ib_num_conflicts);
+				}
+
+			return true;
+		}
+
+	if (builder_p -> ib_num_entries >= UINT32_MAX)
+		{
+			fprintf (stderr, "Too many genes to index\n");
+			return false;
+		}
+
+	if (builder_p -> ib_previous_gene_size < record_p -> sr_value)
+		{
+			char *gene_s = (char *) realloc (builder_p -> ib_previous_gene_s, record_p -> sr_value);
+
+			if (!gene_s)
+				{
+					fprintf (stderr, "Failed to allocate %u bytes\n", record_p -> sr_value);
+					return false;
+				}
+
+			builder_p -> ib_previous_gene_s = gene_s;
+			builder_p -> ib_previous_gene_size = record_p -> sr_value;
+		}
+
+	memcpy (builder_p -> ib_previous_gene_s, record_p -> sr_gene_s, record_p -> sr_value);
+	builder_p -> ib_previous_gene_length = record_p -> sr_value;
+	builder_p -> ib_previous_cluster_id = record_p -> sr_cluster_id;
+
+	entry.gcie_gene_offset = builder_p -> ib_strings_size;
+	entry.gcie_gene_length = record_p -> sr_value;
+	entry.gcie_cluster_id = record_p -> sr_cluster_id;
+
+	if ((fwrite (&entry, sizeof (entry), 1, builder_p -> ib_entries_p) != 1) ||
+			(fwrite (record_p -> sr_gene_s, 1, record_p -> sr_value, builder_p -> ib_strings_p) != record_p -> sr_value))
+		{
+			fprintf (stderr, "Failed to write entry: %s\n", strerror (errno));
+			return false;
+		}
+
+	builder_p -> ib_strings_size += record_p -> sr_value;
+
+	if (!AddSortRecord (builder_p -> ib_cluster_sorter_p, record_p -> sr_cluster_id, (uint32_t) (builder_p -> ib_num_entries), NULL))
+		{
+			return false;
+		}
+
+	++ (builder_p -> ib_num_entries);
+
+	return true;
+}
+
+
+static bool AddClusterOrder (const SortRecord *record_p, void *data_p)
+{
+	IndexBuilder *builder_p = (IndexBuilder *) data_p;
+
+	if (fwrite (& (record_p -> sr_value), sizeof (uint32_t), 1, builder_p -> ib_order_p) != 1)
+		{
+			fprintf (stderr, "Failed to write cluster order: %s\n", strerror (errno));
+			return false;
+		}
+
+	return true;
+}
+
+
+/*
+ * Write to a temporary file alongside the index and then rename it, so
+ * that a running service never maps a half-written file.
+ */
+static bool WriteIndexFile (const char *filename_s, IndexBuilder *builder_p)
+{
+	bool success_flag = false;
+	const size_t filename_length = strlen (filename_s);
+	char *temp_filename_s = (char *) malloc (filename_length + 5);
+
+	if (temp_filename_s)
+		{
+			FILE *out_p = NULL;
+
+			memcpy (temp_filename_s, filename_s, filename_length);
+			memcpy (temp_filename_s + filename_length, ".tmp", 5);
+
+			out_p = fopen (temp_filename_s, "wb");
+
+			if (out_p)
+				{
+					GeneClusterIndexHeader header;
+					uint64_t checksum = GCI_CHECKSUM_SEED;
+
+					memset (&header, 0, sizeof (header));
+
+					/* Write a blank header for now, to be filled in once the checksum is known */
+					if (fwrite (&header, sizeof (header), 1, out_p) == 1)
+						{
+							if (CopySection (builder_p -> ib_entries_p, out_p, &checksum) &&
+									CopySection (builder_p -> ib_order_p, out_p, &checksum) &&
+									CopySection (builder_p -> ib_strings_p, out_p, &checksum))
+								{
+									memcpy (header.gcih_magic, GCI_MAGIC_S, sizeof (GCI_MAGIC_S));
+									header.gcih_version = GCI_VERSION;
+									header.gcih_byte_order = GCI_BYTE_ORDER;
+									header.gcih_num_entries = builder_p -> ib_num_entries;
+									header.gcih_strings_size = builder_p -> ib_strings_size;
+									header.gcih_checksum = checksum;
+
+									if ((fseek (out_p, 0, SEEK_SET) == 0) && (fwrite (&header, sizeof (header), 1, out_p) == 1))
+										{
+											success_flag = true;
+										}
+								}
+						}
+
+					if (fclose (out_p) != 0)
+						{
+							success_flag = false;
+						}
+
+					if (success_flag)
+						{
+							if (rename (temp_filename_s, filename_s) != 0)
+								{
+									success_flag = false;
+								}
+						}
+
+					if (!success_flag)
+						{
+							fprintf (stderr, "Failed to write \"%s\": %s\n", filename_s, strerror (errno));
+							unlink (temp_filename_s);
+						}
+				}		/* if (out_p) */
+			else
+				{
+					fprintf (stderr, "Failed to open \"%s\": %s\n", temp_filename_s, strerror (errno));
+				}
+
+			free (temp_filename_s);
+		}		/* if (temp_filename_s) */
+
+	return success_flag;
+}
+
+
+static bool CopySection (FILE *in_p, FILE *out_p, uint64_t *checksum_p)
+{
+	char buffer [65536];
+	size_t num_read;
+
+	if (fflush (in_p) != 0)
+		{
+			return false;
+		}
+
+	rewind (in_p);
+
+	while ((num_read = fread (buffer, 1, sizeof (buffer), in_p)) > 0)
+		{
+			*checksum_p = UpdateGeneClusterIndexChecksum (buffer, num_read, *checksum_p);
+
+			if (fwrite (buffer, 1, num_read, out_p) != num_read)
+				{
+					return false;
+				}
+		}
+
+	return (ferror (in_p) == 0);
+}
+
+
+/*
+ * The memory is split between the records and, if there are any,
+ * their Gene IDs.
+ */
+static Sorter *AllocateSorter (const bool genes_flag, const size_t memory_size, const char *temp_dir_s)
+{
+	Sorter *sorter_p = (Sorter *) calloc (1, sizeof (Sorter));
+
+	if (sorter_p)
+		{
+			const size_t records_size = genes_flag ? (memory_size >> 1) : memory_size;
+
+			sorter_p -> so_genes_flag = genes_flag;
+			sorter_p -> so_compare_fn = genes_flag ? CompareGeneRecords : CompareClusterRecords;
+			sorter_p -> so_temp_dir_s = temp_dir_s;
+			sorter_p -> so_max_records = records_size / sizeof (SortRecord);
+
+			if (sorter_p -> so_max_records < 1)
+				{
+					sorter_p -> so_max_records = 1;
+				}
+
+			sorter_p -> so_records_p = (SortRecord *) malloc (sorter_p -> so_max_records * sizeof (SortRecord));
+
+			if (sorter_p -> so_records_p)
+				{
+					if (genes_flag)
+						{
+							sorter_p -> so_arena_size = memory_size - records_size;
+							sorter_p -> so_arena_p = (char *) malloc (sorter_p -> so_arena_size);
+
+							if (sorter_p -> so_arena_p)
+								{
+									return sorter_p;
+								}
+						}
+					else
+						{
+							return sorter_p;
+						}
+
+					free (sorter_p -> so_records_p);
+				}
+
+			free (sorter_p);
+		}
+
+	return NULL;
+}
+
+
+static void FreeSorter (Sorter *sorter_p)
+{
+	size_t i;
+
+	for (i = 0; i < sorter_p -> so_num_runs; ++ i)
+		{
+			fclose (sorter_p -> so_runs_pp [i]);
+		}
+
+	if (sorter_p -> so_runs_pp)
+		{
+			free (sorter_p -> so_runs_pp);
+		}
+
+	if (sorter_p -> so_arena_p)
+		{
+			free (sorter_p -> so_arena_p);
+		}
+
+	free (sorter_p -> so_records_p);
+	free (sorter_p);
+}
+
+
+static bool AddSortRecord (Sorter *sorter_p, const uint32_t cluster_id, const uint32_t value, const char *gene_s)
+{
+	const size_t gene_length = sorter_p -> so_genes_flag ? value : 0;
+	SortRecord *record_p;
+
+	if (gene_length > sorter_p -> so_arena_size)
+		{
+			fprintf (stderr, "Gene ID of %u bytes is too large to sort\n", value);
+			return false;
+		}
+
+	if ((sorter_p -> so_num_records == sorter_p -> so_max_records) || (sorter_p -> so_arena_used + gene_length > sorter_p -> so_arena_size))
+		{
+			if (!FlushSorter (sorter_p))
+				{
+					return false;
+				}
+		}
+
+	record_p = (sorter_p -> so_records_p) + (sorter_p -> so_num_records);
+	record_p -> sr_cluster_id = cluster_id;
+	record_p -> sr_value = value;
+	record_p -> sr_gene_s = NULL;
+
+	if (gene_length > 0)
+		{
+			char *dest_s = (sorter_p -> so_arena_p) + (sorter_p -> so_arena_used);
+
+			memcpy (dest_s, gene_s, gene_length);
+			record_p -> sr_gene_s = dest_s;
+			sorter_p -> so_arena_used += gene_length;
+		}
+
+	++ (sorter_p -> so_num_records);
+
+	return true;
+}
+
+
+/*
+ * Sort the records in memory and write them out as a new run.
+ */
+static bool FlushSorter (Sorter *sorter_p)
+{
+	bool success_flag = false;
+	FILE *run_p = NULL;
+
+	if (sorter_p -> so_num_runs == sorter_p -> so_max_runs)
+		{
+			const size_t max_runs = (sorter_p -> so_max_runs > 0) ? (sorter_p -> so_max_runs << 1) : 16;
+			FILE **runs_pp = (FILE **) realloc (sorter_p -> so_runs_pp, max_runs * sizeof (FILE *));
+
+			if (!runs_pp)
+				{
+					fprintf (stderr, "Failed to allocate %zu runs\n", max_runs);
+					return false;
+				}
+
+			sorter_p -> so_runs_pp = runs_pp;
+			sorter_p -> so_max_runs = max_runs;
+		}
+
+	qsort (sorter_p -> so_records_p, sorter_p -> so_num_records, sizeof (SortRecord), sorter_p -> so_compare_fn);
+
+	run_p = OpenTemporaryFile (sorter_p -> so_temp_dir_s);
+
+	if (run_p)
+		{
+			size_t i;
+
+			success_flag = true;
+
+			for (i = 0; (i < sorter_p -> so_num_records) && success_flag; ++ i)
+				{
+					success_flag = WriteRunRecord ((sorter_p -> so_records_p) + i, run_p);
+				}
+
+			if (success_flag && (fflush (run_p) == 0))
+				{
+					rewind (run_p);
+					sorter_p -> so_runs_pp [sorter_p -> so_num_runs] = run_p;
+					++ (sorter_p -> so_num_runs);
+
+					sorter_p -> so_num_records = 0;
+					sorter_p -> so_arena_used = 0;
+				}
+			else
+				{
+					fprintf (stderr, "Failed to write sorted run: %s\n", strerror (errno));
+					fclose (run_p);
+					success_flag = false;
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Pass every record to callback_fn in sorted order. If everything fitted
+ * in memory then there is nothing to merge, otherwise the runs are merged
+ * GCIB_MAX_MERGE_RUNS at a time until there are few enough left to
+ * merge in one go.
+ */
+static bool MergeSorter (Sorter *sorter_p, RecordCallback callback_fn, void *callback_data_p)
+{
+	if (sorter_p -> so_num_runs == 0)
+		{
+			size_t i;
+
+			qsort (sorter_p -> so_records_p, sorter_p -> so_num_records, sizeof (SortRecord), sorter_p -> so_compare_fn);
+
+			for (i = 0; i < sorter_p -> so_num_records; ++ i)
+				{
+					if (!callback_fn ((sorter_p -> so_records_p) + i, callback_data_p))
+						{
+							return false;
+						}
+				}
+
+			return true;
+		}
+
+	if ((sorter_p -> so_num_records > 0) && (!FlushSorter (sorter_p)))
+		{
+			return false;
+		}
+
+	while (sorter_p -> so_num_runs > GCIB_MAX_MERGE_RUNS)
+		{
+			FILE *run_p = OpenTemporaryFile (sorter_p -> so_temp_dir_s);
+			FILE **first_run_pp = (sorter_p -> so_runs_pp) + (sorter_p -> so_num_runs - GCIB_MAX_MERGE_RUNS);
+			size_t i;
+
+			if (!run_p)
+				{
+					return false;
+				}
+
+			if (! (MergeRuns (sorter_p, first_run_pp, GCIB_MAX_MERGE_RUNS, WriteRunRecord, run_p) && (fflush (run_p) == 0)))
+				{
+					fprintf (stderr, "Failed to merge sorted runs: %s\n", strerror (errno));
+					fclose (run_p);
+					return false;
+				}
+
+			for (i = 0; i < GCIB_MAX_MERGE_RUNS; ++ i)
+				{
+					fclose (first_run_pp [i]);
+				}
+
+			rewind (run_p);
+			*first_run_pp = run_p;
+			sorter_p -> so_num_runs -= GCIB_MAX_MERGE_RUNS - 1;
+		}
+
+	return MergeRuns (sorter_p, sorter_p -> so_runs_pp, sorter_p -> so_num_runs, callback_fn, callback_data_p);
+}
+
+
+static bool MergeRuns (Sorter *sorter_p, FILE **runs_pp, const size_t num_runs, RecordCallback callback_fn, void *callback_data_p)
+{
+	bool success_flag = false;
+	RunReader *readers_p = (RunReader *) calloc (num_runs, sizeof (RunReader));
+	RunReader **heap_pp = (RunReader **) malloc (num_runs * sizeof (RunReader *));
+
+	if (readers_p && heap_pp)
+		{
+			size_t num_readers = 0;
+			size_t i;
+
+			success_flag = true;
+
+			for (i = 0; i < num_runs; ++ i)
+				{
+					RunReader *reader_p = readers_p + i;
+
+					reader_p -> rr_file_p = runs_pp [i];
+
+					if (ReadRunRecord (reader_p, sorter_p -> so_genes_flag))
+						{
+							heap_pp [num_readers] = reader_p;
+							++ num_readers;
+						}
+				}
+
+			for (i = num_readers >> 1; i > 0; -- i)
+				{
+					SiftDownRunReaders (heap_pp, num_readers, i - 1, sorter_p -> so_compare_fn);
+				}
+
+			while ((num_readers > 0) && success_flag)
+				{
+					RunReader *reader_p = *heap_pp;
+
+					success_flag = callback_fn (& (reader_p -> rr_record), callback_data_p);
+
+					if (!ReadRunRecord (reader_p, sorter_p -> so_genes_flag))
+						{
+							-- num_readers;
+							*heap_pp = heap_pp [num_readers];
+						}
+
+					SiftDownRunReaders (heap_pp, num_readers, 0, sorter_p -> so_compare_fn);
+				}
+
+			for (i = 0; i < num_runs; ++ i)
+				{
+					if (ferror (runs_pp [i]))
+						{
+							fprintf (stderr, "Failed to read sorted run: %s\n", strerror (errno));
+							success_flag = false;
+						}
+
+					if (readers_p [i].rr_buffer_s)
+						{
+							free (readers_p [i].rr_buffer_s);
+						}
+				}
+		}
+	else
+		{
+			fprintf (stderr, "Failed to allocate readers for %zu runs\n", num_runs);
+		}
+
+	if (readers_p)
+		{
+			free (readers_p);
+		}
+
+	if (heap_pp)
+		{
+			free (heap_pp);
+		}
+
+	return success_flag;
+}
+
+
+static void SiftDownRunReaders (RunReader **readers_pp, const size_t num_readers, size_t i, int (*compare_fn) (const void *v0_p, const void *v1_p))
+{
+	for (;;)
+		{
+			const size_t left = (i << 1) + 1;
+			const size_t right = left + 1;
+			size_t smallest = i;
+
+			if ((left < num_readers) && (compare_fn (& (readers_pp [left] -> rr_record), & (readers_pp [smallest] -> rr_record)) < 0))
+				{
+					smallest = left;
+				}
+
+			if ((right < num_readers) && (compare_fn (& (readers_pp [right] -> rr_record), & (readers_pp [smallest] -> rr_record)) < 0))
+				{
+					smallest = right;
+				}
+
+			if (smallest == i)
+				{
+					return;
+				}
+			else
+				{
+					RunReader *reader_p = readers_pp [i];
+
+					readers_pp [i] = readers_pp [smallest];
+					readers_pp [smallest] = reader_p;
+					i = smallest;
+				}
+		}
+}
+
+
+/*
+ * Each record in a run is its Cluster ID and value followed, when
+ * sorting genes, by the Gene ID.
+ */
+static bool WriteRunRecord (const SortRecord *record_p, void *data_p)
+{
+	FILE *run_p = (FILE *) data_p;
+	uint32_t values [2];
+
+	values [0] = record_p -> sr_cluster_id;
+	values [1] = record_p -> sr_value;
+
+	if (fwrite (values, sizeof (uint32_t), 2, run_p) != 2)
+		{
+			return false;
+		}
+
+	if (record_p -> sr_gene_s)
+		{
+			if (fwrite (record_p -> sr_gene_s, 1, record_p -> sr_value, run_p) != record_p -> sr_value)
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static bool ReadRunRecord (RunReader *reader_p, const bool genes_flag)
+{
+	uint32_t values [2];
+
+	if (fread (values, sizeof (uint32_t), 2, reader_p -> rr_file_p) != 2)
+		{
+			return false;
+		}
+
+	reader_p -> rr_record.sr_cluster_id = values [0];
+	reader_p -> rr_record.sr_value = values [1];
+	reader_p -> rr_record.sr_gene_s = NULL;
+
+	if (genes_flag)
+		{
+			if (reader_p -> rr_buffer_size < values [1])
+				{
+					char *buffer_s = (char *) realloc (reader_p -> rr_buffer_s, values [1]);
+
+					if (!buffer_s)
+						{
+							return false;
+						}
+
+					reader_p -> rr_buffer_s = buffer_s;
+					reader_p -> rr_buffer_size = values [1];
+				}
+
+			if (fread (reader_p -> rr_buffer_s, 1, values [1], reader_p -> rr_file_p) != values [1])
+				{
+					return false;
+				}
+
+			reader_p -> rr_record.sr_gene_s = reader_p -> rr_buffer_s;
+		}
+
+	return true;
+}
+
+
+/*
+ * This is the same order as the lookups in gene_cluster_index.c use, by
+ * the Gene IDs' bytes and then their lengths. Repeated genes are then
+ * ordered by Cluster ID so that the choice between them is stable.
+ */
+static int CompareGeneRecords (const void *v0_p, const void *v1_p)
+{
+	const SortRecord *record0_p = (const SortRecord *) v0_p;
+	const SortRecord *record1_p = (const SortRecord *) v1_p;
+	const uint32_t length = (record0_p -> sr_value < record1_p -> sr_value) ? record0_p -> sr_value : record1_p -> sr_value;
+	int res = memcmp (record0_p -> sr_gene_s, record1_p -> sr_gene_s, length);
+
+	if (res == 0)
+		{
+			if (record0_p -> sr_value != record1_p -> sr_value)
+				{
+					res = (record0_p -> sr_value < record1_p -> sr_value) ? -1 : 1;
+				}
+			else if (record0_p -> sr_cluster_id != record1_p -> sr_cluster_id)
+				{
+					res = (record0_p -> sr_cluster_id < record1_p -> sr_cluster_id) ? -1 : 1;
+				}
+		}
+
+	return res;
+}
+
+
+/*
+ * The entries were numbered in Gene ID order, so ordering by their
+ * indexes within a cluster keeps each cluster's genes sorted.
+ */
+static int CompareClusterRecords (const void *v0_p, const void *v1_p)
+{
+	const SortRecord *record0_p = (const SortRecord *) v0_p;
+	const SortRecord *record1_p = (const SortRecord *) v1_p;
+
+	if (record0_p -> sr_cluster_id != record1_p -> sr_cluster_id)
+		{
+			return (record0_p -> sr_cluster_id < record1_p -> sr_cluster_id) ? -1 : 1;
+		}
+	else if (record0_p -> sr_value != record1_p -> sr_value)
+		{
+			return (record0_p -> sr_value < record1_p -> sr_value) ? -1 : 1;
+		}
+
+	return 0;
+}
+
+
+/*
+ * The file is unlinked straight away so that it is removed
+ * however the program exits.
+ */
+static FILE *OpenTemporaryFile (const char *temp_dir_s)
+{
+	const size_t dir_length = strlen (temp_dir_s);
+	const char * const template_s = "/gene_cluster_index_XXXXXX";
+	char *filename_s = (char *) malloc (dir_length + strlen (template_s) + 1);
+	FILE *file_p = NULL;
+
+	if (filename_s)
+		{
+			int fd;
+
+			strcpy (filename_s, temp_dir_s);
+			strcpy (filename_s + dir_length, template_s);
+
+			fd = mkstemp (filename_s);
+
+			if (fd != -1)
+				{
+					unlink (filename_s);
+
+					file_p = fdopen (fd, "w+b");
+
+					if (!file_p)
+						{
+							close (fd);
+						}
+				}
+
+			if (!file_p)
+				{
+					fprintf (stderr, "Failed to create temporary file in \"%s\": %s\n", temp_dir_s, strerror (errno));
+				}
+
+			free (filename_s);
+		}
+
+	return file_p;
+}
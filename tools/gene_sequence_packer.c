@@ -0,0 +1,411 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * gene_sequence_packer.c
+ *
+ * Pack the sequence and alignment fields of a mongoexport JSON dump so
+ * that it can be loaded back with mongoimport, or unpack them again.
+ * The packed values are written as canonical extended JSON binary values,
+ * { "$binary": { "base64": "...", "subType": "80" } }, and the search
+ * service unpacks them when it returns them.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jansson.h"
+
+#include "packed_sequence.h"
+#include "memory_allocations.h"
+
+
+/* The fields that the service stores the sequences and alignments in */
+#define GSP_DEFAULT_FIELDS_S "gene_sequence,alignment"
+
+
+static bool PackDocument (json_t *doc_p, const char *fields_s, const bool unpack_flag, unsigned long long *num_packed_p);
+
+static json_t *GetPackedValue (const json_t *value_p);
+
+static json_t *GetUnpackedValue (const json_t *value_p);
+
+static char *EncodeBase64 (const uint8_t *data_p, const size_t size);
+
+static uint8_t *DecodeBase64 (const char *data_s, size_t *size_p);
+
+static void PrintUsage (const char *program_s);
+
+
+int main (int argc, char *argv [])
+{
+	const char *input_s = NULL;
+	const char *output_s = NULL;
+	const char *fields_s = GSP_DEFAULT_FIELDS_S;
+	bool unpack_flag = false;
+	int ret = 1;
+	int c;
+
+	while ((c = getopt (argc, argv, "i:o:f:uh")) != -1)
+		{
+			switch (c)
+				{
+					case 'i':
+						input_s = optarg;
+						break;
+
+					case 'o':
+						output_s = optarg;
+						break;
+
+					case 'f':
+						fields_s = optarg;
+						break;
+
+					case 'u':
+						unpack_flag = true;
+						break;
+
+					default:
+						PrintUsage (argv [0]);
+						return 1;
+				}
+		}
+
+	if (optind == argc)
+		{
+			FILE *in_p = input_s ? fopen (input_s, "r") : stdin;
+
+			if (in_p)
+				{
+					FILE *out_p = output_s ? fopen (output_s, "w") : stdout;
+
+					if (out_p)
+						{
+							char *line_s = NULL;
+							size_t line_size = 0;
+							unsigned long long line_number = 0;
+							unsigned long long num_packed = 0;
+							bool success_flag = true;
+
+							while (success_flag && (getline (&line_s, &line_size, in_p) != -1))
+								{
+									json_error_t error;
+									json_t *doc_p = NULL;
+
+									++ line_number;
+
+									if (line_s [strspn (line_s, " \t\r\n")] == '\0')
+										{
+											continue;
+										}
+
+									doc_p = json_loads (line_s, 0, &error);
+
+									if (doc_p)
+										{
+											if (PackDocument (doc_p, fields_s, unpack_flag, &num_packed))
+												{
+													if ((json_dumpf (doc_p, out_p, JSON_COMPACT) != 0) || (fputc ('\n', out_p) == EOF))
+														{
+															fprintf (stderr, "Failed to write line %llu: %s\n", line_number, strerror (errno));
+															success_flag = false;
+														}
+												}
+											else
+												{
+													fprintf (stderr, "Failed to %s line %llu\n", unpack_flag ? "unpack" : "pack", line_number);
+													success_flag = false;
+												}
+
+											json_decref (doc_p);
+										}
+									else
+										{
+											fprintf (stderr, "Failed to parse line %llu: %s\n", line_number, error.text);
+											success_flag = false;
+										}
+								}
+
+							if (ferror (in_p))
+								{
+									fprintf (stderr, "Failed to read input: %s\n", strerror (errno));
+									success_flag = false;
+								}
+
+							if (line_s)
+								{
+									free (line_s);
+								}
+
+							if ((out_p != stdout) && (fclose (out_p) != 0))
+								{
+									fprintf (stderr, "Failed to write \"%s\": %s\n", output_s, strerror (errno));
+									success_flag = false;
+								}
+
+							if (success_flag)
+								{
+									fprintf (stderr, "%s %llu values in %llu lines\n", unpack_flag ? "Unpacked" : "Packed", num_packed, line_number);
+									ret = 0;
+								}
+						}
+					else
+						{
+							fprintf (stderr, "Failed to open \"%s\": %s\n", output_s, strerror (errno));
+						}
+
+					if (in_p != stdin)
+						{
+							fclose (in_p);
+						}
+				}
+			else
+				{
+					fprintf (stderr, "Failed to open \"%s\": %s\n", input_s, strerror (errno));
+				}
+		}
+	else
+		{
+			PrintUsage (argv [0]);
+		}
+
+	return ret;
+}
+
+
+static void PrintUsage (const char *program_s)
+{
+	fprintf (stderr,
+		"Usage: %s [-i <input file>] [-o <output file>] [-f <fields>] [-u]\n"
+		"\n"
+		"  -i  The mongoexport JSON file to read, the default is stdin.\n"
+		"  -o  The file to write for mongoimport, the default is stdout.\n"
+		"  -f  The comma-separated fields to pack, the default is %s.\n"
+		"      Values that wouldn't get smaller, such as protein sequences, are left as they are.\n"
+		"  -u  Unpack the fields rather than packing them.\n",
+		program_s, GSP_DEFAULT_FIELDS_S);
+}
+
+
+static bool PackDocument (json_t *doc_p, const char *fields_s, const bool unpack_flag, unsigned long long *num_packed_p)
+{
+	const char *start_s = fields_s;
+
+	while (*start_s != '\0')
+		{
+			const size_t length = strcspn (start_s, ",");
+
+			if (length > 0)
+				{
+					char key_s [256];
+
+					if (length < sizeof (key_s))
+						{
+							const json_t *value_p = NULL;
+
+							memcpy (key_s, start_s, length);
+							key_s [length] = '\0';
+
+							value_p = json_object_get (doc_p, key_s);
+
+							if (value_p)
+								{
+									json_t *new_value_p = unpack_flag ? GetUnpackedValue (value_p) : GetPackedValue (value_p);
+
+									if (new_value_p)
+										{
+											if (json_object_set_new (doc_p, key_s, new_value_p) != 0)
+												{
+													return false;
+												}
+
+											++ (*num_packed_p);
+										}
+								}
+						}
+				}
+
+			start_s += length;
+
+			if (*start_s == ',')
+				{
+					++ start_s;
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * Get { "$binary": { "base64": "...", "subType": "80" } } for a string
+ * value or NULL if it isn't a string or wouldn't get any smaller.
+ */
+static json_t *GetPackedValue (const json_t *value_p)
+{
+	json_t *binary_p = NULL;
+
+	if (json_is_string (value_p))
+		{
+			size_t packed_size;
+			uint8_t *packed_p = PackSequence (json_string_value (value_p), json_string_length (value_p), &packed_size);
+
+			if (packed_p)
+				{
+					char *base64_s = EncodeBase64 (packed_p, packed_size);
+
+					if (base64_s)
+						{
+							char subtype_s [3];
+
+							snprintf (subtype_s, sizeof (subtype_s), "%02x", (unsigned int) PS_BSON_SUBTYPE);
+							binary_p = json_pack ("{s:{s:s,s:s}}", "$binary", "base64", base64_s, "subType", subtype_s);
+
+							free (base64_s);
+						}
+
+					FreeMemory (packed_p);
+				}
+		}
+
+	return binary_p;
+}
+
+
+/*
+ * Get the unpacked string for a packed value, accepting both the
+ * current and the legacy extended JSON forms that mongoexport writes.
+ */
+static json_t *GetUnpackedValue (const json_t *value_p)
+{
+	json_t *sequence_p = NULL;
+	const json_t *binary_p = json_object_get (value_p, "$binary");
+	const char *base64_s = NULL;
+
+	if (json_is_object (binary_p))
+		{
+			base64_s = json_string_value (json_object_get (binary_p, "base64"));
+		}
+	else
+		{
+			base64_s = json_string_value (binary_p);
+		}
+
+	if (base64_s)
+		{
+			size_t size;
+			uint8_t *data_p = DecodeBase64 (base64_s, &size);
+
+			if (data_p)
+				{
+					if (IsPackedSequence (PS_BSON_SUBTYPE, data_p, size))
+						{
+							size_t length;
+							char *value_s = UnpackSequence (data_p, size, &length);
+
+							if (value_s)
+								{
+									sequence_p = json_stringn (value_s, length);
+									FreeMemory (value_s);
+								}
+						}
+
+					free (data_p);
+				}
+		}
+
+	return sequence_p;
+}
+
+
+static const char S_BASE64_CHARS [] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static char *EncodeBase64 (const uint8_t *data_p, const size_t size)
+{
+	char *base64_s = (char *) malloc (((size + 2) / 3) * 4 + 1);
+
+	if (base64_s)
+		{
+			char *dest_s = base64_s;
+			size_t i;
+
+			for (i = 0; i < size; i += 3)
+				{
+					const uint32_t triple = (((uint32_t) data_p [i]) << 16) |
+						((i + 1 < size) ? (((uint32_t) data_p [i + 1]) << 8) : 0) |
+						((i + 2 < size) ? ((uint32_t) data_p [i + 2]) : 0);
+
+					*dest_s ++ = S_BASE64_CHARS [(triple >> 18) & 0x3F];
+					*dest_s ++ = S_BASE64_CHARS [(triple >> 12) & 0x3F];
+					*dest_s ++ = (i + 1 < size) ? S_BASE64_CHARS [(triple >> 6) & 0x3F] : '=';
+					*dest_s ++ = (i + 2 < size) ? S_BASE64_CHARS [triple & 0x3F] : '=';
+				}
+
+			*dest_s = '\0';
+		}
+
+	return base64_s;
+}
+
+
+static uint8_t *DecodeBase64 (const char *data_s, size_t *size_p)
+{
+	const size_t length = strlen (data_s);
+	uint8_t *data_p = (length % 4 == 0) ? (uint8_t *) malloc ((length / 4) * 3 + 1) : NULL;
+
+	if (data_p)
+		{
+			size_t size = 0;
+			uint32_t value = 0;
+			size_t num_bits = 0;
+			size_t i;
+
+			for (i = 0; i < length; ++ i)
+				{
+					const char *c_p = NULL;
+
+					if (data_s [i] == '=')
+						{
+							break;
+						}
+
+					c_p = strchr (S_BASE64_CHARS, data_s [i]);
+
+					if ((!c_p) || (*c_p == '\0'))
+						{
+							free (data_p);
+							return NULL;
+						}
+
+					value = (value << 6) | (uint32_t) (c_p - S_BASE64_CHARS);
+					num_bits += 6;
+
+					if (num_bits >= 8)
+						{
+							num_bits -= 8;
+							data_p [size ++] = (uint8_t) ((value >> num_bits) & 0xFF);
+						}
+				}
+
+			*size_p = size;
+		}
+
+	return data_p;
+}
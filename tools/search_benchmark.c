@@ -0,0 +1,1418 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_benchmark.c
+ *
+ * Time the search service's own work for each shape of query without
+ * a MongoDB server. This includes search_service.c so that it can call
+ * RunSearch () directly and stands in for the calls that it makes to
+ * the Grassroots MongoDB library and the driver with an in-memory
+ * collection of synthetic genes. So the timings cover building the
+ * queries, converting and wrapping the hits and the caching, but not
+ * the server or the network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "search_service.c"
+
+#include "allocation_counter.h"
+#include "shared_resources.h"
+
+
+#define SB_DEFAULT_NUM_CLUSTERS (2000)
+#define SB_DEFAULT_GENES_PER_CLUSTER (10)
+#define SB_DEFAULT_SEQUENCE_LENGTH (400)
+#define SB_DEFAULT_ITERATIONS (2000)
+#define SB_DEFAULT_LIST_LENGTH (20)
+#define SB_DEFAULT_PAGE_SIZE (5)
+
+
+typedef enum
+{
+	SS_GENE,
+	SS_GENES,
+	SS_CLUSTER,
+	SS_CLUSTER_PAGE,
+	SS_PREFIX,
+	SS_SUMMARY,
+	SS_NUM_SHAPES
+} SearchShape;
+
+
+static const char * const S_SHAPE_NAMES_SS [SS_NUM_SHAPES] =
+{
+	"gene",
+	"genes",
+	"cluster",
+	"cluster_page",
+	"prefix",
+	"summary"
+};
+
+
+/*
+ * The synthetic genes, sorted by Gene ID. Each cluster is a run of
+ * consecutive genes, so the Gene and Cluster IDs are in the same order
+ * just as they are in the compound index.
+ */
+typedef struct MockCollection
+{
+	bson_t **mc_docs_pp;
+
+	char **mc_gene_ids_ss;
+
+	size_t mc_num_docs;
+
+	uint32 mc_genes_per_cluster;
+} MockCollection;
+
+
+/*
+ * The results of a query. For a find, these are the matching documents
+ * with any projection applied as each one is read. For an aggregation,
+ * these are the number of matching genes in each cluster.
+ */
+struct _mongoc_cursor_t
+{
+	size_t *mcu_indexes_p;
+
+	size_t mcu_num_results;
+
+	uint32 *mcu_cluster_ids_p;
+
+	int32 *mcu_counts_p;
+
+	size_t mcu_next;
+
+	bson_t *mcu_projection_p;
+
+	bson_t mcu_doc;
+};
+
+
+/*
+ * The pool hands these out as MongoTools. They never connect to
+ * anything, they just keep hold of their current results.
+ */
+typedef struct MockMongoTool
+{
+	MongoTool mmt_base;
+
+	mongoc_cursor_t *mmt_cursor_p;
+} MockMongoTool;
+
+
+static MockCollection *s_collection_p = NULL;
+
+
+static MockCollection *AllocateMockCollection (const uint32 num_clusters, const uint32 genes_per_cluster, const uint32 sequence_length, unsigned int *seed_p);
+
+static void FreeMockCollection (MockCollection *collection_p);
+
+static size_t GetGeneLowerBound (const MockCollection *collection_p, const char *gene_s);
+
+static size_t *FindMockDocuments (const MockCollection *collection_p, const bson_t *query_p, size_t *num_found_p);
+
+static int CompareIndexes (const void *v0_p, const void *v1_p);
+
+static mongoc_cursor_t *AllocateMockCursor (size_t *indexes_p, const size_t num_indexes, const bson_t *projection_p);
+
+static const bson_t *GetProjectedDocument (mongoc_cursor_t *cursor_p, const bson_t *doc_p);
+
+static MongoTool *AllocateBenchmarkMongoTool (void *data_p);
+
+static void *AllocateBenchmarkPool (void *data_p);
+
+static void FreeBenchmarkPool (void *pool_p);
+
+static void *AllocateBenchmarkCache (void *data_p);
+
+static void FreeBenchmarkCache (void *cache_p);
+
+static Service *AllocateBenchmarkService (GeneTreesServiceData *data_p);
+
+static void SetSearchRequest (const SearchShape shape, SearchRequest *request_p, char *gene_s, char *genes_s, uint32 *cluster_p, uint32 *limit_p, const uint32 list_length, unsigned int *seed_p);
+
+static bool RunBenchmark (Service *service_p, GeneTreesServiceData *data_p, const SearchShape shape, const uint32 iterations, const uint32 list_length, const uint32 page_size, unsigned int *seed_p);
+
+static bool RunTitleBenchmark (const uint32 iterations, const uint32 hits_per_search, unsigned int *seed_p);
+
+static int CompareTimes (const void *v0_p, const void *v1_p);
+
+static double GetPercentile (const uint64 *times_p, const size_t num_times, const double percentile);
+
+static void PrintMemoryUsage (const char *stage_s);
+
+static void PrintUsage (const char *program_s);
+
+
+int main (int argc, char *argv [])
+{
+	unsigned long num_clusters = SB_DEFAULT_NUM_CLUSTERS;
+	unsigned long genes_per_cluster = SB_DEFAULT_GENES_PER_CLUSTER;
+	unsigned long sequence_length = SB_DEFAULT_SEQUENCE_LENGTH;
+	unsigned long iterations = SB_DEFAULT_ITERATIONS;
+	unsigned long list_length = SB_DEFAULT_LIST_LENGTH;
+	unsigned long page_size = SB_DEFAULT_PAGE_SIZE;
+	unsigned long cache_entries = 0;
+	unsigned int seed = 1;
+	const char *shape_s = NULL;
+	int ret = 1;
+	int c;
+
+	while ((c = getopt (argc, argv, "n:g:l:i:s:p:e:r:q:h")) != -1)
+		{
+			switch (c)
+				{
+					case 'n':
+						num_clusters = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'g':
+						genes_per_cluster = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'l':
+						sequence_length = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'i':
+						iterations = strtoul (optarg, NULL, 10);
+						break;
+
+					case 's':
+						list_length = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'p':
+						page_size = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'e':
+						cache_entries = strtoul (optarg, NULL, 10);
+						break;
+
+					case 'r':
+						seed = (unsigned int) strtoul (optarg, NULL, 10);
+						break;
+
+					case 'q':
+						shape_s = optarg;
+						break;
+
+					default:
+						PrintUsage (argv [0]);
+						return 1;
+				}
+		}
+
+	if ((num_clusters == 0) || (num_clusters > UINT32_MAX) || (genes_per_cluster == 0) || (genes_per_cluster > UINT32_MAX / num_clusters) || (sequence_length > UINT32_MAX)
+			|| (iterations == 0) || (iterations > UINT32_MAX) || (list_length == 0) || (list_length > UINT32_MAX) || (page_size == 0) || (page_size > UINT32_MAX))
+		{
+			PrintUsage (argv [0]);
+		}
+	else
+		{
+			SearchShape shape = SS_NUM_SHAPES;
+
+			if (shape_s)
+				{
+					for (shape = SS_GENE; (shape < SS_NUM_SHAPES) && (strcmp (shape_s, S_SHAPE_NAMES_SS [shape]) != 0); ++ shape)
+						{
+						}
+
+					if (shape == SS_NUM_SHAPES)
+						{
+							fprintf (stderr, "Unknown query shape \"%s\"\n", shape_s);
+							PrintUsage (argv [0]);
+							return 1;
+						}
+				}
+
+			PrintMemoryUsage ("Before loading");
+
+			if ((s_collection_p = AllocateMockCollection ((uint32) num_clusters, (uint32) genes_per_cluster, (uint32) sequence_length, &seed)) != NULL)
+				{
+					GeneTreesServiceData *data_p = AllocateGeneTreesServiceData ();
+
+					PrintMemoryUsage ("After loading");
+
+					if (data_p)
+						{
+							Service *service_p = NULL;
+
+							data_p -> gtsd_database_s = EasyCopyToNewString ("benchmark");
+							data_p -> gtsd_collection_s = EasyCopyToNewString ("genes");
+							data_p -> gtsd_prefix_search_limit = 100;
+							data_p -> gtsd_pool_p = (MongoToolPool *) AcquireSharedResource ("mongo_pool:benchmark", AllocateBenchmarkPool, FreeBenchmarkPool, NULL);
+
+							if (cache_entries > 0)
+								{
+									size_t max_entries = (size_t) cache_entries;
+
+									data_p -> gtsd_cache_p = (SearchCache *) AcquireSharedResource ("search_cache:benchmark", AllocateBenchmarkCache, FreeBenchmarkCache, &max_entries);
+								}
+
+							if ((data_p -> gtsd_pool_p) && ((cache_entries == 0) || (data_p -> gtsd_cache_p)))
+								{
+									service_p = AllocateBenchmarkService (data_p);
+								}
+
+							if (service_p)
+								{
+									SearchShape i = shape_s ? shape : SS_GENE;
+									const SearchShape last = shape_s ? shape : (SS_NUM_SHAPES - 1);
+
+									printf ("%u clusters of %u genes, %u iterations per shape, cache %s\n\n", (uint32) num_clusters, (uint32) genes_per_cluster, (uint32) iterations, (cache_entries > 0) ? "on" : "off");
+									printf ("%-13s %9s %9s %9s %9s %9s %12s %12s %8s\n", "shape", "hits/q", "p50 us", "p90 us", "p99 us", "max us", "allocs/q", "allocs/hit", "failed");
+
+									ret = 0;
+
+									for ( ; i <= last; ++ i)
+										{
+											if (!RunBenchmark (service_p, data_p, i, (uint32) iterations, (uint32) list_length, (uint32) page_size, &seed))
+												{
+													ret = 1;
+												}
+										}
+
+									printf ("\n");
+
+									if (!RunTitleBenchmark ((uint32) iterations, (uint32) genes_per_cluster, &seed))
+										{
+											ret = 1;
+										}
+
+									printf ("\n");
+									PrintMemoryUsage ("After searching");
+
+									/* This frees the GeneTreesServiceData too */
+									FreeService (service_p);
+								}
+							else
+								{
+									fprintf (stderr, "Failed to set up the search service\n");
+									ReleaseGeneTreesServiceData (data_p);
+								}
+
+						}		/* if (data_p) */
+					else
+						{
+							fprintf (stderr, "Failed to allocate GeneTreesServiceData\n");
+						}
+
+					FreeMockCollection (s_collection_p);
+					s_collection_p = NULL;
+				}		/* if ((s_collection_p = AllocateMockCollection (...)) != NULL) */
+			else
+				{
+					fprintf (stderr, "Failed to create %lu clusters of %lu genes\n", num_clusters, genes_per_cluster);
+				}
+		}
+
+	return ret;
+}
+
+
+/*
+ * STAND-INS FOR THE GRASSROOTS MONGODB LIBRARY AND THE DRIVER
+ *
+ * These replace the library's own versions when the benchmark is
+ * linked, so they must keep the same signatures.
+ */
+
+bool FindMatchingMongoDocumentsByBSON (MongoTool *tool_p, const bson_t *query_p, const bson_t *extra_opts_p)
+{
+	MockMongoTool *mock_p = (MockMongoTool *) tool_p;
+	size_t num_found = 0;
+	size_t *indexes_p = NULL;
+
+	if (mock_p -> mmt_cursor_p)
+		{
+			mongoc_cursor_destroy (mock_p -> mmt_cursor_p);
+			mock_p -> mmt_cursor_p = NULL;
+		}
+
+	if ((indexes_p = FindMockDocuments (s_collection_p, query_p, &num_found)) != NULL)
+		{
+			bson_t projection;
+			bool projection_flag = false;
+
+			if (extra_opts_p)
+				{
+					bson_iter_t iter;
+
+					if (bson_iter_init_find (&iter, extra_opts_p, "limit") && BSON_ITER_HOLDS_NUMBER (&iter))
+						{
+							const int64 limit = bson_iter_as_int64 (&iter);
+
+							if ((limit > 0) && (((uint64) limit) < num_found))
+								{
+									num_found = (size_t) limit;
+								}
+						}
+
+					if (bson_iter_init_find (&iter, extra_opts_p, "projection") && BSON_ITER_HOLDS_DOCUMENT (&iter))
+						{
+							const uint8_t *data_p = NULL;
+							uint32_t length = 0;
+
+							bson_iter_document (&iter, &length, &data_p);
+							projection_flag = bson_init_static (&projection, data_p, length);
+						}
+				}
+
+			/* The hits are already in Gene ID order, so "sort" is ignored */
+			if ((mock_p -> mmt_cursor_p = AllocateMockCursor (indexes_p, num_found, projection_flag ? &projection : NULL)) != NULL)
+				{
+					return true;
+				}
+
+			FreeMemory (indexes_p);
+		}
+
+	return false;
+}
+
+
+bool IterateOverMongoResults (MongoTool *tool_p, bool (*process_bson_fn) (const bson_t *document_p, void *data_p), void *data_p)
+{
+	MockMongoTool *mock_p = (MockMongoTool *) tool_p;
+	bool success_flag = true;
+
+	if (mock_p -> mmt_cursor_p)
+		{
+			const bson_t *document_p = NULL;
+
+			while (success_flag && mongoc_cursor_next (mock_p -> mmt_cursor_p, &document_p))
+				{
+					success_flag = process_bson_fn (document_p, data_p);
+				}
+		}
+
+	return success_flag;
+}
+
+
+void FreeMongoTool (MongoTool *tool_p)
+{
+	MockMongoTool *mock_p = (MockMongoTool *) tool_p;
+
+	if (mock_p -> mmt_cursor_p)
+		{
+			mongoc_cursor_destroy (mock_p -> mmt_cursor_p);
+		}
+
+	FreeMemory (mock_p);
+}
+
+
+/*
+ * Only the pipeline that DoSummary () uses is supported: a $match
+ * followed by counting the genes in each cluster, sorted by cluster.
+ */
+mongoc_cursor_t *mongoc_collection_aggregate (mongoc_collection_t * UNUSED_PARAM (collection_p), mongoc_query_flags_t UNUSED_PARAM (flags), const bson_t *pipeline_p, const bson_t * UNUSED_PARAM (opts_p), const mongoc_read_prefs_t * UNUSED_PARAM (read_prefs_p))
+{
+	mongoc_cursor_t *cursor_p = NULL;
+	bson_iter_t iter;
+	bson_iter_t stage_iter;
+
+	if (bson_iter_init_find (&iter, pipeline_p, "pipeline") && BSON_ITER_HOLDS_ARRAY (&iter) && bson_iter_recurse (&iter, &stage_iter)
+			&& bson_iter_next (&stage_iter) && BSON_ITER_HOLDS_DOCUMENT (&stage_iter) && bson_iter_recurse (&stage_iter, &iter)
+			&& bson_iter_find (&iter, "$match") && BSON_ITER_HOLDS_DOCUMENT (&iter))
+		{
+			const uint8_t *data_p = NULL;
+			uint32_t length = 0;
+			bson_t match;
+
+			bson_iter_document (&iter, &length, &data_p);
+
+			if (bson_init_static (&match, data_p, length))
+				{
+					size_t num_found = 0;
+					size_t *indexes_p = FindMockDocuments (s_collection_p, &match, &num_found);
+
+					if (indexes_p)
+						{
+							if ((cursor_p = AllocateMockCursor (indexes_p, 0, NULL)) != NULL)
+								{
+									cursor_p -> mcu_cluster_ids_p = (uint32 *) AllocMemoryArray (num_found + 1, sizeof (uint32));
+									cursor_p -> mcu_counts_p = (int32 *) AllocMemoryArray (num_found + 1, sizeof (int32));
+
+									if ((cursor_p -> mcu_cluster_ids_p) && (cursor_p -> mcu_counts_p))
+										{
+											size_t i;
+
+											for (i = 0; i < num_found; ++ i)
+												{
+													const uint32 cluster_id = (uint32) (indexes_p [i] / (s_collection_p -> mc_genes_per_cluster));
+
+													if ((cursor_p -> mcu_num_results == 0) || (cursor_p -> mcu_cluster_ids_p [cursor_p -> mcu_num_results - 1] != cluster_id))
+														{
+															cursor_p -> mcu_cluster_ids_p [cursor_p -> mcu_num_results] = cluster_id;
+															cursor_p -> mcu_counts_p [cursor_p -> mcu_num_results] = 0;
+															++ (cursor_p -> mcu_num_results);
+														}
+
+													++ (cursor_p -> mcu_counts_p [cursor_p -> mcu_num_results - 1]);
+												}
+										}
+									else
+										{
+											mongoc_cursor_destroy (cursor_p);
+											cursor_p = NULL;
+										}
+								}
+							else
+								{
+									FreeMemory (indexes_p);
+								}
+						}
+				}
+		}
+
+	return cursor_p;
+}
+
+
+bool mongoc_cursor_next (mongoc_cursor_t *cursor_p, const bson_t **bson_pp)
+{
+	if (cursor_p -> mcu_next < cursor_p -> mcu_num_results)
+		{
+			const size_t i = cursor_p -> mcu_next;
+
+			++ (cursor_p -> mcu_next);
+
+			if (cursor_p -> mcu_cluster_ids_p)
+				{
+					bson_reinit (& (cursor_p -> mcu_doc));
+
+					if (BSON_APPEND_INT32 (& (cursor_p -> mcu_doc), "_id", (int32) (cursor_p -> mcu_cluster_ids_p [i])) && BSON_APPEND_INT32 (& (cursor_p -> mcu_doc), "genes", cursor_p -> mcu_counts_p [i]))
+						{
+							*bson_pp = & (cursor_p -> mcu_doc);
+							return true;
+						}
+				}
+			else
+				{
+					*bson_pp = GetProjectedDocument (cursor_p, s_collection_p -> mc_docs_pp [cursor_p -> mcu_indexes_p [i]]);
+					return (*bson_pp != NULL);
+				}
+		}
+
+	return false;
+}
+
+
+bool mongoc_cursor_error (mongoc_cursor_t * UNUSED_PARAM (cursor_p), bson_error_t * UNUSED_PARAM (error_p))
+{
+	return false;
+}
+
+
+void mongoc_cursor_destroy (mongoc_cursor_t *cursor_p)
+{
+	if (cursor_p -> mcu_indexes_p)
+		{
+			FreeMemory (cursor_p -> mcu_indexes_p);
+		}
+
+	if (cursor_p -> mcu_cluster_ids_p)
+		{
+			FreeMemory (cursor_p -> mcu_cluster_ids_p);
+		}
+
+	if (cursor_p -> mcu_counts_p)
+		{
+			FreeMemory (cursor_p -> mcu_counts_p);
+		}
+
+	if (cursor_p -> mcu_projection_p)
+		{
+			bson_destroy (cursor_p -> mcu_projection_p);
+		}
+
+	bson_destroy (& (cursor_p -> mcu_doc));
+	FreeMemory (cursor_p);
+}
+
+
+/*
+ * STATIC FUNCTIONS
+ */
+
+static MockCollection *AllocateMockCollection (const uint32 num_clusters, const uint32 genes_per_cluster, const uint32 sequence_length, unsigned int *seed_p)
+{
+	MockCollection *collection_p = (MockCollection *) AllocMemory (sizeof (MockCollection));
+
+	if (collection_p)
+		{
+			const size_t num_docs = ((size_t) num_clusters) * genes_per_cluster;
+
+			collection_p -> mc_num_docs = 0;
+			collection_p -> mc_genes_per_cluster = genes_per_cluster;
+			collection_p -> mc_docs_pp = (bson_t **) AllocMemoryArray (num_docs, sizeof (bson_t *));
+			collection_p -> mc_gene_ids_ss = (char **) AllocMemoryArray (num_docs, sizeof (char *));
+
+			if ((collection_p -> mc_docs_pp) && (collection_p -> mc_gene_ids_ss))
+				{
+					static const char S_AMINO_ACIDS_S [] = "ACDEFGHIKLMNPQRSTVWY";
+					const size_t tree_size = ((size_t) genes_per_cluster) * 16 + 4;
+					char *sequence_s = (char *) AllocMemory (((size_t) sequence_length) + 1);
+					char *tree_s = (char *) AllocMemory (tree_size);
+					bool success_flag = (sequence_s != NULL) && (tree_s != NULL);
+					uint32 i;
+
+					for (i = 0; (i < num_clusters) && success_flag; ++ i)
+						{
+							const size_t first_doc = ((size_t) i) * genes_per_cluster;
+							size_t tree_length = 0;
+							uint32 j;
+
+							/* A star tree of the cluster's genes, which is enough to convert */
+							tree_s [tree_length ++] = '(';
+
+							for (j = 0; j < genes_per_cluster; ++ j)
+								{
+									tree_length += snprintf (tree_s + tree_length, tree_size - tree_length, "%sG%08zu:0.1", (j > 0) ? "," : "", first_doc + j);
+								}
+
+							snprintf (tree_s + tree_length, tree_size - tree_length, ");");
+
+							for (j = 0; (j < genes_per_cluster) && success_flag; ++ j)
+								{
+									const size_t k = first_doc + j;
+									bson_t *doc_p = NULL;
+									char gene_s [32];
+									bson_oid_t oid;
+									uint32 l;
+
+									for (l = 0; l < sequence_length; ++ l)
+										{
+											sequence_s [l] = S_AMINO_ACIDS_S [rand_r (seed_p) % (sizeof (S_AMINO_ACIDS_S) - 1)];
+										}
+
+									sequence_s [sequence_length] = '\0';
+
+									snprintf (gene_s, sizeof (gene_s), "G%08zu", k);
+									bson_oid_init (&oid, NULL);
+
+									success_flag = false;
+
+									if ((doc_p = bson_new ()) != NULL)
+										{
+											if (BSON_APPEND_OID (doc_p, "_id", &oid) && BSON_APPEND_UTF8 (doc_p, GTS_GENE_ID_S, gene_s) && BSON_APPEND_INT32 (doc_p, GTS_CLUSTER_ID_S, (int32) i)
+													&& BSON_APPEND_UTF8 (doc_p, GTS_GENETREE_S, tree_s) && BSON_APPEND_UTF8 (doc_p, GTS_GENE_SEQUENCE_S, sequence_s))
+												{
+													if ((collection_p -> mc_gene_ids_ss [k] = EasyCopyToNewString (gene_s)) != NULL)
+														{
+															collection_p -> mc_docs_pp [k] = doc_p;
+															++ (collection_p -> mc_num_docs);
+															success_flag = true;
+														}
+												}
+
+											if (!success_flag)
+												{
+													bson_destroy (doc_p);
+												}
+										}
+
+								}		/* for (j = 0; (j < genes_per_cluster) && success_flag; ++ j) */
+
+						}		/* for (i = 0; (i < num_clusters) && success_flag; ++ i) */
+
+					if (sequence_s)
+						{
+							FreeMemory (sequence_s);
+						}
+
+					if (tree_s)
+						{
+							FreeMemory (tree_s);
+						}
+
+					if (success_flag)
+						{
+							return collection_p;
+						}
+				}
+
+			FreeMockCollection (collection_p);
+		}		/* if (collection_p) */
+
+	return NULL;
+}
+
+
+static void FreeMockCollection (MockCollection *collection_p)
+{
+	size_t i;
+
+	for (i = 0; i < collection_p -> mc_num_docs; ++ i)
+		{
+			bson_destroy (collection_p -> mc_docs_pp [i]);
+			FreeCopiedString (collection_p -> mc_gene_ids_ss [i]);
+		}
+
+	if (collection_p -> mc_docs_pp)
+		{
+			FreeMemory (collection_p -> mc_docs_pp);
+		}
+
+	if (collection_p -> mc_gene_ids_ss)
+		{
+			FreeMemory (collection_p -> mc_gene_ids_ss);
+		}
+
+	FreeMemory (collection_p);
+}
+
+
+/*
+ * Get the index of the first gene that is not before gene_s, as
+ * a $gte on the gene_id index would start from.
+ */
+static size_t GetGeneLowerBound (const MockCollection *collection_p, const char *gene_s)
+{
+	size_t low = 0;
+	size_t high = collection_p -> mc_num_docs;
+
+	while (low < high)
+		{
+			const size_t mid = low + ((high - low) >> 1);
+
+			if (strcmp (collection_p -> mc_gene_ids_ss [mid], gene_s) < 0)
+				{
+					low = mid + 1;
+				}
+			else
+				{
+					high = mid;
+				}
+		}
+
+	return low;
+}
+
+
+/*
+ * Get the indexes, in Gene ID order, of the documents that match one
+ * of the queries that GetSearchQuery () builds: a gene_id that is either
+ * a string or a document of $in, $gte and $lt, along with an optional
+ * cluster_id.
+ */
+static size_t *FindMockDocuments (const MockCollection *collection_p, const bson_t *query_p, size_t *num_found_p)
+{
+	size_t *indexes_p = NULL;
+	size_t low = 0;
+	size_t high = collection_p -> mc_num_docs;
+	bson_iter_t in_iter;
+	bool in_flag = false;
+	bool success_flag = true;
+	bson_iter_t iter;
+
+	if (bson_iter_init (&iter, query_p))
+		{
+			while (success_flag && bson_iter_next (&iter))
+				{
+					const char *key_s = bson_iter_key (&iter);
+
+					if (strcmp (key_s, GTS_GENE_ID_S) == 0)
+						{
+							if (BSON_ITER_HOLDS_UTF8 (&iter))
+								{
+									const char *gene_s = bson_iter_utf8 (&iter, NULL);
+									const size_t i = GetGeneLowerBound (collection_p, gene_s);
+
+									if ((i < collection_p -> mc_num_docs) && (strcmp (collection_p -> mc_gene_ids_ss [i], gene_s) == 0))
+										{
+											if (i > low)
+												{
+													low = i;
+												}
+
+											if (i + 1 < high)
+												{
+													high = i + 1;
+												}
+										}
+									else
+										{
+											high = 0;
+										}
+								}
+							else if (BSON_ITER_HOLDS_DOCUMENT (&iter))
+								{
+									bson_iter_t op_iter;
+
+									if (bson_iter_recurse (&iter, &op_iter))
+										{
+											while (success_flag && bson_iter_next (&op_iter))
+												{
+													const char *op_s = bson_iter_key (&op_iter);
+
+													if ((strcmp (op_s, "$in") == 0) && BSON_ITER_HOLDS_ARRAY (&op_iter))
+														{
+															in_flag = bson_iter_recurse (&op_iter, &in_iter);
+															success_flag = in_flag;
+														}
+													else if ((strcmp (op_s, "$gte") == 0) && BSON_ITER_HOLDS_UTF8 (&op_iter))
+														{
+															const size_t i = GetGeneLowerBound (collection_p, bson_iter_utf8 (&op_iter, NULL));
+
+															if (i > low)
+																{
+																	low = i;
+																}
+														}
+													else if ((strcmp (op_s, "$lt") == 0) && BSON_ITER_HOLDS_UTF8 (&op_iter))
+														{
+															const size_t i = GetGeneLowerBound (collection_p, bson_iter_utf8 (&op_iter, NULL));
+
+															if (i < high)
+																{
+																	high = i;
+																}
+														}
+													else
+														{
+															success_flag = false;
+														}
+												}
+										}
+									else
+										{
+											success_flag = false;
+										}
+								}
+							else
+								{
+									success_flag = false;
+								}
+						}
+					else if ((strcmp (key_s, GTS_CLUSTER_ID_S) == 0) && BSON_ITER_HOLDS_INT32 (&iter))
+						{
+							const size_t first_doc = ((size_t) bson_iter_int32 (&iter)) * (collection_p -> mc_genes_per_cluster);
+							const size_t last_doc = first_doc + (collection_p -> mc_genes_per_cluster);
+
+							if (first_doc > low)
+								{
+									low = first_doc;
+								}
+
+							if (last_doc < high)
+								{
+									high = last_doc;
+								}
+						}
+					else
+						{
+							success_flag = false;
+						}
+				}		/* while (success_flag && bson_iter_next (&iter)) */
+		}
+	else
+		{
+			success_flag = false;
+		}
+
+	if (success_flag)
+		{
+			size_t num_found = 0;
+
+			if (in_flag)
+				{
+					bson_iter_t count_iter = in_iter;
+					size_t num_genes = 0;
+
+					while (bson_iter_next (&count_iter))
+						{
+							++ num_genes;
+						}
+
+					if ((indexes_p = (size_t *) AllocMemoryArray (num_genes + 1, sizeof (size_t))) != NULL)
+						{
+							while (bson_iter_next (&in_iter))
+								{
+									if (BSON_ITER_HOLDS_UTF8 (&in_iter))
+										{
+											const char *gene_s = bson_iter_utf8 (&in_iter, NULL);
+											const size_t i = GetGeneLowerBound (collection_p, gene_s);
+
+											if ((i >= low) && (i < high) && (strcmp (collection_p -> mc_gene_ids_ss [i], gene_s) == 0))
+												{
+													indexes_p [num_found ++] = i;
+												}
+										}
+								}
+
+							/* The server returns each matching document once, sorted */
+							if (num_found > 1)
+								{
+									size_t i;
+									size_t j = 0;
+
+									qsort (indexes_p, num_found, sizeof (size_t), CompareIndexes);
+
+									for (i = 1; i < num_found; ++ i)
+										{
+											if (indexes_p [i] != indexes_p [j])
+												{
+													indexes_p [++ j] = indexes_p [i];
+												}
+										}
+
+									num_found = j + 1;
+								}
+						}
+				}
+			else
+				{
+					if (high > low)
+						{
+							num_found = high - low;
+						}
+
+					if ((indexes_p = (size_t *) AllocMemoryArray (num_found + 1, sizeof (size_t))) != NULL)
+						{
+							size_t i;
+
+							for (i = 0; i < num_found; ++ i)
+								{
+									indexes_p [i] = low + i;
+								}
+						}
+				}
+
+			*num_found_p = num_found;
+		}
+	else
+		{
+			PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, query_p, "The benchmark doesn't support this query");
+		}
+
+	return indexes_p;
+}
+
+
+static int CompareIndexes (const void *v0_p, const void *v1_p)
+{
+	const size_t i0 = * ((const size_t *) v0_p);
+	const size_t i1 = * ((const size_t *) v1_p);
+
+	return (i0 < i1) ? -1 : ((i0 > i1) ? 1 : 0);
+}
+
+
+/*
+ * The cursor takes ownership of indexes_p and keeps a copy of
+ * the projection.
+ */
+static mongoc_cursor_t *AllocateMockCursor (size_t *indexes_p, const size_t num_indexes, const bson_t *projection_p)
+{
+	mongoc_cursor_t *cursor_p = (mongoc_cursor_t *) AllocMemory (sizeof (mongoc_cursor_t));
+
+	if (cursor_p)
+		{
+			cursor_p -> mcu_indexes_p = indexes_p;
+			cursor_p -> mcu_num_results = num_indexes;
+			cursor_p -> mcu_cluster_ids_p = NULL;
+			cursor_p -> mcu_counts_p = NULL;
+			cursor_p -> mcu_next = 0;
+			cursor_p -> mcu_projection_p = NULL;
+			bson_init (& (cursor_p -> mcu_doc));
+
+			if ((!projection_p) || ((cursor_p -> mcu_projection_p = bson_copy (projection_p)) != NULL))
+				{
+					return cursor_p;
+				}
+
+			bson_destroy (& (cursor_p -> mcu_doc));
+			FreeMemory (cursor_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Like the driver, reuse a single document for each hit. The _id is
+ * always returned unless the projection excludes it.
+ */
+static const bson_t *GetProjectedDocument (mongoc_cursor_t *cursor_p, const bson_t *doc_p)
+{
+	const bson_t *projection_p = cursor_p -> mcu_projection_p;
+
+	if (projection_p)
+		{
+			bson_iter_t iter;
+
+			bson_reinit (& (cursor_p -> mcu_doc));
+
+			if (bson_iter_init (&iter, doc_p))
+				{
+					while (bson_iter_next (&iter))
+						{
+							const char *key_s = bson_iter_key (&iter);
+							bson_iter_t projection_iter;
+							bool include_flag;
+
+							if (bson_iter_init_find (&projection_iter, projection_p, key_s))
+								{
+									include_flag = bson_iter_as_bool (&projection_iter);
+								}
+							else
+								{
+									include_flag = (strcmp (key_s, "_id") == 0);
+								}
+
+							if (include_flag && (!bson_append_iter (& (cursor_p -> mcu_doc), NULL, 0, &iter)))
+								{
+									return NULL;
+								}
+						}
+				}
+
+			return & (cursor_p -> mcu_doc);
+		}
+
+	return doc_p;
+}
+
+
+static MongoTool *AllocateBenchmarkMongoTool (void * UNUSED_PARAM (data_p))
+{
+	MockMongoTool *tool_p = (MockMongoTool *) AllocMemory (sizeof (MockMongoTool));
+
+	if (tool_p)
+		{
+			memset (tool_p, 0, sizeof (MockMongoTool));
+		}
+
+	return (MongoTool *) tool_p;
+}
+
+
+/*
+ * The service data releases its pool and cache, so they have to come
+ * from the same registry that the services use.
+ */
+static void *AllocateBenchmarkPool (void * UNUSED_PARAM (data_p))
+{
+	return AllocateMongoToolPool (1, 0, AllocateBenchmarkMongoTool, NULL);
+}
+
+
+static void FreeBenchmarkPool (void *pool_p)
+{
+	FreeMongoToolPool ((MongoToolPool *) pool_p);
+}
+
+
+static void *AllocateBenchmarkCache (void *data_p)
+{
+	return AllocateSearchCache (* ((const size_t *) data_p), 0, 0);
+}
+
+
+static void FreeBenchmarkCache (void *cache_p)
+{
+	FreeSearchCache ((SearchCache *) cache_p);
+}
+
+
+static Service *AllocateBenchmarkService (GeneTreesServiceData *data_p)
+{
+	Service *service_p = (Service *) AllocMemory (sizeof (Service));
+
+	if (service_p)
+		{
+			/*
+			 * The GeneTreesServiceData is attached afterwards as there is no
+			 * server for InitialiseService () to get its configuration from
+			 */
+			if (InitialiseService (service_p,
+														 GetGeneTreesSearchServiceName,
+														 GetGeneTreesSearchServiceDescription,
+														 GetGeneTreesSearchServiceAlias,
+														 GetGeneTreesSearchServiceInformationUri,
+														 RunGeneTreesSearchService,
+														 IsResourceForGeneTreesSearchService,
+														 GetGeneTreesSearchServiceParameters,
+														 GetGeneTreesSearchServiceParameterTypesForNamedParameters,
+														 ReleaseGeneTreesSearchServiceParameters,
+														 CloseGeneTreesSearchService,
+														 NULL,
+														 false,
+														 SY_SYNCHRONOUS,
+														 NULL,
+														 GetGeneTreesSearchServiceMetadata,
+														 NULL,
+														 NULL))
+				{
+					service_p -> se_data_p = (ServiceData *) data_p;
+					data_p -> gtsd_base_data.sd_service_p = service_p;
+
+					return service_p;
+				}
+
+			FreeMemory (service_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Fill in a random request of the given shape. The buffers are
+ * owned by the caller.
+ */
+static void SetSearchRequest (const SearchShape shape, SearchRequest *request_p, char *gene_s, char *genes_s, uint32 *cluster_p, uint32 *limit_p, const uint32 list_length, unsigned int *seed_p)
+{
+	const size_t num_docs = s_collection_p -> mc_num_docs;
+	const uint32 num_clusters = (uint32) (num_docs / (s_collection_p -> mc_genes_per_cluster));
+	const char *random_gene_s = s_collection_p -> mc_gene_ids_ss [rand_r (seed_p) % num_docs];
+
+	memset (request_p, 0, sizeof (SearchRequest));
+
+	switch (shape)
+		{
+			case SS_GENE:
+				strcpy (gene_s, random_gene_s);
+				request_p -> sr_gene_s = gene_s;
+				break;
+
+			case SS_GENES:
+				{
+					char *cursor_s = genes_s;
+					uint32 i;
+
+					for (i = 0; i < list_length; ++ i)
+						{
+							const char *list_gene_s = s_collection_p -> mc_gene_ids_ss [rand_r (seed_p) % num_docs];
+
+							cursor_s += sprintf (cursor_s, "%s%s", (i > 0) ? ", " : "", list_gene_s);
+						}
+
+					request_p -> sr_genes_s = genes_s;
+				}
+				break;
+
+			case SS_CLUSTER:
+				*cluster_p = rand_r (seed_p) % num_clusters;
+				request_p -> sr_cluster_p = cluster_p;
+				break;
+
+			case SS_CLUSTER_PAGE:
+				/* A page from somewhere in the cluster, as a client following the tokens would ask for */
+				*cluster_p = (uint32) ((strtoul (random_gene_s + 1, NULL, 10)) / (s_collection_p -> mc_genes_per_cluster));
+				strcpy (gene_s, random_gene_s);
+				request_p -> sr_cluster_p = cluster_p;
+				request_p -> sr_page_token_s = gene_s;
+				request_p -> sr_limit_p = limit_p;
+				break;
+
+			case SS_PREFIX:
+				{
+					/* Drop the last digit so that this matches up to 10 genes */
+					const size_t length = strlen (random_gene_s);
+
+					memcpy (gene_s, random_gene_s, length - 1);
+					gene_s [length - 1] = '*';
+					gene_s [length] = '\0';
+					request_p -> sr_gene_s = gene_s;
+				}
+				break;
+
+			case SS_SUMMARY:
+				{
+					char *cursor_s = genes_s;
+					uint32 i;
+
+					for (i = 0; i < list_length; ++ i)
+						{
+							const char *list_gene_s = s_collection_p -> mc_gene_ids_ss [rand_r (seed_p) % num_docs];
+
+							cursor_s += sprintf (cursor_s, "%s%s", (i > 0) ? ", " : "", list_gene_s);
+						}
+
+					request_p -> sr_genes_s = genes_s;
+					request_p -> sr_summary_flag = true;
+				}
+				break;
+
+			default:
+				break;
+		}
+}
+
+
+static bool RunBenchmark (Service *service_p, GeneTreesServiceData *data_p, const SearchShape shape, const uint32 iterations, const uint32 list_length, const uint32 page_size, unsigned int *seed_p)
+{
+	bool success_flag = false;
+	uint64 *times_p = (uint64 *) AllocMemoryArray (iterations, sizeof (uint64));
+	char *genes_s = (char *) AllocMemory (((size_t) list_length) * 34 + 1);
+
+	if (times_p && genes_s)
+		{
+			uint64 num_hits = 0;
+			uint64 num_allocations = 0;
+			uint32 num_failed = 0;
+			uint32 i;
+
+			success_flag = true;
+
+			/* The first search isn't counted as it sets up any one-off state */
+			for (i = 0; (i <= iterations) && success_flag; ++ i)
+				{
+					ServiceJobSet *jobs_p = AllocateSimpleServiceJobSet (service_p, NULL, "Gene Trees");
+
+					if (jobs_p)
+						{
+							ServiceJob *job_p = GetServiceJobFromServiceJobSet (jobs_p, 0);
+							SearchRequest request;
+							AllocationCounts before;
+							AllocationCounts after;
+							char gene_s [32];
+							uint32 cluster = 0;
+							uint32 limit = page_size;
+							uint64 start_ns;
+							uint64 end_ns;
+
+							SetSearchRequest (shape, &request, gene_s, genes_s, &cluster, &limit, list_length, seed_p);
+
+							GetAllocationCounts (&before);
+							start_ns = GetSearchTime ();
+
+							RunSearch (job_p, &request, data_p, false);
+
+							end_ns = GetSearchTime ();
+							GetAllocationCounts (&after);
+
+							if (i > 0)
+								{
+									const OperationStatus status = GetServiceJobStatus (job_p);
+
+									times_p [i - 1] = end_ns - start_ns;
+									num_allocations += after.ac_num_allocations - before.ac_num_allocations;
+									num_hits += json_array_size (job_p -> sj_result_p);
+
+									if ((status != OS_SUCCEEDED) && (status != OS_PARTIALLY_SUCCEEDED))
+										{
+											++ num_failed;
+										}
+								}
+
+							FreeServiceJobSet (jobs_p);
+						}
+					else
+						{
+							fprintf (stderr, "Failed to allocate ServiceJobSet\n");
+							success_flag = false;
+						}
+				}
+
+			if (success_flag)
+				{
+					qsort (times_p, iterations, sizeof (uint64), CompareTimes);
+
+					printf ("%-13s %9.1f %9.1f %9.1f %9.1f %9.1f %12.1f %12.1f %8u\n",
+									S_SHAPE_NAMES_SS [shape],
+									((double) num_hits) / iterations,
+									GetPercentile (times_p, iterations, 0.5),
+									GetPercentile (times_p, iterations, 0.9),
+									GetPercentile (times_p, iterations, 0.99),
+									times_p [iterations - 1] / 1000.0,
+									((double) num_allocations) / iterations,
+									(num_hits > 0) ? ((double) num_allocations) / num_hits : 0.0,
+									num_failed);
+
+					success_flag = (num_failed == 0);
+				}
+		}
+	else
+		{
+			fprintf (stderr, "Failed to allocate memory for %u searches\n", iterations);
+		}
+
+	if (times_p)
+		{
+			FreeMemory (times_p);
+		}
+
+	if (genes_s)
+		{
+			FreeMemory (genes_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Compare the allocations for the hits' titles, "<gene> - <index>",
+ * between building a new string for each hit, as AddSearchHit () used
+ * to, and writing them into a buffer that is reused for the whole
+ * search, as it does now. Each search has the same number of hits as
+ * a cluster.
+ */
+static bool RunTitleBenchmark (const uint32 iterations, const uint32 hits_per_search, unsigned int *seed_p)
+{
+	uint64 old_allocations = 0;
+	uint64 new_allocations = 0;
+	uint64 old_ns = 0;
+	uint64 new_ns = 0;
+	const uint64 num_hits = ((uint64) iterations) * hits_per_search;
+	uint32 i;
+
+	for (i = 0; i < iterations; ++ i)
+		{
+			const char *prefix_s = s_collection_p -> mc_gene_ids_ss [rand_r (seed_p) % (s_collection_p -> mc_num_docs)];
+			char *title_buffer_s = NULL;
+			size_t title_buffer_size = 0;
+			AllocationCounts before;
+			AllocationCounts after;
+			uint64 start_ns;
+			size_t j;
+
+			GetAllocationCounts (&before);
+			start_ns = GetSearchTime ();
+
+			for (j = 0; j < hits_per_search; ++ j)
+				{
+					char *index_s = ConvertSizeTToString (j);
+
+					if (index_s)
+						{
+							char *title_s = ConcatenateVarargsStrings (prefix_s, " - ", index_s, NULL);
+
+							FreeCopiedString (index_s);
+
+							if (title_s)
+								{
+									FreeCopiedString (title_s);
+								}
+							else
+								{
+									fprintf (stderr, "Failed to build title for \"%s\"\n", prefix_s);
+									return false;
+								}
+						}
+					else
+						{
+							fprintf (stderr, "Failed to convert " SIZET_FMT " to string\n", j);
+							return false;
+						}
+				}
+
+			old_ns += GetSearchTime () - start_ns;
+			GetAllocationCounts (&after);
+			old_allocations += after.ac_num_allocations - before.ac_num_allocations;
+
+			GetAllocationCounts (&before);
+			start_ns = GetSearchTime ();
+
+			for (j = 0; j < hits_per_search; ++ j)
+				{
+					const size_t title_size = strlen (prefix_s) + 24;
+
+					if (! (ReserveSearchHitsBuffer (&title_buffer_s, &title_buffer_size, title_size) && (snprintf (title_buffer_s, title_buffer_size, "%s - " SIZET_FMT, prefix_s, j) > 0)))
+						{
+							fprintf (stderr, "Failed to build title for \"%s\"\n", prefix_s);
+
+							if (title_buffer_s)
+								{
+									FreeMemory (title_buffer_s);
+								}
+
+							return false;
+						}
+				}
+
+			if (title_buffer_s)
+				{
+					FreeMemory (title_buffer_s);
+				}
+
+			new_ns += GetSearchTime () - start_ns;
+			GetAllocationCounts (&after);
+			new_allocations += after.ac_num_allocations - before.ac_num_allocations;
+		}
+
+	printf ("Hit titles for %u searches of %u hits\n", iterations, hits_per_search);
+	printf ("  a new string for each hit: %6.2f allocs/hit %8.1f ns/hit\n", ((double) old_allocations) / num_hits, ((double) old_ns) / num_hits);
+	printf ("  a reused buffer:           %6.2f allocs/hit %8.1f ns/hit\n", ((double) new_allocations) / num_hits, ((double) new_ns) / num_hits);
+
+	return true;
+}
+
+
+static int CompareTimes (const void *v0_p, const void *v1_p)
+{
+	const uint64 t0 = * ((const uint64 *) v0_p);
+	const uint64 t1 = * ((const uint64 *) v1_p);
+
+	return (t0 < t1) ? -1 : ((t0 > t1) ? 1 : 0);
+}
+
+
+/* Get the nearest-rank percentile of the sorted times in microseconds */
+static double GetPercentile (const uint64 *times_p, const size_t num_times, const double percentile)
+{
+	size_t i = (size_t) (percentile * num_times + 0.5);
+
+	if (i > 0)
+		{
+			-- i;
+		}
+
+	if (i >= num_times)
+		{
+			i = num_times - 1;
+		}
+
+	return times_p [i] / 1000.0;
+}
+
+
+static void PrintMemoryUsage (const char *stage_s)
+{
+	printf ("%s: RSS %zu KB, peak RSS %zu KB\n", stage_s, GetCurrentRSS () >> 10, GetPeakRSS () >> 10);
+}
+
+
+static void PrintUsage (const char *program_s)
+{
+	fprintf (stderr,
+		"Usage: %s [-n <clusters>] [-g <genes per cluster>] [-l <sequence length>] [-i <iterations>]\n"
+		"          [-s <list length>] [-p <page size>] [-e <cache entries>] [-r <seed>] [-q <shape>]\n"
+		"\n"
+		"  -n  The number of clusters to generate, the default is %d.\n"
+		"  -g  The number of genes in each cluster, the default is %d.\n"
+		"  -l  The length of each gene's sequence, the default is %d.\n"
+		"  -i  The number of searches of each shape to time, the default is %d.\n"
+		"  -s  The number of Gene IDs in each list for the genes and summary shapes, the default is %d.\n"
+		"  -p  The page size for the cluster_page shape, the default is %d.\n"
+		"  -e  The number of result sets to cache, the default is 0 for no cache.\n"
+		"  -r  The seed for the random genes and searches, the default is 1.\n"
+		"  -q  Only run one shape of search: gene, genes, cluster, cluster_page, prefix or summary.\n",
+		program_s, SB_DEFAULT_NUM_CLUSTERS, SB_DEFAULT_GENES_PER_CLUSTER, SB_DEFAULT_SEQUENCE_LENGTH, SB_DEFAULT_ITERATIONS, SB_DEFAULT_LIST_LENGTH, SB_DEFAULT_PAGE_SIZE);
+}